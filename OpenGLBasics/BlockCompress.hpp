@@ -0,0 +1,474 @@
+#pragma once
+#include "main.h"
+#include "ThreadPool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BLOCK_SSE
+#endif
+
+
+/*
+CPU block compression (BC1, BC3, BC4 and BC5).
+Every 4x4 block is encoded on its own, the rows of blocks are spread over the ThreadPool.
+BC1 colors: the endpoints are the extremes of the pixels along their principal axis, then
+refined once by least squares on the chosen indices. The indices come from projecting the
+pixels on the quantized endpoints, 4 pixels at a time with SSE2.
+BC4 values: the endpoints are the min and max, the 8 value mode is always used.
+BC3 is a BC4 block of the alpha followed by a BC1 color block, BC5 two BC4 blocks (red and green).
+The inputs are RGBA8 images.
+*/
+
+enum BlockFormat
+{
+    BLOCK_BC1,  // RGB, 8 bytes per block
+    BLOCK_BC3,  // RGBA, 16 bytes per block
+    BLOCK_BC4,  // red, 8 bytes per block
+    BLOCK_BC5   // red and green (normal maps), 16 bytes per block
+};
+
+inline uint32 blockBytes(const BlockFormat format)
+{
+    return format == BLOCK_BC1 || format == BLOCK_BC4 ? 8 : 16;
+}
+
+inline const char* blockFormatName(const BlockFormat format)
+{
+    switch (format)
+    {
+    case BLOCK_BC1: return "BC1";
+    case BLOCK_BC3: return "BC3";
+    case BLOCK_BC4: return "BC4";
+    default: return "BC5";
+    }
+}
+
+// Bytes of a width x height image in format
+inline uint64 compressedSize(const uint32 width, const uint32 height, const BlockFormat format)
+{
+    return (uint64)((width + 3) / 4) * ((height + 3) / 4) * blockBytes(format);
+}
+
+// One channel of the 16 pixels of a block, as floats so the projections run 4 pixels at a time
+struct BlockChannels
+{
+    float c[4][16];
+};
+
+inline uint32 packColor565(const float* color)
+{
+    const uint32 r = (uint32)std::min(std::max(color[0] * 31.0f / 255.0f + 0.5f, 0.0f), 31.0f);
+    const uint32 g = (uint32)std::min(std::max(color[1] * 63.0f / 255.0f + 0.5f, 0.0f), 63.0f);
+    const uint32 b = (uint32)std::min(std::max(color[2] * 31.0f / 255.0f + 0.5f, 0.0f), 31.0f);
+    return (r << 11) | (g << 5) | b;
+}
+
+inline void unpackColor565(const uint32 packed, float* color)
+{
+    const uint32 r = (packed >> 11) & 31;
+    const uint32 g = (packed >> 5) & 63;
+    const uint32 b = packed & 31;
+    color[0] = (float)((r << 3) | (r >> 2));
+    color[1] = (float)((g << 2) | (g >> 4));
+    color[2] = (float)((b << 3) | (b >> 2));
+}
+
+/*
+Pick the palette step (0 at e1 to steps at e0) nearest to every pixel by projecting it on the
+segment, returns the squared error of the block. The first channels of block are used.
+*/
+inline float projectBlock(const BlockChannels& block, const uint32 channels, const float* e0, const float* e1,
+    const int steps, int* selected)
+{
+    float dir[3] = { 0.0f, 0.0f, 0.0f };
+    float length2 = 0.0f;
+    for (uint32 c = 0; c < channels; c++)
+    {
+        dir[c] = e0[c] - e1[c];
+        length2 += dir[c] * dir[c];
+    }
+    const float scale = length2 > 0.0f ? (float)steps / length2 : 0.0f;
+
+#if defined(BLOCK_SSE)
+    __m128 error = _mm_setzero_ps();
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 maxStep = _mm_set1_ps((float)steps);
+    const __m128 invSteps = _mm_set1_ps(1.0f / (float)steps);
+    for (uint32 i = 0; i < 16; i += 4)
+    {
+        __m128 t = zero;
+        for (uint32 c = 0; c < channels; c++)
+        {
+            const __m128 offset = _mm_sub_ps(_mm_loadu_ps(block.c[c] + i), _mm_set1_ps(e1[c]));
+            t = _mm_add_ps(t, _mm_mul_ps(offset, _mm_set1_ps(dir[c] * scale)));
+        }
+        t = _mm_min_ps(_mm_max_ps(t, zero), maxStep);
+        const __m128i step = _mm_cvtps_epi32(t);
+        _mm_storeu_si128((__m128i*)(selected + i), step);
+
+        const __m128 weight = _mm_mul_ps(_mm_cvtepi32_ps(step), invSteps);
+        for (uint32 c = 0; c < channels; c++)
+        {
+            const __m128 palette = _mm_add_ps(_mm_set1_ps(e1[c]), _mm_mul_ps(weight, _mm_set1_ps(dir[c])));
+            const __m128 difference = _mm_sub_ps(_mm_loadu_ps(block.c[c] + i), palette);
+            error = _mm_add_ps(error, _mm_mul_ps(difference, difference));
+        }
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, error);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#else
+    float error = 0.0f;
+    for (uint32 i = 0; i < 16; i++)
+    {
+        float t = 0.0f;
+        for (uint32 c = 0; c < channels; c++)
+            t += (block.c[c][i] - e1[c]) * dir[c] * scale;
+        const int step = (int)std::floor(std::min(std::max(t, 0.0f), (float)steps) + 0.5f);
+        selected[i] = step;
+        for (uint32 c = 0; c < channels; c++)
+        {
+            const float difference = block.c[c][i] - (e1[c] + dir[c] * (float)step / (float)steps);
+            error += difference * difference;
+        }
+    }
+    return error;
+#endif
+}
+
+// Endpoints and indices of a 4 color BC1 block for the given (quantized) endpoints
+inline float encodeColorIndices(const BlockChannels& block, const uint32 color0, const uint32 color1, uint32& indices)
+{
+    // palette order of the steps from color1 (0) to color0 (3)
+    static const uint32 stepIndex[4] = { 1, 3, 2, 0 };
+    float e0[3], e1[3];
+    unpackColor565(color0, e0);
+    unpackColor565(color1, e1);
+    int steps[16];
+    const float error = projectBlock(block, 3, e0, e1, 3, steps);
+    indices = 0;
+    for (uint32 i = 0; i < 16; i++)
+        indices |= stepIndex[steps[i]] << (2 * i);
+    return error;
+}
+
+// Quantize the endpoints in 4 color mode order (color0 > color1)
+inline void quantizeEndpoints(const float* high, const float* low, uint32& color0, uint32& color1)
+{
+    color0 = packColor565(high);
+    color1 = packColor565(low);
+    if (color0 < color1)
+        std::swap(color0, color1);
+}
+
+inline void writeColorBlock(unsigned char* out, const uint32 color0, const uint32 color1, const uint32 indices)
+{
+    out[0] = (unsigned char)color0;
+    out[1] = (unsigned char)(color0 >> 8);
+    out[2] = (unsigned char)color1;
+    out[3] = (unsigned char)(color1 >> 8);
+    memcpy(out + 4, &indices, 4);
+}
+
+// BC1 block of the RGB channels of block (8 bytes), always in 4 color mode so it is valid in BC3 too
+inline void encodeBC1Block(const BlockChannels& block, unsigned char* out)
+{
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    float low[3] = { 255.0f, 255.0f, 255.0f };
+    float high[3] = { 0.0f, 0.0f, 0.0f };
+    for (uint32 c = 0; c < 3; c++)
+        for (uint32 i = 0; i < 16; i++)
+        {
+            mean[c] += block.c[c][i];
+            low[c] = std::min(low[c], block.c[c][i]);
+            high[c] = std::max(high[c], block.c[c][i]);
+        }
+    for (uint32 c = 0; c < 3; c++)
+        mean[c] /= 16.0f;
+
+    // principal axis by power iteration on the covariance, from the bounding box diagonal
+    float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    for (uint32 i = 0; i < 16; i++)
+    {
+        const float r = block.c[0][i] - mean[0];
+        const float g = block.c[1][i] - mean[1];
+        const float b = block.c[2][i] - mean[2];
+        cov[0] += r * r;
+        cov[1] += r * g;
+        cov[2] += r * b;
+        cov[3] += g * g;
+        cov[4] += g * b;
+        cov[5] += b * b;
+    }
+    float axis[3] = { high[0] - low[0], high[1] - low[1], high[2] - low[2] };
+    for (int iteration = 0; iteration < 4; iteration++)
+    {
+        const float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+        const float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+        const float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+        const float norm = std::max(std::fabs(x), std::max(std::fabs(y), std::fabs(z)));
+        if (norm <= 0.0f)
+            break;
+        axis[0] = x / norm;
+        axis[1] = y / norm;
+        axis[2] = z / norm;
+    }
+
+    // extremes along the axis, inset by 1/16 of the range like the hardware palette rounding expects
+    float minT = 0.0f, maxT = 0.0f;
+    for (uint32 i = 0; i < 16; i++)
+    {
+        const float t = (block.c[0][i] - mean[0]) * axis[0] + (block.c[1][i] - mean[1]) * axis[1] + (block.c[2][i] - mean[2]) * axis[2];
+        minT = std::min(minT, t);
+        maxT = std::max(maxT, t);
+    }
+    const float axisLength2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+    if (axisLength2 > 0.0f)
+    {
+        const float inset = (maxT - minT) / 16.0f;
+        minT = (minT + inset) / axisLength2;
+        maxT = (maxT - inset) / axisLength2;
+    }
+    float e0[3], e1[3];
+    for (uint32 c = 0; c < 3; c++)
+    {
+        e0[c] = mean[c] + axis[c] * maxT;
+        e1[c] = mean[c] + axis[c] * minT;
+    }
+
+    uint32 color0, color1, indices;
+    quantizeEndpoints(e0, e1, color0, color1);
+    if (color0 == color1)
+    {
+        writeColorBlock(out, color0, color1, 0);
+        return;
+    }
+    float error = encodeColorIndices(block, color0, color1, indices);
+
+    // least squares endpoints for the chosen indices
+    static const float weight0[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+    float aa = 0.0f, bb = 0.0f, ab = 0.0f;
+    float ax[3] = { 0.0f, 0.0f, 0.0f };
+    float bx[3] = { 0.0f, 0.0f, 0.0f };
+    for (uint32 i = 0; i < 16; i++)
+    {
+        const float a = weight0[(indices >> (2 * i)) & 3];
+        const float b = 1.0f - a;
+        aa += a * a;
+        bb += b * b;
+        ab += a * b;
+        for (uint32 c = 0; c < 3; c++)
+        {
+            ax[c] += a * block.c[c][i];
+            bx[c] += b * block.c[c][i];
+        }
+    }
+    const float determinant = aa * bb - ab * ab;
+    if (std::fabs(determinant) > 1e-6f)
+    {
+        float fit0[3], fit1[3];
+        for (uint32 c = 0; c < 3; c++)
+        {
+            fit0[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+            fit1[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+        }
+        uint32 refined0, refined1, refinedIndices;
+        quantizeEndpoints(fit0, fit1, refined0, refined1);
+        if (refined0 != refined1)
+        {
+            const float refinedError = encodeColorIndices(block, refined0, refined1, refinedIndices);
+            if (refinedError < error)
+            {
+                color0 = refined0;
+                color1 = refined1;
+                indices = refinedIndices;
+            }
+        }
+    }
+    writeColorBlock(out, color0, color1, indices);
+}
+
+// BC4 block of one channel of block (8 bytes)
+inline void encodeBC4Block(const BlockChannels& block, const uint32 channel, unsigned char* out)
+{
+    float low = 255.0f, high = 0.0f;
+    for (uint32 i = 0; i < 16; i++)
+    {
+        low = std::min(low, block.c[channel][i]);
+        high = std::max(high, block.c[channel][i]);
+    }
+    const unsigned char e0 = (unsigned char)(high + 0.5f);
+    const unsigned char e1 = (unsigned char)(low + 0.5f);
+    out[0] = e0;
+    out[1] = e1;
+    memset(out + 2, 0, 6);
+    if (e0 == e1)
+        return;
+
+    // palette order of the steps from e1 (0) to e0 (7)
+    static const uint64 stepIndex[8] = { 1, 7, 6, 5, 4, 3, 2, 0 };
+    BlockChannels single;
+    memcpy(single.c[0], block.c[channel], sizeof(single.c[0]));
+    const float endpoint0 = (float)e0;
+    const float endpoint1 = (float)e1;
+    int steps[16];
+    projectBlock(single, 1, &endpoint0, &endpoint1, 7, steps);
+    uint64 bits = 0;
+    for (uint32 i = 0; i < 16; i++)
+        bits |= stepIndex[steps[i]] << (3 * i);
+    for (uint32 i = 0; i < 6; i++)
+        out[2 + i] = (unsigned char)(bits >> (8 * i));
+}
+
+inline void encodeBlock(const BlockChannels& block, const BlockFormat format, unsigned char* out)
+{
+    switch (format)
+    {
+    case BLOCK_BC1:
+        encodeBC1Block(block, out);
+        break;
+    case BLOCK_BC3:
+        encodeBC4Block(block, 3, out);
+        encodeBC1Block(block, out + 8);
+        break;
+    case BLOCK_BC4:
+        encodeBC4Block(block, 0, out);
+        break;
+    case BLOCK_BC5:
+        encodeBC4Block(block, 0, out);
+        encodeBC4Block(block, 1, out + 8);
+        break;
+    }
+}
+
+// Compress a width x height RGBA8 image, the edge blocks repeat the last row and column
+inline std::vector<unsigned char> compressImage(const unsigned char* rgba, const uint32 width, const uint32 height, const BlockFormat format)
+{
+    const uint32 blocksX = (width + 3) / 4;
+    const uint32 blocksY = (height + 3) / 4;
+    const uint32 bytes = blockBytes(format);
+    std::vector<unsigned char> output((size_t)blocksX * blocksY * bytes);
+    ThreadPool::shared().parallelFor(blocksY, [&](const uint32 by)
+    {
+        BlockChannels block;
+        for (uint32 bx = 0; bx < blocksX; bx++)
+        {
+            for (uint32 y = 0; y < 4; y++)
+            {
+                const unsigned char* row = rgba + (size_t)std::min(by * 4 + y, height - 1) * width * 4;
+                for (uint32 x = 0; x < 4; x++)
+                {
+                    const unsigned char* pixel = row + (size_t)std::min(bx * 4 + x, width - 1) * 4;
+                    for (uint32 c = 0; c < 4; c++)
+                        block.c[c][y * 4 + x] = (float)pixel[c];
+                }
+            }
+            encodeBlock(block, format, output.data() + ((size_t)by * blocksX + bx) * bytes);
+        }
+    });
+    return output;
+}
+
+// Decoders, for measuring the encoder error
+
+inline void decodeBC1Block(const unsigned char* in, unsigned char* rgba, const uint32 pitch, const bool alwaysFourColors)
+{
+    const uint32 color0 = in[0] | (in[1] << 8);
+    const uint32 color1 = in[2] | (in[3] << 8);
+    float palette[4][4];
+    unpackColor565(color0, palette[0]);
+    unpackColor565(color1, palette[1]);
+    palette[0][3] = palette[1][3] = palette[2][3] = palette[3][3] = 255.0f;
+    for (uint32 c = 0; c < 3; c++)
+    {
+        if (color0 > color1 || alwaysFourColors)
+        {
+            palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+            palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+        }
+        else
+        {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2.0f;
+            palette[3][c] = 0.0f;
+        }
+    }
+    if (!(color0 > color1 || alwaysFourColors))
+        palette[3][3] = 0.0f;
+
+    uint32 indices;
+    memcpy(&indices, in + 4, 4);
+    for (uint32 i = 0; i < 16; i++)
+    {
+        const float* color = palette[(indices >> (2 * i)) & 3];
+        unsigned char* pixel = rgba + (i / 4) * pitch + (i % 4) * 4;
+        for (uint32 c = 0; c < 4; c++)
+            pixel[c] = (unsigned char)(color[c] + 0.5f);
+    }
+}
+
+inline void decodeBC4Block(const unsigned char* in, unsigned char* rgba, const uint32 pitch, const uint32 channel)
+{
+    float palette[8];
+    palette[0] = in[0];
+    palette[1] = in[1];
+    if (in[0] > in[1])
+        for (uint32 i = 2; i < 8; i++)
+            palette[i] = ((8 - i) * palette[0] + (i - 1) * palette[1]) / 7.0f;
+    else
+    {
+        for (uint32 i = 2; i < 6; i++)
+            palette[i] = ((6 - i) * palette[0] + (i - 1) * palette[1]) / 5.0f;
+        palette[6] = 0.0f;
+        palette[7] = 255.0f;
+    }
+
+    uint64 bits = 0;
+    for (uint32 i = 0; i < 6; i++)
+        bits |= (uint64)in[2 + i] << (8 * i);
+    for (uint32 i = 0; i < 16; i++)
+        rgba[(i / 4) * pitch + (i % 4) * 4 + channel] = (unsigned char)(palette[(bits >> (3 * i)) & 7] + 0.5f);
+}
+
+// Decode a compressed image to RGBA8 (the channels a format does not store are 0, alpha 255)
+inline std::vector<unsigned char> decompressImage(const unsigned char* data, const uint32 width, const uint32 height, const BlockFormat format)
+{
+    const uint32 blocksX = (width + 3) / 4;
+    const uint32 blocksY = (height + 3) / 4;
+    const uint32 bytes = blockBytes(format);
+    const uint32 pitch = blocksX * 16;
+    std::vector<unsigned char> padded((size_t)pitch * blocksY * 4, 0);
+    for (uint32 by = 0; by < blocksY; by++)
+        for (uint32 bx = 0; bx < blocksX; bx++)
+        {
+            const unsigned char* in = data + ((size_t)by * blocksX + bx) * bytes;
+            unsigned char* out = padded.data() + (size_t)by * 4 * pitch + bx * 16;
+            switch (format)
+            {
+            case BLOCK_BC1:
+                decodeBC1Block(in, out, pitch, false);
+                break;
+            case BLOCK_BC3:
+                decodeBC1Block(in + 8, out, pitch, true);
+                decodeBC4Block(in, out, pitch, 3);
+                break;
+            case BLOCK_BC4:
+            case BLOCK_BC5:
+                for (uint32 y = 0; y < 4; y++)
+                    for (uint32 x = 0; x < 4; x++)
+                        out[y * pitch + x * 4 + 3] = 255;
+                decodeBC4Block(in, out, pitch, 0);
+                if (format == BLOCK_BC5)
+                    decodeBC4Block(in + 8, out, pitch, 1);
+                break;
+            }
+        }
+
+    std::vector<unsigned char> rgba((size_t)width * height * 4);
+    for (uint32 y = 0; y < height; y++)
+        memcpy(rgba.data() + (size_t)y * width * 4, padded.data() + (size_t)y * pitch, (size_t)width * 4);
+    return rgba;
+}
@@ -0,0 +1,386 @@
+#pragma once
+#include "main.h"
+#include "Frustum.hpp"
+#include <GLM/glm.hpp>
+#include <GLM/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define CULLING_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CULLING_SSE
+#endif
+
+
+/*
+Frustum culling of instances.
+The instance bounds are kept in SoA layout (one array per component) so 4 (SSE) or 8 (AVX)
+instances are tested against a plane at once. The visible instances come out as a compacted
+list of indices, written without branches.
+*/
+
+// World space bounding spheres, one array per component
+struct SphereBounds
+{
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<float> radius;
+
+    void resize(const uint32 count)
+    {
+        x.resize(count);
+        y.resize(count);
+        z.resize(count);
+        radius.resize(count);
+    }
+
+    uint32 size() const
+    {
+        return (uint32)x.size();
+    }
+};
+
+// World space axis aligned boxes as center and half extents, one array per component
+struct BoxBounds
+{
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<float> extentX;
+    std::vector<float> extentY;
+    std::vector<float> extentZ;
+
+    void resize(const uint32 count)
+    {
+        x.resize(count);
+        y.resize(count);
+        z.resize(count);
+        extentX.resize(count);
+        extentY.resize(count);
+        extentZ.resize(count);
+    }
+
+    uint32 size() const
+    {
+        return (uint32)x.size();
+    }
+};
+
+// Bounding spheres of count instances of a mesh with the model space sphere (center, radius)
+inline void transformSpheres(const glm::vec4& sphere, const uint32 count, const glm::mat4* models, SphereBounds& out)
+{
+    out.resize(count);
+    float* x = out.x.data();
+    float* y = out.y.data();
+    float* z = out.z.data();
+    float* radius = out.radius.data();
+    for (uint32 i = 0; i < count; i++)
+    {
+        const float* m = &models[i][0][0];
+        x[i] = m[0] * sphere.x + m[4] * sphere.y + m[8] * sphere.z + m[12];
+        y[i] = m[1] * sphere.x + m[5] * sphere.y + m[9] * sphere.z + m[13];
+        z[i] = m[2] * sphere.x + m[6] * sphere.y + m[10] * sphere.z + m[14];
+        // the largest axis scale keeps the sphere conservative for non uniform scales
+        const float scale2 = std::max(std::max(m[0] * m[0] + m[1] * m[1] + m[2] * m[2],
+            m[4] * m[4] + m[5] * m[5] + m[6] * m[6]), m[8] * m[8] + m[9] * m[9] + m[10] * m[10]);
+        radius[i] = sphere.w * std::sqrt(scale2);
+    }
+}
+
+// World boxes of count instances of a mesh with the model space box, enclosing the transformed box
+inline void transformBoxes(const glm::vec3& boxMin, const glm::vec3& boxMax, const uint32 count, const glm::mat4* models, BoxBounds& out)
+{
+    out.resize(count);
+    const glm::vec4 center((boxMin + boxMax) * 0.5f, 1.0f);
+    const glm::vec3 extent = (boxMax - boxMin) * 0.5f;
+    for (uint32 i = 0; i < count; i++)
+    {
+        const glm::mat4& model = models[i];
+        const glm::vec4 world = model * center;
+        const glm::vec3 worldExtent = glm::abs(glm::vec3(model[0])) * extent.x
+            + glm::abs(glm::vec3(model[1])) * extent.y + glm::abs(glm::vec3(model[2])) * extent.z;
+        out.x[i] = world.x;
+        out.y[i] = world.y;
+        out.z[i] = world.z;
+        out.extentX[i] = worldExtent.x;
+        out.extentY[i] = worldExtent.y;
+        out.extentZ[i] = worldExtent.z;
+    }
+}
+
+/*
+Indices of the spheres touching the frustum, written to visible (room for bounds.size() entries).
+Returns how many are visible.
+*/
+inline uint32 cullSpheres(const Frustum& frustum, const SphereBounds& bounds, uint32* visible)
+{
+    const uint32 count = bounds.size();
+    const float* x = bounds.x.data();
+    const float* y = bounds.y.data();
+    const float* z = bounds.z.data();
+    const float* radius = bounds.radius.data();
+    uint32 visibleCount = 0;
+    uint32 i = 0;
+
+#if defined(CULLING_AVX)
+    __m256 planeX[6], planeY[6], planeZ[6], planeW[6];
+    for (int p = 0; p < 6; p++)
+    {
+        planeX[p] = _mm256_set1_ps(frustum.planes[p].x);
+        planeY[p] = _mm256_set1_ps(frustum.planes[p].y);
+        planeZ[p] = _mm256_set1_ps(frustum.planes[p].z);
+        planeW[p] = _mm256_set1_ps(frustum.planes[p].w);
+    }
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256 cx = _mm256_loadu_ps(x + i);
+        const __m256 cy = _mm256_loadu_ps(y + i);
+        const __m256 cz = _mm256_loadu_ps(z + i);
+        const __m256 negRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(radius + i));
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int p = 0; p < 6; p++)
+        {
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(planeX[p], cx), _mm256_mul_ps(planeY[p], cy)),
+                _mm256_add_ps(_mm256_mul_ps(planeZ[p], cz), planeW[p]));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negRadius, _CMP_GE_OQ));
+        }
+        const int mask = _mm256_movemask_ps(inside);
+        for (uint32 lane = 0; lane < 8; lane++)
+        {
+            visible[visibleCount] = i + lane;
+            visibleCount += (mask >> lane) & 1;
+        }
+    }
+#elif defined(CULLING_SSE)
+    __m128 planeX[6], planeY[6], planeZ[6], planeW[6];
+    for (int p = 0; p < 6; p++)
+    {
+        planeX[p] = _mm_set1_ps(frustum.planes[p].x);
+        planeY[p] = _mm_set1_ps(frustum.planes[p].y);
+        planeZ[p] = _mm_set1_ps(frustum.planes[p].z);
+        planeW[p] = _mm_set1_ps(frustum.planes[p].w);
+    }
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128 cx = _mm_loadu_ps(x + i);
+        const __m128 cy = _mm_loadu_ps(y + i);
+        const __m128 cz = _mm_loadu_ps(z + i);
+        const __m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int p = 0; p < 6; p++)
+        {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planeX[p], cx), _mm_mul_ps(planeY[p], cy)),
+                _mm_add_ps(_mm_mul_ps(planeZ[p], cz), planeW[p]));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negRadius));
+        }
+        const int mask = _mm_movemask_ps(inside);
+        for (uint32 lane = 0; lane < 4; lane++)
+        {
+            visible[visibleCount] = i + lane;
+            visibleCount += (mask >> lane) & 1;
+        }
+    }
+#endif
+
+    // what is left (everything without SIMD)
+    for (; i < count; i++)
+    {
+        visible[visibleCount] = i;
+        visibleCount += frustum.intersectsSphere(glm::vec3(x[i], y[i], z[i]), radius[i]) ? 1 : 0;
+    }
+    return visibleCount;
+}
+
+/*
+Indices of the boxes touching the frustum, written to visible (room for bounds.size() entries).
+A box is outside when its corner furthest along a plane normal is behind it. Returns how many are visible.
+*/
+inline uint32 cullBoxes(const Frustum& frustum, const BoxBounds& bounds, uint32* visible)
+{
+    const uint32 count = bounds.size();
+    uint32 visibleCount = 0;
+    uint32 i = 0;
+
+#if defined(CULLING_AVX) || defined(CULLING_SSE)
+#if defined(CULLING_AVX)
+    typedef __m256 Lanes;
+    const uint32 width = 8;
+#define CULL_SET1 _mm256_set1_ps
+#define CULL_LOAD _mm256_loadu_ps
+#define CULL_ADD _mm256_add_ps
+#define CULL_MUL _mm256_mul_ps
+#define CULL_AND _mm256_and_ps
+#define CULL_GE_ZERO(a) _mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_GE_OQ)
+#define CULL_ALL_ONES _mm256_castsi256_ps(_mm256_set1_epi32(-1))
+#define CULL_MOVEMASK _mm256_movemask_ps
+#else
+    typedef __m128 Lanes;
+    const uint32 width = 4;
+#define CULL_SET1 _mm_set1_ps
+#define CULL_LOAD _mm_loadu_ps
+#define CULL_ADD _mm_add_ps
+#define CULL_MUL _mm_mul_ps
+#define CULL_AND _mm_and_ps
+#define CULL_GE_ZERO(a) _mm_cmpge_ps(a, _mm_setzero_ps())
+#define CULL_ALL_ONES _mm_castsi128_ps(_mm_set1_epi32(-1))
+#define CULL_MOVEMASK _mm_movemask_ps
+#endif
+    Lanes planeX[6], planeY[6], planeZ[6], planeW[6], absX[6], absY[6], absZ[6];
+    for (int p = 0; p < 6; p++)
+    {
+        planeX[p] = CULL_SET1(frustum.planes[p].x);
+        planeY[p] = CULL_SET1(frustum.planes[p].y);
+        planeZ[p] = CULL_SET1(frustum.planes[p].z);
+        planeW[p] = CULL_SET1(frustum.planes[p].w);
+        absX[p] = CULL_SET1(std::fabs(frustum.planes[p].x));
+        absY[p] = CULL_SET1(std::fabs(frustum.planes[p].y));
+        absZ[p] = CULL_SET1(std::fabs(frustum.planes[p].z));
+    }
+    for (; i + width <= count; i += width)
+    {
+        const Lanes cx = CULL_LOAD(bounds.x.data() + i);
+        const Lanes cy = CULL_LOAD(bounds.y.data() + i);
+        const Lanes cz = CULL_LOAD(bounds.z.data() + i);
+        const Lanes ex = CULL_LOAD(bounds.extentX.data() + i);
+        const Lanes ey = CULL_LOAD(bounds.extentY.data() + i);
+        const Lanes ez = CULL_LOAD(bounds.extentZ.data() + i);
+        Lanes inside = CULL_ALL_ONES;
+        for (int p = 0; p < 6; p++)
+        {
+            // signed distance of the center plus the projected half extents
+            Lanes distance = CULL_ADD(CULL_ADD(CULL_MUL(planeX[p], cx), CULL_MUL(planeY[p], cy)), CULL_ADD(CULL_MUL(planeZ[p], cz), planeW[p]));
+            Lanes reach = CULL_ADD(CULL_ADD(CULL_MUL(absX[p], ex), CULL_MUL(absY[p], ey)), CULL_MUL(absZ[p], ez));
+            inside = CULL_AND(inside, CULL_GE_ZERO(CULL_ADD(distance, reach)));
+        }
+        const int mask = CULL_MOVEMASK(inside);
+        for (uint32 lane = 0; lane < width; lane++)
+        {
+            visible[visibleCount] = i + lane;
+            visibleCount += (mask >> lane) & 1;
+        }
+    }
+#undef CULL_SET1
+#undef CULL_LOAD
+#undef CULL_ADD
+#undef CULL_MUL
+#undef CULL_AND
+#undef CULL_GE_ZERO
+#undef CULL_ALL_ONES
+#undef CULL_MOVEMASK
+#endif
+
+    for (; i < count; i++)
+    {
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; p++)
+        {
+            const glm::vec4& plane = frustum.planes[p];
+            float distance = plane.x * bounds.x[i] + plane.y * bounds.y[i] + plane.z * bounds.z[i] + plane.w;
+            float reach = std::fabs(plane.x) * bounds.extentX[i] + std::fabs(plane.y) * bounds.extentY[i] + std::fabs(plane.z) * bounds.extentZ[i];
+            inside = distance + reach >= 0.0f;
+        }
+        visible[visibleCount] = i;
+        visibleCount += inside ? 1 : 0;
+    }
+    return visibleCount;
+}
+
+/*
+Culls the instances of a model and keeps the matrices of the visible ones, packed so they can be
+given straight to ModelInstanced::setTransforms. The arrays are reused between frames.
+*/
+class InstanceCuller
+{
+    SphereBounds spheres;
+public:
+    std::vector<uint32> visible;        // indices of the visible instances
+    std::vector<glm::mat4> transforms;  // PV * model of the visible instances
+    std::vector<glm::mat4> models;
+    std::vector<glm::mat3> normalMats;
+    uint32 visibleCount;
+
+    InstanceCuller()
+        : visibleCount(0)
+    {
+    }
+
+    // Cull count instances of a model with the model space bounding sphere. normalMats is optional.
+    uint32 cull(const glm::mat4& PV, const glm::vec4& sphere, const uint32 count, const glm::mat4* instanceModels,
+        const glm::mat3* instanceNormals = nullptr)
+    {
+        transformSpheres(sphere, count, instanceModels, spheres);
+        visible.resize(count);
+        visibleCount = cullSpheres(Frustum::fromMatrix(PV), spheres, visible.data());
+
+        transforms.resize(visibleCount);
+        models.resize(visibleCount);
+        normalMats.resize(instanceNormals ? visibleCount : 0);
+        for (uint32 i = 0; i < visibleCount; i++)
+        {
+            const glm::mat4& model = instanceModels[visible[i]];
+            transforms[i] = PV * model;
+            models[i] = model;
+            if (instanceNormals)
+                normalMats[i] = instanceNormals[visible[i]];
+        }
+        return visibleCount;
+    }
+};
+
+/*
+Time the sphere and box culling of count random instances, best of runs.
+Started from the command line: OpenGLBasics --bench-cull 100000
+*/
+inline void benchmarkCulling(const uint32 count, const uint32 runs = 50)
+{
+    typedef std::chrono::steady_clock Clock;
+    const glm::mat4 PV = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f, 100.0f)
+        * glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    const Frustum frustum = Frustum::fromMatrix(PV);
+
+    // instances spread in a 200 units cube around the camera
+    std::vector<glm::mat4> models(count);
+    uint32 seed = 12345;
+    auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) * (1.0f / 16777216.0f); };
+    for (glm::mat4& model : models)
+    {
+        model = glm::mat4(1.0f);
+        model[3] = glm::vec4(random() * 200.0f - 100.0f, random() * 200.0f - 100.0f, random() * 200.0f - 100.0f, 1.0f);
+    }
+
+    SphereBounds spheres;
+    BoxBounds boxes;
+    transformSpheres(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), count, models.data(), spheres);
+    transformBoxes(glm::vec3(-1.0f), glm::vec3(1.0f), count, models.data(), boxes);
+    std::vector<uint32> visible(count);
+
+    double transformBest = 1e30;
+    double sphereBest = 1e30;
+    double boxBest = 1e30;
+    uint32 sphereVisible = 0;
+    uint32 boxVisible = 0;
+    for (uint32 run = 0; run < runs; run++)
+    {
+        Clock::time_point start = Clock::now();
+        transformSpheres(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), count, models.data(), spheres);
+        transformBest = std::min(transformBest, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+
+        start = Clock::now();
+        sphereVisible = cullSpheres(frustum, spheres, visible.data());
+        sphereBest = std::min(sphereBest, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+
+        start = Clock::now();
+        boxVisible = cullBoxes(frustum, boxes, visible.data());
+        boxBest = std::min(boxBest, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+    }
+
+    std::cout << "CULL::" << count << " instances: spheres " << sphereBest << " ms (" << sphereVisible << " visible), boxes "
+        << boxBest << " ms (" << boxVisible << " visible), bounds update " << transformBest << " ms" << std::endl;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "main.h"
+#include <GLM/glm.hpp>
+
+
+// View frustum planes extracted from a projection * view (* model) matrix.
+// The planes point inwards and are normalized so the distances are in world units.
+struct Frustum
+{
+    glm::vec4 planes[6]; // left, right, bottom, top, near, far
+
+    static Frustum fromMatrix(const glm::mat4& PV)
+    {
+        Frustum frustum;
+        glm::vec4 row0(PV[0][0], PV[1][0], PV[2][0], PV[3][0]);
+        glm::vec4 row1(PV[0][1], PV[1][1], PV[2][1], PV[3][1]);
+        glm::vec4 row2(PV[0][2], PV[1][2], PV[2][2], PV[3][2]);
+        glm::vec4 row3(PV[0][3], PV[1][3], PV[2][3], PV[3][3]);
+
+        frustum.planes[0] = row3 + row0;
+        frustum.planes[1] = row3 - row0;
+        frustum.planes[2] = row3 + row1;
+        frustum.planes[3] = row3 - row1;
+        frustum.planes[4] = row3 + row2;
+        frustum.planes[5] = row3 - row2;
+
+        for (int i = 0; i < 6; i++)
+            frustum.planes[i] /= glm::length(glm::vec3(frustum.planes[i]));
+        return frustum;
+    }
+
+    bool intersectsSphere(const glm::vec3& center, const float radius) const
+    {
+        for (int i = 0; i < 6; i++)
+            if (glm::dot(glm::vec3(planes[i]), center) + planes[i].w < -radius)
+                return false;
+        return true;
+    }
+};
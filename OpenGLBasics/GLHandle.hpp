@@ -0,0 +1,138 @@
+#pragma once
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+
+/*
+Move-only owners of GL object names. The object is deleted with its handle, so the classes
+holding them can't be copied by accident and never leak their buffers, arrays, textures or framebuffers.
+The handles convert to the name, so they are passed to the gl functions as they are.
+GL thread only, and the context has to outlive them.
+*/
+
+enum GLObjectType
+{
+    GL_OBJECT_BUFFER,
+    GL_OBJECT_VERTEX_ARRAY,
+    GL_OBJECT_TEXTURE,
+    GL_OBJECT_PROGRAM,
+    GL_OBJECT_FRAMEBUFFER,
+    GL_OBJECT_RENDERBUFFER
+};
+
+template<GLObjectType Type>
+class GLHandle
+{
+    GLuint name;
+public:
+    GLHandle()
+        : name(0)
+    {
+    }
+
+    // Take ownership of an existing name
+    explicit GLHandle(const GLuint inName)
+        : name(inName)
+    {
+    }
+
+    ~GLHandle()
+    {
+        reset();
+    }
+
+    GLHandle(const GLHandle&) = delete;
+    GLHandle& operator=(const GLHandle&) = delete;
+
+    GLHandle(GLHandle&& other) noexcept
+        : name(other.name)
+    {
+        other.name = 0;
+    }
+
+    GLHandle& operator=(GLHandle&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            name = other.name;
+            other.name = 0;
+        }
+        return *this;
+    }
+
+    // New object, programs are created with glCreateProgram instead
+    static GLHandle create()
+    {
+        GLuint created = 0;
+        switch (Type)
+        {
+        case GL_OBJECT_BUFFER:
+            glGenBuffers(1, &created);
+            break;
+        case GL_OBJECT_VERTEX_ARRAY:
+            glGenVertexArrays(1, &created);
+            break;
+        case GL_OBJECT_TEXTURE:
+            glGenTextures(1, &created);
+            break;
+        case GL_OBJECT_PROGRAM:
+            created = glCreateProgram();
+            break;
+        case GL_OBJECT_FRAMEBUFFER:
+            glGenFramebuffers(1, &created);
+            break;
+        case GL_OBJECT_RENDERBUFFER:
+            glGenRenderbuffers(1, &created);
+            break;
+        }
+        return GLHandle(created);
+    }
+
+    // Delete the object (if any) and own inName instead
+    void reset(const GLuint inName = 0)
+    {
+        if (name)
+        {
+            switch (Type)
+            {
+            case GL_OBJECT_BUFFER:
+                glDeleteBuffers(1, &name);
+                break;
+            case GL_OBJECT_VERTEX_ARRAY:
+                glDeleteVertexArrays(1, &name);
+                break;
+            case GL_OBJECT_TEXTURE:
+                glDeleteTextures(1, &name);
+                break;
+            case GL_OBJECT_PROGRAM:
+                glDeleteProgram(name);
+                break;
+            case GL_OBJECT_FRAMEBUFFER:
+                glDeleteFramebuffers(1, &name);
+                break;
+            case GL_OBJECT_RENDERBUFFER:
+                glDeleteRenderbuffers(1, &name);
+                break;
+            }
+        }
+        name = inName;
+    }
+
+    GLuint get() const
+    {
+        return name;
+    }
+
+    operator GLuint() const
+    {
+        return name;
+    }
+};
+
+typedef GLHandle<GL_OBJECT_BUFFER> GLBuffer;
+typedef GLHandle<GL_OBJECT_VERTEX_ARRAY> GLVertexArray;
+typedef GLHandle<GL_OBJECT_TEXTURE> GLTexture;
+typedef GLHandle<GL_OBJECT_PROGRAM> GLProgram;
+typedef GLHandle<GL_OBJECT_FRAMEBUFFER> GLFramebuffer;
+typedef GLHandle<GL_OBJECT_RENDERBUFFER> GLRenderbuffer;
@@ -0,0 +1,647 @@
+#pragma once
+#include "main.h"
+#include "VertexFormat.hpp"
+#define GLEW_STATIC
+#include <GL/glew.h>
+#include <GLM/glm.hpp>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+
+/*
+Geometry arena: big vertex and index buffers the meshes are suballocated from.
+Meshes with the same vertex format share a GeometryPool and its VAO, so drawing them one after
+the other never switches VAO. Every draw offsets its indices and uses the first vertex of its
+mesh as base vertex. The instance matrices of all the draws are suballocated the same way from
+three buffers every VAO reads (InstanceRange), a draw starts at its instances with a base instance
+when the driver has ARB_base_instance, else the instance attributes are moved when the first
+instance changes. GL thread only.
+*/
+
+// Initial size of the buffers of a pool, they double when full
+#define GEOMETRY_POOL_VERTEX_BYTES (4 * 1024 * 1024)
+#define GEOMETRY_POOL_INDEX_BYTES (1 * 1024 * 1024)
+// indices are allocated in 4 byte units so 16 and 32 bit indices are always aligned
+#define GEOMETRY_INDEX_UNIT 4
+// Initial number of instances of the instance buffers, they double when full
+#define GEOMETRY_INSTANCE_CAPACITY 4096
+
+// Instance attributes: transform (PV * model) and model matrices, then the normal matrix
+enum InstanceAttribute
+{
+    INSTANCE_TRANSFORM,
+    INSTANCE_MODEL,
+    INSTANCE_NORMAL
+};
+
+inline uint32 instanceStride(const uint32 attribute)
+{
+    return attribute == INSTANCE_NORMAL ? sizeof(glm::mat3) : sizeof(glm::mat4);
+}
+
+// glDrawElementsInstancedBaseVertexBaseInstance is there (GL 4.2 or ARB_base_instance)
+inline bool hasBaseInstance()
+{
+    static const bool supported = GLEW_VERSION_4_2 || GLEW_ARB_base_instance;
+    return supported;
+}
+
+// First fit allocator of [0, size()), the released blocks are merged with their neighbours
+class RangeAllocator
+{
+    struct Block
+    {
+        uint64 offset;
+        uint64 size;
+    };
+
+    std::vector<Block> freeBlocks; // sorted by offset
+    uint64 capacity;
+public:
+    RangeAllocator()
+        : capacity(0)
+    {
+    }
+
+    uint64 size() const
+    {
+        return capacity;
+    }
+
+    uint64 used() const
+    {
+        uint64 available = 0;
+        for (const Block& block : freeBlocks)
+            available += block.size;
+        return capacity - available;
+    }
+
+    // Offset of count units, ~0 when there is no free block big enough
+    uint64 allocate(const uint64 count)
+    {
+        if (count == 0)
+            return 0;
+
+        for (size_t i = 0; i < freeBlocks.size(); i++)
+        {
+            Block& block = freeBlocks[i];
+            if (block.size < count)
+                continue;
+
+            const uint64 offset = block.offset;
+            block.offset += count;
+            block.size -= count;
+            if (block.size == 0)
+                freeBlocks.erase(freeBlocks.begin() + i);
+            return offset;
+        }
+        return ~0ull;
+    }
+
+    // Take extra more units right after the count ones at offset, false when they are not free
+    bool extend(const uint64 offset, const uint64 count, const uint64 extra)
+    {
+        if (extra == 0)
+            return true;
+
+        auto it = std::lower_bound(freeBlocks.begin(), freeBlocks.end(), offset + count,
+            [](const Block& block, const uint64 value) { return block.offset < value; });
+        if (it == freeBlocks.end() || it->offset != offset + count || it->size < extra)
+            return false;
+        it->offset += extra;
+        it->size -= extra;
+        if (it->size == 0)
+            freeBlocks.erase(it);
+        return true;
+    }
+
+    void release(const uint64 offset, const uint64 count)
+    {
+        if (count == 0)
+            return;
+
+        auto it = std::lower_bound(freeBlocks.begin(), freeBlocks.end(), offset,
+            [](const Block& block, const uint64 value) { return block.offset < value; });
+        size_t i = it - freeBlocks.begin();
+        freeBlocks.insert(it, Block{ offset, count });
+
+        if (i + 1 < freeBlocks.size() && freeBlocks[i].offset + freeBlocks[i].size == freeBlocks[i + 1].offset)
+        {
+            freeBlocks[i].size += freeBlocks[i + 1].size;
+            freeBlocks.erase(freeBlocks.begin() + i + 1);
+        }
+        if (i > 0 && freeBlocks[i - 1].offset + freeBlocks[i - 1].size == freeBlocks[i].offset)
+        {
+            freeBlocks[i - 1].size += freeBlocks[i].size;
+            freeBlocks.erase(freeBlocks.begin() + i);
+        }
+    }
+
+    // Add [size(), newCapacity) to the free space
+    void grow(const uint64 newCapacity)
+    {
+        release(capacity, newCapacity - capacity);
+        capacity = newCapacity;
+    }
+};
+
+inline bool operator==(const VertexAttribute& a, const VertexAttribute& b)
+{
+    return a.size == b.size && a.type == b.type && a.normalized == b.normalized && a.offset == b.offset;
+}
+
+inline bool operator==(const VertexFormat& a, const VertexFormat& b)
+{
+    return a.position == b.position && a.normal == b.normal && a.uv == b.uv && a.tangent == b.tangent && a.stride == b.stride;
+}
+
+// New buffer of size bytes starting with the used bytes of buffer, the old one is deleted when the result replaces it
+inline GLBuffer growBuffer(const GLuint buffer, const uint64 used, const uint64 size, const GLenum usage)
+{
+    GLBuffer bigger = GLBuffer::create();
+    glBindBuffer(GL_COPY_WRITE_BUFFER, bigger);
+    glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)size, nullptr, usage);
+    if (buffer && used)
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (GLsizeiptr)used);
+    }
+    return bigger;
+}
+
+// Vertex and index buffers of one vertex format and the VAO reading them
+class GeometryPool
+{
+    RangeAllocator vertexSpace;     // in vertices
+    RangeAllocator indexSpace;      // in GEOMETRY_INDEX_UNIT
+    // the arena instance buffers and the instance the attributes 4 to 14 start at, without base instance
+    const GLBuffer* instanceBuffers;
+    uint32 instanceFirst;
+public:
+    const VertexFormat format;
+    GLVertexArray VAO; // Vertex Array Object
+    GLBuffer VBO; // Vertex Buffer Object
+    GLBuffer EBO; // Elements Buffer Object
+
+    GeometryPool(const VertexFormat& inFormat, const GLBuffer* inInstanceBuffers)
+        : instanceBuffers(inInstanceBuffers), instanceFirst(0), format(inFormat)
+    {
+        const uint64 vertexCapacity = GEOMETRY_POOL_VERTEX_BYTES / format.stride;
+        const uint64 indexCapacity = GEOMETRY_POOL_INDEX_BYTES / GEOMETRY_INDEX_UNIT;
+
+        VAO = GLVertexArray::create();
+        VBO = GLBuffer::create();
+        EBO = GLBuffer::create();
+        glBindVertexArray(VAO);
+
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, vertexCapacity * format.stride, nullptr, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCapacity * GEOMETRY_INDEX_UNIT, nullptr, GL_STATIC_DRAW);
+
+        // positions, normals, texture coords and tangents
+        setVertexAttributes(format);
+
+        // transform, model and normal matrices, read from the arena instance buffers
+        for (uint32 location = 4; location < 15; location++)
+        {
+            glEnableVertexAttribArray(location);
+            glVertexAttribDivisor(location, 1);
+        }
+        pointInstances();
+        glBindVertexArray(0);
+
+        vertexSpace.grow(vertexCapacity);
+        indexSpace.grow(indexCapacity);
+    }
+
+    // The buffers and the VAO are deleted with the pool, the arena keeps it as long as the application
+    GeometryPool(const GeometryPool&) = delete;
+    GeometryPool& operator=(const GeometryPool&) = delete;
+
+    // Room for vertexCount vertices and indexBytes of indices, the buffers grow when they are full
+    void allocate(const uint32 vertexCount, const uint64 indexBytes, uint32& firstVertex, uint64& indexOffset)
+    {
+        const uint64 indexUnits = (indexBytes + GEOMETRY_INDEX_UNIT - 1) / GEOMETRY_INDEX_UNIT;
+
+        uint64 vertex = vertexSpace.allocate(vertexCount);
+        if (vertex == ~0ull)
+        {
+            grow(VBO, GL_ARRAY_BUFFER, vertexSpace, vertexCount, format.stride);
+            vertex = vertexSpace.allocate(vertexCount);
+        }
+        uint64 index = indexSpace.allocate(indexUnits);
+        if (index == ~0ull)
+        {
+            grow(EBO, GL_ELEMENT_ARRAY_BUFFER, indexSpace, indexUnits, GEOMETRY_INDEX_UNIT);
+            index = indexSpace.allocate(indexUnits);
+        }
+
+        firstVertex = (uint32)vertex;
+        indexOffset = index * GEOMETRY_INDEX_UNIT;
+    }
+
+    /*
+    Grow a range to newVertexCount vertices and newIndexBytes of indices keeping its content. It grows
+    in place when the space after it is free, else it is moved (copied on the GPU) somewhere else.
+    */
+    void extend(uint32& firstVertex, const uint32 vertexCount, const uint32 newVertexCount,
+        uint64& indexOffset, const uint64 indexBytes, const uint64 newIndexBytes)
+    {
+        if (newVertexCount > vertexCount && !vertexSpace.extend(firstVertex, vertexCount, newVertexCount - vertexCount))
+        {
+            const uint64 vertex = relocate(VBO, GL_ARRAY_BUFFER, vertexSpace, firstVertex, vertexCount, newVertexCount, format.stride);
+            firstVertex = (uint32)vertex;
+        }
+
+        const uint64 indexUnits = (indexBytes + GEOMETRY_INDEX_UNIT - 1) / GEOMETRY_INDEX_UNIT;
+        const uint64 newIndexUnits = (newIndexBytes + GEOMETRY_INDEX_UNIT - 1) / GEOMETRY_INDEX_UNIT;
+        if (newIndexUnits > indexUnits && !indexSpace.extend(indexOffset / GEOMETRY_INDEX_UNIT, indexUnits, newIndexUnits - indexUnits))
+            indexOffset = relocate(EBO, GL_ELEMENT_ARRAY_BUFFER, indexSpace, indexOffset / GEOMETRY_INDEX_UNIT, indexUnits, newIndexUnits, GEOMETRY_INDEX_UNIT)
+                * GEOMETRY_INDEX_UNIT;
+    }
+
+    void release(const uint32 firstVertex, const uint32 vertexCount, const uint64 indexOffset, const uint64 indexBytes)
+    {
+        vertexSpace.release(firstVertex, vertexCount);
+        indexSpace.release(indexOffset / GEOMETRY_INDEX_UNIT, (indexBytes + GEOMETRY_INDEX_UNIT - 1) / GEOMETRY_INDEX_UNIT);
+    }
+
+    // Fill part of the buffers, offsets in bytes from the start of the buffer
+    void uploadVertices(const uint64 offset, const uint64 size, const void* data)
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, VBO);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)offset, (GLsizeiptr)size, data);
+    }
+
+    void uploadIndices(const uint64 offset, const uint64 size, const void* data)
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, EBO);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)offset, (GLsizeiptr)size, data);
+    }
+
+    /*
+    Bind the VAO for a draw of the instances from firstInstance of the arena instance buffers.
+    Returns the base instance the draw has to use: firstInstance with ARB_base_instance, else 0
+    and the attributes are moved to firstInstance if they were not there already.
+    */
+    uint32 bind(const uint32 firstInstance)
+    {
+        glBindVertexArray(VAO);
+        if (hasBaseInstance())
+            return firstInstance;
+        if (instanceFirst != firstInstance)
+        {
+            instanceFirst = firstInstance;
+            pointInstances();
+        }
+        return 0;
+    }
+
+    // Point the instance attributes of the VAO (bound) at the instance buffers again, after they were replaced
+    void pointInstances()
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, instanceBuffers[INSTANCE_TRANSFORM]);
+        size_t offset = (size_t)instanceFirst * sizeof(glm::mat4);
+        for (uint32 column = 0; column < 4; column++)
+            glVertexAttribPointer(4 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(offset + sizeof(glm::vec4) * column));
+
+        glBindBuffer(GL_ARRAY_BUFFER, instanceBuffers[INSTANCE_MODEL]);
+        for (uint32 column = 0; column < 4; column++)
+            glVertexAttribPointer(8 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(offset + sizeof(glm::vec4) * column));
+
+        glBindBuffer(GL_ARRAY_BUFFER, instanceBuffers[INSTANCE_NORMAL]);
+        offset = (size_t)instanceFirst * sizeof(glm::mat3);
+        for (uint32 column = 0; column < 3; column++)
+            glVertexAttribPointer(12 + column, 3, GL_FLOAT, GL_FALSE, sizeof(glm::mat3), (void*)(offset + sizeof(glm::vec3) * column));
+    }
+
+    uint64 vertexBytesUsed() const
+    {
+        return vertexSpace.used() * format.stride;
+    }
+
+    uint64 vertexBytesAllocated() const
+    {
+        return vertexSpace.size() * format.stride;
+    }
+
+    uint64 indexBytesUsed() const
+    {
+        return indexSpace.used() * GEOMETRY_INDEX_UNIT;
+    }
+
+    uint64 indexBytesAllocated() const
+    {
+        return indexSpace.size() * GEOMETRY_INDEX_UNIT;
+    }
+
+private:
+    // Allocate newCount units, copy the count ones at offset there and free them. Returns the new offset.
+    uint64 relocate(GLBuffer& buffer, const GLenum target, RangeAllocator& space, const uint64 offset, const uint64 count,
+        const uint64 newCount, const uint32 unitSize)
+    {
+        uint64 moved = space.allocate(newCount);
+        if (moved == ~0ull)
+        {
+            grow(buffer, target, space, newCount, unitSize);
+            moved = space.allocate(newCount);
+        }
+        if (count)
+        {
+            glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (GLintptr)(offset * unitSize), (GLintptr)(moved * unitSize),
+                (GLsizeiptr)(count * unitSize));
+        }
+        space.release(offset, count);
+        return moved;
+    }
+
+    // Replace the buffer with one at least twice as big with room for count more units, keeping its content
+    void grow(GLBuffer& buffer, const GLenum target, RangeAllocator& space, const uint64 count, const uint32 unitSize)
+    {
+        const uint64 capacity = std::max(space.size() * 2, space.size() + count);
+        buffer = growBuffer(buffer, space.size() * unitSize, capacity * unitSize, GL_STATIC_DRAW);
+        space.grow(capacity);
+
+        // the VAO still points at the old buffer
+        glBindVertexArray(VAO);
+        glBindBuffer(target, buffer);
+        if (target == GL_ARRAY_BUFFER)
+            setVertexAttributes(format);
+        glBindVertexArray(0);
+    }
+};
+
+// Vertices and indices of one mesh in a pool, given back to the pool when destroyed. Move-only.
+class GeometryRange
+{
+public:
+    GeometryPool* pool;
+    uint32 firstVertex; // in the pool vertex buffer
+    uint32 vertexCount;
+    uint64 indexOffset; // in bytes in the pool index buffer
+    uint64 indexBytes;
+
+    GeometryRange()
+        : pool(nullptr), firstVertex(0), vertexCount(0), indexOffset(0), indexBytes(0)
+    {
+    }
+
+    GeometryRange(GeometryPool& inPool, const uint32 inVertexCount, const uint64 inIndexBytes)
+        : pool(&inPool), firstVertex(0), vertexCount(inVertexCount), indexOffset(0), indexBytes(inIndexBytes)
+    {
+        pool->allocate(vertexCount, indexBytes, firstVertex, indexOffset);
+    }
+
+    ~GeometryRange()
+    {
+        reset();
+    }
+
+    GeometryRange(const GeometryRange&) = delete;
+    GeometryRange& operator=(const GeometryRange&) = delete;
+
+    GeometryRange(GeometryRange&& other) noexcept
+        : pool(other.pool), firstVertex(other.firstVertex), vertexCount(other.vertexCount),
+        indexOffset(other.indexOffset), indexBytes(other.indexBytes)
+    {
+        other.pool = nullptr;
+    }
+
+    GeometryRange& operator=(GeometryRange&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            pool = other.pool;
+            firstVertex = other.firstVertex;
+            vertexCount = other.vertexCount;
+            indexOffset = other.indexOffset;
+            indexBytes = other.indexBytes;
+            other.pool = nullptr;
+        }
+        return *this;
+    }
+
+    // Grow to at least newVertexCount vertices and newIndexBytes of indices, the range may move in the pool
+    void extend(const uint32 newVertexCount, const uint64 newIndexBytes)
+    {
+        pool->extend(firstVertex, vertexCount, std::max(vertexCount, newVertexCount), indexOffset, indexBytes, std::max(indexBytes, newIndexBytes));
+        vertexCount = std::max(vertexCount, newVertexCount);
+        indexBytes = std::max(indexBytes, newIndexBytes);
+    }
+
+    void reset()
+    {
+        if (pool)
+            pool->release(firstVertex, vertexCount, indexOffset, indexBytes);
+        pool = nullptr;
+    }
+};
+
+// The pools of every vertex format in use and the instance buffers they all read
+class GeometryArena
+{
+    std::vector<std::unique_ptr<GeometryPool>> pools;
+    GLBuffer instanceBuffers[3];    // transform, model and normal matrices (InstanceAttribute)
+    RangeAllocator instanceSpace;   // in instances
+public:
+    static GeometryArena& shared()
+    {
+        static GeometryArena arena;
+        return arena;
+    }
+
+    // Pool of the format, created on first use
+    GeometryPool& pool(const VertexFormat& format)
+    {
+        for (const std::unique_ptr<GeometryPool>& pool : pools)
+            if (pool->format == format)
+                return *pool;
+        if (instanceSpace.size() == 0)
+            growInstances(GEOMETRY_INSTANCE_CAPACITY);
+        pools.push_back(std::unique_ptr<GeometryPool>(new GeometryPool(format, instanceBuffers)));
+        return *pools.back();
+    }
+
+    const std::vector<std::unique_ptr<GeometryPool>>& getPools() const
+    {
+        return pools;
+    }
+
+    // First of count instances, the instance buffers grow when they are full
+    uint32 allocateInstances(const uint32 count)
+    {
+        uint64 first = instanceSpace.allocate(count);
+        if (first == ~0ull)
+        {
+            growInstances(std::max(std::max(instanceSpace.size() * 2, instanceSpace.size() + count), (uint64)GEOMETRY_INSTANCE_CAPACITY));
+            first = instanceSpace.allocate(count);
+        }
+        return (uint32)first;
+    }
+
+    void releaseInstances(const uint32 first, const uint32 count)
+    {
+        instanceSpace.release(first, count);
+    }
+
+    // Fill count instances of one attribute from first
+    void uploadInstances(const InstanceAttribute attribute, const uint32 first, const uint32 count, const void* data)
+    {
+        const uint32 stride = instanceStride(attribute);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, instanceBuffers[attribute]);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)first * stride, (GLsizeiptr)count * stride, data);
+    }
+
+    // Copy count instances of every attribute from one range to another, they must not overlap
+    void copyInstances(const uint32 from, const uint32 to, const uint32 count)
+    {
+        for (uint32 attribute = 0; attribute < 3; attribute++)
+        {
+            const uint32 stride = instanceStride(attribute);
+            glBindBuffer(GL_COPY_READ_BUFFER, instanceBuffers[attribute]);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, instanceBuffers[attribute]);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (GLintptr)from * stride, (GLintptr)to * stride, (GLsizeiptr)count * stride);
+        }
+    }
+
+    uint64 instanceBytesUsed() const
+    {
+        return instanceSpace.used() * (2 * sizeof(glm::mat4) + sizeof(glm::mat3));
+    }
+
+    uint64 instanceBytesAllocated() const
+    {
+        return instanceSpace.size() * (2 * sizeof(glm::mat4) + sizeof(glm::mat3));
+    }
+
+    /*
+    Delete the pools and the instance buffers. The arena is a static, its handles would be deleted
+    after the GL context is gone: call it before glfwTerminate, once every mesh and InstanceRange is gone.
+    */
+    void shutdown()
+    {
+        pools.clear();
+        for (GLBuffer& buffer : instanceBuffers)
+            buffer.reset();
+        instanceSpace = RangeAllocator();
+    }
+
+private:
+    // Replace the instance buffers with bigger ones and point every pool at them
+    void growInstances(const uint64 capacity)
+    {
+        for (uint32 attribute = 0; attribute < 3; attribute++)
+        {
+            const uint32 stride = instanceStride(attribute);
+            instanceBuffers[attribute] = growBuffer(instanceBuffers[attribute], instanceSpace.size() * stride, capacity * stride, GL_DYNAMIC_DRAW);
+        }
+        instanceSpace.grow(capacity);
+
+        for (const std::unique_ptr<GeometryPool>& pool : pools)
+        {
+            glBindVertexArray(pool->VAO);
+            pool->pointInstances();
+        }
+        glBindVertexArray(0);
+    }
+};
+
+/*
+Instance matrices of a draw in the arena instance buffers: PV * model, model and normal matrices.
+They belong to whoever draws (ModelInstanced, StaticBatch, HierarchicalLod), not to the shared
+meshes, so two models drawing the same geometry never overwrite each other's instances.
+The space is allocated by the first setTransforms and grows with the count. Move-only, GL thread only.
+*/
+class InstanceRange
+{
+    uint32 first;
+    uint32 capacity;
+public:
+    InstanceRange()
+        : first(0), capacity(0)
+    {
+    }
+
+    ~InstanceRange()
+    {
+        reset();
+    }
+
+    InstanceRange(const InstanceRange&) = delete;
+    InstanceRange& operator=(const InstanceRange&) = delete;
+
+    InstanceRange(InstanceRange&& other) noexcept
+        : first(other.first), capacity(other.capacity)
+    {
+        other.capacity = 0;
+    }
+
+    InstanceRange& operator=(InstanceRange&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            first = other.first;
+            capacity = other.capacity;
+            other.capacity = 0;
+        }
+        return *this;
+    }
+
+    // type 0 is the transform (PV * model) and 1 the model matrix
+    void setTransforms(const uint32 count, const glm::mat4* matrices, const unsigned char type)
+    {
+        if (type > 1 || count == 0)
+            return;
+        reserve(count);
+        GeometryArena::shared().uploadInstances(type == 0 ? INSTANCE_TRANSFORM : INSTANCE_MODEL, first, count, matrices);
+    }
+
+    void setTransforms(const uint32 count, const glm::mat3* matrices)
+    {
+        if (count == 0)
+            return;
+        reserve(count);
+        GeometryArena::shared().uploadInstances(INSTANCE_NORMAL, first, count, matrices);
+    }
+
+    // First instance of the range in the instance buffers
+    uint32 getFirst() const
+    {
+        return first;
+    }
+
+    uint64 gpuBytes() const
+    {
+        return (uint64)capacity * (2 * sizeof(glm::mat4) + sizeof(glm::mat3));
+    }
+
+    void reset()
+    {
+        if (capacity)
+            GeometryArena::shared().releaseInstances(first, capacity);
+        capacity = 0;
+    }
+
+private:
+    // Room for count instances, the ones already set are kept
+    void reserve(const uint32 count)
+    {
+        if (count <= capacity)
+            return;
+        const uint32 newCapacity = std::max(count, capacity * 2);
+        const uint32 newFirst = GeometryArena::shared().allocateInstances(newCapacity);
+        if (capacity)
+        {
+            GeometryArena::shared().copyInstances(first, newFirst, capacity);
+            GeometryArena::shared().releaseInstances(first, capacity);
+        }
+        first = newFirst;
+        capacity = newCapacity;
+    }
+};
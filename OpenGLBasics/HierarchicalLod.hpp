@@ -0,0 +1,331 @@
+#pragma once
+#include "main.h"
+#include "Model.hpp"
+#include "StaticBatch.hpp"
+#include "MeshSimplify.hpp"
+#include "MeshOptimizer.hpp"
+#include "ThreadPool.hpp"
+#include <GLM/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <map>
+#include <tuple>
+#include <vector>
+
+
+/*
+Hierarchical level of detail of static placements.
+The placements (a model and its model matrix) are grouped by the cell of a uniform grid their
+bounds center falls in. Once their geometry is fully uploaded, update() reads the meshes back and
+the thread pool merges the meshes of every cluster in world space in one proxy and simplifies it;
+a later update() uploads the proxies. The models share a MaterialArray, the proxy vertices keep
+their layer in it. draw() draws the proxies of the clusters further than the switch distance and
+the placements of the other ones, instanced per model, so far away the scene costs one draw per
+cluster whatever the number of objects and materials in it.
+GL thread only.
+*/
+
+struct HlodStats
+{
+    uint32 proxies;     // clusters drawn with their proxies
+    uint32 objects;     // placements drawn one by one
+    uint32 drawCalls;
+};
+
+class HierarchicalLod
+{
+    struct Placement
+    {
+        uint32 model;       // in models
+        glm::mat4 transform;
+        glm::mat3 normalMat;
+    };
+
+    struct Cluster
+    {
+        std::vector<uint32> placements;
+        glm::vec4 bounds;   // world space sphere
+        float error;        // of its proxy, in world units
+    };
+
+    // Merged and simplified meshes of a cluster, made on the pool
+    struct ProxyMesh
+    {
+        MeshData data;
+        float error;
+    };
+
+    // instances of a model drawn at full detail this frame
+    struct ModelBatch
+    {
+        std::vector<glm::mat4> transforms;
+        std::vector<glm::mat4> models;
+        std::vector<glm::mat3> normalMats;
+    };
+
+    std::vector<ModelInstanced*> models;
+    MaterialArray* materials;           // of every model
+    std::vector<Placement> placements;
+    std::vector<Cluster> clusters;
+    std::vector<MeshInstanced> proxies; // one per cluster
+    std::future<std::vector<ProxyMesh>> merging; // the proxies of every cluster
+    InstanceRange proxyInstances;       // the single instance every proxy draws
+    std::vector<ModelBatch> batches;    // one per model, draw scratch
+    glm::mat4 viewProjection;
+    float cellSize;
+    float switchDistance;
+    float proxyRatio;
+    float proxyError;
+    bool built;
+public:
+    /*
+    cellSize is the side of the grid cells the placements are clustered in. The clusters are drawn
+    with their proxies when the camera is further than switchDistance from their bounds. The proxies
+    keep about proxyRatio of the cluster triangles, simplified up to proxyError times the cluster size.
+    */
+    HierarchicalLod(const float inCellSize, const float inSwitchDistance, const float inProxyRatio = 0.1f, const float inProxyError = 0.02f)
+        : materials(nullptr), viewProjection(0.0f), cellSize(inCellSize), switchDistance(inSwitchDistance),
+        proxyRatio(inProxyRatio), proxyError(inProxyError), built(false)
+    {
+    }
+
+    ~HierarchicalLod()
+    {
+        // the merge reads the placements and the models
+        if (merging.valid())
+            merging.wait();
+    }
+
+    // The model has to outlive the clusters, all of them drawn with the same MaterialArray. Only before they are built.
+    void add(ModelInstanced& model, const glm::mat4& transform)
+    {
+        if (built || merging.valid())
+        {
+            std::cout << "WARNING::HLOD::Placement added after the clusters were built" << std::endl;
+            return;
+        }
+        if (!model.getMaterialArray() || (materials && model.getMaterialArray() != materials))
+        {
+            std::cout << "WARNING::HLOD::The models of the placements need the same MaterialArray" << std::endl;
+            return;
+        }
+        materials = model.getMaterialArray();
+
+        uint32 index = 0;
+        while (index < models.size() && models[index] != &model)
+            index++;
+        if (index == models.size())
+        {
+            models.push_back(&model);
+            // the proxies are made of the full detail meshes
+            model.getGeometry()->requestAll();
+        }
+        placements.push_back(Placement{ index, transform, glm::transpose(glm::inverse(glm::mat3(transform))) });
+    }
+
+    // Build the clusters once every model is uploaded, the proxies are made on the pool. Returns true once they are built.
+    bool update()
+    {
+        if (built)
+            return true;
+        if (merging.valid())
+        {
+            if (merging.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                return false;
+            uploadProxies(merging.get());
+            return true;
+        }
+        for (const ModelInstanced* model : models)
+            if (!model->getGeometry()->isComplete())
+                return false;
+
+        build();
+        return false;
+    }
+
+    bool isBuilt() const
+    {
+        return built;
+    }
+
+    uint32 clusterCount() const
+    {
+        return (uint32)clusters.size();
+    }
+
+    uint32 placementCount() const
+    {
+        return (uint32)placements.size();
+    }
+
+    /*
+    Draw the proxies of the far clusters and the placements of the near ones, with the MATERIAL_ARRAYS shader bound by the caller.
+    The instance transforms of the models are overwritten.
+    */
+    HlodStats draw(const glm::mat4& PV, const glm::vec3& cameraPos)
+    {
+        HlodStats stats = { 0, 0, 0 };
+        if (!built || !materials)
+            return stats;
+
+        if (PV != viewProjection)
+        {
+            viewProjection = PV;
+            proxyInstances.setTransforms(1, &viewProjection, 0);
+        }
+        for (ModelBatch& batch : batches)
+        {
+            batch.transforms.clear();
+            batch.models.clear();
+            batch.normalMats.clear();
+        }
+
+        materials->bind();
+        for (uint32 i = 0; i < clusters.size(); i++)
+        {
+            const Cluster& cluster = clusters[i];
+            if (glm::length(glm::vec3(cluster.bounds) - cameraPos) - cluster.bounds.w > switchDistance)
+            {
+                proxies[i].draw(proxyInstances, 1);
+                stats.proxies++;
+                stats.drawCalls++;
+                continue;
+            }
+
+            for (uint32 p : cluster.placements)
+            {
+                const Placement& placement = placements[p];
+                ModelBatch& batch = batches[placement.model];
+                batch.transforms.push_back(PV * placement.transform);
+                batch.models.push_back(placement.transform);
+                batch.normalMats.push_back(placement.normalMat);
+            }
+        }
+
+        for (uint32 m = 0; m < models.size(); m++)
+        {
+            const uint32 count = (uint32)batches[m].transforms.size();
+            if (count == 0)
+                continue;
+            models[m]->setTransforms(count, batches[m].transforms.data(), 0);
+            models[m]->setTransforms(count, batches[m].models.data(), 1);
+            models[m]->setTransforms(count, batches[m].normalMats.data());
+            models[m]->draw(count);
+            stats.objects += count;
+            stats.drawCalls += (uint32)models[m]->getGeometry()->meshes.size();
+        }
+        return stats;
+    }
+
+private:
+    // World space bounding sphere of a placement
+    glm::vec4 placementBounds(const Placement& placement) const
+    {
+        const glm::vec4 bounds = models[placement.model]->getBounds();
+        const glm::mat4& t = placement.transform;
+        const float scale = std::sqrt(std::max(glm::dot(glm::vec3(t[0]), glm::vec3(t[0])),
+            std::max(glm::dot(glm::vec3(t[1]), glm::vec3(t[1])), glm::dot(glm::vec3(t[2]), glm::vec3(t[2])))));
+        return glm::vec4(glm::vec3(t * glm::vec4(glm::vec3(bounds), 1.0f)), bounds.w * scale);
+    }
+
+    // Cluster the placements and read their meshes back, the proxies are merged on the pool
+    void build()
+    {
+        // cluster the placements by grid cell
+        std::vector<glm::vec4> placementSpheres(placements.size());
+        std::map<std::tuple<int, int, int>, uint32> cells;
+        for (uint32 p = 0; p < placements.size(); p++)
+        {
+            placementSpheres[p] = placementBounds(placements[p]);
+            const glm::vec3 cell = glm::floor(glm::vec3(placementSpheres[p]) / cellSize);
+            const std::tuple<int, int, int> key((int)cell.x, (int)cell.y, (int)cell.z);
+            std::map<std::tuple<int, int, int>, uint32>::iterator found = cells.find(key);
+            if (found == cells.end())
+            {
+                found = cells.insert(std::make_pair(key, (uint32)clusters.size())).first;
+                clusters.push_back(Cluster{ std::vector<uint32>(), glm::vec4(0.0f), 0.0f });
+            }
+            clusters[found->second].placements.push_back(p);
+        }
+
+        for (Cluster& cluster : clusters)
+        {
+            glm::vec3 minPos(placementSpheres[cluster.placements[0]]);
+            glm::vec3 maxPos = minPos;
+            for (uint32 p : cluster.placements)
+            {
+                const glm::vec4& sphere = placementSpheres[p];
+                minPos = glm::min(minPos, glm::vec3(sphere) - sphere.w);
+                maxPos = glm::max(maxPos, glm::vec3(sphere) + sphere.w);
+            }
+            const glm::vec3 center = (minPos + maxPos) * 0.5f;
+            float radius = 0.0f;
+            for (uint32 p : cluster.placements)
+                radius = std::max(radius, glm::length(glm::vec3(placementSpheres[p]) - center) + placementSpheres[p].w);
+            cluster.bounds = glm::vec4(center, radius);
+        }
+
+        // the meshes are read back here, the GL thread, once per model
+        std::vector<std::vector<MeshData>> modelData(models.size());
+        for (uint32 m = 0; m < models.size(); m++)
+            for (const MeshInstanced& mesh : models[m]->getGeometry()->meshes)
+                modelData[m].push_back(mesh.readMeshData());
+
+        // the placements, clusters and models are not changed until the merge is done
+        merging = ThreadPool::shared().submit([this, modelData = std::move(modelData)]()
+        {
+            std::vector<ProxyMesh> merged(clusters.size());
+            ThreadPool::shared().parallelFor((uint32)clusters.size(), [&](const uint32 c)
+            {
+                mergeCluster(clusters[c], modelData, merged[c]);
+            });
+            return merged;
+        });
+    }
+
+    // Merge the meshes of the cluster in world space and simplify the result, the layers are kept apart as seams
+    void mergeCluster(const Cluster& cluster, const std::vector<std::vector<MeshData>>& modelData, ProxyMesh& proxy) const
+    {
+        MeshData& target = proxy.data;
+        for (uint32 p : cluster.placements)
+        {
+            const Placement& placement = placements[p];
+            for (const MeshData& mesh : modelData[placement.model])
+            {
+                MeshData data = mesh;
+                appendWorldSpace(target, data, placement.transform);
+            }
+        }
+
+        const uint32 targetCount = (uint32)(target.indices.size() / 3 * proxyRatio) * 3;
+        target.indices = simplifyMesh(target.vertices, target.indices, targetCount, proxyError * cluster.bounds.w * 2.0f, &proxy.error);
+        optimizeVertexCache(target.indices, (uint32)target.vertices.size());
+        optimizeVertexFetch(target.vertices, target.indices);
+    }
+
+    // Upload the proxies made by the pool
+    void uploadProxies(const std::vector<ProxyMesh>& merged)
+    {
+        const glm::mat4 identity(1.0f);
+        const glm::mat3 identityNormal(1.0f);
+        proxyInstances.setTransforms(1, &identity, 1);
+        proxyInstances.setTransforms(1, &identityNormal);
+        proxyInstances.setTransforms(1, &viewProjection, 0);
+        proxies.reserve(merged.size());
+        for (uint32 c = 0; c < merged.size(); c++)
+        {
+            // world positions are kept in floats like the static batches, no CPU copy of the proxy is kept
+            const MeshData& data = merged[c].data;
+            PackedVertices packed = packVertices(data.vertices, VertexLayout());
+            PackedIndices packedIndices = packIndices(data.indices, std::vector<IndexRange>(1, IndexRange{ 0, (uint32)data.indices.size(), 0 }));
+            proxies.push_back(MeshInstanced(packed.bytes(data.vertices), (uint32)data.vertices.size(), packed.format, packed.dequant,
+                packedIndices.bytes(data.indices), (uint32)data.indices.size(), packedIndices.indexSize, packedIndices.ranges));
+            proxies.back().bounds = clusters[c].bounds;
+            clusters[c].error = merged[c].error;
+        }
+
+        batches.resize(models.size());
+        built = true;
+    }
+};
@@ -0,0 +1,282 @@
+#pragma once
+#include "main.h"
+#include "Model.hpp"
+#include <GLM/glm.hpp>
+#include <GLM/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+
+/*
+Impostors of far instances.
+bake() renders a model offscreen from frames x frames directions spread over the sphere with an
+octahedral mapping, each view into its cell of three atlases: the albedo (sRGB, alpha is the
+coverage), the model space normal with the depth inside the bounding sphere in alpha and the
+metallic, roughness and ambient occlusion of the material.
+draw() then replaces every instance by one quad, all of them in a single instanced draw. The vertex
+shader (res/Shaders/impostor.vert) picks the baked view nearest to the direction of the camera. The
+fragment shader is fragment_PBR.frag built with IMPOSTOR_DEFINE: it moves the fragment to the baked
+surface and lights it with the same BRDF and shadow as the meshes.
+GL thread only.
+*/
+
+#define IMPOSTOR_DEFINE "#define IMPOSTOR\n"
+
+// Up axis of the camera of a baked view, it must match the one in impostor.vert
+inline glm::vec3 impostorUp(const glm::vec3& dir)
+{
+    return std::abs(dir.y) > 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+}
+
+// Direction of the baked view in cell (x, y) of the atlas
+inline glm::vec3 impostorDirection(const uint32 x, const uint32 y, const uint32 frames)
+{
+    const glm::vec2 e = (glm::vec2((float)x, (float)y) + 0.5f) / (float)frames * 2.0f - 1.0f;
+    glm::vec3 n(e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y));
+    const float t = std::max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return glm::normalize(n);
+}
+
+class Impostor
+{
+    GLTexture albedo;
+    GLTexture normalDepth;
+    GLTexture MRA;
+    GLVertexArray VAO;
+    GLBuffer quadVBO;
+    GLBuffer instanceVBO;   // model matrices of the impostors drawn
+    uint32 instanceCapacity;
+    uint32 frames;
+    glm::vec4 bounds;       // model space bounding sphere of the baked model
+    // drawInstances scratch
+    std::vector<glm::mat4> nearTransforms;
+    std::vector<glm::mat4> nearModels;
+    std::vector<glm::mat3> nearNormals;
+    std::vector<glm::mat4> farModels;
+public:
+    Impostor()
+        : instanceCapacity(0), frames(0), bounds(0.0f)
+    {
+    }
+
+    bool isBaked() const
+    {
+        return frames != 0;
+    }
+
+    /*
+    Render model into frames x frames views of frameSize texels. bakeShader is
+    impostorBake.vert/.frag, the model binds its textures to units 0 and 1 like when it is drawn.
+    The model has to be uploaded, returns false when it is not ready yet.
+    */
+    bool bake(ModelInstanced& model, Shader& bakeShader, const uint32 inFrames = 8, const uint32 frameSize = 128)
+    {
+        if (!model.isReady())
+            return false;
+
+        frames = inFrames;
+        bounds = model.getBounds();
+        const GLsizei size = (GLsizei)(frames * frameSize);
+        createAtlas(albedo, size, GL_SRGB8_ALPHA8);
+        createAtlas(normalDepth, size, GL_RGBA8);
+        createAtlas(MRA, size, GL_RGBA8);
+
+        GLint previousFramebuffer;
+        GLint viewport[4];
+        GLfloat clearColor[4];
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+
+        GLFramebuffer fbo = GLFramebuffer::create();
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedo, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normalDepth, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, MRA, 0);
+        GLRenderbuffer rbo = GLRenderbuffer::create();
+        glBindRenderbuffer(GL_RENDERBUFFER, rbo);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rbo);
+        const GLenum drawBuffers[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+        glDrawBuffers(3, drawBuffers);
+
+        const bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        if (complete)
+        {
+            glEnable(GL_DEPTH_TEST);
+            // the linear albedo is stored in sRGB, like the textures it comes from
+            glEnable(GL_FRAMEBUFFER_SRGB);
+            glViewport(0, 0, size, size);
+            glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+            // orthographic views of the bounding sphere, the depth covers it from front to back
+            const glm::vec3 center(bounds);
+            const float radius = bounds.w;
+            const glm::mat4 projection = glm::ortho(-radius, radius, -radius, radius, radius, 3.0f * radius);
+            const glm::mat4 identity(1.0f);
+            const glm::mat3 identityNormal(1.0f);
+            bakeShader.bind();
+            bakeShader.setInt("material.albedo", 0);
+            bakeShader.setInt("material.MRA", 1);
+            for (uint32 y = 0; y < frames; y++)
+                for (uint32 x = 0; x < frames; x++)
+                {
+                    const glm::vec3 dir = impostorDirection(x, y, frames);
+                    const glm::mat4 PV = projection * glm::lookAt(center + dir * 2.0f * radius, center, impostorUp(dir));
+                    glViewport((GLint)(x * frameSize), (GLint)(y * frameSize), (GLsizei)frameSize, (GLsizei)frameSize);
+                    model.setTransforms(1, &PV, 0);
+                    model.setTransforms(1, &identity, 1);
+                    model.setTransforms(1, &identityNormal);
+                    model.draw(1);
+                }
+            glDisable(GL_FRAMEBUFFER_SRGB);
+
+            for (GLuint atlas : { (GLuint)albedo, (GLuint)normalDepth, (GLuint)MRA })
+            {
+                glBindTexture(GL_TEXTURE_2D, atlas);
+                glGenerateMipmap(GL_TEXTURE_2D);
+            }
+        }
+        else
+            std::cout << "ERROR::IMPOSTOR::Bake framebuffer is not complete" << std::endl;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, (GLuint)previousFramebuffer);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+        if (!complete)
+        {
+            frames = 0;
+            return false;
+        }
+
+        createQuad();
+        return true;
+    }
+
+    /*
+    Draw count impostors with the given model matrices in one instanced draw. shader is impostor.vert
+    with fragment_PBR.frag built with IMPOSTOR_DEFINE, its sun and shadow map set like the lit shader.
+    */
+    void draw(Shader& shader, const glm::mat4& PV, const glm::vec3& cameraPos, const uint32 count, const glm::mat4* models)
+    {
+        if (!isBaked() || count == 0)
+            return;
+
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        const uint32 size = count * 16 * sizeof(float);
+        if (instanceCapacity < size)
+        {
+            glBufferData(GL_ARRAY_BUFFER, size, models, GL_DYNAMIC_DRAW);
+            instanceCapacity = size;
+        }
+        else
+            glBufferSubData(GL_ARRAY_BUFFER, 0, size, models);
+
+        shader.bind();
+        shader.setMat4f("PV", PV);
+        shader.setVec4f("viewPos", cameraPos.x, cameraPos.y, cameraPos.z, 1.0f);
+        shader.setVec4f("bounds", bounds.x, bounds.y, bounds.z, bounds.w);
+        shader.setFloat("frames", (float)frames);
+        // the shadow map stays on unit 2
+        shader.setInt("material.albedo", 0);
+        shader.setInt("material.MRA", 1);
+        shader.setInt("normalDepth", 3);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, albedo);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, MRA);
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, normalDepth);
+        glActiveTexture(GL_TEXTURE0);
+
+        glBindVertexArray(VAO);
+        glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, 4, count);
+        glBindVertexArray(0);
+    }
+
+    /*
+    Draw the instances closer than cutoff with the model (with the shader bound by the caller) and
+    the others as impostors. Returns the number of impostors drawn.
+    */
+    uint32 drawInstances(ModelInstanced& model, Shader& impostorShader, const glm::mat4& PV,
+        const glm::vec3& cameraPos, const float cutoff, const uint32 count, const glm::mat4* models)
+    {
+        nearTransforms.clear();
+        nearModels.clear();
+        nearNormals.clear();
+        farModels.clear();
+        const float cutoff2 = isBaked() ? cutoff * cutoff : INFINITY;
+        for (uint32 i = 0; i < count; i++)
+        {
+            const glm::vec3 offset = glm::vec3(models[i][3]) - cameraPos;
+            if (glm::dot(offset, offset) > cutoff2)
+                farModels.push_back(models[i]);
+            else
+            {
+                nearTransforms.push_back(PV * models[i]);
+                nearModels.push_back(models[i]);
+                nearNormals.push_back(glm::transpose(glm::inverse(glm::mat3(models[i]))));
+            }
+        }
+
+        if (!nearModels.empty())
+        {
+            const uint32 nearCount = (uint32)nearModels.size();
+            model.setTransforms(nearCount, nearTransforms.data(), 0);
+            model.setTransforms(nearCount, nearModels.data(), 1);
+            model.setTransforms(nearCount, nearNormals.data());
+            model.draw(nearCount);
+        }
+        draw(impostorShader, PV, cameraPos, (uint32)farModels.size(), farModels.data());
+        return (uint32)farModels.size();
+    }
+
+private:
+    static void createAtlas(GLTexture& texture, const GLsizei size, const GLint internalFormat)
+    {
+        texture = GLTexture::create();
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    // Corners of the quad at location 0, the instance model matrices at 8 to 11 like the meshes
+    void createQuad()
+    {
+        if (VAO)
+            return;
+
+        const float corners[] =
+        {
+            -1.0f, -1.0f,
+             1.0f, -1.0f,
+             1.0f,  1.0f,
+            -1.0f,  1.0f
+        };
+        VAO = GLVertexArray::create();
+        quadVBO = GLBuffer::create();
+        instanceVBO = GLBuffer::create();
+        glBindVertexArray(VAO);
+
+        glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 2, (void*)0);
+
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        for (uint32 i = 0; i < 4; i++)
+        {
+            glEnableVertexAttribArray(8 + i);
+            glVertexAttribPointer(8 + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(sizeof(glm::vec4) * i));
+            glVertexAttribDivisor(8 + i, 1);
+        }
+        glBindVertexArray(0);
+    }
+};
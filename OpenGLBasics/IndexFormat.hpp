@@ -0,0 +1,152 @@
+#pragma once
+#include "main.h"
+#include "Vertex.hpp"
+#define GLEW_STATIC
+#include <GL/glew.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+
+/*
+16 bit index buffers.
+A mesh with up to 65536 vertices is uploaded with 16 bit indices. Bigger meshes can be split in
+ranges of triangles that address at most 65536 vertices each, drawn with their own base vertex.
+*/
+
+#define SHORT_INDEX_VERTEX_LIMIT 65536u
+
+struct PackedIndices
+{
+    uint32 indexSize;                       // 2 or 4 bytes
+    std::vector<uint16_t> shortIndices;     // relative to the base vertex of their range, empty for 32 bit
+    std::vector<IndexRange> ranges;
+
+    // Bytes to upload for the indices that were packed
+    const void* bytes(const std::vector<uint32>& indices) const
+    {
+        return indexSize == 2 ? (const void*)shortIndices.data() : (const void*)indices.data();
+    }
+};
+
+inline GLenum indexType(const uint32 indexSize)
+{
+    return indexSize == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+/*
+Reorder (and duplicate at the chunk borders) the vertices so every range of triangles uses a
+window of at most SHORT_INDEX_VERTEX_LIMIT vertices. The triangle order is kept.
+The indices stay absolute, the ranges give the base vertex of every window.
+*/
+inline std::vector<IndexRange> splitForShortIndices(MeshData& mesh)
+{
+    const uint32 indexCount = (uint32)mesh.indices.size();
+    if (mesh.vertices.size() <= SHORT_INDEX_VERTEX_LIMIT)
+        return std::vector<IndexRange>(1, IndexRange{ 0, indexCount, 0 });
+
+    std::vector<IndexRange> ranges;
+    std::vector<Vertex> vertices;
+    vertices.reserve(mesh.vertices.size());
+
+    // chunk[v] is the last chunk that used v and remap[v] where it went in that chunk
+    std::vector<uint32> chunk(mesh.vertices.size(), 0xFFFFFFFFu);
+    std::vector<uint32> remap(mesh.vertices.size());
+    IndexRange current = { 0, 0, 0 };
+    uint32 chunkId = 0;
+
+    for (uint32 i = 0; i + 2 < indexCount; i += 3)
+    {
+        uint32 added = 0;
+        for (uint32 k = 0; k < 3; k++)
+        {
+            uint32 v = mesh.indices[i + k];
+            bool repeated = (k > 0 && mesh.indices[i] == v) || (k > 1 && mesh.indices[i + 1] == v);
+            if (chunk[v] != chunkId && !repeated)
+                added++;
+        }
+
+        if ((uint32)vertices.size() - current.baseVertex + added > SHORT_INDEX_VERTEX_LIMIT)
+        {
+            ranges.push_back(current);
+            current.firstIndex = i;
+            current.indexCount = 0;
+            current.baseVertex = (uint32)vertices.size();
+            chunkId++;
+        }
+
+        for (uint32 k = 0; k < 3; k++)
+        {
+            uint32& v = mesh.indices[i + k];
+            if (chunk[v] != chunkId)
+            {
+                chunk[v] = chunkId;
+                remap[v] = (uint32)vertices.size();
+                vertices.push_back(mesh.vertices[v]);
+            }
+            v = remap[v];
+        }
+        current.indexCount += 3;
+    }
+    ranges.push_back(current);
+
+    mesh.vertices.swap(vertices);
+    return ranges;
+}
+
+// Parts of the ranges inside the indices [first, end)
+inline std::vector<IndexRange> clipRanges(const std::vector<IndexRange>& ranges, const uint32 first, const uint32 end)
+{
+    std::vector<IndexRange> clipped;
+    for (const IndexRange& range : ranges)
+    {
+        uint32 start = std::max(range.firstIndex, first);
+        uint32 stop = std::min(range.firstIndex + range.indexCount, end);
+        if (start < stop)
+            clipped.push_back(IndexRange{ start, stop - start, range.baseVertex });
+    }
+    return clipped;
+}
+
+// Build the 16 bit indices if every range fits, else keep the 32 bit ones
+inline PackedIndices packIndices(const std::vector<uint32>& indices, const std::vector<IndexRange>& ranges, const bool allowShort = true)
+{
+    PackedIndices packed;
+    packed.ranges = ranges;
+    packed.indexSize = 4;
+    if (!allowShort)
+        return packed;
+
+    for (const IndexRange& range : ranges)
+        for (uint32 i = range.firstIndex; i < range.firstIndex + range.indexCount; i++)
+            if (indices[i] - range.baseVertex >= SHORT_INDEX_VERTEX_LIMIT)
+                return packed;
+
+    packed.indexSize = 2;
+    packed.shortIndices.resize(indices.size());
+    for (const IndexRange& range : ranges)
+        for (uint32 i = range.firstIndex; i < range.firstIndex + range.indexCount; i++)
+            packed.shortIndices[i] = (uint16_t)(indices[i] - range.baseVertex);
+    return packed;
+}
+
+// Inverse of packIndices, count indices of indexSize bytes back to absolute 32 bit indices
+inline std::vector<uint32> unpackIndices(const void* data, const uint32 count, const uint32 indexSize, const std::vector<IndexRange>& ranges)
+{
+    std::vector<uint32> indices(count);
+    if (indexSize == 4)
+    {
+        memcpy(indices.data(), data, (size_t)count * 4);
+        return indices;
+    }
+
+    const uint16_t* shortIndices = (const uint16_t*)data;
+    for (const IndexRange& range : ranges)
+    {
+        const uint32 stop = std::min(range.firstIndex + range.indexCount, count);
+        for (uint32 i = range.firstIndex; i < stop; i++)
+            indices[i] = shortIndices[i] + range.baseVertex;
+    }
+    return indices;
+}
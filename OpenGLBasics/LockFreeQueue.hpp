@@ -0,0 +1,69 @@
+#pragma once
+#include "main.h"
+#include <atomic>
+#include <utility>
+
+
+/*
+Multiple producer, single consumer queue without locks.
+Producers push on an atomic list, the consumer takes the whole list at once and reverses it,
+so there is no ABA problem and items come out in the order they were pushed by each producer.
+*/
+template<typename T>
+class LockFreeQueue
+{
+    struct Node
+    {
+        T value;
+        Node* next;
+    };
+
+    std::atomic<Node*> head;    // last pushed
+    Node* pending;              // taken by the consumer, oldest first
+public:
+    LockFreeQueue()
+        : head(nullptr), pending(nullptr)
+    {
+    }
+
+    ~LockFreeQueue()
+    {
+        T value;
+        while (pop(value));
+    }
+
+    LockFreeQueue(const LockFreeQueue&) = delete;
+    LockFreeQueue& operator=(const LockFreeQueue&) = delete;
+
+    // Any thread
+    void push(T value)
+    {
+        Node* node = new Node{ std::move(value), head.load(std::memory_order_relaxed) };
+        while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // Consumer thread only
+    bool pop(T& value)
+    {
+        if (!pending)
+        {
+            // reverse the pushed list so the oldest comes first
+            Node* node = head.exchange(nullptr, std::memory_order_acquire);
+            while (node)
+            {
+                Node* next = node->next;
+                node->next = pending;
+                pending = node;
+                node = next;
+            }
+            if (!pending)
+                return false;
+        }
+
+        Node* node = pending;
+        pending = node->next;
+        value = std::move(node->value);
+        delete node;
+        return true;
+    }
+};
@@ -0,0 +1,202 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// Read only view of a whole file mapped in memory.
+// The pointer returned by data() is valid until the object is closed or destroyed.
+class MappedFile
+{
+    const unsigned char* m_data;
+    size_t m_size;
+#ifdef _WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
+#else
+    int m_file;
+#endif
+public:
+    MappedFile()
+        : m_data(nullptr), m_size(0)
+#ifdef _WIN32
+        , m_file(INVALID_HANDLE_VALUE), m_mapping(NULL)
+#else
+        , m_file(-1)
+#endif
+    {
+    }
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    // the mapping can not be shared, only handed over (the view keeps its address)
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept
+        : MappedFile()
+    {
+        swap(other);
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            swap(other);
+        }
+        return *this;
+    }
+
+    void swap(MappedFile& other) noexcept
+    {
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        std::swap(m_file, other.m_file);
+#ifdef _WIN32
+        std::swap(m_mapping, other.m_mapping);
+#endif
+    }
+
+    bool open(const std::string& path)
+    {
+        close();
+#ifdef _WIN32
+        m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (m_file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+        {
+            close();
+            return false;
+        }
+        m_size = (size_t)size.QuadPart;
+
+        m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!m_mapping)
+        {
+            close();
+            return false;
+        }
+        m_data = (const unsigned char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        m_file = ::open(path.c_str(), O_RDONLY);
+        if (m_file < 0)
+            return false;
+
+        struct stat info;
+        if (fstat(m_file, &info) != 0 || info.st_size == 0)
+        {
+            close();
+            return false;
+        }
+        m_size = (size_t)info.st_size;
+
+        void* view = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+        m_data = (view == MAP_FAILED) ? nullptr : (const unsigned char*)view;
+#endif
+        if (!m_data)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        m_mapping = NULL;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_data)
+            munmap((void*)m_data, m_size);
+        if (m_file >= 0)
+            ::close(m_file);
+        m_file = -1;
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    bool isOpen() const { return m_data != nullptr; }
+    const unsigned char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+};
+
+// Hash of the file contents used to detect stale caches
+inline unsigned long long hashBytes(const unsigned char* data, const size_t size)
+{
+    const unsigned long long prime = 1099511628211ull;
+    unsigned long long hash = 14695981039346656037ull ^ size;
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++)
+        hash = (hash ^ data[i]) * prime;
+
+    return hash;
+}
+
+/*
+Cache files are written next to their final path and moved over it once complete, so a crash never
+leaves a half written file and a reader that mapped the previous one keeps a valid view.
+The temporary name is unique per thread, two threads writing the same cache don't share it.
+*/
+inline std::string temporaryPathFor(const std::string& path)
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%zx.tmp", std::hash<std::thread::id>()(std::this_thread::get_id()));
+    return path + suffix;
+}
+
+// Move the finished temporary file over path, it is deleted when that fails
+inline bool replaceFile(const std::string& temporaryPath, const std::string& path)
+{
+    std::error_code error;
+    std::filesystem::rename(temporaryPath, path, error);
+    if (error)
+    {
+        std::filesystem::remove(temporaryPath, error);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "main.h"
+#include "TextureCache.hpp"
+#include <memory>
+#include <string>
+#include <vector>
+
+
+/*
+The textures of a set of materials packed as the layers of texture arrays.
+Each map (diffuse, specular) of all the materials is one GL_TEXTURE_2D_ARRAY, layer i holding the
+map of material i. A model binds the arrays once and draws all its meshes, every vertex picking
+its layer with the w of its position (Vertex::layer, shaders built with the MATERIAL_ARRAYS define),
+so meshes of several materials merged in one (ImportOptions::mergeMeshes, StaticBatch, HierarchicalLod)
+are a single draw. The images of another size are resampled to the layer size.
+There is no per material shininess, fragment_PBR reads the roughness from the specular map (MRA).
+*/
+
+#define MATERIAL_ARRAYS_DEFINE "#define MATERIAL_ARRAYS\n"
+
+struct MaterialTextures
+{
+    std::string diffuse;
+    std::string specular;
+};
+
+class MaterialArray
+{
+    std::shared_ptr<Texture> diffuse;
+    std::shared_ptr<Texture> specular;
+    uint32 layerCount;
+public:
+    MaterialArray(const std::vector<MaterialTextures>& materials, const uint32 layerSize,
+        const TextureOptions& diffuseOptions = TextureOptions(), const TextureOptions& specularOptions = TextureOptions())
+        : layerCount((uint32)materials.size())
+    {
+        std::vector<std::string> diffusePaths;
+        std::vector<std::string> specularPaths;
+        for (const MaterialTextures& material : materials)
+        {
+            diffusePaths.push_back(material.diffuse);
+            specularPaths.push_back(material.specular);
+        }
+        diffuse = TextureCache::shared().acquireArray(diffusePaths, layerSize, diffuseOptions);
+        specular = TextureCache::shared().acquireArray(specularPaths, layerSize, specularOptions);
+    }
+
+    // Diffuse maps on unit 0 and specular maps on unit 1, like the textures of a Material
+    void bind() const
+    {
+        diffuse->bind(0);
+        specular->bind(1);
+    }
+
+    uint32 size() const
+    {
+        return layerCount;
+    }
+};
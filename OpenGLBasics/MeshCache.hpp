@@ -0,0 +1,349 @@
+#pragma once
+#include "main.h"
+#include "MappedFile.hpp"
+#include "Vertex.hpp"
+#include "Meshlet.hpp"
+#include "MeshSimplify.hpp"
+#include "MeshCodec.hpp"
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+
+/*
+Binary mesh cache.
+Stores the final vertex and index arrays of an imported model so the next run can skip Assimp.
+
+Layout (all offsets are from the start of the file and 16 bytes aligned):
+    MeshCacheHeader
+    MeshCacheEntry[meshCount]
+    vertex, index, IndexRange, Meshlet and MeshLod arrays of every submesh
+With MESH_CACHE_COMPRESSED the vertex and index arrays are MeshCodec streams, decoded when the cache is opened.
+*/
+
+#define MESH_CACHE_MAGIC 0x4D42474F // "OGBM"
+#define MESH_CACHE_VERSION 11 // 10 stored the vertex deltas without zigzag, 9 lost the index jumps of 32768 or more in compressed 16 bit indices, 8 had 3 component positions
+#define MESH_CACHE_EXTENSION ".meshcache"
+#define MESH_CACHE_COMPRESSED 1 // MeshCacheHeader flag
+
+struct MeshCacheHeader
+{
+    uint32 magic;
+    uint32 version;
+    uint32 vertexStride;
+    uint32 meshCount;
+    uint32 flags;
+    uint32 reserved;
+    uint64 sourceHash;
+    uint64 sourceSize;
+};
+
+struct MeshCacheEntry
+{
+    uint64 vertexOffset;
+    uint64 indexOffset;
+    uint64 rangeOffset;
+    uint64 meshletOffset;
+    uint64 lodOffset;
+    uint64 vertexStoredSize; // bytes in the file, smaller than the vertices when compressed
+    uint64 indexStoredSize;
+    uint32 vertexCount;
+    uint32 indexCount;
+    uint32 indexSize;
+    uint32 rangeCount;
+    uint32 meshletCount;
+    uint32 lodCount;
+    float dequant[4];
+    float bounds[4];
+    float box[6];
+};
+
+// View of one submesh (either inside the mapped cache or in memory to be written)
+struct MeshCacheView
+{
+    const void* vertices;
+    uint32 vertexCount;
+    const void* indices;
+    uint32 indexCount;
+    uint32 indexSize; // 2 or 4 bytes
+    const IndexRange* ranges;
+    uint32 rangeCount;
+    const Meshlet* meshlets;
+    uint32 meshletCount;
+    const MeshLod* lods;
+    uint32 lodCount;
+    float dequant[4]; // position dequantization of packed layouts
+    float bounds[4];  // bounding sphere
+    float box[6];     // bounding box min and max
+};
+
+class MeshCache
+{
+    MappedFile file;
+    const MeshCacheHeader* header;
+    const MeshCacheEntry* entries;
+    // vertices and indices of every submesh when the cache is compressed
+    std::vector<std::vector<unsigned char>> decodedVertices;
+    std::vector<std::vector<unsigned char>> decodedIndices;
+public:
+    MeshCache()
+        : header(nullptr), entries(nullptr)
+    {
+    }
+
+    // header and entries point into the mapping, which keeps its address when the file is moved
+    MeshCache(MeshCache&& other) noexcept
+        : file(std::move(other.file)), header(other.header), entries(other.entries),
+        decodedVertices(std::move(other.decodedVertices)), decodedIndices(std::move(other.decodedIndices))
+    {
+        other.header = nullptr;
+        other.entries = nullptr;
+    }
+
+    MeshCache& operator=(MeshCache&& other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            file = std::move(other.file);
+            header = other.header;
+            entries = other.entries;
+            decodedVertices = std::move(other.decodedVertices);
+            decodedIndices = std::move(other.decodedIndices);
+            other.header = nullptr;
+            other.entries = nullptr;
+        }
+        return *this;
+    }
+
+    MeshCache(const MeshCache&) = delete;
+    MeshCache& operator=(const MeshCache&) = delete;
+
+    // One cache per set of import options, so loading a file with other options doesn't overwrite it
+    static std::string pathFor(const std::string& sourcePath, const uint64 optionsHash)
+    {
+        char suffix[24];
+        snprintf(suffix, sizeof(suffix), ".%016llx", (unsigned long long)optionsHash);
+        return sourcePath + suffix + MESH_CACHE_EXTENSION;
+    }
+
+    // Map the cache file and check it matches the source file and the vertex layout.
+    // A compressed cache is decoded here, so call it from a worker thread.
+    bool open(const std::string& cachePath, const uint64 sourceHash, const uint64 sourceSize, const uint32 vertexStride)
+    {
+        close();
+        if (!file.open(cachePath))
+            return false;
+
+        if (file.size() < sizeof(MeshCacheHeader))
+        {
+            close();
+            return false;
+        }
+
+        header = (const MeshCacheHeader*)file.data();
+        if (header->magic != MESH_CACHE_MAGIC
+            || header->version != MESH_CACHE_VERSION
+            || header->vertexStride != vertexStride
+            || header->sourceHash != sourceHash
+            || header->sourceSize != sourceSize
+            || file.size() < sizeof(MeshCacheHeader) + header->meshCount * sizeof(MeshCacheEntry))
+        {
+            close();
+            return false;
+        }
+        entries = (const MeshCacheEntry*)(file.data() + sizeof(MeshCacheHeader));
+
+        // make sure no entry points outside the file
+        for (uint32 i = 0; i < header->meshCount; i++)
+        {
+            const MeshCacheEntry& entry = entries[i];
+            if ((entry.indexSize != 2 && entry.indexSize != 4)
+                || entry.vertexOffset + entry.vertexStoredSize > file.size()
+                || entry.indexOffset + entry.indexStoredSize > file.size()
+                || entry.rangeOffset + (uint64)entry.rangeCount * sizeof(IndexRange) > file.size()
+                || entry.meshletOffset + (uint64)entry.meshletCount * sizeof(Meshlet) > file.size()
+                || entry.lodOffset + (uint64)entry.lodCount * sizeof(MeshLod) > file.size())
+            {
+                close();
+                return false;
+            }
+            if (!(header->flags & MESH_CACHE_COMPRESSED)
+                && (entry.vertexStoredSize != (uint64)entry.vertexCount * vertexStride
+                    || entry.indexStoredSize != (uint64)entry.indexCount * entry.indexSize))
+            {
+                close();
+                return false;
+            }
+        }
+
+        if (header->flags & MESH_CACHE_COMPRESSED)
+            return decode(vertexStride);
+        return true;
+    }
+
+    void close()
+    {
+        file.close();
+        header = nullptr;
+        entries = nullptr;
+        decodedVertices.clear();
+        decodedIndices.clear();
+    }
+
+    uint32 meshCount() const
+    {
+        return header ? header->meshCount : 0;
+    }
+
+    MeshCacheView mesh(const uint32 index) const
+    {
+        const MeshCacheEntry& entry = entries[index];
+        MeshCacheView view;
+        const bool compressed = (header->flags & MESH_CACHE_COMPRESSED) != 0;
+        view.vertices = compressed ? decodedVertices[index].data() : file.data() + entry.vertexOffset;
+        view.vertexCount = entry.vertexCount;
+        view.indices = compressed ? decodedIndices[index].data() : file.data() + entry.indexOffset;
+        view.indexCount = entry.indexCount;
+        view.indexSize = entry.indexSize;
+        view.ranges = (const IndexRange*)(file.data() + entry.rangeOffset);
+        view.rangeCount = entry.rangeCount;
+        view.meshlets = (const Meshlet*)(file.data() + entry.meshletOffset);
+        view.meshletCount = entry.meshletCount;
+        view.lods = (const MeshLod*)(file.data() + entry.lodOffset);
+        view.lodCount = entry.lodCount;
+        memcpy(view.dequant, entry.dequant, sizeof(view.dequant));
+        memcpy(view.bounds, entry.bounds, sizeof(view.bounds));
+        memcpy(view.box, entry.box, sizeof(view.box));
+        return view;
+    }
+
+    /*
+    compress stores the vertices and indices with encodeMeshStream at level: smaller files, a decode when opened.
+    The file is written to a temporary and moved over cachePath when complete (see replaceFile).
+    */
+    static bool write(const std::string& cachePath, const uint64 sourceHash, const uint64 sourceSize,
+        const uint32 vertexStride, const std::vector<MeshCacheView>& meshes, const bool compress = false,
+        const MeshCodecLevel level = MESH_CODEC_FAST)
+    {
+        const std::string temporaryPath = temporaryPathFor(cachePath);
+        if (!writeFile(temporaryPath, sourceHash, sourceSize, vertexStride, meshes, compress, level))
+        {
+            std::error_code error;
+            std::filesystem::remove(temporaryPath, error);
+            return false;
+        }
+        return replaceFile(temporaryPath, cachePath);
+    }
+
+private:
+    static bool writeFile(const std::string& cachePath, const uint64 sourceHash, const uint64 sourceSize,
+        const uint32 vertexStride, const std::vector<MeshCacheView>& meshes, const bool compress, const MeshCodecLevel level)
+    {
+        std::ofstream out(cachePath, std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+            return false;
+
+        MeshCacheHeader fileHeader;
+        fileHeader.magic = MESH_CACHE_MAGIC;
+        fileHeader.version = MESH_CACHE_VERSION;
+        fileHeader.vertexStride = vertexStride;
+        fileHeader.meshCount = (uint32)meshes.size();
+        fileHeader.flags = compress ? MESH_CACHE_COMPRESSED : 0;
+        fileHeader.reserved = 0;
+        fileHeader.sourceHash = sourceHash;
+        fileHeader.sourceSize = sourceSize;
+
+        std::vector<std::vector<unsigned char>> encodedVertices(compress ? meshes.size() : 0);
+        std::vector<std::vector<unsigned char>> encodedIndices(compress ? meshes.size() : 0);
+        for (size_t i = 0; i < encodedVertices.size(); i++)
+        {
+            encodedVertices[i] = encodeMeshStream(STREAM_VERTICES, meshes[i].vertices, meshes[i].vertexCount, vertexStride, level);
+            encodedIndices[i] = encodeMeshStream(STREAM_INDICES, meshes[i].indices, meshes[i].indexCount, meshes[i].indexSize, level);
+        }
+
+        // compute where each array goes
+        std::vector<MeshCacheEntry> table(meshes.size());
+        uint64 offset = align(sizeof(MeshCacheHeader) + meshes.size() * sizeof(MeshCacheEntry));
+        for (size_t i = 0; i < meshes.size(); i++)
+        {
+            table[i].vertexCount = meshes[i].vertexCount;
+            table[i].indexCount = meshes[i].indexCount;
+            table[i].indexSize = meshes[i].indexSize;
+            table[i].rangeCount = meshes[i].rangeCount;
+            table[i].meshletCount = meshes[i].meshletCount;
+            table[i].lodCount = meshes[i].lodCount;
+            memcpy(table[i].dequant, meshes[i].dequant, sizeof(table[i].dequant));
+            memcpy(table[i].bounds, meshes[i].bounds, sizeof(table[i].bounds));
+            memcpy(table[i].box, meshes[i].box, sizeof(table[i].box));
+            table[i].vertexStoredSize = compress ? encodedVertices[i].size() : (uint64)meshes[i].vertexCount * vertexStride;
+            table[i].indexStoredSize = compress ? encodedIndices[i].size() : (uint64)meshes[i].indexCount * meshes[i].indexSize;
+            table[i].vertexOffset = offset;
+            offset = align(offset + table[i].vertexStoredSize);
+            table[i].indexOffset = offset;
+            offset = align(offset + table[i].indexStoredSize);
+            table[i].rangeOffset = offset;
+            offset = align(offset + (uint64)meshes[i].rangeCount * sizeof(IndexRange));
+            table[i].meshletOffset = offset;
+            offset = align(offset + (uint64)meshes[i].meshletCount * sizeof(Meshlet));
+            table[i].lodOffset = offset;
+            offset = align(offset + (uint64)meshes[i].lodCount * sizeof(MeshLod));
+        }
+
+        out.write((const char*)&fileHeader, sizeof(fileHeader));
+        out.write((const char*)table.data(), table.size() * sizeof(MeshCacheEntry));
+        for (size_t i = 0; i < meshes.size(); i++)
+        {
+            pad(out, table[i].vertexOffset);
+            out.write(compress ? (const char*)encodedVertices[i].data() : (const char*)meshes[i].vertices, (std::streamsize)table[i].vertexStoredSize);
+            pad(out, table[i].indexOffset);
+            out.write(compress ? (const char*)encodedIndices[i].data() : (const char*)meshes[i].indices, (std::streamsize)table[i].indexStoredSize);
+            pad(out, table[i].rangeOffset);
+            out.write((const char*)meshes[i].ranges, (std::streamsize)meshes[i].rangeCount * sizeof(IndexRange));
+            pad(out, table[i].meshletOffset);
+            out.write((const char*)meshes[i].meshlets, (std::streamsize)meshes[i].meshletCount * sizeof(Meshlet));
+            pad(out, table[i].lodOffset);
+            out.write((const char*)meshes[i].lods, (std::streamsize)meshes[i].lodCount * sizeof(MeshLod));
+        }
+
+        out.close();
+        return !out.fail();
+    }
+
+    // Decompress the vertices and indices of every submesh, false (and closed) if a stream is corrupted
+    bool decode(const uint32 vertexStride)
+    {
+        decodedVertices.resize(header->meshCount);
+        decodedIndices.resize(header->meshCount);
+        for (uint32 i = 0; i < header->meshCount; i++)
+        {
+            const MeshCacheEntry& entry = entries[i];
+            decodedVertices[i].resize((size_t)entry.vertexCount * vertexStride);
+            decodedIndices[i].resize((size_t)entry.indexCount * entry.indexSize);
+            if (!decodeMeshStream(file.data() + entry.vertexOffset, (size_t)entry.vertexStoredSize, STREAM_VERTICES,
+                    decodedVertices[i].data(), entry.vertexCount, vertexStride)
+                || !decodeMeshStream(file.data() + entry.indexOffset, (size_t)entry.indexStoredSize, STREAM_INDICES,
+                    decodedIndices[i].data(), entry.indexCount, entry.indexSize))
+            {
+                std::cout << "WARNING::MESH_CACHE::Corrupted compressed mesh " << i << std::endl;
+                close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static uint64 align(const uint64 offset)
+    {
+        return (offset + 15) & ~(uint64)15;
+    }
+
+    static void pad(std::ofstream& out, const uint64 offset)
+    {
+        static const char zeros[16] = {};
+        uint64 current = (uint64)out.tellp();
+        if (current < offset)
+            out.write(zeros, (std::streamsize)(offset - current));
+    }
+};
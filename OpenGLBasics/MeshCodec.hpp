@@ -0,0 +1,885 @@
+#pragma once
+#include "main.h"
+#include "ThreadPool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MESH_CODEC_SSE
+#endif
+
+
+/*
+Compressed vertex and index streams.
+The elements are cut in blocks that are coded (and decoded) independently, so a stream can be
+decoded by several threads. In a block every byte of the elements goes to its own plane:
+    vertices: byte k of every vertex, as the zigzag coded difference with the same byte of the
+              previous vertex (small changes either way are small bytes)
+    indices: byte k of the zigzag coded difference with the next unused vertex (1 + the largest
+             index so far), which is 0 for most new vertices once the vertices are in fetch order.
+             The difference takes 17 bits for 16 bit indices (a range or a level of detail
+             starting over at a low index), so there are always 4 planes, the high ones constant
+             0 in a block without such jumps
+Then every plane is stored constant, raw, bit packed or rANS coded (order 0, 4 interleaved states
+with a word stream each, so the 4 decode chains don't wait on each other).
+Bit packing cuts the plane in groups of 16 bytes stored with 0, 2, 4 or 8 bits each, which SSE2
+unpacks a group at a time. rANS is scalar and decodes about 5 times slower, so it is only used by
+MESH_CODEC_SMALL, for the planes it makes MESH_CODEC_RANS_GAIN percent smaller than packed. The decoder undoes
+the vertex deltas, transposes the planes back to vertices 16x16 bytes at a time and rebuilds the
+indices 8 at a time, all with SSE2: several GB/s of output per core, the blocks are spread over the
+worker threads.
+
+Stream layout:
+    MeshCodecHeader
+    uint32 blockOffsets[blockCount]     from the start of the stream
+    blocks: for every plane a PlaneMode byte and its data
+        PLANE_CONSTANT: the byte
+        PLANE_RAW: the bytes
+        PLANE_RANS: uint16 symbolCount, (uint8 symbol, uint16 frequency)[symbolCount], uint32 wordCount[4],
+                    then the uint16 words of every lane, the first 2 of a lane its initial state
+        PLANE_PACKED: uint8 widths[(groups + 3) / 4] (2 bits per group of 16 bytes: 0, 2, 4 or 8 bits),
+                      then the groups, the byte i of a group in bits (i * width) % 8 of byte i * width / 8
+*/
+
+#define MESH_CODEC_MAGIC 0x43444D4F // "OMDC"
+#define MESH_CODEC_BLOCK_SIZE 65536 // elements per block
+#define MESH_CODEC_PROB_BITS 12
+#define MESH_CODEC_PROB_SCALE (1u << MESH_CODEC_PROB_BITS)
+#define MESH_CODEC_RANS_LOW (1u << 16) // lower bound of the rANS states, they are renormalized 16 bits at a time
+#define MESH_CODEC_RANS_LANES 4     // interleaved rANS states, each with its own words so they decode independently
+#define MESH_CODEC_INDEX_PLANES 4   // whatever the index size
+#define MESH_CODEC_GROUP 16         // bytes of a bit packed group
+#define MESH_CODEC_RANS_GAIN 10     // percents rANS has to save over bit packing to be used (MESH_CODEC_SMALL)
+
+enum MeshStreamKind
+{
+    STREAM_VERTICES,
+    STREAM_INDICES
+};
+
+// How hard encodeMeshStream compresses, the decoder reads both
+enum MeshCodecLevel
+{
+    MESH_CODEC_FAST,    // constant, raw or bit packed planes: several GB/s
+    MESH_CODEC_SMALL    // rANS too where it saves MESH_CODEC_RANS_GAIN percents, a rANS plane decodes at ~0.4 GB/s
+};
+
+enum PlaneMode
+{
+    PLANE_CONSTANT,
+    PLANE_RAW,
+    PLANE_RANS,
+    PLANE_PACKED
+};
+
+struct MeshCodecHeader
+{
+    uint32 magic;
+    uint32 kind;            // MeshStreamKind
+    uint32 count;           // elements
+    uint32 elementSize;     // vertex stride or index size
+};
+
+// Decoding table entry of a rANS slot: symbol | frequency << 8 | start << 20
+typedef uint32 RansDecodeSlot;
+
+inline uint16_t codecReadU16(const unsigned char* data)
+{
+    uint16_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+inline uint32 codecReadU32(const unsigned char* data)
+{
+    uint32 value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+inline void codecWrite(std::vector<unsigned char>& out, const void* data, const size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    out.insert(out.end(), bytes, bytes + size);
+}
+
+inline uint32 zigzagEncode(const int32_t value)
+{
+    return ((uint32)value << 1) ^ (uint32)(value >> 31);
+}
+
+inline int32_t zigzagDecode(const uint32 value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+inline unsigned char zigzagEncodeByte(const unsigned char value)
+{
+    return (unsigned char)((value << 1) ^ (unsigned char)((signed char)value >> 7));
+}
+
+inline unsigned char zigzagDecodeByte(const unsigned char value)
+{
+    return (unsigned char)((value >> 1) ^ (unsigned char)-(value & 1));
+}
+
+// Bytes of a bit packed group for each 2 bits width code
+inline uint32 packedGroupSize(const uint32 code)
+{
+    static const uint32 sizes[4] = { 0, MESH_CODEC_GROUP / 4, MESH_CODEC_GROUP / 2, MESH_CODEC_GROUP };
+    return sizes[code];
+}
+
+// Width code of every group of a plane of count bytes, returns the size of the packed plane (without the mode byte)
+inline size_t packPlaneWidths(const unsigned char* symbols, const uint32 count, std::vector<unsigned char>& codes)
+{
+    const uint32 groups = (count + MESH_CODEC_GROUP - 1) / MESH_CODEC_GROUP;
+    codes.resize(groups);
+    size_t size = (groups + 3) / 4;
+    for (uint32 g = 0; g < groups; g++)
+    {
+        unsigned char largest = 0;
+        for (uint32 i = g * MESH_CODEC_GROUP; i < std::min(count, (g + 1) * MESH_CODEC_GROUP); i++)
+            largest = std::max(largest, symbols[i]);
+        codes[g] = largest == 0 ? 0 : largest < 4 ? 1 : largest < 16 ? 2 : 3;
+        size += packedGroupSize(codes[g]);
+    }
+    return size;
+}
+
+inline void writePackedPlane(const unsigned char* symbols, const uint32 count, const std::vector<unsigned char>& codes,
+    std::vector<unsigned char>& out)
+{
+    out.push_back(PLANE_PACKED);
+    for (size_t g = 0; g < codes.size(); g += 4)
+    {
+        unsigned char widths = 0;
+        for (size_t j = 0; j < 4 && g + j < codes.size(); j++)
+            widths |= codes[g + j] << (2 * j);
+        out.push_back(widths);
+    }
+
+    for (uint32 g = 0; g < (uint32)codes.size(); g++)
+    {
+        // the last group is padded with zeros
+        unsigned char group[MESH_CODEC_GROUP] = {};
+        memcpy(group, symbols + g * MESH_CODEC_GROUP, std::min((uint32)MESH_CODEC_GROUP, count - g * MESH_CODEC_GROUP));
+        const uint32 bits = codes[g] == 3 ? 8 : codes[g] * 2;
+        if (bits == 8)
+        {
+            codecWrite(out, group, MESH_CODEC_GROUP);
+            continue;
+        }
+        unsigned char packed[MESH_CODEC_GROUP] = {};
+        for (uint32 i = 0; i < MESH_CODEC_GROUP; i++)
+            packed[i * bits / 8] |= group[i] << (i * bits % 8);
+        codecWrite(out, packed, packedGroupSize(codes[g]));
+    }
+}
+
+// Frequencies of the symbols scaled to sum MESH_CODEC_PROB_SCALE, every symbol present keeps at least 1
+inline void normalizeFrequencies(const uint32* counts, const uint32 total, uint32* frequencies)
+{
+    uint32 sum = 0;
+    uint32 largest = 0;
+    for (uint32 s = 0; s < 256; s++)
+    {
+        frequencies[s] = counts[s] ? std::max(1u, (uint32)((uint64)counts[s] * MESH_CODEC_PROB_SCALE / total)) : 0;
+        sum += frequencies[s];
+        if (frequencies[s] > frequencies[largest])
+            largest = s;
+    }
+
+    // the rounding error goes to the most frequent symbol, where it costs the least
+    if (sum < MESH_CODEC_PROB_SCALE)
+        frequencies[largest] += MESH_CODEC_PROB_SCALE - sum;
+    while (sum > MESH_CODEC_PROB_SCALE)
+    {
+        uint32* most = std::max_element(frequencies, frequencies + 256);
+        const uint32 excess = std::min(sum - MESH_CODEC_PROB_SCALE, *most / 2);
+        *most -= excess;
+        sum -= excess;
+    }
+}
+
+/*
+rANS code a plane of count bytes (counts: how many times each byte value is in it) unless it is not
+MESH_CODEC_RANS_GAIN percent smaller than fastSize, the size of the plane bit packed or raw.
+Returns true when it was written.
+*/
+inline bool encodeRansPlane(const unsigned char* symbols, const uint32 count, const uint32* counts, const uint32 symbolCount,
+    const size_t fastSize, std::vector<unsigned char>& out)
+{
+    uint32 frequencies[256];
+    uint32 starts[256];
+    normalizeFrequencies(counts, count, frequencies);
+    uint32 start = 0;
+    for (uint32 s = 0; s < 256; s++)
+    {
+        starts[s] = start;
+        start += frequencies[s];
+    }
+
+    // rANS encodes backwards, the words are reversed at the end so the decoder reads forward.
+    // Symbol i goes to lane i % MESH_CODEC_RANS_LANES, every lane has its own words.
+    std::vector<uint16_t> words[MESH_CODEC_RANS_LANES];
+    size_t wordTotal = 0;
+    for (uint32 lane = 0; lane < MESH_CODEC_RANS_LANES; lane++)
+    {
+        std::vector<uint16_t>& laneWords = words[lane];
+        laneWords.reserve(count / (2 * MESH_CODEC_RANS_LANES) + 2);
+        uint32 state = MESH_CODEC_RANS_LOW;
+        const uint32 laneCount = count > lane ? (count - 1 - lane) / MESH_CODEC_RANS_LANES + 1 : 0;
+        for (uint32 n = laneCount; n-- > 0; )
+        {
+            const uint32 symbol = symbols[lane + n * MESH_CODEC_RANS_LANES];
+            const uint32 frequency = frequencies[symbol];
+            if (state >= ((MESH_CODEC_RANS_LOW >> MESH_CODEC_PROB_BITS) << 16) * frequency)
+            {
+                laneWords.push_back((uint16_t)(state & 0xFFFF));
+                state >>= 16;
+            }
+            state = ((state / frequency) << MESH_CODEC_PROB_BITS) + (state % frequency) + starts[symbol];
+        }
+        laneWords.push_back((uint16_t)(state & 0xFFFF));
+        laneWords.push_back((uint16_t)(state >> 16));
+        std::reverse(laneWords.begin(), laneWords.end());
+        wordTotal += laneWords.size();
+    }
+
+    const size_t ransSize = 2 + symbolCount * 3 + 4 * MESH_CODEC_RANS_LANES + wordTotal * 2;
+    if (ransSize * 100 > fastSize * (100 - MESH_CODEC_RANS_GAIN))
+        return false;
+
+    out.push_back(PLANE_RANS);
+    const uint16_t storedCount = (uint16_t)symbolCount;
+    codecWrite(out, &storedCount, 2);
+    for (uint32 s = 0; s < 256; s++)
+    {
+        if (!frequencies[s])
+            continue;
+        const uint16_t frequency = (uint16_t)frequencies[s];
+        out.push_back((unsigned char)s);
+        codecWrite(out, &frequency, 2);
+    }
+    for (uint32 lane = 0; lane < MESH_CODEC_RANS_LANES; lane++)
+    {
+        const uint32 wordCount = (uint32)words[lane].size();
+        codecWrite(out, &wordCount, 4);
+    }
+    for (uint32 lane = 0; lane < MESH_CODEC_RANS_LANES; lane++)
+        codecWrite(out, words[lane].data(), words[lane].size() * 2);
+    return true;
+}
+
+// Store a plane of count bytes in the cheapest mode of the level
+inline void encodePlane(const unsigned char* symbols, const uint32 count, const MeshCodecLevel level, std::vector<unsigned char>& out)
+{
+    uint32 counts[256] = {};
+    for (uint32 i = 0; i < count; i++)
+        counts[symbols[i]]++;
+
+    uint32 symbolCount = 0;
+    for (uint32 s = 0; s < 256; s++)
+        symbolCount += counts[s] ? 1 : 0;
+    if (symbolCount <= 1)
+    {
+        out.push_back(PLANE_CONSTANT);
+        out.push_back(count ? symbols[0] : 0);
+        return;
+    }
+
+    std::vector<unsigned char> codes;
+    const size_t packedSize = packPlaneWidths(symbols, count, codes);
+    if (level == MESH_CODEC_SMALL && encodeRansPlane(symbols, count, counts, symbolCount, std::min((size_t)count, packedSize), out))
+        return;
+    if (packedSize < count)
+        writePackedPlane(symbols, count, codes, out);
+    else
+    {
+        out.push_back(PLANE_RAW);
+        codecWrite(out, symbols, count);
+    }
+}
+
+inline unsigned char ransDecode(uint32& state, const RansDecodeSlot* slots, const unsigned char*& read, const unsigned char* end)
+{
+    const uint32 mask = MESH_CODEC_PROB_SCALE - 1;
+    const RansDecodeSlot slot = slots[state & mask];
+    state = ((slot >> 8) & 0xFFF) * (state >> MESH_CODEC_PROB_BITS) + (state & mask) - (slot >> 20);
+    if (state < MESH_CODEC_RANS_LOW && read < end)
+    {
+        state = (state << 16) | codecReadU16(read);
+        read += 2;
+    }
+    return (unsigned char)slot;
+}
+
+// Same without branches, the caller makes sure there is a word left to read
+inline unsigned char ransDecodeFast(uint32& state, const RansDecodeSlot* slots, const unsigned char*& read)
+{
+    const uint32 mask = MESH_CODEC_PROB_SCALE - 1;
+    const RansDecodeSlot slot = slots[state & mask];
+    state = ((slot >> 8) & 0xFFF) * (state >> MESH_CODEC_PROB_BITS) + (state & mask) - (slot >> 20);
+    // arithmetic rather than a select, which compilers turn back into a mispredicted branch
+    const uint32 renormalize = state < MESH_CODEC_RANS_LOW ? 1 : 0;
+    const uint32 word = codecReadU16(read);
+    state = (state << (renormalize * 16)) | (word & (0u - renormalize));
+    read += renormalize * 2;
+    return (unsigned char)slot;
+}
+
+#if defined(MESH_CODEC_SSE)
+// Vertex bytes of a group from their zigzag coded deltas, carry is the previous byte in every lane
+inline __m128i undoDeltaGroup(const __m128i zigzag, __m128i& carry)
+{
+    const __m128i low7 = _mm_set1_epi8(0x7F);
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i sum = _mm_xor_si128(_mm_and_si128(_mm_srli_epi16(zigzag, 1), low7), _mm_sub_epi8(_mm_setzero_si128(), _mm_and_si128(zigzag, one)));
+    sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 1));
+    sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 2));
+    sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 4));
+    sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 8));
+    sum = _mm_add_epi8(sum, carry);
+    // last byte to every lane
+    carry = _mm_shuffle_epi32(_mm_shufflehi_epi16(_mm_unpackhi_epi8(sum, sum), 0xFF), 0xFF);
+    return sum;
+}
+#endif
+
+// Running sum of count zigzag coded bytes in place: the vertex bytes from their deltas
+inline void undoVertexDeltas(unsigned char* bytes, const uint32 count)
+{
+    uint32 i = 0;
+    unsigned char previous = 0;
+#if defined(MESH_CODEC_SSE)
+    __m128i carry = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16)
+        _mm_storeu_si128((__m128i*)(bytes + i), undoDeltaGroup(_mm_loadu_si128((const __m128i*)(bytes + i)), carry));
+    previous = i ? bytes[i - 1] : 0;
+#endif
+    for (; i < count; i++)
+    {
+        previous = (unsigned char)(previous + zigzagDecodeByte(bytes[i]));
+        bytes[i] = previous;
+    }
+}
+
+/*
+Unpack the groups of a PLANE_PACKED plane (data after the mode byte), returns where it ends (nullptr if it is corrupted).
+With deltas the vertex bytes are rebuilt from their deltas as the groups are unpacked, like undoVertexDeltas.
+*/
+inline const unsigned char* decodePackedPlane(const unsigned char* data, const unsigned char* end, const uint32 count,
+    unsigned char* symbols, const bool deltas)
+{
+    const uint32 groups = (count + MESH_CODEC_GROUP - 1) / MESH_CODEC_GROUP;
+    const uint32 widthBytes = (groups + 3) / 4;
+    if ((size_t)(end - data) < widthBytes)
+        return nullptr;
+    const unsigned char* widths = data;
+    const unsigned char* read = data + widthBytes;
+
+    // check the size once, the groups are then read without bounds checks
+    size_t size = 0;
+    for (uint32 g = 0; g < groups; g++)
+        size += packedGroupSize((widths[g >> 2] >> (2 * (g & 3))) & 3);
+    if ((size_t)(end - read) < size)
+        return nullptr;
+
+#if defined(MESH_CODEC_SSE)
+    const __m128i mask2 = _mm_set1_epi8(3);
+    const __m128i mask4 = _mm_set1_epi8(15);
+    __m128i carry = _mm_setzero_si128();
+#else
+    unsigned char previous = 0;
+#endif
+    for (uint32 g = 0; g < groups; g++, symbols += MESH_CODEC_GROUP)
+    {
+        const uint32 code = (widths[g >> 2] >> (2 * (g & 3))) & 3;
+#if defined(MESH_CODEC_SSE)
+        __m128i group;
+        if (code == 0)
+            group = _mm_setzero_si128();
+        else if (code == 1)
+        {
+            // the 4 fields of every byte, interleaved back in order
+            const __m128i packed = _mm_cvtsi32_si128((int)codecReadU32(read));
+            const __m128i first = _mm_unpacklo_epi8(_mm_and_si128(packed, mask2), _mm_and_si128(_mm_srli_epi16(packed, 2), mask2));
+            const __m128i second = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(packed, 4), mask2), _mm_and_si128(_mm_srli_epi16(packed, 6), mask2));
+            group = _mm_unpacklo_epi16(first, second);
+        }
+        else if (code == 2)
+        {
+            const __m128i packed = _mm_loadl_epi64((const __m128i*)read);
+            group = _mm_unpacklo_epi8(_mm_and_si128(packed, mask4), _mm_and_si128(_mm_srli_epi16(packed, 4), mask4));
+        }
+        else
+            group = _mm_loadu_si128((const __m128i*)read);
+        _mm_storeu_si128((__m128i*)symbols, deltas ? undoDeltaGroup(group, carry) : group);
+#else
+        const uint32 bits = code == 3 ? 8 : code * 2;
+        for (uint32 i = 0; i < MESH_CODEC_GROUP; i++)
+        {
+            symbols[i] = bits ? (unsigned char)((read[i * bits / 8] >> (i * bits % 8)) & ((1u << bits) - 1)) : 0;
+            if (deltas)
+                symbols[i] = previous = (unsigned char)(previous + zigzagDecodeByte(symbols[i]));
+        }
+#endif
+        read += packedGroupSize(code);
+    }
+    return read;
+}
+
+// The constant, raw and rANS planes of decodePlane (data after the mode byte)
+inline const unsigned char* decodeStoredPlane(const unsigned char mode, const unsigned char* data, const unsigned char* end,
+    const uint32 count, unsigned char* symbols, RansDecodeSlot* slots)
+{
+    if (mode == PLANE_CONSTANT)
+    {
+        if (data >= end)
+            return nullptr;
+        memset(symbols, *data, count);
+        return data + 1;
+    }
+    if (mode == PLANE_RAW)
+    {
+        if ((size_t)(end - data) < count)
+            return nullptr;
+        memcpy(symbols, data, count);
+        return data + count;
+    }
+    if (mode != PLANE_RANS || !slots || end - data < 2)
+        return nullptr;
+
+    // frequency table to slots
+    const uint32 symbolCount = codecReadU16(data);
+    data += 2;
+    if ((size_t)(end - data) < symbolCount * 3 + 4 * MESH_CODEC_RANS_LANES)
+        return nullptr;
+    uint32 start = 0;
+    for (uint32 i = 0; i < symbolCount; i++, data += 3)
+    {
+        const uint32 frequency = codecReadU16(data + 1);
+        if (frequency >= MESH_CODEC_PROB_SCALE || start + frequency > MESH_CODEC_PROB_SCALE)
+            return nullptr;
+        const RansDecodeSlot entry = data[0] | (frequency << 8) | (start << 20);
+        for (uint32 slot = start; slot < start + frequency; slot++)
+            slots[slot] = entry;
+        start += frequency;
+    }
+    if (start != MESH_CODEC_PROB_SCALE)
+        return nullptr;
+
+    // the words of every lane and its state, stored first
+    const unsigned char* read[MESH_CODEC_RANS_LANES];
+    const unsigned char* laneEnds[MESH_CODEC_RANS_LANES];
+    uint32 states[MESH_CODEC_RANS_LANES];
+    const unsigned char* words = data + 4 * MESH_CODEC_RANS_LANES;
+    for (uint32 lane = 0; lane < MESH_CODEC_RANS_LANES; lane++)
+    {
+        const uint32 wordCount = codecReadU32(data + 4 * lane);
+        if (wordCount < 2 || (size_t)(end - words) < (size_t)wordCount * 2)
+            return nullptr;
+        states[lane] = ((uint32)codecReadU16(words) << 16) | codecReadU16(words + 2);
+        read[lane] = words + 4;
+        words += (size_t)wordCount * 2;
+        laneEnds[lane] = words;
+    }
+
+    // Every symbol reads at most one word of its lane: while each lane has n words left the next n
+    // symbols of every lane are decoded without checks, then n is measured again. The states and
+    // the pointers stay in locals, the symbol bytes could alias them.
+    uint32 i = 0;
+    uint32 state0 = states[0], state1 = states[1], state2 = states[2], state3 = states[3];
+    const unsigned char* read0 = read[0];
+    const unsigned char* read1 = read[1];
+    const unsigned char* read2 = read[2];
+    const unsigned char* read3 = read[3];
+    for (;;)
+    {
+        const size_t wordsLeft = std::min(std::min(laneEnds[0] - read0, laneEnds[1] - read1),
+            std::min(laneEnds[2] - read2, laneEnds[3] - read3)) / 2;
+        const uint32 stop = i + (uint32)std::min(wordsLeft, (size_t)(count - i) / MESH_CODEC_RANS_LANES) * MESH_CODEC_RANS_LANES;
+        if (stop == i)
+            break;
+        for (; i < stop; i += MESH_CODEC_RANS_LANES)
+        {
+            unsigned char decoded[MESH_CODEC_RANS_LANES];
+            decoded[0] = ransDecodeFast(state0, slots, read0);
+            decoded[1] = ransDecodeFast(state1, slots, read1);
+            decoded[2] = ransDecodeFast(state2, slots, read2);
+            decoded[3] = ransDecodeFast(state3, slots, read3);
+            memcpy(symbols + i, decoded, MESH_CODEC_RANS_LANES);
+        }
+    }
+    states[0] = state0, states[1] = state1, states[2] = state2, states[3] = state3;
+    read[0] = read0, read[1] = read1, read[2] = read2, read[3] = read3;
+    for (; i < count; i++)
+    {
+        const uint32 lane = i % MESH_CODEC_RANS_LANES;
+        symbols[i] = ransDecode(states[lane], slots, read[lane], laneEnds[lane]);
+    }
+
+    return words;
+}
+
+/*
+Decode a plane of count bytes starting at data, returns where it ends (nullptr if it is corrupted).
+symbols has room for count rounded up to MESH_CODEC_GROUP bytes, packed planes write whole groups.
+With deltas the plane holds vertex deltas, symbols gets the vertex bytes (see undoVertexDeltas).
+*/
+inline const unsigned char* decodePlane(const unsigned char* data, const unsigned char* end, const uint32 count,
+    unsigned char* symbols, RansDecodeSlot* slots, const bool deltas)
+{
+    if (data >= end)
+        return nullptr;
+    const unsigned char mode = *data++;
+
+    if (mode == PLANE_PACKED)
+        return decodePackedPlane(data, end, count, symbols, deltas);
+    // bytes that never change (a 0 delta is 0 zigzag coded)
+    if (mode == PLANE_CONSTANT && deltas && data < end && *data == 0)
+    {
+        memset(symbols, 0, count);
+        return data + 1;
+    }
+    const unsigned char* planeEnd = decodeStoredPlane(mode, data, end, count, symbols, slots);
+    if (planeEnd && deltas)
+        undoVertexDeltas(symbols, count);
+    return planeEnd;
+}
+
+// Compress count elements of elementSize bytes (vertices or 2/4 bytes indices)
+inline std::vector<unsigned char> encodeMeshStream(const MeshStreamKind kind, const void* data, const uint32 count, const uint32 elementSize,
+    const MeshCodecLevel level = MESH_CODEC_FAST)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    const uint32 blockCount = (count + MESH_CODEC_BLOCK_SIZE - 1) / MESH_CODEC_BLOCK_SIZE;
+
+    // the blocks are independent, code them in parallel and put them together after
+    std::vector<std::vector<unsigned char>> blocks(blockCount);
+    ThreadPool::shared().parallelFor(blockCount, [&](const uint32 b)
+    {
+        const uint32 first = b * MESH_CODEC_BLOCK_SIZE;
+        const uint32 blockSize = std::min((uint32)MESH_CODEC_BLOCK_SIZE, count - first);
+        std::vector<unsigned char> plane(blockSize);
+        std::vector<uint32> deltas;
+        const uint32 planeCount = kind == STREAM_INDICES ? MESH_CODEC_INDEX_PLANES : elementSize;
+
+        if (kind == STREAM_INDICES)
+        {
+            deltas.resize(blockSize);
+            uint32 next = 0;
+            for (uint32 i = 0; i < blockSize; i++)
+            {
+                uint32 index = 0;
+                memcpy(&index, bytes + (size_t)(first + i) * elementSize, elementSize);
+                deltas[i] = zigzagEncode((int32_t)(next - index));
+                next = std::max(next, index + 1);
+            }
+        }
+
+        for (uint32 k = 0; k < planeCount; k++)
+        {
+            if (kind == STREAM_INDICES)
+            {
+                for (uint32 i = 0; i < blockSize; i++)
+                    plane[i] = (unsigned char)(deltas[i] >> (8 * k));
+            }
+            else
+            {
+                const unsigned char* source = bytes + (size_t)first * elementSize + k;
+                unsigned char previous = 0;
+                for (uint32 i = 0; i < blockSize; i++, source += elementSize)
+                {
+                    plane[i] = zigzagEncodeByte((unsigned char)(*source - previous));
+                    previous = *source;
+                }
+            }
+            encodePlane(plane.data(), blockSize, level, blocks[b]);
+        }
+    });
+
+    std::vector<unsigned char> out;
+    MeshCodecHeader header = { MESH_CODEC_MAGIC, (uint32)kind, count, elementSize };
+    codecWrite(out, &header, sizeof(header));
+    uint32 offset = (uint32)(sizeof(header) + blockCount * sizeof(uint32));
+    for (const std::vector<unsigned char>& block : blocks)
+    {
+        codecWrite(out, &offset, sizeof(offset));
+        offset += (uint32)block.size();
+    }
+    for (const std::vector<unsigned char>& block : blocks)
+        codecWrite(out, block.data(), block.size());
+    return out;
+}
+
+/*
+Interleave elementSize planes of count bytes (plane k at planes + k * planeStride) back into count
+elements of elementSize bytes: 16 elements of 16 planes are transposed at a time.
+*/
+inline void transposePlanes(const unsigned char* planes, const size_t planeStride, const uint32 count, const uint32 elementSize,
+    unsigned char* out)
+{
+    uint32 i = 0;
+#if defined(MESH_CODEC_SSE)
+    // the unpacks leave element e in row bitreverse(e)
+    static const uint32 rowElement[16] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 };
+    for (; i + 16 <= count; i += 16)
+        for (uint32 k = 0; k < elementSize; k += 16)
+        {
+            const uint32 width = std::min(16u, elementSize - k);
+            __m128i rows[16];
+            __m128i next[16];
+            for (uint32 r = 0; r < 16; r++)
+                rows[r] = r < width ? _mm_loadu_si128((const __m128i*)(planes + (k + r) * planeStride + i)) : _mm_setzero_si128();
+            for (uint32 j = 0; j < 8; j++)
+            {
+                next[j] = _mm_unpacklo_epi8(rows[2 * j], rows[2 * j + 1]);
+                next[j + 8] = _mm_unpackhi_epi8(rows[2 * j], rows[2 * j + 1]);
+            }
+            for (uint32 j = 0; j < 8; j++)
+            {
+                rows[j] = _mm_unpacklo_epi16(next[2 * j], next[2 * j + 1]);
+                rows[j + 8] = _mm_unpackhi_epi16(next[2 * j], next[2 * j + 1]);
+            }
+            for (uint32 j = 0; j < 8; j++)
+            {
+                next[j] = _mm_unpacklo_epi32(rows[2 * j], rows[2 * j + 1]);
+                next[j + 8] = _mm_unpackhi_epi32(rows[2 * j], rows[2 * j + 1]);
+            }
+            for (uint32 j = 0; j < 8; j++)
+            {
+                rows[j] = _mm_unpacklo_epi64(next[2 * j], next[2 * j + 1]);
+                rows[j + 8] = _mm_unpackhi_epi64(next[2 * j], next[2 * j + 1]);
+            }
+
+            for (uint32 r = 0; r < 16; r++)
+            {
+                unsigned char* target = out + (size_t)(i + rowElement[r]) * elementSize + k;
+                if (width == 16)
+                {
+                    _mm_storeu_si128((__m128i*)target, rows[r]);
+                    continue;
+                }
+                // the last planes of the element, without writing over the next one
+                __m128i row = rows[r];
+                uint32 left = width;
+                if (left >= 8)
+                {
+                    _mm_storel_epi64((__m128i*)target, row);
+                    row = _mm_srli_si128(row, 8);
+                    target += 8;
+                    left -= 8;
+                }
+                uint32 low = (uint32)_mm_cvtsi128_si32(row);
+                if (left >= 4)
+                {
+                    memcpy(target, &low, 4);
+                    low = (uint32)_mm_cvtsi128_si32(_mm_srli_si128(row, 4));
+                    target += 4;
+                    left -= 4;
+                }
+                for (; left > 0; left--, low >>= 8)
+                    *target++ = (unsigned char)low;
+            }
+        }
+#endif
+    for (; i < count; i++)
+        for (uint32 k = 0; k < elementSize; k++)
+            out[(size_t)i * elementSize + k] = planes[k * planeStride + i];
+}
+
+/*
+Indices of a block from its 4 byte planes (planes[k * planeStride + i] is byte k of the zigzag delta of index i).
+The next unused vertex only ever grows by max(0, 1 - delta), so it is a running sum and the indices
+are rebuilt 8 at a time. 16 bit indices are rebuilt in 16 bit lanes: the low 16 bits of next and of
+the indices only depend on the low 16 bits of the deltas, plane 2 only gives their sign and bit 15.
+*/
+inline void rebuildIndices(const unsigned char* planes, const size_t planeStride, const uint32 count, const uint32 indexSize,
+    unsigned char* out)
+{
+    uint32 next = 0;
+    uint32 i = 0;
+#if defined(MESH_CODEC_SSE)
+    const __m128i zero = _mm_setzero_si128();
+    if (indexSize == 2)
+    {
+        const __m128i one = _mm_set1_epi16(1);
+        __m128i base = _mm_setzero_si128();
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i byte0 = _mm_loadu_si128((const __m128i*)(planes + i));
+            const __m128i byte1 = _mm_loadu_si128((const __m128i*)(planes + planeStride + i));
+            const __m128i byte2 = _mm_loadu_si128((const __m128i*)(planes + 2 * planeStride + i));
+            const __m128i low[2] = { _mm_unpacklo_epi8(byte0, byte1), _mm_unpackhi_epi8(byte0, byte1) };
+            const __m128i high[2] = { _mm_unpacklo_epi8(byte2, zero), _mm_unpackhi_epi8(byte2, zero) };
+
+            for (uint32 half = 0; half < 2; half++)
+            {
+                // low 16 bits of the delta, it is at most 0 when the zigzag is odd or 0
+                const __m128i sign = _mm_and_si128(low[half], one);
+                const __m128i shifted = _mm_or_si128(_mm_srli_epi16(low[half], 1), _mm_slli_epi16(_mm_and_si128(high[half], one), 15));
+                const __m128i delta = _mm_xor_si128(shifted, _mm_sub_epi16(zero, sign));
+                const __m128i reuse = _mm_or_si128(_mm_cmpeq_epi16(sign, one), _mm_cmpeq_epi16(_mm_or_si128(low[half], high[half]), zero));
+                const __m128i step = _mm_and_si128(_mm_sub_epi16(one, delta), reuse);
+                __m128i sum = _mm_add_epi16(step, _mm_slli_si128(step, 2));
+                sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 4));
+                sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 8));
+                const __m128i indices = _mm_sub_epi16(_mm_add_epi16(base, _mm_sub_epi16(sum, step)), delta);
+                _mm_storeu_si128((__m128i*)(out + (size_t)(i + half * 8) * 2), indices);
+                base = _mm_add_epi16(base, _mm_shuffle_epi32(_mm_shufflehi_epi16(sum, 0xFF), 0xFF));
+            }
+        }
+        next = (uint32)_mm_cvtsi128_si32(base) & 0xFFFF;
+    }
+    else
+    {
+        const __m128i one = _mm_set1_epi32(1);
+        __m128i base = _mm_setzero_si128();
+        for (; i + 8 <= count; i += 8)
+        {
+            // zigzag deltas of the 8 indices from the planes
+            const __m128i low = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(planes + i)), _mm_loadl_epi64((const __m128i*)(planes + planeStride + i)));
+            const __m128i high = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(planes + 2 * planeStride + i)), _mm_loadl_epi64((const __m128i*)(planes + 3 * planeStride + i)));
+            const __m128i zigzag[2] = { _mm_unpacklo_epi16(low, high), _mm_unpackhi_epi16(low, high) };
+
+            for (uint32 half = 0; half < 2; half++)
+            {
+                const __m128i delta = _mm_xor_si128(_mm_srli_epi32(zigzag[half], 1), _mm_sub_epi32(zero, _mm_and_si128(zigzag[half], one)));
+                __m128i step = _mm_sub_epi32(one, delta);
+                step = _mm_and_si128(step, _mm_cmpgt_epi32(step, zero));
+                // next before each index: base + exclusive running sum of the steps
+                __m128i sum = _mm_add_epi32(step, _mm_slli_si128(step, 4));
+                sum = _mm_add_epi32(sum, _mm_slli_si128(sum, 8));
+                _mm_storeu_si128((__m128i*)(out + (size_t)(i + half * 4) * 4), _mm_sub_epi32(_mm_add_epi32(base, _mm_sub_epi32(sum, step)), delta));
+                base = _mm_add_epi32(base, _mm_shuffle_epi32(sum, 0xFF));
+            }
+        }
+        next = (uint32)_mm_cvtsi128_si32(base);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        uint32 zigzag = 0;
+        for (uint32 k = 0; k < MESH_CODEC_INDEX_PLANES; k++)
+            zigzag |= (uint32)planes[k * planeStride + i] << (8 * k);
+        const int32_t delta = zigzagDecode(zigzag);
+        const uint32 index = next - (uint32)delta;
+        next += delta < 1 ? (uint32)(1 - delta) : 0;
+        memcpy(out + (size_t)i * indexSize, &index, indexSize);
+    }
+}
+
+// Decompress a stream made by encodeMeshStream into out (count * elementSize bytes). False if it is corrupted.
+inline bool decodeMeshStream(const unsigned char* data, const size_t size, const MeshStreamKind kind,
+    void* out, const uint32 count, const uint32 elementSize)
+{
+    if (size < sizeof(MeshCodecHeader))
+        return false;
+    MeshCodecHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != MESH_CODEC_MAGIC || header.kind != (uint32)kind || header.count != count || header.elementSize != elementSize
+        || elementSize == 0 || (kind == STREAM_INDICES && elementSize != 2 && elementSize != 4))
+        return false;
+
+    const uint32 blockCount = (count + MESH_CODEC_BLOCK_SIZE - 1) / MESH_CODEC_BLOCK_SIZE;
+    if (size < sizeof(header) + (size_t)blockCount * sizeof(uint32))
+        return false;
+
+    unsigned char* bytes = (unsigned char*)out;
+    std::vector<char> failed(blockCount, 0);
+    ThreadPool::shared().parallelFor(blockCount, [&](const uint32 b)
+    {
+        const uint32 first = b * MESH_CODEC_BLOCK_SIZE;
+        const uint32 blockSize = std::min((uint32)MESH_CODEC_BLOCK_SIZE, count - first);
+        const uint32 offset = codecReadU32(data + sizeof(header) + b * sizeof(uint32));
+        if (offset > size)
+        {
+            failed[b] = 1;
+            return;
+        }
+
+        const unsigned char* block = data + offset;
+        const unsigned char* end = data + size;
+        // every plane of the block is decoded before they are put back together. They are padded to whole
+        // packed groups, and a cache line more so the transpose does not read them all from the same cache sets
+        const uint32 planeCount = kind == STREAM_INDICES ? MESH_CODEC_INDEX_PLANES : elementSize;
+        const size_t planeStride = (blockSize + MESH_CODEC_GROUP - 1) / MESH_CODEC_GROUP * MESH_CODEC_GROUP + 64;
+        std::unique_ptr<unsigned char[]> planes(new unsigned char[planeStride * planeCount]);
+        std::unique_ptr<RansDecodeSlot[]> slots;
+
+        for (uint32 k = 0; k < planeCount; k++)
+        {
+            unsigned char* plane = planes.get() + k * planeStride;
+            // the rANS table is only made for the blocks that need it
+            if (block < end && *block == PLANE_RANS && !slots)
+                slots.reset(new RansDecodeSlot[MESH_CODEC_PROB_SCALE]);
+            block = decodePlane(block, end, blockSize, plane, slots.get(), kind == STREAM_VERTICES);
+            if (!block)
+            {
+                failed[b] = 1;
+                return;
+            }
+        }
+
+        if (kind == STREAM_INDICES)
+            rebuildIndices(planes.get(), planeStride, blockSize, elementSize, bytes + (size_t)first * elementSize);
+        else
+            transposePlanes(planes.get(), planeStride, blockSize, elementSize, bytes + (size_t)first * elementSize);
+    });
+
+    for (char blockFailed : failed)
+        if (blockFailed)
+            return false;
+    return true;
+}
+
+/*
+Check that the streams of a mesh decode back to the same bytes at both levels and time the decoding, best of runs.
+Used by benchmarkMeshCodec (OpenGLBasics --bench-codec res/Models/monkey.obj)
+*/
+inline bool benchmarkMeshStream(const char* label, const MeshStreamKind kind, const void* data, const uint32 count,
+    const uint32 elementSize, const uint32 runs = 20)
+{
+    typedef std::chrono::steady_clock Clock;
+    const size_t rawSize = (size_t)count * elementSize;
+    const MeshCodecLevel levels[] = { MESH_CODEC_FAST, MESH_CODEC_SMALL };
+    const char* levelNames[] = { "fast", "small" };
+
+    for (uint32 l = 0; l < 2; l++)
+    {
+        Clock::time_point start = Clock::now();
+        std::vector<unsigned char> encoded = encodeMeshStream(kind, data, count, elementSize, levels[l]);
+        const double encodeTime = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        std::vector<unsigned char> decoded(rawSize);
+        double decodeBest = 1e30;
+        for (uint32 run = 0; run < runs; run++)
+        {
+            start = Clock::now();
+            if (!decodeMeshStream(encoded.data(), encoded.size(), kind, decoded.data(), count, elementSize))
+            {
+                std::cout << "ERROR::MESH_CODEC::" << label << " (" << levelNames[l] << ") could not be decoded" << std::endl;
+                return false;
+            }
+            decodeBest = std::min(decodeBest, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+        }
+
+        if (rawSize && memcmp(decoded.data(), data, rawSize) != 0)
+        {
+            std::cout << "ERROR::MESH_CODEC::" << label << " (" << levelNames[l] << ") does not round trip" << std::endl;
+            return false;
+        }
+
+        std::cout << "CODEC::" << label << " " << levelNames[l] << ": " << rawSize << " -> " << encoded.size() << " bytes ("
+            << (encoded.size() ? (double)rawSize / encoded.size() : 0.0) << "x), encode " << encodeTime << " ms, decode "
+            << decodeBest << " ms (" << (decodeBest > 0.0 ? rawSize / (decodeBest * 1e6) : 0.0) << " GB/s)" << std::endl;
+    }
+    return true;
+}
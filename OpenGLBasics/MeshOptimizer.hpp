@@ -0,0 +1,343 @@
+#pragma once
+#include "main.h"
+#include "Vertex.hpp"
+#include <GLM/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+
+/*
+Post import optimizations of the index and vertex buffers.
+    optimizeVertexCache:  reorders the triangles for the post transform cache (Forsyth).
+    optimizeOverdraw:     splits the result in clusters and sorts them front to back from the outside.
+    optimizeVertexFetch:  reorders the vertices in order of first use.
+analyzeVertexCache simulates a FIFO cache to give ACMR/ATVR without a GPU.
+*/
+
+#define FORSYTH_CACHE_SIZE 32
+#define FIFO_CACHE_SIZE 16
+#define OPTIMIZER_NONE 0xFFFFFFFFu
+
+struct VertexCacheStats
+{
+    float acmr; // transformed vertices per triangle (0.5 is ideal, 3 is the worst)
+    float atvr; // transformed vertices per vertex (1 is ideal)
+};
+
+// Simulate a FIFO post transform cache. Returns the misses of every triangle if requested.
+inline VertexCacheStats analyzeVertexCache(const std::vector<uint32>& indices, const uint32 vertexCount,
+    const uint32 cacheSize = FIFO_CACHE_SIZE, std::vector<unsigned char>* triangleMisses = nullptr)
+{
+    VertexCacheStats stats = { 0.0f, 0.0f };
+    const uint32 triangleCount = (uint32)indices.size() / 3;
+    if (triangleCount == 0 || vertexCount == 0)
+        return stats;
+
+    // a vertex is in the cache if it was inserted less than cacheSize insertions ago
+    std::vector<uint32> insertedAt(vertexCount, OPTIMIZER_NONE);
+    std::vector<char> used(vertexCount, 0);
+    uint32 time = 0;
+    uint32 misses = 0;
+    uint32 usedVertices = 0;
+
+    if (triangleMisses)
+        triangleMisses->assign(triangleCount, 0);
+
+    for (uint32 i = 0; i < indices.size(); i++)
+    {
+        uint32 vertex = indices[i];
+        if (insertedAt[vertex] == OPTIMIZER_NONE || time - insertedAt[vertex] >= cacheSize)
+        {
+            insertedAt[vertex] = time++;
+            misses++;
+            if (triangleMisses)
+                (*triangleMisses)[i / 3]++;
+        }
+        if (!used[vertex])
+        {
+            used[vertex] = 1;
+            usedVertices++;
+        }
+    }
+
+    stats.acmr = (float)misses / triangleCount;
+    stats.atvr = (float)misses / usedVertices;
+    return stats;
+}
+
+inline float forsythVertexScore(const int cachePosition, const uint32 remaining)
+{
+    // no triangle left so nothing to gain by using it
+    if (remaining == 0)
+        return -1.0f;
+
+    float score = 0.0f;
+    if (cachePosition >= 0)
+    {
+        // the last triangle vertices get a fixed score so the strip does not wander back
+        if (cachePosition < 3)
+            score = 0.75f;
+        else
+            score = powf(1.0f - (cachePosition - 3) / float(FORSYTH_CACHE_SIZE - 3), 1.5f);
+    }
+
+    // favour vertices with few triangles left to avoid leaving lone triangles behind
+    score += 2.0f * powf((float)remaining, -0.5f);
+    return score;
+}
+
+inline void optimizeVertexCache(std::vector<uint32>& indices, const uint32 vertexCount)
+{
+    const uint32 triangleCount = (uint32)indices.size() / 3;
+    if (triangleCount < 2)
+        return;
+
+    // triangles of every vertex, the first remaining[v] entries are the ones not emitted yet
+    std::vector<uint32> remaining(vertexCount, 0);
+    for (uint32 index : indices)
+        remaining[index]++;
+
+    std::vector<uint32> offsets(vertexCount + 1, 0);
+    for (uint32 v = 0; v < vertexCount; v++)
+        offsets[v + 1] = offsets[v] + remaining[v];
+
+    std::vector<uint32> adjacency(indices.size());
+    {
+        std::vector<uint32> fill(offsets.begin(), offsets.end() - 1);
+        for (uint32 i = 0; i < indices.size(); i++)
+            adjacency[fill[indices[i]]++] = i / 3;
+    }
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> vertexScore(vertexCount);
+    for (uint32 v = 0; v < vertexCount; v++)
+        vertexScore[v] = forsythVertexScore(-1, remaining[v]);
+
+    std::vector<float> triangleScore(triangleCount);
+    std::vector<char> emitted(triangleCount, 0);
+    uint32 best = 0;
+    for (uint32 t = 0; t < triangleCount; t++)
+    {
+        triangleScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+        if (triangleScore[t] > triangleScore[best])
+            best = t;
+    }
+
+    std::vector<uint32> output;
+    output.reserve(indices.size());
+    std::vector<uint32> cache;
+    std::vector<uint32> newCache;
+    cache.reserve(FORSYTH_CACHE_SIZE + 3);
+    newCache.reserve(FORSYTH_CACHE_SIZE + 3);
+    uint32 cursor = 0;
+
+    for (uint32 count = 0; count < triangleCount; count++)
+    {
+        // nothing in the cache is useful, take the next triangle in input order
+        if (best == OPTIMIZER_NONE)
+        {
+            while (emitted[cursor])
+                cursor++;
+            best = cursor;
+        }
+
+        const uint32* triangle = &indices[best * 3];
+        emitted[best] = 1;
+        output.insert(output.end(), triangle, triangle + 3);
+
+        // remove the triangle from the remaining lists
+        for (int k = 0; k < 3; k++)
+        {
+            uint32 v = triangle[k];
+            uint32* list = &adjacency[offsets[v]];
+            for (uint32 j = 0; j < remaining[v]; j++)
+            {
+                if (list[j] == best)
+                {
+                    std::swap(list[j], list[remaining[v] - 1]);
+                    remaining[v]--;
+                    break;
+                }
+            }
+        }
+
+        // move the triangle vertices to the front of the LRU cache
+        newCache.clear();
+        newCache.insert(newCache.end(), triangle, triangle + 3);
+        for (uint32 v : cache)
+            if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+                newCache.push_back(v);
+
+        for (uint32 i = 0; i < newCache.size(); i++)
+        {
+            uint32 v = newCache[i];
+            cachePosition[v] = i < FORSYTH_CACHE_SIZE ? (int)i : -1;
+            vertexScore[v] = forsythVertexScore(cachePosition[v], remaining[v]);
+        }
+
+        // rescore the triangles touching the cache and pick the best one
+        best = OPTIMIZER_NONE;
+        float bestScore = -1.0f;
+        for (uint32 v : newCache)
+        {
+            const uint32* list = &adjacency[offsets[v]];
+            for (uint32 j = 0; j < remaining[v]; j++)
+            {
+                uint32 t = list[j];
+                triangleScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+                if (triangleScore[t] > bestScore)
+                {
+                    bestScore = triangleScore[t];
+                    best = t;
+                }
+            }
+        }
+
+        if (newCache.size() > FORSYTH_CACHE_SIZE)
+            newCache.resize(FORSYTH_CACHE_SIZE);
+        cache.swap(newCache);
+    }
+
+    indices.swap(output);
+}
+
+/*
+Split the cache optimized triangles in clusters and draw the clusters facing outwards first.
+threshold is how much the ACMR may grow (1.05 = 5%) in exchange for smaller clusters.
+*/
+inline void optimizeOverdraw(std::vector<uint32>& indices, const std::vector<Vertex>& vertices, const float threshold = 1.05f)
+{
+    const uint32 triangleCount = (uint32)indices.size() / 3;
+    if (triangleCount < 2)
+        return;
+    const uint32 vertexCount = (uint32)vertices.size();
+
+    // hard boundaries: the triangles where the cache is completely flushed
+    std::vector<unsigned char> misses;
+    analyzeVertexCache(indices, vertexCount, FIFO_CACHE_SIZE, &misses);
+
+    std::vector<uint32> hard;
+    for (uint32 t = 0; t < triangleCount; t++)
+        if (t == 0 || misses[t] == 3)
+            hard.push_back(t);
+    hard.push_back(triangleCount);
+
+    // soft boundaries: split a cluster once its running ACMR is close enough to the whole cluster one
+    std::vector<uint32> insertedAt(vertexCount, OPTIMIZER_NONE);
+    uint32 time = 0;
+    auto touch = [&](const uint32 vertex) -> uint32
+    {
+        if (insertedAt[vertex] != OPTIMIZER_NONE && time - insertedAt[vertex] < FIFO_CACHE_SIZE)
+            return 0;
+        insertedAt[vertex] = time++;
+        return 1;
+    };
+
+    std::vector<uint32> clusters;
+    for (size_t h = 0; h + 1 < hard.size(); h++)
+    {
+        uint32 start = hard[h];
+        uint32 end = hard[h + 1];
+
+        uint32 clusterMisses = 0;
+        for (uint32 t = start; t < end; t++)
+            clusterMisses += misses[t];
+        float clusterThreshold = threshold * clusterMisses / (end - start);
+
+        // every cluster starts with a cold cache
+        time += FIFO_CACHE_SIZE;
+        clusters.push_back(start);
+
+        uint32 runningMisses = 0;
+        uint32 runningFaces = 0;
+        for (uint32 t = start; t < end; t++)
+        {
+            runningMisses += touch(indices[t * 3]) + touch(indices[t * 3 + 1]) + touch(indices[t * 3 + 2]);
+            runningFaces++;
+            if (t + 1 < end && (float)runningMisses / runningFaces <= clusterThreshold)
+            {
+                clusters.push_back(t + 1);
+                time += FIFO_CACHE_SIZE;
+                runningMisses = 0;
+                runningFaces = 0;
+            }
+        }
+    }
+    clusters.push_back(triangleCount);
+
+    // mesh centroid
+    glm::vec3 meshCentroid(0.0f);
+    for (const Vertex& vertex : vertices)
+        meshCentroid += vertex.pos;
+    meshCentroid /= (float)vertexCount;
+
+    struct ClusterKey
+    {
+        float key;
+        uint32 index;
+    };
+    std::vector<ClusterKey> keys(clusters.size() - 1);
+    for (uint32 c = 0; c + 1 < clusters.size(); c++)
+    {
+        glm::vec3 centroid(0.0f);
+        glm::vec3 normal(0.0f);
+        float area = 0.0f;
+        for (uint32 t = clusters[c]; t < clusters[c + 1]; t++)
+        {
+            const glm::vec3& a = vertices[indices[t * 3]].pos;
+            const glm::vec3& b = vertices[indices[t * 3 + 1]].pos;
+            const glm::vec3& d = vertices[indices[t * 3 + 2]].pos;
+            glm::vec3 faceNormal = glm::cross(b - a, d - a);
+            float faceArea = glm::length(faceNormal);
+
+            centroid += (a + b + d) * (faceArea / 3.0f);
+            normal += faceNormal;
+            area += faceArea;
+        }
+
+        float normalLength = glm::length(normal);
+        centroid = area > 0.0f ? centroid / area : meshCentroid;
+        normal = normalLength > 0.0f ? normal / normalLength : glm::vec3(0.0f);
+
+        keys[c].key = glm::dot(centroid - meshCentroid, normal);
+        keys[c].index = c;
+    }
+
+    // clusters facing away from the center are more likely to occlude the rest
+    std::stable_sort(keys.begin(), keys.end(), [](const ClusterKey& a, const ClusterKey& b) { return a.key > b.key; });
+
+    std::vector<uint32> output;
+    output.reserve(indices.size());
+    for (const ClusterKey& key : keys)
+        output.insert(output.end(), indices.begin() + clusters[key.index] * 3, indices.begin() + clusters[key.index + 1] * 3);
+    indices.swap(output);
+}
+
+// Reorder the vertices in the order they are first referenced. Unused vertices are dropped.
+inline void optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<uint32>& indices)
+{
+    std::vector<uint32> remap(vertices.size(), OPTIMIZER_NONE);
+    std::vector<Vertex> output;
+    output.reserve(vertices.size());
+
+    for (uint32& index : indices)
+    {
+        if (remap[index] == OPTIMIZER_NONE)
+        {
+            remap[index] = (uint32)output.size();
+            output.push_back(vertices[index]);
+        }
+        index = remap[index];
+    }
+
+    vertices.swap(output);
+}
+
+// Run the three passes in order on one mesh
+inline void optimizeMesh(MeshData& mesh, const float overdrawThreshold = 1.05f)
+{
+    optimizeVertexCache(mesh.indices, (uint32)mesh.vertices.size());
+    optimizeOverdraw(mesh.indices, mesh.vertices, overdrawThreshold);
+    optimizeVertexFetch(mesh.vertices, mesh.indices);
+}
@@ -0,0 +1,490 @@
+#pragma once
+#include "main.h"
+#include "Vertex.hpp"
+#include "MeshOptimizer.hpp"
+#include <GLM/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+
+/*
+Quadric error mesh simplification.
+Edges are collapsed onto one of their vertices so the simplified index buffer reuses the
+vertices of the source. Vertices on UV or normal seams (same position, different attributes)
+only collapse along the seam together with their twin, border vertices only along the border
+and anything more complex is locked, so the seams and borders keep their shape.
+*/
+
+#define SIMPLIFY_NONE 0xFFFFFFFFu
+#define SIMPLIFY_MANY 0xFFFFFFFEu
+// extra weight of the planes that keep the borders in place
+#define SIMPLIFY_BORDER_WEIGHT 10.0f
+// a level is dropped when it keeps more than this fraction of the previous one
+#define LOD_MIN_REDUCTION 0.9f
+
+enum SimplifyVertexKind
+{
+    SIMPLIFY_MANIFOLD,
+    SIMPLIFY_BORDER,
+    SIMPLIFY_SEAM,
+    SIMPLIFY_LOCKED
+};
+
+// Level of detail stored after the previous ones in the index buffer of the mesh
+struct MeshLod
+{
+    uint32 firstIndex;
+    uint32 indexCount;
+    float error; // in model units
+    uint32 vertexCount; // the level only uses the vertices below it (all of them unless the mesh is progressive)
+};
+
+struct Quadric
+{
+    // symmetric plane matrix, plane offsets and the accumulated weight
+    double a00, a01, a02, a11, a12, a22;
+    double b0, b1, b2;
+    double c;
+    double weight;
+};
+
+inline Quadric planeQuadric(const glm::vec3& normal, const float distance, const float weight)
+{
+    Quadric q;
+    q.a00 = weight * normal.x * normal.x;
+    q.a01 = weight * normal.x * normal.y;
+    q.a02 = weight * normal.x * normal.z;
+    q.a11 = weight * normal.y * normal.y;
+    q.a12 = weight * normal.y * normal.z;
+    q.a22 = weight * normal.z * normal.z;
+    q.b0 = weight * normal.x * distance;
+    q.b1 = weight * normal.y * distance;
+    q.b2 = weight * normal.z * distance;
+    q.c = weight * distance * distance;
+    q.weight = weight;
+    return q;
+}
+
+inline void addQuadric(Quadric& q, const Quadric& other)
+{
+    q.a00 += other.a00; q.a01 += other.a01; q.a02 += other.a02;
+    q.a11 += other.a11; q.a12 += other.a12; q.a22 += other.a22;
+    q.b0 += other.b0; q.b1 += other.b1; q.b2 += other.b2;
+    q.c += other.c;
+    q.weight += other.weight;
+}
+
+// Mean squared distance from p to the planes of the quadric
+inline float quadricError(const Quadric& q, const glm::vec3& p)
+{
+    double x = p.x, y = p.y, z = p.z;
+    double error = q.a00 * x * x + q.a11 * y * y + q.a22 * z * z
+        + 2.0 * (q.a01 * x * y + q.a02 * x * z + q.a12 * y * z)
+        + 2.0 * (q.b0 * x + q.b1 * y + q.b2 * z) + q.c;
+    return q.weight > 0.0 ? (float)(std::max(error, 0.0) / q.weight) : 0.0f;
+}
+
+/*
+Simplify the triangles of indices down to targetIndexCount indices without moving any vertex
+further than maxError (in model units). resultError gets the error reached.
+*/
+inline std::vector<uint32> simplifyMesh(const std::vector<Vertex>& vertices, const std::vector<uint32>& indices,
+    const uint32 targetIndexCount, const float maxError, float* resultError = nullptr)
+{
+    const uint32 vertexCount = (uint32)vertices.size();
+    std::vector<uint32> result(indices);
+    if (resultError)
+        *resultError = 0.0f;
+    if (result.size() <= targetIndexCount || vertexCount == 0)
+        return result;
+
+    // referenced vertices sharing a position: position id and a circular list of the wedges
+    std::vector<uint32> positionId(vertexCount);
+    std::vector<uint32> wedge(vertexCount);
+    uint32 positionCount = 0;
+    {
+        std::vector<char> referenced(vertexCount, 0);
+        for (uint32 index : result)
+            referenced[index] = 1;
+        std::vector<uint32> order;
+        order.reserve(vertexCount);
+        for (uint32 v = 0; v < vertexCount; v++)
+        {
+            if (referenced[v])
+                order.push_back(v);
+            else
+            {
+                positionId[v] = positionCount++;
+                wedge[v] = v;
+            }
+        }
+        auto less = [&](const uint32 a, const uint32 b)
+        {
+            return memcmp(&vertices[a].pos, &vertices[b].pos, sizeof(glm::vec3)) < 0;
+        };
+        std::sort(order.begin(), order.end(), less);
+
+        const uint32 orderCount = (uint32)order.size();
+        for (uint32 i = 0; i < orderCount; )
+        {
+            uint32 end = i + 1;
+            while (end < orderCount && !less(order[i], order[end]))
+                end++;
+            for (uint32 k = i; k < end; k++)
+            {
+                positionId[order[k]] = positionCount;
+                wedge[order[k]] = order[k + 1 < end ? k + 1 : i];
+            }
+            positionCount++;
+            i = end;
+        }
+    }
+
+    std::vector<glm::vec3> positions(positionCount);
+    for (uint32 v = 0; v < vertexCount; v++)
+        positions[positionId[v]] = vertices[v].pos;
+
+    // quadrics of the triangle planes, weighted by area
+    std::vector<Quadric> quadrics(positionCount);
+    memset(quadrics.data(), 0, quadrics.size() * sizeof(Quadric));
+    for (size_t i = 0; i + 2 < result.size(); i += 3)
+    {
+        const glm::vec3& p0 = vertices[result[i]].pos;
+        glm::vec3 normal = glm::cross(vertices[result[i + 1]].pos - p0, vertices[result[i + 2]].pos - p0);
+        float length = glm::length(normal);
+        if (length == 0.0f)
+            continue;
+        normal /= length;
+        Quadric q = planeQuadric(normal, -glm::dot(normal, p0), length * 0.5f);
+        for (uint32 k = 0; k < 3; k++)
+            addQuadric(quadrics[positionId[result[i + k]]], q);
+    }
+
+    std::vector<uint32> offsets(vertexCount + 1);
+    std::vector<uint32> targets;           // vertex space edges leaving every vertex
+    std::vector<uint32> triangles;         // triangles around every vertex
+    std::vector<uint32> openOut(vertexCount), openIn(vertexCount);
+    std::vector<unsigned char> kind(vertexCount);
+    std::vector<uint32> remap(vertexCount);
+    std::vector<char> locked(positionCount);
+
+    struct Collapse
+    {
+        uint32 from;
+        uint32 to;
+        float cost;
+    };
+    std::vector<Collapse> collapses;
+
+    auto buildAdjacency = [&]()
+    {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        for (uint32 index : result)
+            offsets[index + 1]++;
+        for (uint32 v = 0; v < vertexCount; v++)
+            offsets[v + 1] += offsets[v];
+        targets.resize(result.size());
+        triangles.resize(result.size());
+        std::vector<uint32> fill(offsets.begin(), offsets.end() - 1);
+        for (uint32 i = 0; i < result.size(); i++)
+        {
+            uint32 next = (i % 3 == 2) ? i - 2 : i + 1;
+            uint32 slot = fill[result[i]]++;
+            targets[slot] = result[next];
+            triangles[slot] = i / 3;
+        }
+    };
+    auto hasEdge = [&](const uint32 a, const uint32 b)
+    {
+        for (uint32 j = offsets[a]; j < offsets[a + 1]; j++)
+            if (targets[j] == b)
+                return true;
+        return false;
+    };
+    // an edge is open in position space when no wedge pair has the opposite edge
+    auto hasPositionEdge = [&](const uint32 a, const uint32 b)
+    {
+        uint32 w = a;
+        do
+        {
+            for (uint32 j = offsets[w]; j < offsets[w + 1]; j++)
+                if (positionId[targets[j]] == positionId[b])
+                    return true;
+            w = wedge[w];
+        } while (w != a);
+        return false;
+    };
+
+    float error = 0.0f;
+    const float maxCost = maxError * maxError;
+    bool first = true;
+
+    while (result.size() > targetIndexCount)
+    {
+        buildAdjacency();
+
+        // find the open edges and classify the vertices
+        std::fill(openOut.begin(), openOut.end(), SIMPLIFY_NONE);
+        std::fill(openIn.begin(), openIn.end(), SIMPLIFY_NONE);
+        for (uint32 v = 0; v < vertexCount; v++)
+            for (uint32 j = offsets[v]; j < offsets[v + 1]; j++)
+            {
+                uint32 t = targets[j];
+                if (hasEdge(t, v))
+                    continue;
+                openOut[v] = openOut[v] == SIMPLIFY_NONE ? t : SIMPLIFY_MANY;
+                openIn[t] = openIn[t] == SIMPLIFY_NONE ? v : SIMPLIFY_MANY;
+            }
+
+        auto single = [](const uint32 value) { return value < SIMPLIFY_MANY; };
+        for (uint32 v = 0; v < vertexCount; v++)
+        {
+            const uint32 w = wedge[v];
+            if (w == v)
+            {
+                if (openOut[v] == SIMPLIFY_NONE && openIn[v] == SIMPLIFY_NONE)
+                    kind[v] = SIMPLIFY_MANIFOLD;
+                else if (single(openOut[v]) && single(openIn[v])
+                    && !hasPositionEdge(openOut[v], v) && !hasPositionEdge(v, openIn[v]))
+                    kind[v] = SIMPLIFY_BORDER;
+                else
+                    kind[v] = SIMPLIFY_LOCKED; // seam ends and non manifold vertices
+            }
+            else if (wedge[w] == v && single(openOut[v]) && single(openIn[v]) && single(openOut[w]) && single(openIn[w])
+                && positionId[openOut[v]] == positionId[openIn[w]] && positionId[openIn[v]] == positionId[openOut[w]])
+                kind[v] = SIMPLIFY_SEAM;
+            else
+                kind[v] = SIMPLIFY_LOCKED;
+        }
+
+        // planes along the borders so they do not shrink
+        if (first)
+        {
+            first = false;
+            for (uint32 v = 0; v < vertexCount; v++)
+            {
+                if (kind[v] != SIMPLIFY_BORDER || !single(openOut[v]))
+                    continue;
+                const glm::vec3& a = vertices[v].pos;
+                const glm::vec3& b = vertices[openOut[v]].pos;
+                // the triangle owning the edge gives the side of the plane
+                for (uint32 j = offsets[v]; j < offsets[v + 1]; j++)
+                {
+                    if (targets[j] != openOut[v])
+                        continue;
+                    uint32 triangle = triangles[j];
+                    const glm::vec3& p0 = vertices[result[triangle * 3]].pos;
+                    glm::vec3 faceNormal = glm::cross(vertices[result[triangle * 3 + 1]].pos - p0, vertices[result[triangle * 3 + 2]].pos - p0);
+                    glm::vec3 normal = glm::cross(b - a, faceNormal);
+                    float length = glm::length(normal);
+                    if (length == 0.0f)
+                        break;
+                    normal /= length;
+                    float edgeLength = glm::length(b - a);
+                    Quadric q = planeQuadric(normal, -glm::dot(normal, a), edgeLength * edgeLength * SIMPLIFY_BORDER_WEIGHT);
+                    addQuadric(quadrics[positionId[v]], q);
+                    addQuadric(quadrics[positionId[openOut[v]]], q);
+                    break;
+                }
+            }
+        }
+
+        // every edge that can collapse with its cost
+        collapses.clear();
+        auto canCollapse = [&](const uint32 from, const uint32 to)
+        {
+            switch (kind[from])
+            {
+            case SIMPLIFY_MANIFOLD:
+                return true;
+            case SIMPLIFY_BORDER:
+            case SIMPLIFY_SEAM:
+                return to == openOut[from] || to == openIn[from];
+            default:
+                return false;
+            }
+        };
+        for (uint32 i = 0; i < result.size(); i++)
+        {
+            uint32 a = result[i];
+            uint32 b = result[(i % 3 == 2) ? i - 2 : i + 1];
+            if (positionId[a] == positionId[b])
+                continue;
+            if (canCollapse(a, b))
+                collapses.push_back(Collapse{ a, b, quadricError(quadrics[positionId[a]], positions[positionId[b]]) });
+            if (canCollapse(b, a))
+                collapses.push_back(Collapse{ b, a, quadricError(quadrics[positionId[b]], positions[positionId[a]]) });
+        }
+        if (collapses.empty())
+            break;
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+        // each collapse removes about two triangles
+        const size_t wanted = (result.size() - targetIndexCount) / 6 + 1;
+        size_t done = 0;
+        for (uint32 v = 0; v < vertexCount; v++)
+            remap[v] = v;
+        std::fill(locked.begin(), locked.end(), 0);
+
+        // the triangles around a vertex must not flip when it moves to target
+        auto flips = [&](const uint32 from, const uint32 to)
+        {
+            const glm::vec3& target = positions[positionId[to]];
+            for (uint32 j = offsets[from]; j < offsets[from + 1]; j++)
+            {
+                const uint32* tri = &result[triangles[j] * 3];
+                glm::vec3 p[3];
+                bool touches = false;
+                for (uint32 k = 0; k < 3; k++)
+                {
+                    p[k] = vertices[tri[k]].pos;
+                    touches |= positionId[tri[k]] == positionId[to];
+                }
+                if (touches)
+                    continue; // becomes degenerate
+                glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+                for (uint32 k = 0; k < 3; k++)
+                    if (tri[k] == from)
+                        p[k] = target;
+                glm::vec3 after = glm::cross(p[1] - p[0], p[2] - p[0]);
+                if (glm::dot(before, after) <= 0.0f)
+                    return true;
+            }
+            return false;
+        };
+        auto lockAround = [&](const uint32 vertex)
+        {
+            for (uint32 j = offsets[vertex]; j < offsets[vertex + 1]; j++)
+                for (uint32 k = 0; k < 3; k++)
+                    locked[positionId[result[triangles[j] * 3 + k]]] = 1;
+        };
+
+        for (const Collapse& collapse : collapses)
+        {
+            if (done >= wanted || collapse.cost > maxCost)
+                break;
+            const uint32 from = collapse.from;
+            const uint32 to = collapse.to;
+            if (locked[positionId[from]] || locked[positionId[to]])
+                continue;
+
+            uint32 twin = SIMPLIFY_NONE, twinTo = SIMPLIFY_NONE;
+            if (kind[from] == SIMPLIFY_SEAM)
+            {
+                twin = wedge[from];
+                twinTo = to == openOut[from] ? openIn[twin] : openOut[twin];
+            }
+            if (flips(from, to) || (twin != SIMPLIFY_NONE && flips(twin, twinTo)))
+                continue;
+
+            remap[from] = to;
+            lockAround(from);
+            if (twin != SIMPLIFY_NONE)
+            {
+                remap[twin] = twinTo;
+                lockAround(twin);
+            }
+            addQuadric(quadrics[positionId[to]], quadrics[positionId[from]]);
+            error = std::max(error, collapse.cost);
+            done++;
+        }
+        if (done == 0)
+            break;
+
+        // apply the collapses and drop the degenerate triangles
+        size_t write = 0;
+        for (size_t i = 0; i + 2 < result.size(); i += 3)
+        {
+            uint32 a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+            if (positionId[a] == positionId[b] || positionId[b] == positionId[c] || positionId[a] == positionId[c])
+                continue;
+            result[write++] = a;
+            result[write++] = b;
+            result[write++] = c;
+        }
+        result.resize(write);
+    }
+
+    if (resultError)
+        *resultError = std::sqrt(error);
+    return result;
+}
+
+/*
+Append levelCount - 1 simplified levels to the indices of the mesh, each one with about
+reduction times the triangles of the previous one. maxError is relative to the mesh size.
+Level 0 is the mesh itself.
+*/
+inline std::vector<MeshLod> generateLods(MeshData& mesh, const uint32 levelCount, const float reduction, const float maxError)
+{
+    const uint32 vertexCount = (uint32)mesh.vertices.size();
+    std::vector<MeshLod> lods(1, MeshLod{ 0, (uint32)mesh.indices.size(), 0.0f, vertexCount });
+    if (levelCount <= 1 || mesh.indices.empty())
+        return lods;
+
+    const float extent = boundingSphere(mesh.vertices).w * 2.0f;
+    const std::vector<uint32> source(mesh.indices);
+    uint32 previousCount = (uint32)source.size();
+    float error = 0.0f;
+
+    for (uint32 level = 1; level < levelCount; level++)
+    {
+        // every level starts from the full mesh so its error is measured against it
+        uint32 target = (uint32)(previousCount / 3 * reduction) * 3;
+        float levelError;
+        std::vector<uint32> simplified = simplifyMesh(mesh.vertices, source, target, maxError * extent, &levelError);
+        if (simplified.empty() || simplified.size() > previousCount * LOD_MIN_REDUCTION)
+            break;
+
+        optimizeVertexCache(simplified, (uint32)mesh.vertices.size());
+        error = std::max(error, levelError);
+        lods.push_back(MeshLod{ (uint32)mesh.indices.size(), (uint32)simplified.size(), error, vertexCount });
+        mesh.indices.insert(mesh.indices.end(), simplified.begin(), simplified.end());
+        previousCount = (uint32)simplified.size();
+    }
+    return lods;
+}
+
+/*
+Lay out the levels of a mesh for progressive streaming: the indices go from the coarsest level to
+the full mesh and the vertices in the order they are first used by them, so every level only needs
+the vertices below its MeshLod::vertexCount. The coarsest level is the base mesh, every other level
+is a refinement chunk: its indices and the vertices it adds.
+*/
+inline void makeProgressive(MeshData& mesh, std::vector<MeshLod>& lods)
+{
+    if (lods.size() <= 1)
+        return;
+
+    const uint32 vertexCount = (uint32)mesh.vertices.size();
+    std::vector<uint32> remap(vertexCount, 0xFFFFFFFFu);
+    std::vector<Vertex> vertices;
+    std::vector<uint32> indices;
+    vertices.reserve(vertexCount);
+    indices.reserve(mesh.indices.size());
+
+    std::vector<MeshLod> progressive(lods);
+    for (size_t level = lods.size(); level-- > 0; )
+    {
+        const MeshLod& lod = lods[level];
+        progressive[level].firstIndex = (uint32)indices.size();
+        for (uint32 i = lod.firstIndex; i < lod.firstIndex + lod.indexCount; i++)
+        {
+            uint32& target = remap[mesh.indices[i]];
+            if (target == 0xFFFFFFFFu)
+            {
+                target = (uint32)vertices.size();
+                vertices.push_back(mesh.vertices[mesh.indices[i]]);
+            }
+            indices.push_back(target);
+        }
+        progressive[level].vertexCount = (uint32)vertices.size();
+    }
+
+    // vertices no level uses are dropped
+    mesh.vertices = std::move(vertices);
+    mesh.indices = std::move(indices);
+    lods = std::move(progressive);
+}
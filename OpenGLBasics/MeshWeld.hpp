@@ -0,0 +1,226 @@
+#pragma once
+#include "main.h"
+#include "Vertex.hpp"
+#include "ThreadPool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+
+/*
+Vertex welding.
+Vertices whose attributes are all within the epsilons of an earlier vertex are merged into it and
+the indices remapped. The vertices are bucketed once in a grid of positionEpsilon sized cells;
+each one looks for the earliest matching vertex in the cells its epsilon box touches, so the pairs
+that straddle a cell boundary are found too. A vertex joins the group of the vertex it matched and
+the first vertex of every group is the one kept, so the result does not depend on the thread count.
+*/
+
+// Largest difference of every attribute for two vertices to be merged (0 means exact match)
+struct WeldSettings
+{
+    float positionEpsilon = 1e-5f;
+    float normalEpsilon = 1e-3f;
+    float uvEpsilon = 1e-5f;
+    float tangentEpsilon = 1e-3f;
+};
+
+struct WeldStats
+{
+    uint32 verticesBefore;
+    uint32 verticesAfter;
+};
+
+// below this size the weld runs on the calling thread only
+#define WELD_PARALLEL_THRESHOLD 16384
+#define WELD_NO_VERTEX 0xFFFFFFFFu
+
+// Grid cell of a coordinate, the float bits when epsilon is 0 (-0 and +0 are the same)
+inline int weldCell(const float value, const float epsilon)
+{
+    if (epsilon <= 0.0f)
+    {
+        int bits;
+        float exact = (value == 0.0f) ? 0.0f : value;
+        memcpy(&bits, &exact, sizeof(bits));
+        return bits;
+    }
+
+    double cell = std::floor((double)value / epsilon);
+    if (cell > 2147483647.0) cell = 2147483647.0;
+    if (cell < -2147483648.0) cell = -2147483648.0;
+    return (int)cell;
+}
+
+inline uint32 weldCellHash(const int x, const int y, const int z)
+{
+    uint64 hash = 0xCBF29CE484222325ull;
+    hash = (hash ^ (uint32)x) * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ (uint32)y) * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ (uint32)z) * 0x9E3779B97F4A7C15ull;
+    return (uint32)(hash ^ (hash >> 32));
+}
+
+inline bool weldClose(const float a, const float b, const float epsilon)
+{
+    return epsilon <= 0.0f ? a == b : std::abs(a - b) <= epsilon;
+}
+
+inline bool weldMatch(const Vertex& a, const Vertex& b, const WeldSettings& settings)
+{
+    for (int c = 0; c < 3; c++)
+    {
+        if (!weldClose(a.pos[c], b.pos[c], settings.positionEpsilon)
+            || !weldClose(a.normal[c], b.normal[c], settings.normalEpsilon)
+            || !weldClose(a.tangent[c], b.tangent[c], settings.tangentEpsilon))
+            return false;
+    }
+    return weldClose(a.uvCoord.x, b.uvCoord.x, settings.uvEpsilon) && weldClose(a.uvCoord.y, b.uvCoord.y, settings.uvEpsilon)
+        && a.layer == b.layer;
+}
+
+inline WeldStats weldVertices(std::vector<Vertex>& vertices, std::vector<uint32>& indices, const WeldSettings& settings = WeldSettings())
+{
+    const uint32 count = (uint32)vertices.size();
+    WeldStats stats = { count, count };
+    if (count < 2)
+        return stats;
+
+    ThreadPool& pool = ThreadPool::shared();
+    const bool parallel = count >= WELD_PARALLEL_THRESHOLD && pool.size() > 0;
+    const uint32 chunkSize = 4096;
+    const uint32 chunks = (count + chunkSize - 1) / chunkSize;
+    auto forChunks = [&](auto func)
+    {
+        auto chunk = [&](const uint32 c)
+        {
+            const uint32 end = std::min(count, (c + 1) * chunkSize);
+            for (uint32 i = c * chunkSize; i < end; i++)
+                func(i);
+        };
+        if (parallel)
+            pool.parallelFor(chunks, chunk);
+        else
+            for (uint32 c = 0; c < chunks; c++)
+                chunk(c);
+    };
+
+    // grid cell of every vertex
+    const float epsilon = settings.positionEpsilon;
+    std::vector<int> cells((size_t)count * 3);
+    forChunks([&](const uint32 i)
+    {
+        for (int c = 0; c < 3; c++)
+            cells[(size_t)i * 3 + c] = weldCell(vertices[i].pos[c], epsilon);
+    });
+
+    // number the occupied cells with an open addressing table, slots hold a vertex of the cell
+    uint32 tableSize = 16;
+    while (tableSize < count * 2)
+        tableSize <<= 1;
+    std::vector<uint32> table(tableSize, WELD_NO_VERTEX);
+    std::vector<uint32> cellIds(tableSize);
+    std::vector<uint32> cellOf(count);
+    uint32 cellCount = 0;
+    auto findSlot = [&](const int x, const int y, const int z) -> uint32
+    {
+        uint32 slot = weldCellHash(x, y, z) & (tableSize - 1);
+        while (table[slot] != WELD_NO_VERTEX)
+        {
+            const int* other = &cells[(size_t)table[slot] * 3];
+            if (other[0] == x && other[1] == y && other[2] == z)
+                break;
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        return slot;
+    };
+    for (uint32 i = 0; i < count; i++)
+    {
+        const int* cell = &cells[(size_t)i * 3];
+        const uint32 slot = findSlot(cell[0], cell[1], cell[2]);
+        if (table[slot] == WELD_NO_VERTEX)
+        {
+            table[slot] = i;
+            cellIds[slot] = cellCount++;
+        }
+        cellOf[i] = cellIds[slot];
+    }
+
+    // bucket the vertices by cell, in index order inside a cell
+    std::vector<uint32> cellStart(cellCount + 1, 0);
+    for (uint32 i = 0; i < count; i++)
+        cellStart[cellOf[i] + 1]++;
+    for (uint32 c = 0; c < cellCount; c++)
+        cellStart[c + 1] += cellStart[c];
+    std::vector<uint32> members(count);
+    {
+        std::vector<uint32> fill(cellStart.begin(), cellStart.end() - 1);
+        for (uint32 i = 0; i < count; i++)
+            members[fill[cellOf[i]]++] = i;
+    }
+
+    // earliest vertex each one matches, searched in the cells its epsilon box touches
+    std::vector<uint32> earliest(count);
+    forChunks([&](const uint32 i)
+    {
+        int low[3];
+        int high[3];
+        for (int c = 0; c < 3; c++)
+        {
+            const float value = vertices[i].pos[c];
+            low[c] = epsilon > 0.0f ? weldCell(value - epsilon, epsilon) : cells[(size_t)i * 3 + c];
+            high[c] = epsilon > 0.0f ? weldCell(value + epsilon, epsilon) : cells[(size_t)i * 3 + c];
+        }
+
+        uint32 match = WELD_NO_VERTEX;
+        for (int x = low[0]; x <= high[0]; x++)
+            for (int y = low[1]; y <= high[1]; y++)
+                for (int z = low[2]; z <= high[2]; z++)
+                {
+                    const uint32 slot = findSlot(x, y, z);
+                    if (table[slot] == WELD_NO_VERTEX)
+                        continue;
+                    const uint32 cell = cellIds[slot];
+                    for (uint32 m = cellStart[cell]; m < cellStart[cell + 1]; m++)
+                    {
+                        const uint32 other = members[m];
+                        if (other >= i || other >= match)
+                            break;
+                        if (weldMatch(vertices[other], vertices[i], settings))
+                        {
+                            match = other;
+                            break;
+                        }
+                    }
+                }
+        earliest[i] = match;
+    });
+
+    // join the group of the matched vertex, in order so the earlier groups are final
+    std::vector<uint32> first(count);
+    for (uint32 i = 0; i < count; i++)
+        first[i] = earliest[i] == WELD_NO_VERTEX ? i : first[earliest[i]];
+
+    // compact the unique vertices keeping their order
+    std::vector<uint32> remap(count);
+    uint32 unique = 0;
+    for (uint32 i = 0; i < count; i++)
+    {
+        if (first[i] == i)
+        {
+            remap[i] = unique;
+            vertices[unique++] = vertices[i];
+        }
+        else
+            remap[i] = remap[first[i]];
+    }
+    vertices.resize(unique);
+    vertices.shrink_to_fit();
+
+    for (uint32& index : indices)
+        index = remap[index];
+
+    stats.verticesAfter = unique;
+    return stats;
+}
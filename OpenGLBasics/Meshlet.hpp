@@ -0,0 +1,291 @@
+#pragma once
+#include "main.h"
+#include "Vertex.hpp"
+#include "Frustum.hpp"
+#include <GLM/glm.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+
+/*
+Meshlets: small clusters of triangles with their own bounds so they can be culled on the CPU.
+The triangles of every meshlet are contiguous in the index buffer, so the visible meshlets
+are merged in index ranges and drawn with the existing index buffer.
+*/
+
+// small clusters cull better, every run of visible meshlets costs one draw call
+#define MESHLET_MAX_VERTICES 32
+#define MESHLET_MAX_TRIANGLES 48
+// how much the builder favors narrow normal cones over compact bounds
+#define MESHLET_CONE_WEIGHT 5.0f
+
+struct Meshlet
+{
+    uint32 firstIndex;
+    uint32 indexCount;
+    uint32 baseVertex;      // of the index range the meshlet belongs to
+    uint32 vertexCount;
+    glm::vec3 center;       // bounding sphere
+    float radius;
+    glm::vec3 coneApex;     // normal cone, the meshlet is back facing when
+    float coneCutoff;       // dot(normalize(coneApex - camera), coneAxis) >= coneCutoff
+    glm::vec3 coneAxis;
+};
+
+inline void computeMeshletBounds(Meshlet& meshlet, const std::vector<Vertex>& vertices, const std::vector<uint32>& indices)
+{
+    const uint32 end = meshlet.firstIndex + meshlet.indexCount;
+
+    // bounding sphere around the box center
+    glm::vec3 minPos = vertices[indices[meshlet.firstIndex]].pos;
+    glm::vec3 maxPos = minPos;
+    for (uint32 i = meshlet.firstIndex; i < end; i++)
+    {
+        minPos = glm::min(minPos, vertices[indices[i]].pos);
+        maxPos = glm::max(maxPos, vertices[indices[i]].pos);
+    }
+    meshlet.center = (minPos + maxPos) * 0.5f;
+    meshlet.radius = 0.0f;
+    for (uint32 i = meshlet.firstIndex; i < end; i++)
+        meshlet.radius = std::max(meshlet.radius, glm::length(vertices[indices[i]].pos - meshlet.center));
+
+    // normal cone from the face normals
+    std::vector<glm::vec3> normals;
+    normals.reserve(meshlet.indexCount / 3);
+    glm::vec3 axis(0.0f);
+    for (uint32 i = meshlet.firstIndex; i + 2 < end; i += 3)
+    {
+        const glm::vec3& a = vertices[indices[i]].pos;
+        glm::vec3 normal = glm::cross(vertices[indices[i + 1]].pos - a, vertices[indices[i + 2]].pos - a);
+        float length = glm::length(normal);
+        if (length > 0.0f)
+        {
+            normals.push_back(normal / length);
+            axis += normal / length;
+        }
+    }
+
+    float axisLength = glm::length(axis);
+    meshlet.coneAxis = axisLength > 0.0f ? axis / axisLength : glm::vec3(0.0f, 0.0f, 1.0f);
+    meshlet.coneApex = meshlet.center;
+    meshlet.coneCutoff = 1.0f; // never culled
+
+    float minDot = 1.0f;
+    for (const glm::vec3& normal : normals)
+        minDot = std::min(minDot, glm::dot(normal, meshlet.coneAxis));
+    if (normals.empty() || minDot <= 0.1f)
+        return;
+
+    // move the apex back so every triangle plane is in front of it
+    float maxT = 0.0f;
+    uint32 n = 0;
+    for (uint32 i = meshlet.firstIndex; i + 2 < end; i += 3)
+    {
+        const glm::vec3& a = vertices[indices[i]].pos;
+        glm::vec3 normal = glm::cross(vertices[indices[i + 1]].pos - a, vertices[indices[i + 2]].pos - a);
+        if (glm::length(normal) == 0.0f)
+            continue;
+        float t = glm::dot(meshlet.center - a, normals[n]) / glm::dot(normals[n], meshlet.coneAxis);
+        maxT = std::max(maxT, t);
+        n++;
+    }
+    meshlet.coneApex = meshlet.center - meshlet.coneAxis * maxT;
+    meshlet.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+}
+
+/*
+Split the triangles of every range in meshlets of at most maxVertices/maxTriangles.
+Triangles are grown from a seed through shared vertices and reordered inside their range so every
+meshlet is contiguous. Triangles outside the ranges are left as they are.
+*/
+inline std::vector<Meshlet> buildMeshlets(MeshData& mesh, const std::vector<IndexRange>& ranges,
+    const uint32 maxVertices = MESHLET_MAX_VERTICES, const uint32 maxTriangles = MESHLET_MAX_TRIANGLES)
+{
+    std::vector<Meshlet> meshlets;
+    const uint32 vertexCount = (uint32)mesh.vertices.size();
+    const uint32 triangleCount = (uint32)mesh.indices.size() / 3;
+
+    // triangles using every vertex
+    std::vector<uint32> offsets(vertexCount + 1, 0);
+    for (uint32 index : mesh.indices)
+        offsets[index + 1]++;
+    for (uint32 v = 0; v < vertexCount; v++)
+        offsets[v + 1] += offsets[v];
+    std::vector<uint32> adjacency(mesh.indices.size());
+    {
+        std::vector<uint32> fill(offsets.begin(), offsets.end() - 1);
+        for (uint32 i = 0; i < mesh.indices.size(); i++)
+            adjacency[fill[mesh.indices[i]]++] = i / 3;
+    }
+
+    // triangle centers and normals to keep the meshlets compact and with narrow normal cones
+    std::vector<glm::vec3> centers(triangleCount);
+    std::vector<glm::vec3> normals(triangleCount);
+    for (uint32 t = 0; t < triangleCount; t++)
+    {
+        const glm::vec3& p0 = mesh.vertices[mesh.indices[t * 3 + 0]].pos;
+        const glm::vec3& p1 = mesh.vertices[mesh.indices[t * 3 + 1]].pos;
+        const glm::vec3& p2 = mesh.vertices[mesh.indices[t * 3 + 2]].pos;
+        centers[t] = (p0 + p1 + p2) / 3.0f;
+        glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+        float length = glm::length(normal);
+        normals[t] = length > 0.0f ? normal / length : glm::vec3(0.0f);
+    }
+
+    std::vector<char> used(triangleCount, 0);
+    std::vector<uint32> inMeshlet(vertexCount, 0xFFFFFFFFu);
+    std::vector<uint32> output;
+    std::vector<uint32> candidates;
+
+    for (const IndexRange& range : ranges)
+    {
+        output.clear();
+        const uint32 firstTriangle = range.firstIndex / 3;
+        const uint32 endTriangle = firstTriangle + range.indexCount / 3;
+        uint32 seed = firstTriangle;
+
+        while (true)
+        {
+            while (seed < endTriangle && used[seed])
+                seed++;
+            if (seed == endTriangle)
+                break;
+
+            Meshlet meshlet = {};
+            meshlet.firstIndex = range.firstIndex + (uint32)output.size();
+            meshlet.baseVertex = range.baseVertex;
+            const uint32 id = (uint32)meshlets.size();
+            uint32 triangles = 0;
+            candidates.clear();
+            uint32 next = seed;
+            glm::vec3 centerSum(0.0f);
+            glm::vec3 normalSum(0.0f);
+            float radius = 0.0f;
+
+            while (next != 0xFFFFFFFFu)
+            {
+                // add the triangle
+                used[next] = 1;
+                triangles++;
+                centerSum += centers[next];
+                normalSum += normals[next];
+                for (uint32 k = 0; k < 3; k++)
+                    radius = std::max(radius, glm::length(mesh.vertices[mesh.indices[next * 3 + k]].pos - centerSum / (float)triangles));
+                for (uint32 k = 0; k < 3; k++)
+                {
+                    uint32 v = mesh.indices[next * 3 + k];
+                    output.push_back(v);
+                    if (inMeshlet[v] != id)
+                    {
+                        inMeshlet[v] = id;
+                        meshlet.vertexCount++;
+                        for (uint32 j = offsets[v]; j < offsets[v + 1]; j++)
+                            if (!used[adjacency[j]])
+                                candidates.push_back(adjacency[j]);
+                    }
+                }
+                if (triangles == maxTriangles)
+                    break;
+
+                // pick the neighbour closest to the meshlet and its average normal,
+                // triangles that add no vertex go first
+                next = 0xFFFFFFFFu;
+                float bestCost = FLT_MAX;
+                const glm::vec3 center = centerSum / (float)triangles;
+                const float normalLength = glm::length(normalSum);
+                const glm::vec3 axis = normalLength > 0.0f ? normalSum / normalLength : glm::vec3(0.0f);
+                size_t write = 0;
+                for (size_t c = 0; c < candidates.size(); c++)
+                {
+                    uint32 t = candidates[c];
+                    if (used[t] || t < firstTriangle || t >= endTriangle)
+                        continue;
+                    candidates[write++] = t;
+
+                    uint32 added = 0;
+                    for (uint32 k = 0; k < 3; k++)
+                        if (inMeshlet[mesh.indices[t * 3 + k]] != id)
+                            added++;
+                    if (meshlet.vertexCount + added > maxVertices)
+                        continue;
+
+                    float distance = glm::length(centers[t] - center) / (radius > 0.0f ? radius : 1.0f);
+                    float spread = 1.0f - glm::dot(normals[t], axis);
+                    float cost = (added == 0 ? 0.0f : 10.0f) + distance + spread * MESHLET_CONE_WEIGHT;
+                    if (cost < bestCost)
+                    {
+                        bestCost = cost;
+                        next = t;
+                    }
+                }
+                candidates.resize(write);
+            }
+
+            meshlet.indexCount = range.firstIndex + (uint32)output.size() - meshlet.firstIndex;
+            meshlets.push_back(meshlet);
+        }
+        std::copy(output.begin(), output.end(), mesh.indices.begin() + range.firstIndex);
+    }
+
+    for (Meshlet& meshlet : meshlets)
+        computeMeshletBounds(meshlet, mesh.vertices, mesh.indices);
+    return meshlets;
+}
+
+/*
+Keep the meshlets that are inside the frustum and not back facing for at least one instance
+and merge them in index ranges. Returns the number of triangles kept.
+visible is scratch space, kept by the caller so culling every frame does not allocate.
+*/
+inline uint32 cullMeshlets(const std::vector<Meshlet>& meshlets, const glm::mat4& PV, const glm::vec3& cameraPos,
+    const uint32 count, const glm::mat4* models, std::vector<IndexRange>& visibleRanges, std::vector<char>& visible)
+{
+    visibleRanges.clear();
+    visible.assign(meshlets.size(), 0);
+
+    for (uint32 instance = 0; instance < count; instance++)
+    {
+        const glm::mat4& model = models[instance];
+        // the bounds are in model space, so test them against the model space frustum and camera
+        Frustum frustum = Frustum::fromMatrix(PV * model);
+        glm::vec3 localCamera = glm::vec3(glm::inverse(model) * glm::vec4(cameraPos, 1.0f));
+
+        for (size_t m = 0; m < meshlets.size(); m++)
+        {
+            if (visible[m])
+                continue;
+            const Meshlet& meshlet = meshlets[m];
+            if (!frustum.intersectsSphere(meshlet.center, meshlet.radius))
+                continue;
+
+            glm::vec3 view = meshlet.coneApex - localCamera;
+            float distance = glm::length(view);
+            if (distance > 0.0f && glm::dot(view, meshlet.coneAxis) >= meshlet.coneCutoff * distance)
+                continue;
+            visible[m] = 1;
+        }
+    }
+
+    uint32 triangles = 0;
+    for (size_t m = 0; m < meshlets.size(); m++)
+    {
+        if (!visible[m])
+            continue;
+        const Meshlet& meshlet = meshlets[m];
+        triangles += meshlet.indexCount / 3;
+
+        if (!visibleRanges.empty())
+        {
+            IndexRange& last = visibleRanges.back();
+            if (last.baseVertex == meshlet.baseVertex && last.firstIndex + last.indexCount == meshlet.firstIndex)
+            {
+                last.indexCount += meshlet.indexCount;
+                continue;
+            }
+        }
+        visibleRanges.push_back(IndexRange{ meshlet.firstIndex, meshlet.indexCount, meshlet.baseVertex });
+    }
+    return triangles;
+}
@@ -0,0 +1,350 @@
+#pragma once
+#include "main.h"
+#include "ThreadPool.hpp"
+#include <GLM/gtc/constants.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MIP_SSE
+#endif
+
+
+/*
+Mip chains made on the CPU, so the loader workers build them instead of glGenerateMipmap on the
+GL thread.
+The image is converted once to linear floats, 4 per pixel (sRGB colors are decoded, alpha and the
+data textures are already linear). Every level is filtered from the previous one in two separable
+passes, horizontal then vertical, each spread over the rows with parallelFor, a pixel being one
+SSE2 register. The levels are encoded back to 8 bits with correct rounding of the sRGB curve.
+The box filter averages the source texels under a destination texel (odd sizes included), the
+Kaiser filter is a Kaiser windowed sinc 3 destination texels wide: sharper, with a bit of ringing.
+*/
+
+enum MipFilter
+{
+    MIP_FILTER_BOX,
+    MIP_FILTER_KAISER
+};
+
+struct MipLevel
+{
+    uint32 width;
+    uint32 height;
+    std::vector<unsigned char> pixels; // same channels as the source, rows not padded
+};
+
+// Taps of the source texels read by every destination texel along one axis
+struct MipFilterTable
+{
+    std::vector<int> first;         // first source texel of a destination texel
+    std::vector<uint32> offsets;    // its weights start at weights[offsets[i]], offsets[size] ends them
+    std::vector<float> weights;     // normalized
+};
+
+#define MIP_KAISER_RADIUS 3.0f  // in destination texels
+#define MIP_KAISER_ALPHA 4.0f
+
+// Zeroth order modified Bessel function of the first kind, for the Kaiser window
+inline float besselI0(const float x)
+{
+    float sum = 1.0f;
+    float term = 1.0f;
+    for (int k = 1; k < 20; k++)
+    {
+        const float half = x / (2.0f * (float)k);
+        term *= half * half;
+        sum += term;
+        if (term < sum * 1e-7f)
+            break;
+    }
+    return sum;
+}
+
+inline float kaiserSinc(const float x)
+{
+    const float t = x / MIP_KAISER_RADIUS;
+    if (std::abs(t) >= 1.0f)
+        return 0.0f;
+    const float sinc = x == 0.0f ? 1.0f : std::sin(glm::pi<float>() * x) / (glm::pi<float>() * x);
+    return sinc * besselI0(MIP_KAISER_ALPHA * std::sqrt(1.0f - t * t)) / besselI0(MIP_KAISER_ALPHA);
+}
+
+inline MipFilterTable buildMipFilter(const uint32 sourceSize, const uint32 size, const MipFilter filter)
+{
+    MipFilterTable table;
+    const float scale = (float)sourceSize / (float)size; // source texels per destination texel
+    // the filter is never narrower than a source texel, when resizeImage enlarges an image
+    const float width = std::max(scale, 1.0f);
+    const float support = filter == MIP_FILTER_BOX ? 0.5f * width : MIP_KAISER_RADIUS * width;
+    table.first.resize(size);
+    table.offsets.resize(size + 1);
+    for (uint32 i = 0; i < size; i++)
+    {
+        const float center = ((float)i + 0.5f) * scale;
+        const int first = (int)std::floor(center - support);
+        const int last = (int)std::ceil(center + support);
+        table.first[i] = first;
+        table.offsets[i] = (uint32)table.weights.size();
+
+        float total = 0.0f;
+        for (int s = first; s < last; s++)
+        {
+            float weight;
+            if (filter == MIP_FILTER_BOX)
+                weight = std::max(std::min((float)s + 1.0f, center + support) - std::max((float)s, center - support), 0.0f);
+            else
+                weight = kaiserSinc(((float)s + 0.5f - center) / width);
+            table.weights.push_back(weight);
+            total += weight;
+        }
+        for (uint32 w = table.offsets[i]; w < (uint32)table.weights.size(); w++)
+            table.weights[w] /= total;
+    }
+    table.offsets[size] = (uint32)table.weights.size();
+    return table;
+}
+
+// Source texel read for coordinate s of an axis of size texels
+inline uint32 mipAddress(const int s, const uint32 size, const bool wrap)
+{
+    if (wrap)
+        return (uint32)(((s % (int)size) + (int)size) % (int)size);
+    return (uint32)std::min(std::max(s, 0), (int)size - 1);
+}
+
+// out = sum of weights[i] * pixels[i], 4 floats per pixel
+inline void accumulatePixel(float* out, const float* const* pixels, const float* weights, const uint32 count)
+{
+#if defined(MIP_SSE)
+    __m128 sum = _mm_setzero_ps();
+    for (uint32 i = 0; i < count; i++)
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[i]), _mm_loadu_ps(pixels[i])));
+    _mm_storeu_ps(out, sum);
+#else
+    float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (uint32 i = 0; i < count; i++)
+        for (uint32 c = 0; c < 4; c++)
+            sum[c] += weights[i] * pixels[i][c];
+    for (uint32 c = 0; c < 4; c++)
+        out[c] = sum[c];
+#endif
+}
+
+// Filter a width x height linear RGBA float image to the new size, both passes parallel over the rows
+inline std::vector<float> downsampleLinear(const std::vector<float>& image, const uint32 width, const uint32 height,
+    const uint32 newWidth, const uint32 newHeight, const MipFilter filter, const bool wrap)
+{
+    const MipFilterTable columns = buildMipFilter(width, newWidth, filter);
+    const MipFilterTable rows = buildMipFilter(height, newHeight, filter);
+
+    std::vector<float> horizontal((size_t)newWidth * height * 4);
+    ThreadPool::shared().parallelFor(height, [&](const uint32 y)
+    {
+        const float* row = image.data() + (size_t)y * width * 4;
+        float* out = horizontal.data() + (size_t)y * newWidth * 4;
+        std::vector<const float*> taps;
+        for (uint32 x = 0; x < newWidth; x++)
+        {
+            const uint32 count = columns.offsets[x + 1] - columns.offsets[x];
+            taps.resize(count);
+            for (uint32 i = 0; i < count; i++)
+                taps[i] = row + (size_t)mipAddress(columns.first[x] + (int)i, width, wrap) * 4;
+            accumulatePixel(out + (size_t)x * 4, taps.data(), columns.weights.data() + columns.offsets[x], count);
+        }
+    });
+
+    std::vector<float> result((size_t)newWidth * newHeight * 4);
+    ThreadPool::shared().parallelFor(newHeight, [&](const uint32 y)
+    {
+        const uint32 count = rows.offsets[y + 1] - rows.offsets[y];
+        std::vector<const float*> taps(count);
+        float* out = result.data() + (size_t)y * newWidth * 4;
+        for (uint32 x = 0; x < newWidth; x++)
+        {
+            for (uint32 i = 0; i < count; i++)
+                taps[i] = horizontal.data() + ((size_t)mipAddress(rows.first[y] + (int)i, height, wrap) * newWidth + x) * 4;
+            accumulatePixel(out + (size_t)x * 4, taps.data(), rows.weights.data() + rows.offsets[y], count);
+        }
+    });
+    return result;
+}
+
+// 8 bit sRGB to linear
+inline const float* srgbToLinearTable()
+{
+    static const std::vector<float> table = []()
+    {
+        std::vector<float> values(256);
+        for (uint32 i = 0; i < 256; i++)
+        {
+            const float c = (float)i / 255.0f;
+            values[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        return values;
+    }();
+    return table.data();
+}
+
+/*
+Linear to 8 bit sRGB, rounded like the exact curve: a 4096 entries guess corrected against the
+linear values halfway between the 8 bit steps.
+*/
+inline unsigned char linearToSrgb(const float linear)
+{
+    struct Tables
+    {
+        float thresholds[256];  // linear value halfway between step i and i + 1
+        unsigned char guess[4096];
+    };
+    static const Tables tables = []()
+    {
+        Tables t;
+        for (uint32 i = 0; i < 256; i++)
+        {
+            const float c = ((float)i + 0.5f) / 255.0f;
+            t.thresholds[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        for (uint32 i = 0; i < 4096; i++)
+        {
+            const float l = (float)i / 4095.0f;
+            const float c = l <= 0.0031308f ? l * 12.92f : 1.055f * std::pow(l, 1.0f / 2.4f) - 0.055f;
+            t.guess[i] = (unsigned char)std::min(std::max(c * 255.0f + 0.5f, 0.0f), 255.0f);
+        }
+        return t;
+    }();
+
+    const float l = std::min(std::max(linear, 0.0f), 1.0f);
+    uint32 value = tables.guess[(uint32)(l * 4095.0f + 0.5f)];
+    while (value < 255 && l >= tables.thresholds[value])
+        value++;
+    while (value > 0 && l < tables.thresholds[value - 1])
+        value--;
+    return (unsigned char)value;
+}
+
+// Pixels to linear RGBA floats, the missing channels are 0 and alpha 1
+inline std::vector<float> decodeLinear(const unsigned char* pixels, const uint32 width, const uint32 height,
+    const uint32 channels, const bool srgb)
+{
+    const float* toLinear = srgbToLinearTable();
+    const uint32 colorChannels = srgb ? std::min(channels, 3u) : 0;
+    std::vector<float> image((size_t)width * height * 4);
+    ThreadPool::shared().parallelFor(height, [&](const uint32 y)
+    {
+        const unsigned char* in = pixels + (size_t)y * width * channels;
+        float* out = image.data() + (size_t)y * width * 4;
+        for (uint32 x = 0; x < width; x++, in += channels, out += 4)
+        {
+            out[0] = out[1] = out[2] = 0.0f;
+            out[3] = 1.0f;
+            for (uint32 c = 0; c < channels; c++)
+                out[c] = c < colorChannels ? toLinear[in[c]] : (float)in[c] * (1.0f / 255.0f);
+        }
+    });
+    return image;
+}
+
+inline void encodeLinear(const std::vector<float>& image, const uint32 width, const uint32 height,
+    const uint32 channels, const bool srgb, unsigned char* pixels)
+{
+    const uint32 colorChannels = srgb ? std::min(channels, 3u) : 0;
+    ThreadPool::shared().parallelFor(height, [&](const uint32 y)
+    {
+        const float* in = image.data() + (size_t)y * width * 4;
+        unsigned char* out = pixels + (size_t)y * width * channels;
+        for (uint32 x = 0; x < width; x++, in += 4, out += channels)
+        {
+#if defined(MIP_SSE)
+            // all 4 channels as linear values, the sRGB ones are replaced below
+            const __m128 scaled = _mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(in), _mm_setzero_ps()),
+                _mm_set1_ps(1.0f)), _mm_set1_ps(255.0f)), _mm_set1_ps(0.5f));
+            int values[4];
+            _mm_storeu_si128((__m128i*)values, _mm_cvttps_epi32(scaled));
+            for (uint32 c = colorChannels; c < channels; c++)
+                out[c] = (unsigned char)values[c];
+#else
+            for (uint32 c = colorChannels; c < channels; c++)
+                out[c] = (unsigned char)(std::min(std::max(in[c], 0.0f), 1.0f) * 255.0f + 0.5f);
+#endif
+            for (uint32 c = 0; c < colorChannels; c++)
+                out[c] = linearToSrgb(in[c]);
+        }
+    });
+}
+
+// Resample an image to newWidth x newHeight with the mip filters, in linear space like the mips
+inline std::vector<unsigned char> resizeImage(const unsigned char* pixels, const uint32 width, const uint32 height,
+    const uint32 channels, const uint32 newWidth, const uint32 newHeight, const bool srgb,
+    const MipFilter filter = MIP_FILTER_BOX, const bool wrap = false)
+{
+    const std::vector<float> image = downsampleLinear(decodeLinear(pixels, width, height, channels, srgb), width, height,
+        newWidth, newHeight, filter, wrap);
+    std::vector<unsigned char> result((size_t)newWidth * newHeight * channels);
+    encodeLinear(image, newWidth, newHeight, channels, srgb, result.data());
+    return result;
+}
+
+/*
+Every mip level of a width x height image below the full size one, down to 1x1.
+srgb: the first 3 channels are sRGB colors, filtered in linear space. wrap: the filter reads
+across the edges like GL_REPEAT, else the edge texels are repeated.
+*/
+inline std::vector<MipLevel> generateMipChain(const unsigned char* pixels, const uint32 width, const uint32 height,
+    const uint32 channels, const bool srgb, const MipFilter filter = MIP_FILTER_BOX, const bool wrap = false)
+{
+    std::vector<MipLevel> levels;
+    std::vector<float> image = decodeLinear(pixels, width, height, channels, srgb);
+    uint32 levelWidth = width;
+    uint32 levelHeight = height;
+    while (levelWidth > 1 || levelHeight > 1)
+    {
+        const uint32 newWidth = std::max(levelWidth / 2, 1u);
+        const uint32 newHeight = std::max(levelHeight / 2, 1u);
+        image = downsampleLinear(image, levelWidth, levelHeight, newWidth, newHeight, filter, wrap);
+        levelWidth = newWidth;
+        levelHeight = newHeight;
+
+        levels.push_back(MipLevel{ levelWidth, levelHeight, std::vector<unsigned char>((size_t)levelWidth * levelHeight * channels) });
+        encodeLinear(image, levelWidth, levelHeight, channels, srgb, levels.back().pixels.data());
+    }
+    return levels;
+}
+
+/*
+Time the mip chain of an image with both filters.
+Started from the command line: OpenGLBasics --bench-mips res/Textures/RedBrick/brick_df.png
+*/
+inline void benchmarkMipGeneration(const std::string& path, const uint32 runs = 5)
+{
+    typedef std::chrono::steady_clock Clock;
+    int width, height, channels;
+    unsigned char* pixels = stbi_load(path.c_str(), &width, &height, &channels, 0);
+    if (!pixels)
+    {
+        std::cout << "ERROR::BENCH::Could not read " << path << std::endl;
+        return;
+    }
+
+    const MipFilter filters[2] = { MIP_FILTER_BOX, MIP_FILTER_KAISER };
+    const char* names[2] = { "box", "kaiser" };
+    for (uint32 f = 0; f < 2; f++)
+    {
+        double best = 1e30;
+        size_t levels = 0;
+        for (uint32 run = 0; run < runs; run++)
+        {
+            const Clock::time_point start = Clock::now();
+            levels = generateMipChain(pixels, (uint32)width, (uint32)height, (uint32)channels, channels >= 3, filters[f]).size();
+            best = std::min(best, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+        }
+        std::cout << "BENCH::MIPS::" << path << " " << names[f] << ": " << levels << " levels in " << best << " ms, "
+            << (double)width * height / (best * 1000.0) << " MP/s of source" << std::endl;
+    }
+    stbi_image_free(pixels);
+}
@@ -1,39 +1,99 @@
 #pragma once
 #include "main.h"
+#include "Vertex.hpp"
+#include "MeshCache.hpp"
+#include "ThreadPool.hpp"
+#include "MeshWeld.hpp"
+#include "MeshOptimizer.hpp"
+#include "VertexFormat.hpp"
+#include "IndexFormat.hpp"
+#include "Meshlet.hpp"
+#include "MeshSimplify.hpp"
+#include "ObjLoader.hpp"
+#include "LockFreeQueue.hpp"
+#include "GeometryArena.hpp"
+#include "MeshCodec.hpp"
+#include "MaterialArray.hpp"
 #define GLEW_STATIC
 #include <GL/glew.h>
 #include <GLM/glm.hpp>
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 
-struct Vertex
+/*
+What a mesh keeps in RAM once it is on the GPU.
+CPU_DATA_KEEP keeps the vertices and indices for CPU queries (picking, collision, static batching),
+CPU_DATA_COMPRESSED keeps them coded with MeshCodec and decodes them in readMeshData.
+*/
+enum CpuDataPolicy
 {
-    glm::vec3 pos;
-    glm::vec3 normal;
-    glm::vec2 uvCoord;
-	glm::vec3 tangent;
+    CPU_DATA_DISCARD,
+    CPU_DATA_KEEP,
+    CPU_DATA_COMPRESSED
+};
+
+// Memory used by a model
+struct ModelMemory
+{
+    uint64 cpuBytes;
+    uint64 gpuBytes;
 };
 
 class Mesh
 {
-    uint32 VAO; // Vertex Array Object
-    uint32 VBO; // Vertex Buffer Object
+    GLVertexArray VAO; // Vertex Array Object
+    GLBuffer VBO; // Vertex Buffer Object
     //uint32 IBO; // Per Instance attributes Buffer Object
-    uint32 EBO; // Elements Buffer Object
+    GLBuffer EBO; // Elements Buffer Object
+    glm::vec4 dequant; // Position dequantization
+    VertexFormat format;
+    uint32 vertexCount;
+    uint32 indexCount;
+    uint32 indexSize; // 2 or 4 bytes
+    // MeshCodec streams of the uploaded vertices and indices, kept by CPU_DATA_COMPRESSED
+    std::vector<unsigned char> vertexStream;
+    std::vector<unsigned char> indexStream;
 public:
-    std::vector<Vertex> vertices;
+    std::vector<Vertex> vertices; // empty unless created with CPU_DATA_KEEP
     std::vector<uint32> indices;
 public:
-    Mesh(const std::vector<Vertex>& nVertices, const std::vector<uint32>& nIndices)
-        : vertices(nVertices), indices(nIndices)
+    Mesh(const std::vector<Vertex>& nVertices, const std::vector<uint32>& nIndices, const VertexLayout& layout = VertexLayout(),
+        const CpuDataPolicy policy = CPU_DATA_DISCARD)
+        : Mesh(std::vector<Vertex>(nVertices), std::vector<uint32>(nIndices), layout, policy)
+    {
+    }
+
+    // Take the arrays instead of copying them
+    Mesh(std::vector<Vertex>&& nVertices, std::vector<uint32>&& nIndices, const VertexLayout& layout = VertexLayout(),
+        const CpuDataPolicy policy = CPU_DATA_DISCARD)
+        : vertices(std::move(nVertices)), indices(std::move(nIndices))
     {
-        // Generate the buffers
-        glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &VBO);
-        glGenBuffers(1, &EBO);
+        PackedVertices packed = packVertices(vertices, layout);
+        dequant = packed.dequant;
+        format = packed.format;
+        vertexCount = (uint32)vertices.size();
+        indexCount = (uint32)indices.size();
+        // 16 bit indices when the mesh is small enough
+        PackedIndices packedIndices = packIndices(indices, std::vector<IndexRange>(1, IndexRange{ 0, (uint32)indices.size(), 0 }));
+        indexSize = packedIndices.indexSize;
+
+        // Generate the buffers, they are deleted with the mesh
+        VAO = GLVertexArray::create();
+        VBO = GLBuffer::create();
+        EBO = GLBuffer::create();
 
         // Bind the Array Object
         glBindVertexArray(VAO);
@@ -43,33 +103,72 @@ public:
         // Bind Vertex Buffer to the Array Object
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
         // Reserve memory and Send data to the Vertex Buffer
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * packed.format.stride, packed.bytes(vertices), GL_STATIC_DRAW);
 
 
         // Bind Element Buffer to the Array Object
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
         // Reserve memory and Send data to the Elment Buffer
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int),
-            &indices[0], GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * indexSize,
+            packedIndices.bytes(indices), GL_STATIC_DRAW);
+
 
 
+        // Set the atribute pointers (positions, normals, texture coords and tangents)
+        setVertexAttributes(packed.format);
 
-        // Set the atribute pointers
-        // vertex positions
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-        // vertex normals
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
-        // vertex texture coords
-        glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uvCoord));
+        if (policy == CPU_DATA_COMPRESSED)
+        {
+            vertexStream = encodeMeshStream(STREAM_VERTICES, packed.bytes(vertices), vertexCount, format.stride);
+            indexStream = encodeMeshStream(STREAM_INDICES, packedIndices.bytes(indices), indexCount, indexSize);
+        }
+        if (policy != CPU_DATA_KEEP)
+        {
+            vertices = std::vector<Vertex>();
+            indices = std::vector<uint32>();
+        }
     }
 
     void draw(Shader& shader)
     {
         glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, (uint32)indices.size(), GL_UNSIGNED_INT, 0);
+        glVertexAttrib4f(POSITION_DEQUANT_LOCATION, dequant.x, dequant.y, dequant.z, dequant.w);
+        glDrawElements(GL_TRIANGLES, indexCount, indexType(indexSize), 0);
+    }
+
+    // Vertices and indices of the mesh from the CPU copy or the compressed copy, empty when it kept neither
+    MeshData readMeshData() const
+    {
+        MeshData data;
+        if (!vertices.empty())
+        {
+            data.vertices = vertices;
+            data.indices = indices;
+        }
+        else if (!vertexStream.empty())
+        {
+            std::vector<unsigned char> packed((size_t)vertexCount * format.stride);
+            std::vector<unsigned char> packedIndices((size_t)indexCount * indexSize);
+            if (!decodeMeshStream(vertexStream.data(), vertexStream.size(), STREAM_VERTICES, packed.data(), vertexCount, format.stride)
+                || !decodeMeshStream(indexStream.data(), indexStream.size(), STREAM_INDICES, packedIndices.data(), indexCount, indexSize))
+            {
+                std::cout << "ERROR::MESH::Corrupted compressed copy" << std::endl;
+                return data;
+            }
+            data.vertices = unpackVertices(packed.data(), vertexCount, format, dequant);
+            data.indices = unpackIndices(packedIndices.data(), indexCount, indexSize, std::vector<IndexRange>(1, IndexRange{ 0, indexCount, 0 }));
+        }
+        return data;
+    }
+
+    uint64 cpuBytes() const
+    {
+        return vertices.capacity() * sizeof(Vertex) + indices.capacity() * sizeof(uint32) + vertexStream.capacity() + indexStream.capacity();
+    }
+
+    uint64 gpuBytes() const
+    {
+        return (uint64)vertexCount * format.stride + (uint64)indexCount * indexSize;
     }
 };
 
@@ -78,13 +177,25 @@ class Model
     std::vector<Mesh> meshes;
     std::string directory;
     std::vector<Material>* materials;
+    const CpuDataPolicy cpuData;
 public:
-    Model(const std::string& path, std::vector<Material>* inMaterials = nullptr)
-        : materials(inMaterials)
+    Model(const std::string& path, std::vector<Material>* inMaterials = nullptr, const CpuDataPolicy inCpuData = CPU_DATA_DISCARD)
+        : materials(inMaterials), cpuData(inCpuData)
     {
         loadModel(path);
     }
 
+    ModelMemory memoryUsage() const
+    {
+        ModelMemory memory = { 0, 0 };
+        for (const Mesh& mesh : meshes)
+        {
+            memory.cpuBytes += mesh.cpuBytes();
+            memory.gpuBytes += mesh.gpuBytes();
+        }
+        return memory;
+    }
+
     void draw(Shader& shader)
     {
         if (materials && (*materials).size() > 0)
@@ -116,6 +227,7 @@ private:
         }
         directory = path.substr(0, path.find_last_of('/'));
 
+        meshes.reserve(scene->mNumMeshes);
         processNode(scene->mRootNode, scene);
     }
     void processNode(aiNode *node, const aiScene *scene)
@@ -136,6 +248,8 @@ private:
     {
         std::vector<Vertex> vertices;
         std::vector<unsigned int> indices;
+        vertices.reserve(mesh->mNumVertices);
+        indices.reserve(mesh->mNumFaces * 3);
 
         for (unsigned int i = 0; i < mesh->mNumVertices; i++)
         {
@@ -167,310 +281,1592 @@ private:
         // process indices
         for (unsigned int i = 0; i < mesh->mNumFaces; i++)
         {
-            aiFace face = mesh->mFaces[i];
+            const aiFace& face = mesh->mFaces[i];
             for (unsigned int j = 0; j < face.mNumIndices; j++)
                 indices.push_back(face.mIndices[j]);
         }
 
-        return Mesh(vertices, indices);
+        return Mesh(std::move(vertices), std::move(indices), VertexLayout(), cpuData);
     }
 };
 
+// What the model drawing a mesh keeps for it between frames
+struct MeshDrawState
+{
+    std::vector<IndexRange> visibleRanges;  // ranges of the meshlets kept by the last cullMeshlets
+    std::vector<char> visibleMeshlets;      // cullMeshlets scratch
+    InstanceRange lodInstances;             // the instances sorted by level by drawLods
+    // drawLods scratch, kept to avoid allocating every frame
+    std::vector<uint32> instanceLods;
+    std::vector<uint32> lodStarts;
+    std::vector<glm::mat4> lodTransforms;
+    std::vector<glm::mat4> lodModels;
+    std::vector<glm::mat3> lodNormals;
+};
+
+/*
+Mesh suballocated from the geometry pool of its vertex format. It only holds the geometry, it can
+be shared by several models: the instance matrices and the culling results come from the caller.
+*/
 class MeshInstanced
 {
-    uint32 VAO; // Vertex Array Object
-    uint32 VBO; // Vertex Buffer Object
-    uint32 EBO; // Elements Buffer Object
-
-    uint32 TBO; // Transforms Buffer Object
-    uint32 MBO; // Models Buffer Object
-    uint32 NBO; // Normal mat Buffer Object
-    bool m_init;
+    // where the vertices and indices are, in the pool shared by the meshes of the same vertex format
+    GeometryRange allocation;
+
+    uint32 vertexCount;
+    uint32 indexCount;
+    uint32 indexSize; // 2 or 4 bytes
+    std::vector<IndexRange> ranges; // Index ranges drawn with their own base vertex
+    // MeshCodec streams of the packed vertices and indices, kept by CPU_DATA_COMPRESSED
+    std::vector<unsigned char> vertexStream;
+    std::vector<unsigned char> indexStream;
+    // Levels from residentLevel to the coarsest are uploaded. The draws lower wantedLevel to the
+    // finest level they would have used, it only asks ModelGeometry::upload for more detail.
+    uint32 residentLevel;
+    mutable uint32 wantedLevel;
+    glm::vec4 dequant; // Position dequantization
 public:
     std::vector<Vertex> vertices;
     std::vector<uint32> indices;
+    std::vector<Meshlet> meshlets; // empty unless imported with ImportOptions::meshlets
+    std::vector<MeshLod> lods; // level 0 is the full mesh, empty when there are no other levels
+    glm::vec4 bounds; // model space bounding sphere (center, radius)
+    glm::vec3 boxMin; // model space bounding box
+    glm::vec3 boxMax;
 public:
-    MeshInstanced(const std::vector<Vertex>& nVertices, const std::vector<uint32>& nIndices)
-        : vertices(nVertices), indices(nIndices), m_init(false)
+    MeshInstanced(const std::vector<Vertex>& nVertices, const std::vector<uint32>& nIndices, const VertexLayout& layout = VertexLayout())
+        : vertices(nVertices), indices(nIndices)
     {
-        // Generate the buffers
-        glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &VBO);
-        glGenBuffers(1, &EBO);
-        glGenBuffers(1, &TBO);
-        glGenBuffers(1, &MBO);
-        glGenBuffers(1, &NBO);
+        PackedVertices packed = packVertices(vertices, layout);
+        PackedIndices packedIndices = packIndices(indices, std::vector<IndexRange>(1, IndexRange{ 0, (uint32)indices.size(), 0 }));
+        upload(packed.bytes(vertices), (uint32)vertices.size(), packed.format, packed.dequant,
+            packedIndices.bytes(indices), (uint32)indices.size(), packedIndices.indexSize, packedIndices.ranges);
+        bounds = boundingSphere(vertices);
+        boundingBox(vertices, boxMin, boxMax);
+    }
 
-        // Bind the Array Object
-        glBindVertexArray(VAO);
+    // Take the arrays and upload the vertices and indices already packed by packVertices and packIndices
+    MeshInstanced(std::vector<Vertex>&& nVertices, std::vector<uint32>&& nIndices, const PackedVertices& packed, const PackedIndices& packedIndices)
+        : vertices(std::move(nVertices)), indices(std::move(nIndices))
+    {
+        upload(packed.bytes(vertices), (uint32)vertices.size(), packed.format, packed.dequant,
+            packedIndices.bytes(indices), (uint32)indices.size(), packedIndices.indexSize, packedIndices.ranges);
+        bounds = boundingSphere(vertices);
+        boundingBox(vertices, boxMin, boxMax);
+    }
 
+    // Upload straight from external memory (e.g. a mapped mesh cache).
+    // No CPU copy is kept so vertices and indices stay empty. Without allocate the mesh gets no pool
+    // space, a progressive mesh is given it level by level with reserveLevel as it streams in.
+    MeshInstanced(const void* vertexData, const uint32 nVertexCount, const VertexFormat& format, const glm::vec4& nDequant,
+        const void* indexData, const uint32 nIndexCount, const uint32 nIndexSize, const std::vector<IndexRange>& nRanges,
+        const bool allocate = true)
+        : bounds(0.0f), boxMin(0.0f), boxMax(0.0f)
+    {
+        upload(vertexData, nVertexCount, format, nDequant, indexData, nIndexCount, nIndexSize, nRanges, allocate);
+    }
 
+    // The pool range is owned by the mesh, it can be moved but not copied
+    MeshInstanced(MeshInstanced&&) = default;
+    MeshInstanced(const MeshInstanced&) = delete;
+    MeshInstanced& operator=(const MeshInstanced&) = delete;
 
-        // Bind Vertex Buffer to the Array Object
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        // Reserve memory and Send data to the Vertex Buffer
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+    // Draw the full mesh, or the finest level uploaded while it streams in, for the first count instances.
+    // It asks for full detail: a progressive mesh drawn this way streams in every level, drawLods only
+    // asks for the levels its instances need.
+    void draw(const InstanceRange& instances, const uint32 count) const
+    {
+        wantedLevel = 0;
+        if (residentLevel >= levelCount())
+            return;
+        const MeshLod drawn = level(residentLevel);
+        drawRanges(instances, ranges, count, drawn.firstIndex, drawn.firstIndex + drawn.indexCount);
+    }
 
+    // Draw only the meshlets kept by the last cullMeshlets of state (everything when there are no meshlets)
+    void drawCulled(const InstanceRange& instances, const uint32 count, const MeshDrawState& state) const
+    {
+        // the meshlets are made of the full level
+        if (meshlets.empty() || residentLevel > 0)
+            draw(instances, count);
+        else
+            drawRanges(instances, state.visibleRanges, count);
+    }
 
-        // Bind Element Buffer to the Array Object
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        // Reserve memory and Send data to the Elment Buffer
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int),
-            &indices[0], GL_STATIC_DRAW);
-
-
-
-        // Set the atribute pointers
-        // vertex positions
-        glEnableVertexAttribArray(0);
-        // vertex normals
-        glEnableVertexAttribArray(1);
-        // vertex texture coords
-        glEnableVertexAttribArray(2);
-		// vertex tangent coords
-		glEnableVertexAttribArray(3);
-
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uvCoord));
-		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, tangent));
-
-        // Transform attribute
-        /*
-        Since glVertexAttribPointer works on the binded buffer we most not forget to bind the buffer
-        */
-        glBindBuffer(GL_ARRAY_BUFFER, TBO);
-
-        // Enable the vertex attributes
-        int attribLocation = 4;
-        glEnableVertexAttribArray(attribLocation + 0);
-        glEnableVertexAttribArray(attribLocation + 1);
-        glEnableVertexAttribArray(attribLocation + 2);
-        glEnableVertexAttribArray(attribLocation + 3);
-        // Set the buffer layout
-        glVertexAttribPointer(attribLocation + 0, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float) * 4, (void*)0);
-        glVertexAttribPointer(attribLocation + 1, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float) * 4, (void*)(sizeof(float) * 4));
-        glVertexAttribPointer(attribLocation + 2, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float) * 4, (void*)(sizeof(float) * 4 * 2));
-        glVertexAttribPointer(attribLocation + 3, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float) * 4, (void*)(sizeof(float) * 4 * 3));
-        // Set the attributes per instance
-        glVertexAttribDivisor(attribLocation + 0, 1);
-        glVertexAttribDivisor(attribLocation + 1, 1);
-        glVertexAttribDivisor(attribLocation + 2, 1);
-        glVertexAttribDivisor(attribLocation + 3, 1);
-        
-        attribLocation += 4;
-        glEnableVertexAttribArray(attribLocation + 0);
-        glEnableVertexAttribArray(attribLocation + 1);
-        glEnableVertexAttribArray(attribLocation + 2);
-        glEnableVertexAttribArray(attribLocation + 3);
-        glBindBuffer(GL_ARRAY_BUFFER, MBO);
-        glVertexAttribPointer(attribLocation + 0, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float) * 4, (void*)0);
-        glVertexAttribPointer(attribLocation + 1, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float) * 4, (void*)(sizeof(float) * 4));
-        glVertexAttribPointer(attribLocation + 2, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float) * 4, (void*)(sizeof(float) * 4 * 2));
-        glVertexAttribPointer(attribLocation + 3, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float) * 4, (void*)(sizeof(float) * 4 * 3));
-        // Set the attributes per instance
-        glVertexAttribDivisor(attribLocation + 0, 1);
-        glVertexAttribDivisor(attribLocation + 1, 1);
-        glVertexAttribDivisor(attribLocation + 2, 1);
-        glVertexAttribDivisor(attribLocation + 3, 1);
-
-        attribLocation += 4;
-        glEnableVertexAttribArray(attribLocation + 0);
-        glEnableVertexAttribArray(attribLocation + 1);
-        glEnableVertexAttribArray(attribLocation + 2);
-        glBindBuffer(GL_ARRAY_BUFFER, NBO);
-        glVertexAttribPointer(attribLocation + 0, 4, GL_FLOAT, GL_FALSE, 9 * sizeof(float) * 4, (void*)0);
-        glVertexAttribPointer(attribLocation + 1, 4, GL_FLOAT, GL_FALSE, 9 * sizeof(float) * 4, (void*)(sizeof(float) * 4));
-        glVertexAttribPointer(attribLocation + 2, 4, GL_FLOAT, GL_FALSE, 9 * sizeof(float) * 4, (void*)(sizeof(float) * 4 * 2));
-        // Set the attributes per instance
-        glVertexAttribDivisor(attribLocation + 0, 1);
-        glVertexAttribDivisor(attribLocation + 1, 1);
-        glVertexAttribDivisor(attribLocation + 2, 1);
-        glVertexAttribDivisor(attribLocation + 3, 1);
-    }
-
-    void draw(const uint32 count) const
+    // Cull the meshlets against the camera for the count instances with the given model matrices, the result is kept in state.
+    // Returns the number of triangles that drawCulled will submit.
+    uint32 cullMeshlets(const glm::mat4& PV, const glm::vec3& cameraPos, const uint32 count, const glm::mat4* models, MeshDrawState& state) const
     {
-        glBindVertexArray(VAO);
-        glDrawElementsInstanced(GL_TRIANGLES, (uint32)indices.size(), GL_UNSIGNED_INT, NULL, count);
+        if (meshlets.empty())
+            return level(0).indexCount / 3;
+        return ::cullMeshlets(meshlets, PV, cameraPos, count, models, state.visibleRanges, state.visibleMeshlets);
     }
 
-    void setTransforms(const uint32 count, const glm::mat4* matrices, const unsigned char type)
+    MeshLod level(const uint32 index) const
+    {
+        return lods.empty() ? MeshLod{ 0, indexCount, 0.0f, vertexCount } : lods[index];
+    }
+
+    uint32 levelCount() const
+    {
+        return lods.empty() ? 1 : (uint32)lods.size();
+    }
+
+    // Coarsest level whose error projects to at most pixelError pixels.
+    // pixelScale is viewportHeight * 0.5 * projection[1][1].
+    uint32 selectLod(const glm::mat4& model, const glm::vec3& cameraPos, const float pixelScale, const float pixelError) const
+    {
+        glm::vec3 center = glm::vec3(model * glm::vec4(glm::vec3(bounds), 1.0f));
+        float scale = std::sqrt(std::max(glm::dot(glm::vec3(model[0]), glm::vec3(model[0])),
+            std::max(glm::dot(glm::vec3(model[1]), glm::vec3(model[1])), glm::dot(glm::vec3(model[2]), glm::vec3(model[2])))));
+        float distance = glm::length(center - cameraPos) - bounds.w * scale;
+        if (distance <= 0.0f)
+            return 0;
+
+        uint32 selected = 0;
+        for (uint32 i = 1; i < levelCount(); i++)
+        {
+            if (lods[i].error * scale / distance * pixelScale > pixelError)
+                break;
+            selected = i;
+        }
+        return selected;
+    }
+
+    /*
+    Pick the level of every instance, upload the instances grouped by level to state.lodInstances and
+    draw each level with one call. Meshes without levels draw the instances as they are.
+    */
+    void drawLods(const InstanceRange& instances, const glm::vec3& cameraPos, const float pixelScale, const float pixelError,
+        const uint32 count, const glm::mat4* transforms, const glm::mat4* models, const glm::mat3* normalMats, MeshDrawState& state) const
     {
-        switch (type)
+        const uint32 levels = levelCount();
+        if (residentLevel >= levels)
+            return;
+        if (levels == 1)
         {
-        case 0:
-            glBindBuffer(GL_ARRAY_BUFFER, TBO);
-            break;
-        case 1:
-            glBindBuffer(GL_ARRAY_BUFFER, MBO);
-            break;
-        default: return;
+            draw(instances, count);
+            return;
         }
 
+        std::vector<uint32>& instanceLods = state.instanceLods;
+        std::vector<uint32>& lodStarts = state.lodStarts;
+        std::vector<glm::mat4>& lodTransforms = state.lodTransforms;
+        std::vector<glm::mat4>& lodModels = state.lodModels;
+        std::vector<glm::mat3>& lodNormals = state.lodNormals;
+
+        // counting sort of the instances by level
+        instanceLods.resize(count);
+        lodStarts.assign(levels + 1, 0);
+        for (uint32 i = 0; i < count; i++)
+        {
+            // levels still streaming in are replaced by the finest one uploaded
+            const uint32 selected = selectLod(models[i], cameraPos, pixelScale, pixelError);
+            wantedLevel = std::min(wantedLevel, selected);
+            instanceLods[i] = std::max(selected, residentLevel);
+            lodStarts[instanceLods[i] + 1]++;
+        }
+        for (uint32 l = 0; l < levels; l++)
+            lodStarts[l + 1] += lodStarts[l];
 
+        lodTransforms.resize(count);
+        lodModels.resize(count);
+        lodNormals.resize(count);
+        for (uint32 i = 0; i < count; i++)
+        {
+            uint32 slot = lodStarts[instanceLods[i]]++;
+            lodTransforms[slot] = transforms[i];
+            lodModels[slot] = models[i];
+            lodNormals[slot] = normalMats[i];
+        }
+        // the sort moved every start to the next level
+        for (uint32 l = levels; l > 0; l--)
+            lodStarts[l] = lodStarts[l - 1];
+        lodStarts[0] = 0;
 
-        int currentSize;
-        int size = count * 16 * sizeof(float);
-        // get the binded buffer size
-        glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &currentSize);
-        if (currentSize < size)
-            glBufferData(GL_ARRAY_BUFFER, size, matrices, GL_DYNAMIC_DRAW);
-        else
-            glBufferSubData(GL_ARRAY_BUFFER, 0,  size, matrices);
+        state.lodInstances.setTransforms(count, lodTransforms.data(), 0);
+        state.lodInstances.setTransforms(count, lodModels.data(), 1);
+        state.lodInstances.setTransforms(count, lodNormals.data());
+
+        for (uint32 l = 0; l < levels; l++)
+        {
+            const uint32 levelInstances = lodStarts[l + 1] - lodStarts[l];
+            if (levelInstances == 0)
+                continue;
+            // the level starts at its first instance in the range
+            drawRanges(state.lodInstances, ranges, levelInstances, lods[l].firstIndex, lods[l].firstIndex + lods[l].indexCount, lodStarts[l]);
+        }
     }
 
-    void setTransforms(const uint32 count, const glm::mat3* matrices)
+    // Fill part of the vertices of the mesh, offset and size in bytes
+    void uploadVertices(const uint64 offset, const uint64 size, const void* data)
+    {
+        allocation.pool->uploadVertices((uint64)allocation.firstVertex * allocation.pool->format.stride + offset, size, data);
+    }
+
+    // Fill part of the indices of the mesh, offset and size in bytes
+    void uploadIndices(const uint64 offset, const uint64 size, const void* data)
+    {
+        allocation.pool->uploadIndices(allocation.indexOffset + offset, size, data);
+    }
+
+    // Give the space back to the pool, the mesh can't be drawn after this
+    void release()
+    {
+        allocation.reset();
+    }
+
+    const GeometryPool* getPool() const
+    {
+        return allocation.pool;
+    }
+
+    uint32 getIndexSize() const
     {
-        int currentSize;
-        int size = count * 9 * sizeof(float);
-        glBindBuffer(GL_ARRAY_BUFFER, NBO);
-        
-        // get the binded buffer size
-        glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &currentSize);
-        if (currentSize < size)
-            glBufferData(GL_ARRAY_BUFFER, size, matrices, GL_DYNAMIC_DRAW);
+        return indexSize;
+    }
+
+    // Pool space for the levels from level to the coarsest one of a progressive mesh, the ones already there are kept
+    void reserveLevel(const uint32 level)
+    {
+        const MeshLod lod = this->level(level);
+        allocation.extend(lod.vertexCount, (uint64)(lod.firstIndex + lod.indexCount) * indexSize);
+    }
+
+    // Nothing is uploaded yet, the levels will come from the coarsest one
+    void startStreaming()
+    {
+        residentLevel = levelCount();
+        wantedLevel = levelCount() - 1;
+    }
+
+    uint32 getResidentLevel() const
+    {
+        return residentLevel;
+    }
+
+    void setResidentLevel(const uint32 level)
+    {
+        residentLevel = level;
+    }
+
+    uint32 getWantedLevel() const
+    {
+        return wantedLevel;
+    }
+
+    /*
+    Vertices and full detail indices (absolute, the ranges base vertex added) of the mesh.
+    Taken from the CPU copy, else from the compressed copy, else read back from the pool buffers (GL thread only).
+    The readback is a glGetBufferSubData of the whole mesh: the driver waits for every queued command
+    using the pool before copying, one stall per mesh. Geometry read this way often (static batches,
+    HLOD proxies) should be imported with CPU_DATA_KEEP or CPU_DATA_COMPRESSED.
+    */
+    MeshData readMeshData() const
+    {
+        const MeshLod full = level(0);
+        MeshData data;
+        if (!vertices.empty())
+        {
+            data.vertices.assign(vertices.begin(), vertices.begin() + std::min(full.vertexCount, (uint32)vertices.size()));
+            data.indices.assign(indices.begin() + full.firstIndex, indices.begin() + full.firstIndex + full.indexCount);
+            return data;
+        }
+
+        const GeometryPool* pool = allocation.pool;
+        std::vector<unsigned char> packed((size_t)vertexCount * pool->format.stride);
+        std::vector<unsigned char> packedIndices((size_t)indexCount * indexSize);
+        if (!vertexStream.empty())
+        {
+            if (!decodeMeshStream(vertexStream.data(), vertexStream.size(), STREAM_VERTICES, packed.data(), vertexCount, pool->format.stride)
+                || !decodeMeshStream(indexStream.data(), indexStream.size(), STREAM_INDICES, packedIndices.data(), indexCount, indexSize))
+                std::cout << "ERROR::MESH::Corrupted compressed copy" << std::endl;
+        }
         else
-            glBufferSubData(GL_ARRAY_BUFFER, 0, size, matrices);
+        {
+            glBindBuffer(GL_COPY_READ_BUFFER, pool->VBO);
+            glGetBufferSubData(GL_COPY_READ_BUFFER, (GLintptr)allocation.firstVertex * pool->format.stride, (GLsizeiptr)packed.size(), packed.data());
+            glBindBuffer(GL_COPY_READ_BUFFER, pool->EBO);
+            glGetBufferSubData(GL_COPY_READ_BUFFER, (GLintptr)allocation.indexOffset, (GLsizeiptr)packedIndices.size(), packedIndices.data());
+        }
+
+        data.vertices = unpackVertices(packed.data(), vertexCount, pool->format, dequant);
+        data.indices = unpackIndices(packedIndices.data(), indexCount, indexSize, ranges);
+        data.indices.erase(data.indices.begin() + full.firstIndex + full.indexCount, data.indices.end());
+        data.indices.erase(data.indices.begin(), data.indices.begin() + full.firstIndex);
+        return data;
+    }
+
+    /*
+    Keep the CPU side data the policy asks for, the vertices and indices stay on the GPU either way.
+    CPU_DATA_COMPRESSED keeps the given streams, encodeMeshStream of the packed bytes that were uploaded.
+    */
+    void retain(const CpuDataPolicy policy, std::vector<unsigned char>&& nVertexStream = std::vector<unsigned char>(),
+        std::vector<unsigned char>&& nIndexStream = std::vector<unsigned char>())
+    {
+        if (policy == CPU_DATA_KEEP)
+            return;
+        vertices = std::vector<Vertex>();
+        indices = std::vector<uint32>();
+        vertexStream = std::move(nVertexStream);
+        indexStream = std::move(nIndexStream);
+        if (policy == CPU_DATA_DISCARD)
+            vertexStream = indexStream = std::vector<unsigned char>();
+    }
+
+    // Bytes held in RAM by the mesh
+    uint64 cpuBytes() const
+    {
+        return vertices.capacity() * sizeof(Vertex) + indices.capacity() * sizeof(uint32)
+            + vertexStream.capacity() + indexStream.capacity()
+            + meshlets.capacity() * sizeof(Meshlet) + lods.capacity() * sizeof(MeshLod)
+            + ranges.capacity() * sizeof(IndexRange);
+    }
+
+    // Bytes of the pool buffers used by the mesh
+    uint64 gpuBytes() const
+    {
+        const uint64 vertexBytes = allocation.pool ? (uint64)allocation.vertexCount * allocation.pool->format.stride : 0;
+        return vertexBytes + allocation.indexBytes;
+    }
+
+private:
+    // Draw the ranges clipped to the indices [first, end), with the instances from firstInstance
+    void drawRanges(const InstanceRange& instances, const std::vector<IndexRange>& drawn, const uint32 count,
+        const uint32 first = 0, const uint32 end = 0xFFFFFFFFu, const uint32 firstInstance = 0) const
+    {
+        const uint32 baseInstance = allocation.pool->bind(instances.getFirst() + firstInstance);
+        glVertexAttrib4f(POSITION_DEQUANT_LOCATION, dequant.x, dequant.y, dequant.z, dequant.w);
+        for (const IndexRange& range : drawn)
+        {
+            const uint32 start = std::max(range.firstIndex, first);
+            const uint32 stop = std::min(range.firstIndex + range.indexCount, end);
+            if (start >= stop)
+                continue;
+            // the mesh is somewhere in the pool buffers
+            void* offset = (void*)(size_t)(allocation.indexOffset + (uint64)start * indexSize);
+            if (baseInstance)
+                glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, stop - start, indexType(indexSize), offset, count,
+                    allocation.firstVertex + range.baseVertex, baseInstance);
+            else
+                glDrawElementsInstancedBaseVertex(GL_TRIANGLES, stop - start, indexType(indexSize), offset, count, allocation.firstVertex + range.baseVertex);
+        }
+    }
+
+    void upload(const void* vertexData, const uint32 nVertexCount, const VertexFormat& format, const glm::vec4& nDequant,
+        const void* indexData, const uint32 nIndexCount, const uint32 nIndexSize, const std::vector<IndexRange>& nRanges,
+        const bool allocate = true)
+    {
+        vertexCount = nVertexCount;
+        indexCount = nIndexCount;
+        indexSize = nIndexSize;
+        ranges = nRanges;
+        dequant = nDequant;
+
+        // Suballocate the vertices and indices in the pool of the vertex format
+        allocation = GeometryRange(GeometryArena::shared().pool(format), allocate ? nVertexCount : 0, allocate ? (uint64)indexCount * indexSize : 0);
+        if (vertexData)
+            uploadVertices(0, (uint64)nVertexCount * format.stride, vertexData);
+        if (indexData)
+            uploadIndices(0, (uint64)indexCount * indexSize, indexData);
+        residentLevel = wantedLevel = 0;
     }
 };
 
-class ModelInstanced
+// Processing applied to the imported meshes. It is part of the mesh cache key.
+struct ImportOptions
 {
-    std::vector<MeshInstanced> meshes;
+    bool weld = true;
+    WeldSettings weldSettings;
+    // reorder triangles and vertices for the vertex cache, overdraw and vertex fetch
+    bool optimize = false;
+    float overdrawThreshold = 1.05f;
+    // packed vertex layout, octahedral normals need the shaders built with OCTAHEDRAL_NORMALS_DEFINE
+    VertexLayout layout;
+    // 16 bit indices for meshes with up to 65536 vertices, bigger ones can be split in 16 bit ranges
+    bool shortIndices = true;
+    bool splitLargeMeshes = false;
+    // split the meshes in meshlets with bounds and normal cones for cullMeshlets
+    bool meshlets = false;
+    // levels of detail for drawLods, each with about lodReduction times the triangles of the previous one
+    uint32 lodCount = 1;
+    float lodReduction = 0.5f;
+    float lodMaxError = 0.05f; // relative to the mesh size
+    // store the levels coarsest first and upload the base level before the refinements (see makeProgressive),
+    // the finer levels are streamed in when a draw needs them. Needs lodCount > 1, large meshes are not split.
+    bool progressive = false;
+    // merge the meshes in one, drawn in a single call with a MaterialArray (every vertex keeps the index of its mesh as its layer)
+    bool mergeMeshes = false;
+    // read .obj files with the native reader instead of Assimp
+    bool nativeObj = true;
+    // write the mesh cache with compressed vertices and indices (MeshCodec)
+    bool compressCache = false;
+    // MESH_CODEC_SMALL makes the compressed cache smaller but several times slower to open
+    MeshCodecLevel cacheCodec = MESH_CODEC_FAST;
+    // CPU side data kept by the meshes after their upload, not part of the cache key
+    CpuDataPolicy cpuData = CPU_DATA_DISCARD;
+    // print the weld, optimize, pack, meshlet and lod statistics of every mesh, not part of the cache key
+    bool verbose = false;
+
+    uint64 hash() const
+    {
+        const float values[] =
+        {
+            weld ? 1.0f : 0.0f,
+            weldSettings.positionEpsilon, weldSettings.normalEpsilon,
+            weldSettings.uvEpsilon, weldSettings.tangentEpsilon,
+            optimize ? 1.0f : 0.0f, overdrawThreshold,
+            (float)layout.normals, layout.halfUVs ? 1.0f : 0.0f, layout.quantizePositions ? 1.0f : 0.0f,
+            shortIndices ? 1.0f : 0.0f, splitLargeMeshes ? 1.0f : 0.0f,
+            meshlets ? 1.0f : 0.0f,
+            (float)lodCount, lodReduction, lodMaxError, progressive ? 1.0f : 0.0f,
+            nativeObj ? 1.0f : 0.0f,
+            compressCache ? 1.0f : 0.0f, (float)cacheCodec,
+            mergeMeshes ? 1.0f : 0.0f
+        };
+        return hashBytes((const unsigned char*)values, sizeof(values));
+    }
+};
+
+// Bytes uploaded at most by one ModelGeometry::upload step, so a big mesh is spread over several frames
+#define MODEL_UPLOAD_SLICE_SIZE (256 * 1024)
+
+/*
+GPU geometry of an imported model, shared through the ModelRegistry by every ModelInstanced
+created from the same file and import options. The GL objects are deleted with it, so the
+last reference has to go away on the GL thread.
+Loading is split in import (file reading and mesh processing, any thread) and upload (GL thread),
+so the ModelLoader can import on the workers and upload a slice per frame.
+*/
+class ModelGeometry
+{
+    // Imported mesh waiting for its upload
+    struct PendingMesh
+    {
+        MeshData data;
+        PackedVertices packed;
+        PackedIndices packedIndices;
+        std::vector<Meshlet> meshlets;
+        std::vector<MeshLod> lods;
+        glm::vec4 bounds;
+        glm::vec3 boxMin;
+        glm::vec3 boxMax;
+    };
+
     std::string directory;
-    std::vector<Material>* materials;
-	const std::string name;
+    const std::string name;
+    const VertexFormat format;
+    // mapped while the meshes read from it are uploaded, opened again on the pool when a draw asks for a refinement
+    MeshCache cache;
+    std::string cacheFile;
+    uint64 cacheSourceHash;
+    uint64 cacheSourceSize;
+    bool cached;                        // the cache file matches the import, refinements are read from it
+    std::future<MeshCache> reopening;   // the cache opened again on the pool, moved into cache once ready
+    std::vector<PendingMesh> pending;   // imported meshes when there was no cache, until their base level is uploaded
+    uint32 meshCount;
+    // CPU copies the meshes keep after their upload (ImportOptions::cpuData), made by import
+    std::vector<MeshData> keptData;                             // CPU_DATA_KEEP of the meshes read from the cache
+    std::vector<std::vector<unsigned char>> keptVertexStreams;  // CPU_DATA_COMPRESSED
+    std::vector<std::vector<unsigned char>> keptIndexStreams;
+    bool failed;
+    // upload progress, GL thread only
+    uint32 baseMeshes;                  // meshes with their base level (everything when not progressive) uploaded
+    std::vector<uint64> chunkProgress;  // bytes uploaded of the level each mesh is receiving
+    bool ready;                         // every mesh can be drawn
+    bool complete;                      // every level of every mesh is uploaded
+    bool uploadAll;                     // upload the refinements even when no draw asked for them
+    std::promise<void> importedPromise;
+    std::shared_future<void> importedFuture;
+    std::promise<bool> loadedPromise;
+    std::shared_future<bool> loadedFuture;
 public:
-    ModelInstanced(const std::string& path, std::vector<Material>* inMaterials = nullptr, const std::string& inName="mesh")
-        : materials(inMaterials), name(inName)
+    const std::string path;
+    const ImportOptions options;
+    std::vector<MeshInstanced> meshes;  // only complete once isReady
+
+    // Nothing is loaded until import and upload (or finish) are called
+    ModelGeometry(const std::string& inPath, const ImportOptions& inOptions = ImportOptions(), const std::string& inName = "mesh")
+        : name(inName), format(makeVertexFormat(inOptions.layout)), cacheSourceHash(0), cacheSourceSize(0), cached(false), meshCount(0),
+        failed(false), baseMeshes(0), ready(false), complete(false), uploadAll(false),
+        importedFuture(importedPromise.get_future().share()), loadedFuture(loadedPromise.get_future().share()),
+        path(inPath), options(inOptions)
+    {
+    }
+
+    ~ModelGeometry()
+    {
+        // the task reopening the cache reads cacheFile and format
+        if (reopening.valid())
+            reopening.wait();
+    }
+
+    // the GL objects are owned by a single geometry
+    ModelGeometry(const ModelGeometry&) = delete;
+    ModelGeometry& operator=(const ModelGeometry&) = delete;
+
+    // Read the model from its cache or import it. Call it once, from any thread.
+    void import()
     {
         loadModel(path);
+        meshCount = failed ? 0 : (cache.meshCount() ? cache.meshCount() : (uint32)pending.size());
+        prepareKeptData();
+        importedPromise.set_value();
     }
 
-    void draw(Shader& shader, const uint32 count)
+    bool isImported() const
     {
-        if (materials && materials->size() > 0)
-            for (uint32 i = 0; i < meshes.size(); i++)
-            {
-                if ((*materials)[i].diffuse)
-                    (*materials)[i].diffuse->bind(0);
-				if ((*materials)[i].specular)
-                    (*materials)[i].specular->bind(1);
-				/*
-				if ((*materials)[i].normal)
-					(*materials)[i].normal->bind(2);
-				*/
+        return importedFuture.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
 
-				//shader.setFloat("material.shininess", (*materials)[i].shininess);
-                meshes[i].draw(count);
-            }
-        else
-            for (uint32 i = 0; i < meshes.size(); i++)
+    /*
+    Upload at most maxBytes more of the imported meshes, GL thread only.
+    The model is ready once every mesh has its base level. Progressive meshes then get their
+    refinement chunks when a draw asks for a finer level than they have. Nothing of a mesh stays in
+    RAM after its base level (but the copy asked by ImportOptions::cpuData): the cache is closed
+    whenever no draw waits for a refinement and mapped again when one does.
+    Returns true once everything is uploaded (or the import failed), false when there is more
+    to upload or the import is not done yet.
+    */
+    bool upload(const uint64 maxBytes)
+    {
+        if (complete)
+            return true;
+        if (!isImported())
+            return false;
+
+        uint64 budget = maxBytes;
+        chunkProgress.resize(meshCount, 0);
+        while (baseMeshes < meshCount)
+        {
+            // create the buffers, the data is sent in slices
+            if (meshes.size() == baseMeshes)
+                meshes.push_back(createMesh(baseMeshes));
+            if (!uploadLevel(baseMeshes, budget))
+                return false;
+            baseMeshes++;
+        }
+        if (!ready)
+        {
+            ready = true;
+            loadedPromise.set_value(!failed);
+        }
+
+        if (refinementWanted())
+        {
+            // the pending meshes were dropped once the cache was written
+            if (cached && !cache.meshCount() && !reopenCache())
+                return complete;
+            for (uint32 i = 0; i < meshCount; i++)
             {
-                meshes[i].draw(count);
+                MeshInstanced& mesh = meshes[i];
+                while (mesh.getResidentLevel() > 0 && (uploadAll || mesh.getWantedLevel() < mesh.getResidentLevel()))
+                    if (!uploadLevel(i, budget))
+                        return false;
             }
+        }
+
+        // the rest is read again from the cache when a draw needs it
+        cache.close();
+        for (const MeshInstanced& mesh : meshes)
+            if (mesh.getResidentLevel() > 0)
+                return false;
+
+        pending = std::vector<PendingMesh>();
+        keptData = std::vector<MeshData>();
+        keptVertexStreams = keptIndexStreams = std::vector<std::vector<unsigned char>>();
+        complete = true;
+        return true;
     }
 
-    void setTransforms(const uint32 count, const glm::mat4* matrices, const unsigned char type)
+    // There is something upload can send now
+    bool wantsUpload() const
     {
-        for (auto mesh : meshes)
-        {
-            mesh.setTransforms(count, matrices, type);
-        }
+        if (complete || !isImported())
+            return false;
+        return !ready || refinementWanted();
     }
 
-    void setTransforms(const uint32 count, const glm::mat3* matrices)
+    // Upload every level even when no draw asks for it (e.g. to read the meshes back)
+    void requestAll()
+    {
+        uploadAll = true;
+    }
+
+    // Wait for the import and upload everything left, GL thread only
+    void finish()
+    {
+        importedFuture.wait();
+        uploadAll = true;
+        while (!upload(~0ull))
+            if (reopening.valid())
+                reopening.wait();
+    }
+
+    // Every level of every mesh is uploaded
+    bool isComplete() const
+    {
+        return complete;
+    }
+
+    // Every mesh can be drawn, progressive meshes may only have some of their levels
+    bool isReady() const
+    {
+        return ready;
+    }
+
+    // RAM and GPU bytes of the uploaded meshes, GL thread only
+    ModelMemory memoryUsage() const
     {
-        for (auto mesh : meshes)
+        ModelMemory memory = { 0, 0 };
+        for (const MeshInstanced& mesh : meshes)
         {
-            mesh.setTransforms(count, matrices);
+            memory.cpuBytes += mesh.cpuBytes();
+            memory.gpuBytes += mesh.gpuBytes();
         }
+        return memory;
     }
 
-    MeshInstanced& getMesh(const uint32 index)
+    const std::string& getName() const
+    {
+        return name;
+    }
+
+    // Set once the model is uploaded, to false if it could not be loaded
+    std::shared_future<bool> loaded() const
     {
-        return meshes[index];
+        return loadedFuture;
     }
+
 private:
+    // A mesh has levels to upload that a draw asked for (or requestAll)
+    bool refinementWanted() const
+    {
+        for (const MeshInstanced& mesh : meshes)
+            if (mesh.getResidentLevel() > 0 && (uploadAll || mesh.getWantedLevel() < mesh.getResidentLevel()))
+                return true;
+        return false;
+    }
+
+    /*
+    Map the cache again on the pool, true once it is open. The task opens a MeshCache of its own,
+    cache is only replaced here on the GL thread once the future is ready. The streaming stops if
+    the file is gone.
+    */
+    bool reopenCache()
+    {
+        if (!reopening.valid())
+            reopening = ThreadPool::shared().submit([this]()
+            {
+                MeshCache opened;
+                opened.open(cacheFile, cacheSourceHash, cacheSourceSize, format.stride);
+                return opened;
+            });
+        if (reopening.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return false;
+        cache = reopening.get();
+        if (cache.meshCount())
+            return true;
+
+        std::cout << "ERROR::MODEL::Could not open " << cacheFile << " again, " << path << " keeps its coarse levels" << std::endl;
+        cached = false;
+        complete = true;
+        return false;
+    }
+
     void loadModel(const std::string& path)
     {
-        Assimp::Importer import;
-        const aiScene *scene = import.ReadFile(path, 
-			  aiProcess_Triangulate
-			| aiProcess_CalcTangentSpace
-			| aiProcess_FlipUVs
-			| aiProcess_GenSmoothNormals
-		);
+        directory = path.substr(0, path.find_last_of('/'));
 
-        if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
+        // hash the source so a modified model invalidates the cache
+        uint64 sourceHash = 0;
+        uint64 sourceSize = 0;
         {
-            std::cout << "ERROR::ASSIMP::" << import.GetErrorString() << std::endl;
+            MappedFile source;
+            if (source.open(path))
+            {
+                sourceHash = hashBytes(source.data(), source.size()) ^ (options.hash() * 0x9E3779B97F4A7C15ull);
+                sourceSize = source.size();
+            }
+        }
+
+        // the meshes are uploaded straight from the mapped cache file
+        const std::string cachePath = MeshCache::pathFor(path, options.hash());
+        cacheFile = cachePath;
+        cacheSourceHash = sourceHash;
+        cacheSourceSize = sourceSize;
+        if (sourceSize && cache.open(cachePath, sourceHash, sourceSize, format.stride))
+        {
+            cached = true;
             return;
         }
-        directory = path.substr(0, path.find_last_of('/'));
 
-        processNode(scene->mRootNode, scene);
+        importModel(path, sourceSize ? cachePath : std::string(), sourceHash, sourceSize);
     }
-    void processNode(aiNode *node, const aiScene *scene)
+
+    // Make the CPU copies asked by options.cpuData that upload can't take from the pending meshes
+    void prepareKeptData()
     {
-        // process all the node's meshes (if any)
-        for (unsigned int i = 0; i < node->mNumMeshes; i++)
+        if (options.cpuData == CPU_DATA_KEEP && cache.meshCount())
         {
-            aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
-            meshes.push_back(processMesh(mesh, scene));
+            keptData.resize(meshCount);
+            ThreadPool::shared().parallelFor(meshCount, [&](const uint32 i)
+            {
+                MeshCacheView view = cache.mesh(i);
+                std::vector<IndexRange> meshRanges(view.ranges, view.ranges + view.rangeCount);
+                glm::vec4 meshDequant(view.dequant[0], view.dequant[1], view.dequant[2], view.dequant[3]);
+                keptData[i].vertices = unpackVertices(view.vertices, view.vertexCount, format, meshDequant);
+                keptData[i].indices = unpackIndices(view.indices, view.indexCount, view.indexSize, meshRanges);
+            });
         }
-        // then do the same for each of its children
-        for (unsigned int i = 0; i < node->mNumChildren; i++)
+        else if (options.cpuData == CPU_DATA_COMPRESSED)
         {
-            processNode(node->mChildren[i], scene);
+            keptVertexStreams.resize(meshCount);
+            keptIndexStreams.resize(meshCount);
+            for (uint32 i = 0; i < meshCount; i++)
+            {
+                const unsigned char* vertexData;
+                const unsigned char* indexData;
+                uint64 vertexBytes;
+                uint64 indexBytes;
+                meshBytes(i, vertexData, vertexBytes, indexData, indexBytes);
+                const uint32 indexSize = cache.meshCount() ? cache.mesh(i).indexSize : pending[i].packedIndices.indexSize;
+                keptVertexStreams[i] = encodeMeshStream(STREAM_VERTICES, vertexData, (uint32)(vertexBytes / format.stride), format.stride);
+                keptIndexStreams[i] = encodeMeshStream(STREAM_INDICES, indexData, (uint32)(indexBytes / indexSize), indexSize);
+            }
         }
     }
-    MeshInstanced processMesh(aiMesh *mesh, const aiScene *scene)
-    {
-        std::vector<Vertex> vertices;
-        std::vector<unsigned int> indices;
 
-        for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+    // Mesh with its buffers allocated but not filled
+    MeshInstanced createMesh(const uint32 index)
+    {
+        if (cache.meshCount())
         {
-            Vertex vertex;
-            // process vertex positions, normals and texture coordinates
-            glm::vec3 vector;
-            vector.x = mesh->mVertices[i].x;
-            vector.y = mesh->mVertices[i].y;
-            vector.z = mesh->mVertices[i].z;
-            vertex.pos = vector;
+            MeshCacheView view = cache.mesh(index);
+            glm::vec4 meshDequant(view.dequant[0], view.dequant[1], view.dequant[2], view.dequant[3]);
+            std::vector<IndexRange> meshRanges(view.ranges, view.ranges + view.rangeCount);
+            MeshInstanced mesh(nullptr, view.vertexCount, format, meshDequant, nullptr, view.indexCount, view.indexSize, meshRanges,
+                !(options.progressive && view.lodCount > 1));
+            mesh.meshlets.assign(view.meshlets, view.meshlets + view.meshletCount);
+            mesh.lods.assign(view.lods, view.lods + view.lodCount);
+            mesh.bounds = glm::vec4(view.bounds[0], view.bounds[1], view.bounds[2], view.bounds[3]);
+            mesh.boxMin = glm::vec3(view.box[0], view.box[1], view.box[2]);
+            mesh.boxMax = glm::vec3(view.box[3], view.box[4], view.box[5]);
+            mesh.startStreaming();
+            return mesh;
+        }
 
-            vector.x = mesh->mNormals[i].x;
-            vector.y = mesh->mNormals[i].y;
-            vector.z = mesh->mNormals[i].z;
-            vertex.normal = vector;
+        PendingMesh& source = pending[index];
+        MeshInstanced mesh(nullptr, (uint32)source.data.vertices.size(), source.packed.format, source.packed.dequant,
+            nullptr, (uint32)source.data.indices.size(), source.packedIndices.indexSize, source.packedIndices.ranges,
+            !(options.progressive && source.lods.size() > 1));
+        mesh.meshlets = std::move(source.meshlets);
+        mesh.lods = std::move(source.lods);
+        mesh.bounds = source.bounds;
+        mesh.boxMin = source.boxMin;
+        mesh.boxMax = source.boxMax;
+        mesh.startStreaming();
+        return mesh;
+    }
 
-			vector.x = mesh->mTangents[i].x;
-			vector.y = mesh->mTangents[i].y;
-			vector.z = mesh->mTangents[i].z;
-			vertex.tangent = vector;
+    /*
+    Upload the next level of a mesh within the budget, true once it is complete.
+    A level of a progressive mesh is the vertices it adds to the coarser levels and its indices, given
+    their pool space when they arrive; any other mesh is sent whole as its level 0.
+    */
+    bool uploadLevel(const uint32 index, uint64& budget)
+    {
+        MeshInstanced& mesh = meshes[index];
+        const unsigned char* vertexData;
+        const unsigned char* indexData;
+        uint64 vertexBytes;
+        uint64 indexBytes;
+        meshBytes(index, vertexData, vertexBytes, indexData, indexBytes);
 
-            if (mesh->mTextureCoords[0]) // does the mesh contain texture coordinates?
+        const bool base = mesh.getResidentLevel() == mesh.levelCount();
+        uint32 level = 0;
+        uint64 vertexBegin = 0;
+        uint64 vertexEnd = vertexBytes;
+        uint64 indexBegin = 0;
+        uint64 indexEnd = indexBytes;
+        if (options.progressive && mesh.levelCount() > 1)
+        {
+            level = mesh.getResidentLevel() - 1;
+            const MeshLod lod = mesh.level(level);
+            vertexBegin = level + 1 < mesh.levelCount() ? (uint64)mesh.level(level + 1).vertexCount * format.stride : 0;
+            vertexEnd = (uint64)lod.vertexCount * format.stride;
+            indexBegin = (uint64)lod.firstIndex * mesh.getIndexSize();
+            indexEnd = indexBegin + (uint64)lod.indexCount * mesh.getIndexSize();
+            mesh.reserveLevel(level);
+        }
+
+        uint64& uploaded = chunkProgress[index];
+        const uint64 vertexSize = vertexEnd - vertexBegin;
+        const uint64 levelSize = vertexSize + indexEnd - indexBegin;
+        while (uploaded < levelSize)
+        {
+            if (budget == 0)
+                return false;
+            uint64 size;
+            if (uploaded < vertexSize)
             {
-                glm::vec2 vec;
-                vec.x = mesh->mTextureCoords[0][i].x;
-                vec.y = mesh->mTextureCoords[0][i].y;
-                vertex.uvCoord = vec;
+                const uint64 offset = vertexBegin + uploaded;
+                size = std::min(budget, vertexSize - uploaded);
+                mesh.uploadVertices(offset, size, vertexData + offset);
+            }
+            else
+            {
+                const uint64 offset = indexBegin + uploaded - vertexSize;
+                size = std::min(budget, indexEnd - offset);
+                mesh.uploadIndices(offset, size, indexData + offset);
+            }
+            uploaded += size;
+            budget -= size;
+        }
+        uploaded = 0;
+        mesh.setResidentLevel(level);
+
+        // what stays in RAM once the mesh can be drawn, the finer levels come from the cache
+        if (base)
+        {
+            // without a cache the pending mesh is the only copy of the levels left
+            const bool keepPending = !pending.empty() && !cached && level > 0;
+            if (options.cpuData == CPU_DATA_KEEP)
+            {
+                MeshData& kept = pending.empty() ? keptData[index] : pending[index].data;
+                mesh.vertices = keepPending ? kept.vertices : std::move(kept.vertices);
+                mesh.indices = keepPending ? kept.indices : std::move(kept.indices);
             }
+            else if (options.cpuData == CPU_DATA_COMPRESSED)
+                mesh.retain(CPU_DATA_COMPRESSED, std::move(keptVertexStreams[index]), std::move(keptIndexStreams[index]));
+            if (!pending.empty() && !keepPending)
+                pending[index] = PendingMesh();
+        }
+        return true;
+    }
+
+    void meshBytes(const uint32 index, const unsigned char*& vertexData, uint64& vertexBytes,
+        const unsigned char*& indexData, uint64& indexBytes) const
+    {
+        if (cache.meshCount())
+        {
+            MeshCacheView view = cache.mesh(index);
+            vertexData = (const unsigned char*)view.vertices;
+            vertexBytes = (uint64)view.vertexCount * format.stride;
+            indexData = (const unsigned char*)view.indices;
+            indexBytes = (uint64)view.indexCount * view.indexSize;
+            return;
+        }
+
+        const PendingMesh& source = pending[index];
+        vertexData = (const unsigned char*)source.packed.bytes(source.data.vertices);
+        vertexBytes = (uint64)source.data.vertices.size() * source.packed.format.stride;
+        indexData = (const unsigned char*)source.packedIndices.bytes(source.data.indices);
+        indexBytes = (uint64)source.data.indices.size() * source.packedIndices.indexSize;
+    }
+
+    // Import with Assimp and write the result to cachePath (if not empty)
+    void importModel(const std::string& path, const std::string& cachePath, const uint64 sourceHash, const uint64 sourceSize)
+    {
+        // OBJ files are read by the native reader, anything else by Assimp
+        Assimp::Importer import;
+        std::vector<const aiMesh*> work;
+        std::vector<MeshData> data;
+        if (options.nativeObj && isObjPath(path))
+        {
+            if (!loadObj(path, data))
+            {
+                std::cout << "ERROR::OBJ::Could not read " << path << std::endl;
+                failed = true;
+                return;
+            }
+        }
+        else
+        {
+            const aiScene *scene = import.ReadFile(path, 
+				  aiProcess_Triangulate
+				| aiProcess_CalcTangentSpace
+				| aiProcess_FlipUVs
+				| aiProcess_GenSmoothNormals
+			);
+
+            if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
+            {
+                std::cout << "ERROR::ASSIMP::" << import.GetErrorString() << std::endl;
+                failed = true;
+                return;
+            }
+
+            // collect the meshes in tree order so the output keeps the same order
+            collectMeshes(scene->mRootNode, scene, work);
+            data.resize(work.size());
+        }
+
+        // convert them on the workers, only the buffer creation is done on the GL thread.
+        // Every vertex gets the index of its mesh, the layer of its material in a MaterialArray.
+        ThreadPool::shared().parallelFor((uint32)data.size(), [&](const uint32 i)
+        {
+            if (!work.empty())
+                processMesh(work[i], data[i]);
+            for (Vertex& vertex : data[i].vertices)
+                vertex.layer = (float)i;
+        });
+        if (options.mergeMeshes && data.size() > 1)
+        {
+            MeshData merged;
+            for (const MeshData& mesh : data)
+                appendMesh(merged, mesh);
+            data = std::vector<MeshData>(1, std::move(merged));
+        }
+
+        const size_t meshCount = data.size();
+        std::vector<WeldStats> weldStats(meshCount);
+        std::vector<VertexCacheStats> cacheBefore(meshCount);
+        std::vector<VertexCacheStats> cacheAfter(meshCount);
+        pending.resize(meshCount);
+        ThreadPool::shared().parallelFor((uint32)meshCount, [&](const uint32 i)
+        {
+            std::vector<MeshLod>& lods = pending[i].lods;
+            if (options.weld)
+                weldStats[i] = weldVertices(data[i].vertices, data[i].indices, options.weldSettings);
+            if (options.optimize)
+            {
+                cacheBefore[i] = analyzeVertexCache(data[i].indices, (uint32)data[i].vertices.size());
+                optimizeMesh(data[i], options.overdrawThreshold);
+                cacheAfter[i] = analyzeVertexCache(data[i].indices, (uint32)data[i].vertices.size());
+            }
+            if (options.lodCount > 1)
+                lods = generateLods(data[i], options.lodCount, options.lodReduction, options.lodMaxError);
+            if (options.progressive)
+                makeProgressive(data[i], lods);
+            std::vector<IndexRange> ranges(1, IndexRange{ 0, (uint32)data[i].indices.size(), 0 });
+            // splitting would break the vertex prefixes of the progressive levels
+            if (options.shortIndices && options.splitLargeMeshes && !options.progressive)
+                ranges = splitForShortIndices(data[i]);
+            if (options.meshlets)
+            {
+                // only the full detail level is split in meshlets
+                std::vector<IndexRange> fullRanges = ranges;
+                if (!lods.empty())
+                    fullRanges = clipRanges(ranges, lods[0].firstIndex, lods[0].firstIndex + lods[0].indexCount);
+                pending[i].meshlets = buildMeshlets(data[i], fullRanges);
+            }
+            pending[i].packedIndices = packIndices(data[i].indices, ranges, options.shortIndices);
+            pending[i].packed = packVertices(data[i].vertices, options.layout);
+            pending[i].bounds = boundingSphere(data[i].vertices);
+            boundingBox(data[i].vertices, pending[i].boxMin, pending[i].boxMax);
+        });
+
+        if (options.verbose)
+        {
+            if (options.weld)
+                for (size_t i = 0; i < weldStats.size(); i++)
+                    std::cout << "WELD::" << name << "[" << i << "]: " << weldStats[i].verticesBefore
+                        << " -> " << weldStats[i].verticesAfter << " vertices" << std::endl;
+            if (options.optimize)
+                for (size_t i = 0; i < cacheBefore.size(); i++)
+                    std::cout << "OPTIMIZE::" << name << "[" << i << "]: ACMR " << cacheBefore[i].acmr << " -> " << cacheAfter[i].acmr
+                        << ", ATVR " << cacheBefore[i].atvr << " -> " << cacheAfter[i].atvr << std::endl;
+            if (!options.layout.isFloat())
+                for (size_t i = 0; i < pending.size(); i++)
+                {
+                    const PackedVertices& packed = pending[i].packed;
+                    std::cout << "PACK::" << name << "[" << i << "]: " << packed.format.stride << " bytes per vertex (was "
+                        << sizeof(Vertex) << "), max error: position " << packed.error.position
+                        << ", normal " << packed.error.normal << " deg, tangent " << packed.error.tangent
+                        << " deg, uv " << packed.error.uv << std::endl;
+                }
+            if (options.meshlets)
+                for (size_t i = 0; i < pending.size(); i++)
+                    std::cout << "MESHLETS::" << name << "[" << i << "]: " << pending[i].meshlets.size() << " meshlets" << std::endl;
+            if (options.lodCount > 1)
+                for (size_t i = 0; i < pending.size(); i++)
+                {
+                    std::cout << "LOD::" << name << "[" << i << "]:";
+                    for (const MeshLod& lod : pending[i].lods)
+                        std::cout << " " << lod.indexCount / 3 << " (" << lod.error << ")";
+                    std::cout << " triangles (error)" << std::endl;
+                }
+        }
+
+        if (!cachePath.empty() && !data.empty())
+        {
+            std::vector<MeshCacheView> views(data.size());
+            for (size_t i = 0; i < data.size(); i++)
+            {
+                const PendingMesh& mesh = pending[i];
+                views[i].vertices = mesh.packed.bytes(data[i].vertices);
+                views[i].vertexCount = (uint32)data[i].vertices.size();
+                views[i].indices = mesh.packedIndices.bytes(data[i].indices);
+                views[i].indexCount = (uint32)data[i].indices.size();
+                views[i].indexSize = mesh.packedIndices.indexSize;
+                views[i].ranges = mesh.packedIndices.ranges.data();
+                views[i].rangeCount = (uint32)mesh.packedIndices.ranges.size();
+                views[i].meshlets = mesh.meshlets.data();
+                views[i].meshletCount = (uint32)mesh.meshlets.size();
+                views[i].lods = mesh.lods.data();
+                views[i].lodCount = (uint32)mesh.lods.size();
+                memcpy(views[i].bounds, &mesh.bounds[0], sizeof(views[i].bounds));
+                memcpy(views[i].box, &mesh.boxMin[0], sizeof(float) * 3);
+                memcpy(views[i].box + 3, &mesh.boxMax[0], sizeof(float) * 3);
+                memcpy(views[i].dequant, &mesh.packed.dequant[0], sizeof(views[i].dequant));
+            }
+            if (MeshCache::write(cachePath, sourceHash, sourceSize, format.stride, views, options.compressCache, options.cacheCodec))
+                cached = true;
+            else
+                std::cout << "WARNING::MESH_CACHE::Could not write " << cachePath << std::endl;
+        }
+
+        // the CPU copy is kept by the meshes once uploaded
+        for (size_t i = 0; i < data.size(); i++)
+            pending[i].data = std::move(data[i]);
+    }
+
+    static bool isObjPath(const std::string& path)
+    {
+        size_t dot = path.find_last_of('.');
+        if (dot == std::string::npos || path.size() - dot != 4)
+            return false;
+        return tolower(path[dot + 1]) == 'o' && tolower(path[dot + 2]) == 'b' && tolower(path[dot + 3]) == 'j';
+    }
+
+    void collectMeshes(const aiNode *node, const aiScene *scene, std::vector<const aiMesh*>& work)
+    {
+        // process all the node's meshes (if any)
+        for (unsigned int i = 0; i < node->mNumMeshes; i++)
+            work.push_back(scene->mMeshes[node->mMeshes[i]]);
+        // then do the same for each of its children
+        for (unsigned int i = 0; i < node->mNumChildren; i++)
+        {
+            collectMeshes(node->mChildren[i], scene, work);
+        }
+    }
+    static void processMesh(const aiMesh *mesh, MeshData& out)
+    {
+        out.vertices.resize(mesh->mNumVertices);
+        for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+        {
+            Vertex& vertex = out.vertices[i];
+            // process vertex positions, normals and texture coordinates
+            vertex.pos = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+            vertex.normal = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
+
+            if (mesh->mTangents)
+                vertex.tangent = glm::vec3(mesh->mTangents[i].x, mesh->mTangents[i].y, mesh->mTangents[i].z);
+            else
+                vertex.tangent = glm::vec3(0.0f, 0.0f, 0.0f);
+
+            if (mesh->mTextureCoords[0]) // does the mesh contain texture coordinates?
+                vertex.uvCoord = glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y);
             else
                 vertex.uvCoord = glm::vec2(0.0f, 0.0f);
-            vertices.push_back(vertex);
         }
 
         // process indices
+        uint32 indexCount = 0;
+        for (unsigned int i = 0; i < mesh->mNumFaces; i++)
+            indexCount += mesh->mFaces[i].mNumIndices;
+
+        out.indices.resize(indexCount);
+        uint32* index = out.indices.data();
         for (unsigned int i = 0; i < mesh->mNumFaces; i++)
         {
-            aiFace face = mesh->mFaces[i];
+            const aiFace& face = mesh->mFaces[i];
             for (unsigned int j = 0; j < face.mNumIndices; j++)
-                indices.push_back(face.mIndices[j]);
+                *index++ = face.mIndices[j];
+        }
+    }
+};
+
+// Imported models by canonical path and import options, alive while a ModelInstanced uses them
+class ModelRegistry
+{
+    std::mutex mutex;
+    std::unordered_map<std::string, std::weak_ptr<ModelGeometry>> models;
+public:
+    static ModelRegistry& shared()
+    {
+        static ModelRegistry registry;
+        return registry;
+    }
+
+    // The geometry of path imported with options, imported and uploaded on the first request. GL thread only.
+    std::shared_ptr<ModelGeometry> acquire(const std::string& path, const ImportOptions& options = ImportOptions(), const std::string& name = "mesh")
+    {
+        bool created = false;
+        std::shared_ptr<ModelGeometry> geometry = acquireDeferred(path, options, name, created);
+        // the registry is not locked during the import, the other requests of the model wait in finish
+        if (created)
+            geometry->import();
+        // it may still be loading in the ModelLoader
+        geometry->finish();
+        return geometry;
+    }
+
+    // The geometry of path imported with options, without loading it.
+    // When created is set the caller has to import it (from any thread).
+    std::shared_ptr<ModelGeometry> acquireDeferred(const std::string& path, const ImportOptions& options, const std::string& name, bool& created)
+    {
+        const std::string key = canonicalPath(path) + "|" + std::to_string(options.hash()) + "|" + std::to_string((int)options.cpuData);
+        std::lock_guard<std::mutex> lock(mutex);
+
+        std::shared_ptr<ModelGeometry> geometry = models[key].lock();
+        created = !geometry;
+        if (created)
+        {
+            geometry = std::make_shared<ModelGeometry>(path, options, name);
+            models[key] = geometry;
+        }
+        return geometry;
+    }
+
+    // Number of models still in use
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = models.begin(); it != models.end(); )
+        {
+            if (it->second.expired())
+                it = models.erase(it);
+            else
+                ++it;
+        }
+        return models.size();
+    }
+
+    // Call func with every model still in use, without allocating (for the memory report)
+    template<typename Func>
+    void forEach(Func func)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& entry : models)
+        {
+            std::shared_ptr<ModelGeometry> geometry = entry.second.lock();
+            if (geometry)
+                func(*geometry);
+        }
+    }
+};
+
+// RAM and GPU bytes of every model in use and the space taken by the geometry pools, GL thread only
+inline void printMemoryReport()
+{
+    ModelMemory total = { 0, 0 };
+    ModelRegistry::shared().forEach([&](const ModelGeometry& geometry)
+    {
+        const ModelMemory memory = geometry.memoryUsage();
+        std::cout << "MEMORY::" << geometry.getName() << " (" << geometry.path << "): CPU " << memory.cpuBytes / 1024
+            << " KB, GPU " << memory.gpuBytes / 1024 << " KB" << std::endl;
+        total.cpuBytes += memory.cpuBytes;
+        total.gpuBytes += memory.gpuBytes;
+    });
+    std::cout << "MEMORY::models: CPU " << total.cpuBytes / 1024 << " KB, GPU " << total.gpuBytes / 1024 << " KB" << std::endl;
+
+    for (const std::unique_ptr<GeometryPool>& pool : GeometryArena::shared().getPools())
+        std::cout << "MEMORY::pool (stride " << pool->format.stride << "): vertices " << pool->vertexBytesUsed() / 1024 << " / "
+            << pool->vertexBytesAllocated() / 1024 << " KB, indices " << pool->indexBytesUsed() / 1024 << " / "
+            << pool->indexBytesAllocated() / 1024 << " KB" << std::endl;
+    std::cout << "MEMORY::instances: " << GeometryArena::shared().instanceBytesUsed() / 1024 << " / "
+        << GeometryArena::shared().instanceBytesAllocated() / 1024 << " KB" << std::endl;
+}
+
+/*
+Loads models in the background: the import runs on the thread pool and the finished models
+are queued to the GL thread, which uploads them a slice at a time within a per frame budget.
+*/
+class ModelLoader
+{
+    LockFreeQueue<std::shared_ptr<ModelGeometry>> imported;    // pushed by the workers
+    std::deque<std::shared_ptr<ModelGeometry>> uploading;      // GL thread only
+    std::atomic<uint32> importing;
+public:
+    ModelLoader()
+        : importing(0)
+    {
+    }
+
+    static ModelLoader& shared()
+    {
+        static ModelLoader loader;
+        return loader;
+    }
+
+    /*
+    Start loading path and return its geometry right away. A ModelInstanced can be made from it
+    immediately, it draws nothing until the geometry is ready (see ModelGeometry::loaded).
+    Models already loaded or loading are shared through the ModelRegistry.
+    */
+    std::shared_ptr<ModelGeometry> load(const std::string& path, const ImportOptions& options = ImportOptions(), const std::string& name = "mesh")
+    {
+        bool created = false;
+        std::shared_ptr<ModelGeometry> geometry = ModelRegistry::shared().acquireDeferred(path, options, name, created);
+        if (created)
+        {
+            importing++;
+            // the reference is moved to the queue so the geometry is never released on a worker
+            ThreadPool::shared().submit([this, geometry]() mutable
+            {
+                geometry->import();
+                imported.push(std::move(geometry));
+                importing--;
+            });
         }
+        return geometry;
+    }
+
+    // Upload the imported models for about budgetMs milliseconds, once per frame on the GL thread
+    void update(const float budgetMs = 2.0f)
+    {
+        typedef std::chrono::steady_clock Clock;
+        const Clock::time_point start = Clock::now();
+
+        std::shared_ptr<ModelGeometry> geometry;
+        while (imported.pop(geometry))
+            uploading.push_back(std::move(geometry));
+
+        // progressive models stay here until their last level is uploaded, skipped while no draw asks for more
+        size_t i = 0;
+        while (i < uploading.size())
+        {
+            // nobody uses it anymore
+            if (uploading[i].use_count() == 1)
+            {
+                uploading.erase(uploading.begin() + i);
+                continue;
+            }
+            if (!uploading[i]->wantsUpload())
+            {
+                i++;
+                continue;
+            }
+            if (uploading[i]->upload(MODEL_UPLOAD_SLICE_SIZE))
+                uploading.erase(uploading.begin() + i);
+            if (std::chrono::duration<float, std::milli>(Clock::now() - start).count() >= budgetMs)
+                break;
+        }
+    }
+
+    // Models still importing or not ready yet (progressive models waiting for demand are not counted)
+    uint32 pendingCount() const
+    {
+        uint32 count = importing;
+        for (const std::shared_ptr<ModelGeometry>& geometry : uploading)
+            if (!geometry->isReady())
+                count++;
+        return count;
+    }
+
+    // Wait for the imports and drop the models not uploaded yet, before the GL context goes away
+    void shutdown()
+    {
+        while (importing)
+            std::this_thread::yield();
+
+        std::shared_ptr<ModelGeometry> geometry;
+        while (imported.pop(geometry));
+        geometry.reset();
+        uploading.clear();
+    }
+};
+
+class ModelInstanced
+{
+    std::shared_ptr<ModelGeometry> geometry;
+    std::vector<Material>* materials;
+    MaterialArray* materialArray; // instead of materials, the vertices have their layer
+	const std::string name;
+    // the instances and culling results are per model, the geometry may be drawn by other models
+    InstanceRange instances;
+    std::vector<MeshDrawState> meshStates;
+    // drawLods scratch
+    std::vector<glm::mat4> instanceTransforms;
+    std::vector<glm::mat3> instanceNormals;
+public:
+    // The geometry comes from the ModelRegistry, so the file is imported and uploaded only once
+    ModelInstanced(const std::string& path, std::vector<Material>* inMaterials = nullptr, const std::string& inName="mesh",
+        const ImportOptions& inOptions = ImportOptions())
+        : geometry(ModelRegistry::shared().acquire(path, inOptions, inName)), materials(inMaterials), materialArray(nullptr), name(inName)
+    {
+    }
+
+    // Another model (e.g. with other materials) drawing shared geometry, which may still be loading
+    ModelInstanced(const std::shared_ptr<ModelGeometry>& inGeometry, std::vector<Material>* inMaterials = nullptr, const std::string& inName = "mesh")
+        : geometry(inGeometry), materials(inMaterials), materialArray(nullptr), name(inName)
+    {
+    }
+
+    // Drawn with the textures of a MaterialArray, bound once per draw: use a MATERIAL_ARRAYS shader
+    ModelInstanced(const std::shared_ptr<ModelGeometry>& inGeometry, MaterialArray* inMaterialArray, const std::string& inName)
+        : geometry(inGeometry), materials(nullptr), materialArray(inMaterialArray), name(inName)
+    {
+    }
+
+    const std::shared_ptr<ModelGeometry>& getGeometry() const
+    {
+        return geometry;
+    }
+
+    bool isReady() const
+    {
+        return geometry->isReady();
+    }
+
+    std::vector<Material>* getMaterials() const
+    {
+        return materials;
+    }
+
+    MaterialArray* getMaterialArray() const
+    {
+        return materialArray;
+    }
+
+    // Model space bounding sphere (center, radius) of all the meshes, zero until the geometry is ready
+    glm::vec4 getBounds() const
+    {
+        if (!geometry->isReady() || geometry->meshes.empty())
+            return glm::vec4(0.0f);
+
+        glm::vec3 minPos = geometry->meshes[0].boxMin;
+        glm::vec3 maxPos = geometry->meshes[0].boxMax;
+        for (const MeshInstanced& mesh : geometry->meshes)
+        {
+            minPos = glm::min(minPos, mesh.boxMin);
+            maxPos = glm::max(maxPos, mesh.boxMax);
+        }
+        const glm::vec3 center = (minPos + maxPos) * 0.5f;
+        float radius = 0.0f;
+        for (const MeshInstanced& mesh : geometry->meshes)
+            radius = std::max(radius, glm::length(glm::vec3(mesh.bounds) - center) + mesh.bounds.w);
+        return glm::vec4(center, radius);
+    }
+
+    // Full detail, see MeshInstanced::draw. drawLods streams progressive geometry on demand.
+    void draw(const uint32 count)
+    {
+        drawMeshes([&](MeshInstanced& mesh, MeshDrawState&) { mesh.draw(instances, count); });
+    }
+
+    // Draw the meshlets kept by the last cullMeshlets
+    void drawCulled(const uint32 count)
+    {
+        drawMeshes([&](MeshInstanced& mesh, MeshDrawState& state) { mesh.drawCulled(instances, count, state); });
+    }
+
+    /*
+    Draw count instances with the level of detail picked for each one from its distance to the camera,
+    one instanced draw per level. The levels are kept under pixelError pixels of error on screen.
+    This sets the instance transforms (PV * model, model and normal matrices) itself.
+    */
+    void drawLods(Camera& camera, const glm::mat4& projection, const float viewportHeight,
+        const uint32 count, const glm::mat4* models, const float pixelError = 1.0f)
+    {
+        const glm::mat4 PV = projection * camera.GetViewMatrix();
+        instanceTransforms.resize(count);
+        instanceNormals.resize(count);
+        for (uint32 i = 0; i < count; i++)
+        {
+            instanceTransforms[i] = PV * models[i];
+            instanceNormals[i] = glm::transpose(glm::inverse(glm::mat3(models[i])));
+        }
+
+        // the meshes without levels draw the instances as they are
+        for (const MeshInstanced& mesh : geometry->meshes)
+            if (mesh.levelCount() == 1)
+            {
+                setTransforms(count, instanceTransforms.data(), 0);
+                setTransforms(count, models, 1);
+                setTransforms(count, instanceNormals.data());
+                break;
+            }
+
+        const float pixelScale = viewportHeight * 0.5f * projection[1][1];
+        drawMeshes([&](MeshInstanced& mesh, MeshDrawState& state)
+        {
+            mesh.drawLods(instances, camera.Position, pixelScale, pixelError, count, instanceTransforms.data(), models, instanceNormals.data(), state);
+        });
+    }
+
+    // Cull the meshlets of every mesh, returns the number of triangles drawCulled will submit
+    uint32 cullMeshlets(const glm::mat4& PV, const glm::vec3& cameraPos, const uint32 count, const glm::mat4* models)
+    {
+        uint32 triangles = 0;
+        meshStates.resize(geometry->meshes.size());
+        for (uint32 i = 0; i < geometry->meshes.size(); i++)
+            triangles += geometry->meshes[i].cullMeshlets(PV, cameraPos, count, models, meshStates[i]);
+        return triangles;
+    }
+
+    // The instances of this model only, the meshes are drawn with the same ones
+    void setTransforms(const uint32 count, const glm::mat4* matrices, const unsigned char type)
+    {
+        instances.setTransforms(count, matrices, type);
+    }
+
+    void setTransforms(const uint32 count, const glm::mat3* matrices)
+    {
+        instances.setTransforms(count, matrices);
+    }
+
+    MeshInstanced& getMesh(const uint32 index)
+    {
+        return geometry->meshes[index];
+    }
+private:
+    template <typename DrawFunc>
+    void drawMeshes(DrawFunc drawMesh)
+    {
+        if (!geometry->isReady())
+            return;
+        meshStates.resize(geometry->meshes.size());
 
-        return MeshInstanced(vertices, indices);
+        if (materialArray)
+        {
+            materialArray->bind();
+            for (uint32 i = 0; i < geometry->meshes.size(); i++)
+                drawMesh(geometry->meshes[i], meshStates[i]);
+        }
+        else if (materials && materials->size() > 0)
+            for (uint32 i = 0; i < geometry->meshes.size(); i++)
+            {
+                if ((*materials)[i].diffuse)
+                    (*materials)[i].diffuse->bind(0);
+				if ((*materials)[i].specular)
+                    (*materials)[i].specular->bind(1);
+				/*
+				if ((*materials)[i].normal)
+					(*materials)[i].normal->bind(2);
+				*/
+                drawMesh(geometry->meshes[i], meshStates[i]);
+            }
+        else
+            for (uint32 i = 0; i < geometry->meshes.size(); i++)
+            {
+                drawMesh(geometry->meshes[i], meshStates[i]);
+            }
     }
 };
+/*
+Time the native OBJ reader against Assimp with the importer flags, best of runs for each.
+Started from the command line: OpenGLBasics --bench-obj res/Models/monkey.obj res/Models/sphere.obj
+*/
+inline void benchmarkObjImport(const std::string& path, const uint32 runs = 20)
+{
+    typedef std::chrono::steady_clock Clock;
+    double nativeBest = 1e30;
+    double assimpBest = 1e30;
+    size_t nativeVertices = 0;
+    size_t assimpVertices = 0;
+
+    for (uint32 run = 0; run < runs; run++)
+    {
+        std::vector<MeshData> data;
+        Clock::time_point start = Clock::now();
+        if (!loadObj(path, data))
+        {
+            std::cout << "ERROR::BENCH::Could not read " << path << std::endl;
+            return;
+        }
+        nativeBest = std::min(nativeBest, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+        nativeVertices = 0;
+        for (const MeshData& mesh : data)
+            nativeVertices += mesh.vertices.size();
+    }
+
+    for (uint32 run = 0; run < runs; run++)
+    {
+        Assimp::Importer import;
+        Clock::time_point start = Clock::now();
+        const aiScene* scene = import.ReadFile(path,
+            aiProcess_Triangulate | aiProcess_CalcTangentSpace | aiProcess_FlipUVs | aiProcess_GenSmoothNormals);
+        assimpBest = std::min(assimpBest, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+        if (!scene)
+        {
+            std::cout << "ERROR::ASSIMP::" << import.GetErrorString() << std::endl;
+            return;
+        }
+        assimpVertices = 0;
+        for (unsigned int i = 0; i < scene->mNumMeshes; i++)
+            assimpVertices += scene->mMeshes[i]->mNumVertices;
+    }
+
+    std::cout << "BENCH::OBJ::" << path << ": native " << nativeBest << " ms (" << nativeVertices << " vertices), assimp "
+        << assimpBest << " ms (" << assimpVertices << " vertices), " << assimpBest / nativeBest << "x" << std::endl;
+}
+
+/*
+Round trip of 16 bit index streams with jumps of 32768 or more: a 300x300 grid split in 16 bit
+ranges (each range starts over at 0) and a 200x200 grid, 40000 vertices, with its levels of detail
+after it (each level starts over at low indices).
+Run by --bench-codec before the models.
+*/
+inline bool benchmarkShortIndexStreams()
+{
+    auto makeGrid = [](const uint32 size)
+    {
+        MeshData grid;
+        for (uint32 y = 0; y < size; y++)
+            for (uint32 x = 0; x < size; x++)
+            {
+                Vertex vertex;
+                vertex.pos = glm::vec3((float)x, std::sin(x * 0.3f) * std::cos(y * 0.2f), (float)y);
+                vertex.normal = glm::vec3(0.0f, 1.0f, 0.0f);
+                vertex.uvCoord = glm::vec2((float)x, (float)y) / (float)size;
+                vertex.tangent = glm::vec3(1.0f, 0.0f, 0.0f);
+                grid.vertices.push_back(vertex);
+            }
+        for (uint32 y = 0; y + 1 < size; y++)
+            for (uint32 x = 0; x + 1 < size; x++)
+            {
+                const uint32 corner = y * size + x;
+                const uint32 quad[6] = { corner, corner + size, corner + 1, corner + 1, corner + size, corner + size + 1 };
+                grid.indices.insert(grid.indices.end(), quad, quad + 6);
+            }
+        return grid;
+    };
+
+    bool passed = true;
+    MeshData split = makeGrid(300);
+    const std::vector<IndexRange> ranges = splitForShortIndices(split);
+    const PackedIndices splitIndices = packIndices(split.indices, ranges);
+    passed = benchmarkMeshStream("grid 300x300 in 16 bit ranges indices", STREAM_INDICES, splitIndices.bytes(split.indices),
+        (uint32)split.indices.size(), splitIndices.indexSize) && passed;
+
+    MeshData levels = makeGrid(200);
+    generateLods(levels, 4, 0.5f, 0.05f);
+    const PackedIndices levelIndices = packIndices(levels.indices, std::vector<IndexRange>(1, IndexRange{ 0, (uint32)levels.indices.size(), 0 }));
+    passed = benchmarkMeshStream("grid 200x200 with 4 levels indices", STREAM_INDICES, levelIndices.bytes(levels.indices),
+        (uint32)levels.indices.size(), levelIndices.indexSize) && passed;
+    return passed;
+}
+
+/*
+Compress the vertices and indices of a model the way a compressed mesh cache stores them, check they
+decode back to the same bytes and time the decoding.
+Started from the command line: OpenGLBasics --bench-codec res/Models/monkey.obj res/Models/sphere.obj
+*/
+inline void benchmarkMeshCodec(const std::string& path, const ImportOptions& options = ImportOptions())
+{
+    std::vector<MeshData> data;
+    if (!loadObj(path, data))
+    {
+        std::cout << "ERROR::BENCH::Could not read " << path << std::endl;
+        return;
+    }
+
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        if (options.weld)
+            weldVertices(data[i].vertices, data[i].indices, options.weldSettings);
+        optimizeMesh(data[i], options.overdrawThreshold);
+        PackedVertices packed = packVertices(data[i].vertices, options.layout);
+        PackedIndices packedIndices = packIndices(data[i].indices,
+            std::vector<IndexRange>(1, IndexRange{ 0, (uint32)data[i].indices.size(), 0 }), options.shortIndices);
+
+        const std::string label = path + "[" + std::to_string(i) + "]";
+        benchmarkMeshStream((label + " vertices").c_str(), STREAM_VERTICES, packed.bytes(data[i].vertices),
+            (uint32)data[i].vertices.size(), packed.format.stride);
+        benchmarkMeshStream((label + " indices").c_str(), STREAM_INDICES, packedIndices.bytes(data[i].indices),
+            (uint32)data[i].indices.size(), packedIndices.indexSize);
+    }
+}
@@ -0,0 +1,412 @@
+#pragma once
+#include "main.h"
+#include "Vertex.hpp"
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+#include <GLM/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+
+/*
+Wavefront OBJ reader used instead of Assimp for .obj models.
+The file is mapped and split in line aligned chunks that are parsed in parallel, then the
+v/vt/vn triplets of every submesh ('o', 'g' and 'usemtl' start a new one) are deduplicated into
+the vertex and index buffers. Like the Assimp flags used by the importer, polygons are
+triangulated, the UVs are flipped, missing normals are smoothed and tangents are computed.
+*/
+
+#define OBJ_MIN_CHUNK_SIZE (64 * 1024)
+#define OBJ_MISSING -1
+
+struct ObjCorner
+{
+    int32_t v, t, n; // 0 based, OBJ_MISSING when not given
+};
+
+struct ObjChunk
+{
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec2> uvs;
+    std::vector<glm::vec3> normals;
+    std::vector<ObjCorner> corners;     // triangles
+    std::vector<uint32> relative;       // corner * 3 + component of the negative indices, relative to the chunk
+    std::vector<uint32> breaks;         // corners where a new submesh starts
+};
+
+// Powers of ten exactly representable as doubles
+inline double objPow10(const int exponent)
+{
+    static const double powers[] =
+    {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    if (exponent >= 0)
+        return exponent <= 22 ? powers[exponent] : std::pow(10.0, exponent);
+    return exponent >= -22 ? 1.0 / powers[-exponent] : std::pow(10.0, exponent);
+}
+
+inline bool objIsSpace(const char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline void objSkipSpaces(const char*& p, const char* end)
+{
+    while (p < end && objIsSpace(*p))
+        p++;
+}
+
+// Decimal float without locale or allocation: [sign] digits [. digits] [e [sign] digits]
+inline float objParseFloat(const char*& p, const char* end)
+{
+    objSkipSpaces(p, end);
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64 mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa)
+                digits++;
+        }
+        else
+            exponent++;
+    }
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                exponent--;
+                if (mantissa)
+                    digits++;
+            }
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        p++;
+        bool negativeExponent = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negativeExponent = *p++ == '-';
+        int value = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++)
+            value = std::min(value * 10 + (*p - '0'), 1000);
+        exponent += negativeExponent ? -value : value;
+    }
+
+    double result = (double)mantissa;
+    if (exponent < 0)
+        result /= objPow10(-exponent);
+    else if (exponent > 0)
+        result *= objPow10(exponent);
+    return (float)(negative ? -result : result);
+}
+
+inline bool objParseInt(const char*& p, const char* end, int32_t& value)
+{
+    bool negative = false;
+    if (p < end && *p == '-')
+    {
+        negative = true;
+        p++;
+    }
+    if (p >= end || *p < '0' || *p > '9')
+        return false;
+    int32_t result = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        result = result * 10 + (*p - '0');
+    value = negative ? -result : result;
+    return true;
+}
+
+inline void objParseChunk(const char* p, const char* end, ObjChunk& chunk)
+{
+    std::vector<ObjCorner> polygon;
+    std::vector<uint32> polygonRelative;
+
+    while (p < end)
+    {
+        objSkipSpaces(p, end);
+        const char* line = p;
+        while (p < end && *p != '\n')
+            p++;
+        const char* lineEnd = p;
+        if (p < end)
+            p++;
+        if (line == lineEnd)
+            continue;
+
+        const char* c = line + 1;
+        if (line[0] == 'v')
+        {
+            if (c < lineEnd && objIsSpace(*c))
+            {
+                glm::vec3 position;
+                position.x = objParseFloat(c, lineEnd);
+                position.y = objParseFloat(c, lineEnd);
+                position.z = objParseFloat(c, lineEnd);
+                chunk.positions.push_back(position);
+            }
+            else if (c < lineEnd && *c == 't')
+            {
+                c++;
+                glm::vec2 uv;
+                uv.x = objParseFloat(c, lineEnd);
+                uv.y = objParseFloat(c, lineEnd);
+                chunk.uvs.push_back(uv);
+            }
+            else if (c < lineEnd && *c == 'n')
+            {
+                c++;
+                glm::vec3 normal;
+                normal.x = objParseFloat(c, lineEnd);
+                normal.y = objParseFloat(c, lineEnd);
+                normal.z = objParseFloat(c, lineEnd);
+                chunk.normals.push_back(normal);
+            }
+        }
+        else if (line[0] == 'f' && c < lineEnd && objIsSpace(*c))
+        {
+            // corners of the polygon, a negative index counts back from the last element read
+            polygon.clear();
+            polygonRelative.clear();
+            const int32_t counts[3] = { (int32_t)chunk.positions.size(), (int32_t)chunk.uvs.size(), (int32_t)chunk.normals.size() };
+            while (true)
+            {
+                objSkipSpaces(c, lineEnd);
+                int32_t values[3] = { OBJ_MISSING, OBJ_MISSING, OBJ_MISSING };
+                int32_t value;
+                if (!objParseInt(c, lineEnd, value))
+                    break;
+                for (uint32 component = 0; component < 3; component++)
+                {
+                    if (value > 0)
+                        values[component] = value - 1;
+                    else if (value < 0)
+                    {
+                        values[component] = counts[component] + value;
+                        polygonRelative.push_back((uint32)polygon.size() * 3 + component);
+                    }
+                    if (component == 2 || c >= lineEnd || *c != '/')
+                        break;
+                    c++;
+                    if (!objParseInt(c, lineEnd, value))
+                        value = 0; // v//vn
+                }
+                polygon.push_back(ObjCorner{ values[0], values[1], values[2] });
+            }
+
+            // fan triangulation
+            for (uint32 i = 2; i < polygon.size(); i++)
+            {
+                const uint32 source[3] = { 0, i - 1, i };
+                for (uint32 k = 0; k < 3; k++)
+                {
+                    for (uint32 r : polygonRelative)
+                        if (r / 3 == source[k])
+                            chunk.relative.push_back((uint32)chunk.corners.size() * 3 + r % 3);
+                    chunk.corners.push_back(polygon[source[k]]);
+                }
+            }
+        }
+        else if (((line[0] == 'o' || line[0] == 'g') && c < lineEnd && objIsSpace(*c))
+            || (lineEnd - line > 6 && std::equal(line, line + 6, "usemtl")))
+        {
+            if (chunk.breaks.empty() || chunk.breaks.back() != chunk.corners.size())
+                chunk.breaks.push_back((uint32)chunk.corners.size());
+        }
+    }
+}
+
+// Area weighted smooth normals shared by the vertices with the same OBJ position
+inline void objSmoothNormals(MeshData& mesh, const std::vector<ObjCorner>& keys, const uint32 positionCount)
+{
+    std::vector<glm::vec3> sums(positionCount, glm::vec3(0.0f));
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+    {
+        const glm::vec3& a = mesh.vertices[mesh.indices[i]].pos;
+        glm::vec3 normal = glm::cross(mesh.vertices[mesh.indices[i + 1]].pos - a, mesh.vertices[mesh.indices[i + 2]].pos - a);
+        for (uint32 k = 0; k < 3; k++)
+            sums[keys[mesh.indices[i + k]].v] += normal;
+    }
+    for (size_t v = 0; v < mesh.vertices.size(); v++)
+    {
+        if (glm::length(mesh.vertices[v].normal) > 0.0f)
+            continue;
+        glm::vec3 sum = sums[keys[v].v];
+        float length = glm::length(sum);
+        mesh.vertices[v].normal = length > 0.0f ? sum / length : glm::vec3(0.0f, 1.0f, 0.0f);
+    }
+}
+
+// Per vertex tangents from the UV directions, orthogonal to the normals
+inline void computeTangents(MeshData& mesh)
+{
+    std::vector<glm::vec3> sums(mesh.vertices.size(), glm::vec3(0.0f));
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+    {
+        const Vertex& a = mesh.vertices[mesh.indices[i]];
+        const Vertex& b = mesh.vertices[mesh.indices[i + 1]];
+        const Vertex& c = mesh.vertices[mesh.indices[i + 2]];
+        glm::vec3 edge1 = b.pos - a.pos;
+        glm::vec3 edge2 = c.pos - a.pos;
+        glm::vec2 duv1 = b.uvCoord - a.uvCoord;
+        glm::vec2 duv2 = c.uvCoord - a.uvCoord;
+        float determinant = duv1.x * duv2.y - duv2.x * duv1.y;
+        if (std::fabs(determinant) < 1e-12f)
+            continue;
+        glm::vec3 tangent = (edge1 * duv2.y - edge2 * duv1.y) / determinant;
+        for (uint32 k = 0; k < 3; k++)
+            sums[mesh.indices[i + k]] += tangent;
+    }
+    for (size_t v = 0; v < mesh.vertices.size(); v++)
+    {
+        const glm::vec3& normal = mesh.vertices[v].normal;
+        glm::vec3 tangent = sums[v] - normal * glm::dot(normal, sums[v]);
+        float length = glm::length(tangent);
+        mesh.vertices[v].tangent = length > 0.0f ? tangent / length : glm::vec3(0.0f);
+    }
+}
+
+/*
+Read the OBJ file at path into one MeshData per submesh.
+Returns false (with meshes empty) if the file can not be read or has invalid indices.
+*/
+inline bool loadObj(const std::string& path, std::vector<MeshData>& meshes)
+{
+    meshes.clear();
+    MappedFile file;
+    if (!file.open(path))
+        return false;
+
+    // line aligned chunks
+    const char* data = (const char*)file.data();
+    const size_t size = file.size();
+    ThreadPool& pool = ThreadPool::shared();
+    size_t chunkCount = std::max<size_t>(1, std::min<size_t>(pool.size() + 1, size / OBJ_MIN_CHUNK_SIZE));
+    std::vector<const char*> starts(chunkCount + 1);
+    starts[0] = data;
+    starts[chunkCount] = data + size;
+    for (size_t i = 1; i < chunkCount; i++)
+    {
+        const char* p = std::max(data + size * i / chunkCount, starts[i - 1]);
+        while (p < data + size && *p != '\n')
+            p++;
+        starts[i] = p < data + size ? p + 1 : p;
+    }
+
+    std::vector<ObjChunk> chunks(chunkCount);
+    pool.parallelFor((uint32)chunkCount, [&](const uint32 i)
+    {
+        objParseChunk(starts[i], starts[i + 1], chunks[i]);
+    });
+
+    // gather the chunks, the relative indices get the offset of their chunk
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec2> uvs;
+    std::vector<glm::vec3> normals;
+    std::vector<ObjCorner> corners;
+    std::vector<uint32> breaks;
+    for (ObjChunk& chunk : chunks)
+    {
+        const int32_t bases[3] = { (int32_t)positions.size(), (int32_t)uvs.size(), (int32_t)normals.size() };
+        for (uint32 r : chunk.relative)
+            (&chunk.corners[r / 3].v)[r % 3] += bases[r % 3];
+        for (uint32 corner : chunk.breaks)
+            breaks.push_back((uint32)corners.size() + corner);
+        positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+        uvs.insert(uvs.end(), chunk.uvs.begin(), chunk.uvs.end());
+        normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+        corners.insert(corners.end(), chunk.corners.begin(), chunk.corners.end());
+        chunk = ObjChunk();
+    }
+
+    for (const ObjCorner& corner : corners)
+        if (corner.v < 0 || corner.v >= (int32_t)positions.size()
+            || corner.t >= (int32_t)uvs.size() || corner.t < OBJ_MISSING
+            || corner.n >= (int32_t)normals.size() || corner.n < OBJ_MISSING)
+        {
+            std::cout << "ERROR::OBJ::Invalid face index in " << path << std::endl;
+            return false;
+        }
+
+    // submeshes from the breaks, empty ones are dropped
+    std::vector<uint32> bounds(1, 0);
+    for (uint32 corner : breaks)
+        if (corner > bounds.back())
+            bounds.push_back(corner);
+    if ((uint32)corners.size() > bounds.back())
+        bounds.push_back((uint32)corners.size());
+    if (bounds.size() < 2)
+        return false;
+
+    // deduplicate the triplets of every submesh
+    meshes.resize(bounds.size() - 1);
+    pool.parallelFor((uint32)meshes.size(), [&](const uint32 m)
+    {
+        MeshData& mesh = meshes[m];
+        const uint32 first = bounds[m];
+        const uint32 count = bounds[m + 1] - first;
+
+        uint32 tableSize = 1;
+        while (tableSize < count * 2)
+            tableSize <<= 1;
+        std::vector<uint32> table(tableSize, 0xFFFFFFFFu);
+        std::vector<ObjCorner> keys; // triplet of every vertex
+        keys.reserve(count);
+        mesh.indices.resize(count);
+        bool missingNormals = false;
+
+        for (uint32 i = 0; i < count; i++)
+        {
+            const ObjCorner& corner = corners[first + i];
+            uint32 hash = (uint32)corner.v * 73856093u ^ (uint32)corner.t * 19349663u ^ (uint32)corner.n * 83492791u;
+            uint32 slot = hash & (tableSize - 1);
+            while (true)
+            {
+                uint32 vertex = table[slot];
+                if (vertex == 0xFFFFFFFFu)
+                {
+                    vertex = (uint32)mesh.vertices.size();
+                    table[slot] = vertex;
+
+                    Vertex out;
+                    out.pos = positions[corner.v];
+                    out.normal = corner.n != OBJ_MISSING ? normals[corner.n] : glm::vec3(0.0f);
+                    out.uvCoord = corner.t != OBJ_MISSING ? glm::vec2(uvs[corner.t].x, 1.0f - uvs[corner.t].y) : glm::vec2(0.0f);
+                    out.tangent = glm::vec3(0.0f);
+                    missingNormals |= corner.n == OBJ_MISSING;
+                    mesh.vertices.push_back(out);
+                    keys.push_back(corner);
+                    mesh.indices[i] = vertex;
+                    break;
+                }
+                const ObjCorner& key = keys[vertex];
+                if (key.v == corner.v && key.t == corner.t && key.n == corner.n)
+                {
+                    mesh.indices[i] = vertex;
+                    break;
+                }
+                slot = (slot + 1) & (tableSize - 1);
+            }
+        }
+
+        if (missingNormals)
+            objSmoothNormals(mesh, keys, (uint32)positions.size());
+        if (!uvs.empty())
+            computeTangents(mesh);
+    });
+
+    return true;
+}
@@ -0,0 +1,157 @@
+#pragma once
+#include "main.h"
+#include "Model.hpp"
+#include "MaterialArray.hpp"
+#include <GLM/glm.hpp>
+#include <memory>
+#include <vector>
+
+
+/*
+Static batching of geometry that never moves.
+The objects are added with their model matrix. Once all their geometry is fully uploaded, update()
+transforms the meshes to world space and merges them in one mesh, every vertex keeping the layer
+of its material in the MaterialArray of the batch, so the whole batch is a single draw. The batch
+model and normal matrices are the identity and are set once, the only instance data left is the
+view projection matrix, uploaded when it changes. The merged mesh keeps the CPU side data of its
+policy, none by default (readMeshData reads it back from the GPU).
+The meshes are taken with MeshInstanced::readMeshData, geometry imported with CPU_DATA_DISCARD
+(the default) is read back from the GPU, a pipeline stall per mesh when the batch is built.
+GL thread only.
+*/
+
+// Append the vertices of data to target transformed to world space, like appendMesh
+inline void appendWorldSpace(MeshData& target, MeshData& data, const glm::mat4& model, const float firstLayer = 0.0f)
+{
+    const glm::mat3 linear(model);
+    const glm::mat3 normalMat = glm::transpose(glm::inverse(linear));
+    for (Vertex& vertex : data.vertices)
+    {
+        vertex.pos = glm::vec3(model * glm::vec4(vertex.pos, 1.0f));
+        vertex.normal = glm::normalize(normalMat * vertex.normal);
+        vertex.tangent = glm::normalize(linear * vertex.tangent);
+    }
+    appendMesh(target, data, firstLayer);
+}
+
+class StaticBatch
+{
+    struct StaticObject
+    {
+        std::shared_ptr<ModelGeometry> geometry;
+        uint32 firstLayer;
+        glm::mat4 model;
+    };
+
+    std::vector<StaticObject> objects;  // waiting to be merged
+    MaterialArray& materials;
+    std::vector<MeshInstanced> batch;   // the merged mesh, once built
+    InstanceRange instances;            // its single instance
+    glm::mat4 viewProjection;
+    bool built;
+    uint32 mergedObjects;
+    CpuDataPolicy cpuData;              // kept by the merged mesh after its upload
+public:
+    // The batch is drawn with the maps of materials, it has to outlive the batch
+    StaticBatch(MaterialArray& inMaterials, const CpuDataPolicy inCpuData = CPU_DATA_DISCARD)
+        : materials(inMaterials), viewProjection(0.0f), built(false), mergedObjects(0), cpuData(inCpuData)
+    {
+    }
+
+    // The vertices of the geometry use the layers from firstLayer (mesh i: firstLayer + i). Only before the batch is built.
+    void add(const std::shared_ptr<ModelGeometry>& geometry, const uint32 firstLayer, const glm::mat4& model)
+    {
+        if (built)
+        {
+            std::cout << "WARNING::STATIC_BATCH::" << geometry->path << " added after the batch was built" << std::endl;
+            return;
+        }
+        // merged at full detail, progressive geometry has to stream in every level
+        geometry->requestAll();
+        objects.push_back(StaticObject{ geometry, firstLayer, model });
+    }
+
+    // Build the batches once every object is uploaded. Returns true once they are built.
+    bool update()
+    {
+        if (built)
+            return true;
+        for (const StaticObject& object : objects)
+            if (!object.geometry->isComplete())
+                return false;
+
+        build();
+        return true;
+    }
+
+    bool isBuilt() const
+    {
+        return built;
+    }
+
+    uint32 objectCount() const
+    {
+        return mergedObjects;
+    }
+
+    // Draw calls made by draw, one once built
+    uint32 batchCount() const
+    {
+        return (uint32)batch.size();
+    }
+
+    // Upload the view projection matrix of the batches, nothing is sent when it did not change
+    void setViewProjection(const glm::mat4& PV)
+    {
+        if (PV == viewProjection)
+            return;
+        viewProjection = PV;
+        instances.setTransforms(1, &viewProjection, 0);
+    }
+
+    // A single draw, with a MATERIAL_ARRAYS shader or the shadow map (the instance model matrix is the identity)
+    void draw()
+    {
+        if (batch.empty())
+            return;
+        materials.bind();
+        batch[0].draw(instances, 1);
+    }
+
+private:
+    void build()
+    {
+        // to world space, the vertices already have the layer of their mesh
+        MeshData merged;
+        for (const StaticObject& object : objects)
+            for (const MeshInstanced& mesh : object.geometry->meshes)
+            {
+                MeshData data = mesh.readMeshData();
+                appendWorldSpace(merged, data, object.model, (float)object.firstLayer);
+            }
+
+        const glm::mat4 identity(1.0f);
+        const glm::mat3 identityNormal(1.0f);
+        instances.setTransforms(1, &identity, 1);
+        instances.setTransforms(1, &identityNormal);
+        instances.setTransforms(1, &viewProjection, 0);
+        if (!merged.indices.empty())
+        {
+            // world positions are kept in floats, quantizing them to the whole scene would lose precision
+            PackedVertices packed = packVertices(merged.vertices, VertexLayout());
+            PackedIndices packedIndices = packIndices(merged.indices, std::vector<IndexRange>(1, IndexRange{ 0, (uint32)merged.indices.size(), 0 }));
+            std::vector<unsigned char> vertexStream, indexStream;
+            if (cpuData == CPU_DATA_COMPRESSED)
+            {
+                vertexStream = encodeMeshStream(STREAM_VERTICES, packed.bytes(merged.vertices), (uint32)merged.vertices.size(), packed.format.stride);
+                indexStream = encodeMeshStream(STREAM_INDICES, packedIndices.bytes(merged.indices), (uint32)merged.indices.size(), packedIndices.indexSize);
+            }
+            batch.push_back(MeshInstanced(std::move(merged.vertices), std::move(merged.indices), packed, packedIndices));
+            batch.back().retain(cpuData, std::move(vertexStream), std::move(indexStream));
+        }
+
+        mergedObjects = (uint32)objects.size();
+        objects = std::vector<StaticObject>();
+        built = true;
+    }
+};
@@ -0,0 +1,106 @@
+#pragma once
+#include "main.h"
+#include "TextureLoader.hpp"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+/*
+Textures shared by path and options.
+acquire() returns the texture already loaded from the same file with the same TextureOptions,
+else starts loading it with the TextureLoader. The cache only keeps weak references: the GL
+texture is deleted with the last handle, so the textures no material uses are freed.
+GL thread only.
+*/
+
+struct TextureCacheStats
+{
+    uint64 hits;
+    uint64 misses;
+    uint32 textures;        // in use
+    uint64 residentBytes;   // of the textures in use (see Texture::gpuBytes)
+};
+
+class TextureCache
+{
+    std::unordered_map<std::string, std::weak_ptr<Texture>> textures;
+    uint64 hits;
+    uint64 misses;
+public:
+    TextureCache()
+        : hits(0), misses(0)
+    {
+    }
+
+    static TextureCache& shared()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+
+    std::shared_ptr<Texture> acquire(const std::string& path, const TextureOptions& options = TextureOptions())
+    {
+        const std::string key = canonicalPath(path) + "|" + options.key();
+        std::weak_ptr<Texture>& entry = textures[key];
+        std::shared_ptr<Texture> texture = entry.lock();
+        if (texture)
+        {
+            hits++;
+            return texture;
+        }
+
+        misses++;
+        texture = TextureLoader::shared().load(path, options);
+        entry = texture;
+        return texture;
+    }
+
+    // A texture array of the images of paths, see TextureLoader::loadArray
+    std::shared_ptr<Texture> acquireArray(const std::vector<std::string>& paths, const uint32 layerSize,
+        const TextureOptions& options = TextureOptions())
+    {
+        std::string key = "array|" + std::to_string(layerSize);
+        for (const std::string& path : paths)
+            key += "|" + canonicalPath(path);
+        key += "|" + options.key();
+        std::weak_ptr<Texture>& entry = textures[key];
+        std::shared_ptr<Texture> texture = entry.lock();
+        if (texture)
+        {
+            hits++;
+            return texture;
+        }
+
+        misses++;
+        texture = TextureLoader::shared().loadArray(paths, layerSize, options);
+        entry = texture;
+        return texture;
+    }
+
+    // Drops the entries of the freed textures and counts the others
+    TextureCacheStats stats()
+    {
+        TextureCacheStats result = { hits, misses, 0, 0 };
+        for (auto it = textures.begin(); it != textures.end(); )
+        {
+            std::shared_ptr<Texture> texture = it->second.lock();
+            if (!texture)
+            {
+                it = textures.erase(it);
+                continue;
+            }
+            result.textures++;
+            result.residentBytes += texture->gpuBytes;
+            ++it;
+        }
+        return result;
+    }
+
+    // Fraction of the acquires served by a texture already loaded
+    float hitRate() const
+    {
+        return hits + misses ? (float)hits / (float)(hits + misses) : 0.0f;
+    }
+};
@@ -0,0 +1,329 @@
+#pragma once
+#include "main.h"
+#include "MappedFile.hpp"
+#include "BlockCompress.hpp"
+#include "MipGenerator.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+
+/*
+Block compressed texture container.
+Stores the whole mip chain of a texture compressed with BlockCompress, so the next run uploads
+it with glCompressedTexImage2D without decoding or encoding the image.
+The file name has the format, the flags and the size (see pathFor): the same image loaded with
+other options, or resampled for a texture array, gets its own container instead of replacing it.
+
+Layout (all offsets are from the start of the file and 16 bytes aligned):
+    TextureContainerHeader
+    TextureContainerLevel[levelCount]
+    the blocks of every level, largest first
+*/
+
+#define TEXTURE_CONTAINER_MAGIC 0x58544742 // "BGTX"
+#define TEXTURE_CONTAINER_VERSION 2 // 1 had box filtered mips in sRGB space
+#define TEXTURE_CONTAINER_EXTENSION ".btex"
+// TextureContainerHeader flags, how the mips were made
+#define TEXTURE_CONTAINER_SRGB 1    // filtered as sRGB colors
+#define TEXTURE_CONTAINER_KAISER 2  // with MIP_FILTER_KAISER instead of the box filter
+#define TEXTURE_CONTAINER_WRAP 4    // the filter wrapped around the edges
+
+inline uint32 textureContainerFlags(const bool srgb, const MipFilter filter, const bool wrap)
+{
+    return (srgb ? TEXTURE_CONTAINER_SRGB : 0) | (filter == MIP_FILTER_KAISER ? TEXTURE_CONTAINER_KAISER : 0)
+        | (wrap ? TEXTURE_CONTAINER_WRAP : 0);
+}
+
+struct TextureContainerHeader
+{
+    uint32 magic;
+    uint32 version;
+    uint32 format; // BlockFormat
+    uint32 flags;
+    uint32 width;
+    uint32 height;
+    uint32 levelCount;
+    uint32 reserved;
+    uint64 sourceHash;
+    uint64 sourceSize;
+};
+
+struct TextureContainerLevel
+{
+    uint64 offset;
+    uint64 size;
+    uint32 width;
+    uint32 height;
+};
+
+// One compressed mip level, in memory or inside the mapped container
+struct CompressedLevel
+{
+    const unsigned char* data;
+    uint64 size;
+    uint32 width;
+    uint32 height;
+};
+
+/*
+Compress every mip level of a width x height RGBA8 image, down to 1x1. The blocks go in storage.
+The mips are made by generateMipChain (srgb, filter and wrap are its settings).
+*/
+inline std::vector<CompressedLevel> compressMipChain(const unsigned char* rgba, const uint32 width, const uint32 height,
+    const BlockFormat format, std::vector<std::vector<unsigned char>>& storage, const bool srgb,
+    const MipFilter filter = MIP_FILTER_BOX, const bool wrap = false)
+{
+    const std::vector<MipLevel> mips = generateMipChain(rgba, width, height, 4, srgb, filter, wrap);
+    std::vector<CompressedLevel> levels;
+    storage.clear();
+    storage.push_back(compressImage(rgba, width, height, format));
+    levels.push_back(CompressedLevel{ nullptr, storage.back().size(), width, height });
+    for (const MipLevel& mip : mips)
+    {
+        storage.push_back(compressImage(mip.pixels.data(), mip.width, mip.height, format));
+        levels.push_back(CompressedLevel{ nullptr, storage.back().size(), mip.width, mip.height });
+    }
+    for (size_t i = 0; i < levels.size(); i++)
+        levels[i].data = storage[i].data();
+    return levels;
+}
+
+class TextureContainer
+{
+    MappedFile file;
+    const TextureContainerHeader* header;
+    const TextureContainerLevel* levels;
+public:
+    TextureContainer()
+        : header(nullptr), levels(nullptr)
+    {
+    }
+
+    // brick_df.png -> brick_df.png.bc1.7.btex, size (when the image was resampled): brick_df.png.bc1.7.512.btex
+    static std::string pathFor(const std::string& sourcePath, const BlockFormat format, const uint32 flags, const uint32 size = 0)
+    {
+        std::string name = blockFormatName(format);
+        for (char& c : name)
+            c = (char)std::tolower((unsigned char)c);
+        char suffix[32];
+        if (size)
+            snprintf(suffix, sizeof(suffix), ".%x.%u", flags, size);
+        else
+            snprintf(suffix, sizeof(suffix), ".%x", flags);
+        return sourcePath + "." + name + suffix + TEXTURE_CONTAINER_EXTENSION;
+    }
+
+    // Map the container and check it matches the source file and the format asked for
+    bool open(const std::string& containerPath, const uint64 sourceHash, const uint64 sourceSize, const BlockFormat format, const uint32 flags)
+    {
+        close();
+        if (!file.open(containerPath))
+            return false;
+
+        if (file.size() < sizeof(TextureContainerHeader))
+        {
+            close();
+            return false;
+        }
+
+        header = (const TextureContainerHeader*)file.data();
+        if (header->magic != TEXTURE_CONTAINER_MAGIC
+            || header->version != TEXTURE_CONTAINER_VERSION
+            || header->format != (uint32)format
+            || header->flags != flags
+            || header->sourceHash != sourceHash
+            || header->sourceSize != sourceSize
+            || header->levelCount == 0
+            || file.size() < sizeof(TextureContainerHeader) + header->levelCount * sizeof(TextureContainerLevel))
+        {
+            close();
+            return false;
+        }
+        levels = (const TextureContainerLevel*)(file.data() + sizeof(TextureContainerHeader));
+
+        // make sure no level points outside the file or is smaller than its blocks
+        for (uint32 i = 0; i < header->levelCount; i++)
+        {
+            if (levels[i].offset + levels[i].size > file.size()
+                || levels[i].size != compressedSize(levels[i].width, levels[i].height, format))
+            {
+                close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void close()
+    {
+        file.close();
+        header = nullptr;
+        levels = nullptr;
+    }
+
+    uint32 levelCount() const
+    {
+        return header ? header->levelCount : 0;
+    }
+
+    CompressedLevel level(const uint32 index) const
+    {
+        const TextureContainerLevel& entry = levels[index];
+        return CompressedLevel{ file.data() + entry.offset, entry.size, entry.width, entry.height };
+    }
+
+    // Written to a temporary and moved over containerPath when complete (see replaceFile)
+    static bool write(const std::string& containerPath, const uint64 sourceHash, const uint64 sourceSize,
+        const BlockFormat format, const uint32 flags, const std::vector<CompressedLevel>& mips)
+    {
+        const std::string temporaryPath = temporaryPathFor(containerPath);
+        if (!writeFile(temporaryPath, sourceHash, sourceSize, format, flags, mips))
+        {
+            std::error_code error;
+            std::filesystem::remove(temporaryPath, error);
+            return false;
+        }
+        return replaceFile(temporaryPath, containerPath);
+    }
+
+private:
+    static bool writeFile(const std::string& containerPath, const uint64 sourceHash, const uint64 sourceSize,
+        const BlockFormat format, const uint32 flags, const std::vector<CompressedLevel>& mips)
+    {
+        std::ofstream out(containerPath, std::ios::binary | std::ios::trunc);
+        if (!out.is_open() || mips.empty())
+            return false;
+
+        TextureContainerHeader fileHeader;
+        fileHeader.magic = TEXTURE_CONTAINER_MAGIC;
+        fileHeader.version = TEXTURE_CONTAINER_VERSION;
+        fileHeader.format = (uint32)format;
+        fileHeader.flags = flags;
+        fileHeader.width = mips[0].width;
+        fileHeader.height = mips[0].height;
+        fileHeader.levelCount = (uint32)mips.size();
+        fileHeader.reserved = 0;
+        fileHeader.sourceHash = sourceHash;
+        fileHeader.sourceSize = sourceSize;
+
+        std::vector<TextureContainerLevel> table(mips.size());
+        uint64 offset = align(sizeof(TextureContainerHeader) + mips.size() * sizeof(TextureContainerLevel));
+        for (size_t i = 0; i < mips.size(); i++)
+        {
+            table[i].offset = offset;
+            table[i].size = mips[i].size;
+            table[i].width = mips[i].width;
+            table[i].height = mips[i].height;
+            offset = align(offset + mips[i].size);
+        }
+
+        out.write((const char*)&fileHeader, sizeof(fileHeader));
+        out.write((const char*)table.data(), table.size() * sizeof(TextureContainerLevel));
+        for (size_t i = 0; i < mips.size(); i++)
+        {
+            pad(out, table[i].offset);
+            out.write((const char*)mips[i].data, (std::streamsize)mips[i].size);
+        }
+        return out.good();
+    }
+
+    static uint64 align(const uint64 offset)
+    {
+        return (offset + 15) & ~(uint64)15;
+    }
+
+    static void pad(std::ofstream& out, const uint64 offset)
+    {
+        static const char zeros[16] = {};
+        uint64 current = (uint64)out.tellp();
+        if (current < offset)
+            out.write(zeros, (std::streamsize)(offset - current));
+    }
+};
+
+/*
+Build the container of an image ahead of time, like TextureLoader does the first time it loads it
+(the defaults match the default TextureOptions: box filtered mips, wrapping around the edges).
+Started from the command line: OpenGLBasics --compress-textures bc1 res/Textures/RedBrick/brick_df.png
+*/
+inline bool compressTextureFile(const std::string& path, const BlockFormat format, const bool srgb,
+    const MipFilter filter = MIP_FILTER_BOX, const bool wrap = true)
+{
+    MappedFile source;
+    if (!source.open(path))
+    {
+        std::cout << "ERROR::TEXTURE_CONTAINER::Could not read " << path << std::endl;
+        return false;
+    }
+    int width, height, channels;
+    unsigned char* rgba = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, 4);
+    if (!rgba)
+    {
+        std::cout << "ERROR::TEXTURE_CONTAINER::Could not decode " << path << std::endl;
+        return false;
+    }
+
+    std::vector<std::vector<unsigned char>> storage;
+    const std::vector<CompressedLevel> levels = compressMipChain(rgba, (uint32)width, (uint32)height, format, storage, srgb, filter, wrap);
+    stbi_image_free(rgba);
+    const uint32 flags = textureContainerFlags(srgb, filter, wrap);
+    const std::string containerPath = TextureContainer::pathFor(path, format, flags);
+    if (!TextureContainer::write(containerPath, hashBytes(source.data(), source.size()), source.size(), format, flags, levels))
+    {
+        std::cout << "ERROR::TEXTURE_CONTAINER::Could not write " << containerPath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+Time the compression of an image to every format and measure the error of the decoded result
+(PSNR over the channels the format stores).
+Started from the command line: OpenGLBasics --bench-bc res/Textures/RedBrick/brick_df.png
+*/
+inline void benchmarkBlockCompression(const std::string& path, const uint32 runs = 5)
+{
+    typedef std::chrono::steady_clock Clock;
+    int width, height, channels;
+    unsigned char* rgba = stbi_load(path.c_str(), &width, &height, &channels, 4);
+    if (!rgba)
+    {
+        std::cout << "ERROR::BENCH::Could not read " << path << std::endl;
+        return;
+    }
+
+    const BlockFormat formats[4] = { BLOCK_BC1, BLOCK_BC3, BLOCK_BC4, BLOCK_BC5 };
+    const uint32 formatChannels[4] = { 3, 4, 1, 2 };
+    for (uint32 f = 0; f < 4; f++)
+    {
+        std::vector<unsigned char> blocks;
+        double best = 1e30;
+        for (uint32 run = 0; run < runs; run++)
+        {
+            const Clock::time_point start = Clock::now();
+            blocks = compressImage(rgba, (uint32)width, (uint32)height, formats[f]);
+            best = std::min(best, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+        }
+
+        const std::vector<unsigned char> decoded = decompressImage(blocks.data(), (uint32)width, (uint32)height, formats[f]);
+        double squaredError = 0.0;
+        for (size_t i = 0; i < (size_t)width * height; i++)
+            for (uint32 c = 0; c < formatChannels[f]; c++)
+            {
+                const double d = (double)decoded[i * 4 + c] - (double)rgba[i * 4 + c];
+                squaredError += d * d;
+            }
+        const double mse = squaredError / ((double)width * height * formatChannels[f]);
+        const double psnr = mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : INFINITY;
+        std::cout << "BENCH::BC::" << path << " " << blockFormatName(formats[f]) << ": " << best << " ms, "
+            << (double)width * height / (best * 1000.0) << " MP/s, PSNR " << psnr << " dB, "
+            << (double)blocks.size() / ((double)width * height * 4) * 100.0 << "% of RGBA8" << std::endl;
+    }
+    stbi_image_free(rgba);
+}
@@ -0,0 +1,599 @@
+#pragma once
+#include "main.h"
+#include "ThreadPool.hpp"
+#include "LockFreeQueue.hpp"
+#include "TextureContainer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+
+
+/*
+Background texture loading.
+load() returns a texture right away, bound to a 1x1 placeholder, and decodes the image on the
+ThreadPool. update() uploads the decoded images on the GL thread, at most a byte budget per frame:
+the rows go to a new texture object in slices and the placeholder is swapped for it once they
+are all there, so a half uploaded image is never sampled. The mip levels are made by the worker
+too (generateMipChain) and follow the full size image.
+Compressed textures are read from their TextureContainer next to the image, made by the worker
+(and saved) when it is missing or stale, and uploaded one mip level at a time.
+*/
+
+// Placeholder color of the textures still loading (0xAABBGGRR)
+#define TEXTURE_PLACEHOLDER_COLOR 0xFF808080u
+
+enum TextureCompression
+{
+    TEXTURE_UNCOMPRESSED,
+    TEXTURE_COMPRESS_COLOR,     // BC1, or BC3 when the alpha is used
+    TEXTURE_COMPRESS_SINGLE,    // BC4 of the red channel, read as gray
+    TEXTURE_COMPRESS_NORMAL     // BC5 of the red and green channels, z is lost: the shader sampling it has to rebuild it
+};
+
+// How a texture is stored and sampled, part of its TextureCache key
+struct TextureOptions
+{
+    bool srgb = true;       // color data, off for normal maps and masks
+    bool mipmaps = true;    // compressed textures always have their whole mip chain
+    MipFilter mipFilter = MIP_FILTER_BOX;
+    TextureCompression compression = TEXTURE_UNCOMPRESSED;
+    GLenum wrap = GL_REPEAT;
+    GLenum minFilter = GL_LINEAR;
+    GLenum magFilter = GL_LINEAR;
+
+    std::string key() const
+    {
+        return std::to_string((int)srgb) + std::to_string((int)mipmaps) + std::to_string((int)mipFilter) + std::to_string((int)compression) + "|" + std::to_string(wrap) + "|"
+            + std::to_string(minFilter) + "|" + std::to_string(magFilter);
+    }
+};
+
+struct DecodedTexture
+{
+    std::shared_ptr<Texture> texture;
+    std::string path;
+    TextureOptions options;
+    unsigned char* pixels; // stbi_load result, null when the decode failed
+    std::vector<unsigned char> resized; // replaces pixels when the image was resampled to the layer size
+    int width;
+    int height;
+    int channels;
+    GLTexture staging;      // receives the rows, GL thread only
+    uint32 uploadedRows;
+    std::vector<MipLevel> mips; // below the full size image, uploaded after its rows
+    // compressed textures: the mip levels, in the mapped container or in compressedStorage
+    BlockFormat format;
+    TextureContainer container;
+    std::vector<std::vector<unsigned char>> compressedStorage;
+    std::vector<CompressedLevel> levels;
+    uint32 uploadedLevels;
+    uint64 sourceHash;
+    uint64 sourceSize;
+    int sourceWidth;    // of the image file, read from its header by hashSource
+    int sourceHeight;
+    // texture arrays: one image per layer, all layerSize x layerSize with the same format
+    std::vector<std::unique_ptr<DecodedTexture>> layers;
+    uint32 layerSize;
+
+    DecodedTexture()
+        : pixels(nullptr), width(0), height(0), channels(0), uploadedRows(0), format(BLOCK_BC1), uploadedLevels(0),
+        sourceHash(0), sourceSize(0), sourceWidth(0), sourceHeight(0), layerSize(0)
+    {
+    }
+
+    ~DecodedTexture()
+    {
+        if (pixels)
+            stbi_image_free(pixels);
+    }
+
+    DecodedTexture(const DecodedTexture&) = delete;
+    DecodedTexture& operator=(const DecodedTexture&) = delete;
+
+    const unsigned char* data() const
+    {
+        return resized.empty() ? pixels : resized.data();
+    }
+
+    // Worker side: decode the image, or get its compressed mip chain
+    void decode()
+    {
+        if (options.compression == TEXTURE_UNCOMPRESSED)
+        {
+            if (loadPixels(0, 0) && options.mipmaps)
+                makeMips();
+            return;
+        }
+
+        const BlockFormat* candidates;
+        const uint32 candidateCount = compressionCandidates(options.compression, candidates);
+        for (uint32 i = 0; i < candidateCount; i++)
+            if (openContainer(candidates[i], 0))
+                return;
+
+        if (!loadPixels(4, 0))
+            return;
+        compress(options.compression == TEXTURE_COMPRESS_COLOR && hasAlpha() ? BLOCK_BC3 : candidates[0], 0);
+    }
+
+    /*
+    Worker side, texture arrays: every layer is decoded like a texture and resampled to the layer
+    size. The compressed layers are only read from their containers when all of them are there with
+    the same format, else they are all compressed again (BC3 for all when one of them has alpha).
+    */
+    void decodeLayers()
+    {
+        if (options.compression == TEXTURE_UNCOMPRESSED)
+        {
+            for (std::unique_ptr<DecodedTexture>& layer : layers)
+                if (layer->loadPixels(4, layerSize) && options.mipmaps)
+                    layer->makeMips();
+            return;
+        }
+
+        const BlockFormat* candidates;
+        const uint32 candidateCount = compressionCandidates(options.compression, candidates);
+        for (uint32 i = 0; i < candidateCount; i++)
+        {
+            bool opened = true;
+            for (std::unique_ptr<DecodedTexture>& layer : layers)
+                opened = opened && layer->openContainer(candidates[i], layerSize);
+            if (opened)
+                return;
+        }
+
+        bool alpha = false;
+        for (std::unique_ptr<DecodedTexture>& layer : layers)
+        {
+            layer->container.close();
+            layer->levels.clear();
+            if (layer->loadPixels(4, layerSize))
+                alpha = alpha || (options.compression == TEXTURE_COMPRESS_COLOR && layer->hasAlpha());
+        }
+        for (std::unique_ptr<DecodedTexture>& layer : layers)
+            if (layer->data())
+                layer->compress(alpha ? BLOCK_BC3 : candidates[0], layerSize);
+    }
+
+private:
+    static uint32 compressionCandidates(const TextureCompression compression, const BlockFormat*& candidates)
+    {
+        static const BlockFormat color[2] = { BLOCK_BC1, BLOCK_BC3 };
+        static const BlockFormat single[1] = { BLOCK_BC4 };
+        static const BlockFormat normal[1] = { BLOCK_BC5 };
+        candidates = compression == TEXTURE_COMPRESS_SINGLE ? single : compression == TEXTURE_COMPRESS_NORMAL ? normal : color;
+        return compression == TEXTURE_COMPRESS_COLOR ? 2 : 1;
+    }
+
+    uint32 containerFlags() const
+    {
+        return textureContainerFlags(options.srgb, options.mipFilter, options.wrap == GL_REPEAT);
+    }
+
+    // The containers are keyed by the hash and size of the image file
+    bool hashSource()
+    {
+        if (sourceSize)
+            return true;
+        MappedFile source;
+        if (!source.open(path))
+            return false;
+        int sourceChannels;
+        if (!stbi_info_from_memory(source.data(), (int)source.size(), &sourceWidth, &sourceHeight, &sourceChannels))
+            return false;
+        sourceHash = hashBytes(source.data(), source.size());
+        sourceSize = source.size();
+        return sourceSize != 0;
+    }
+
+    // Map the container of the image if it is up to date, with this format and size (0: the size of the image)
+    bool openContainer(const BlockFormat candidate, const uint32 size)
+    {
+        if (!hashSource() || !container.open(TextureContainer::pathFor(path, candidate, containerFlags(), size), sourceHash,
+            sourceSize, candidate, containerFlags()))
+            return false;
+        const uint32 expectedWidth = size ? size : (uint32)sourceWidth;
+        const uint32 expectedHeight = size ? size : (uint32)sourceHeight;
+        if (container.level(0).width != expectedWidth || container.level(0).height != expectedHeight)
+        {
+            container.close();
+            return false;
+        }
+
+        format = candidate;
+        levels.clear();
+        for (uint32 l = 0; l < container.levelCount(); l++)
+            levels.push_back(container.level(l));
+        width = (int)levels[0].width;
+        height = (int)levels[0].height;
+        return true;
+    }
+
+    // Decode the image (requiredChannels 0: as stored), resampled to size x size when size is not 0
+    bool loadPixels(const int requiredChannels, const uint32 size)
+    {
+        pixels = stbi_load(path.c_str(), &width, &height, &channels, requiredChannels);
+        if (!pixels)
+            return false;
+        if (requiredChannels)
+            channels = requiredChannels;
+        if (size && ((uint32)width != size || (uint32)height != size))
+        {
+            resized = resizeImage(pixels, (uint32)width, (uint32)height, (uint32)channels, size, size,
+                options.srgb && channels >= 3, options.mipFilter, options.wrap == GL_REPEAT);
+            stbi_image_free(pixels);
+            pixels = nullptr;
+            width = height = (int)size;
+        }
+        return true;
+    }
+
+    bool hasAlpha() const
+    {
+        const unsigned char* rgba = data();
+        for (size_t i = 0; i < (size_t)width * height; i++)
+            if (rgba[i * 4 + 3] != 255)
+                return true;
+        return false;
+    }
+
+    void makeMips()
+    {
+        mips = generateMipChain(data(), (uint32)width, (uint32)height, (uint32)channels, options.srgb && channels >= 3,
+            options.mipFilter, options.wrap == GL_REPEAT);
+    }
+
+    // Compress the RGBA pixels with their mip chain and save them in the container (size: resampled to, 0 when not)
+    void compress(const BlockFormat blockFormat, const uint32 size)
+    {
+        format = blockFormat;
+        levels = compressMipChain(data(), (uint32)width, (uint32)height, format, compressedStorage, options.srgb,
+            options.mipFilter, options.wrap == GL_REPEAT);
+        if (pixels)
+            stbi_image_free(pixels);
+        pixels = nullptr;
+        resized.clear();
+
+        if (!hashSource())
+            return;
+        const std::string containerPath = TextureContainer::pathFor(path, format, containerFlags(), size);
+        if (!TextureContainer::write(containerPath, sourceHash, sourceSize, format, containerFlags(), levels))
+            std::cout << "WARNING::TEXTURE_CONTAINER::Could not write " << containerPath << std::endl;
+    }
+};
+
+class TextureLoader
+{
+    LockFreeQueue<std::shared_ptr<DecodedTexture>> decoded;    // pushed by the workers
+    std::deque<std::shared_ptr<DecodedTexture>> uploading;     // GL thread only
+    std::atomic<uint32> decoding;   // images decoding or in decoded, counted down by the GL thread when it pops them
+public:
+    TextureLoader()
+        : decoding(0)
+    {
+    }
+
+    static TextureLoader& shared()
+    {
+        static TextureLoader loader;
+        return loader;
+    }
+
+    // Start decoding path on the pool, the texture can be bound right away. GL thread only.
+    // Use TextureCache::acquire to share the textures loaded from the same file.
+    std::shared_ptr<Texture> load(const std::string& path, const TextureOptions& options = TextureOptions())
+    {
+        std::shared_ptr<Texture> texture = std::make_shared<Texture>(TEXTURE_PLACEHOLDER_COLOR);
+        std::shared_ptr<DecodedTexture> image = std::make_shared<DecodedTexture>();
+        image->texture = texture;
+        image->path = path;
+        image->options = options;
+
+        decoding++;
+        ThreadPool::shared().submit([this, image]() mutable
+        {
+            image->decode();
+            // the reference is moved to the queue so the texture is never released on a worker
+            decoded.push(std::move(image));
+        });
+        return texture;
+    }
+
+    /*
+    Start decoding the images of paths on the pool as the layers of a texture array, resampled to
+    layerSize x layerSize when they are another size. The array has a placeholder layer for each path
+    until all of them are uploaded. GL thread only, see TextureCache::acquireArray to share them.
+    */
+    std::shared_ptr<Texture> loadArray(const std::vector<std::string>& paths, const uint32 layerSize,
+        const TextureOptions& options = TextureOptions())
+    {
+        std::shared_ptr<Texture> texture = std::make_shared<Texture>(TEXTURE_PLACEHOLDER_COLOR, (uint32)paths.size());
+        std::shared_ptr<DecodedTexture> image = std::make_shared<DecodedTexture>();
+        image->texture = texture;
+        image->options = options;
+        image->layerSize = layerSize;
+        for (const std::string& path : paths)
+        {
+            image->layers.push_back(std::unique_ptr<DecodedTexture>(new DecodedTexture()));
+            image->layers.back()->path = path;
+            image->layers.back()->options = options;
+            image->path += (image->path.empty() ? "" : ", ") + path;
+        }
+
+        decoding++;
+        ThreadPool::shared().submit([this, image]() mutable
+        {
+            image->decodeLayers();
+            decoded.push(std::move(image));
+        });
+        return texture;
+    }
+
+    // Upload the decoded images, at most budgetBytes of pixels per call, once per frame on the GL thread
+    void update(const uint64 budgetBytes = 4 * 1024 * 1024)
+    {
+        std::shared_ptr<DecodedTexture> image;
+        while (decoded.pop(image))
+        {
+            uploading.push_back(std::move(image));
+            decoding--;
+        }
+
+        uint64 budget = budgetBytes;
+        while (!uploading.empty() && budget > 0)
+        {
+            // nobody uses it anymore
+            if (uploading.front()->texture.use_count() == 1 || upload(*uploading.front(), budget))
+                uploading.pop_front();
+        }
+    }
+
+    // Images still decoding, waiting for update or uploading
+    uint32 pendingCount() const
+    {
+        return decoding + (uint32)uploading.size();
+    }
+
+    // Wait for the decodes and drop the images not uploaded yet, before the GL context goes away
+    void shutdown()
+    {
+        std::shared_ptr<DecodedTexture> image;
+        while (decoding)
+        {
+            while (decoded.pop(image))
+                decoding--;
+            std::this_thread::yield();
+        }
+        image.reset();
+        uploading.clear();
+    }
+
+private:
+    // Send rows of the image while there is budget, returns true once it replaced the placeholder (or failed)
+    static bool upload(DecodedTexture& image, uint64& budget)
+    {
+        if (!image.layers.empty())
+            return uploadArray(image, budget);
+        if (!image.levels.empty())
+            return uploadCompressed(image, budget);
+        if (!image.pixels)
+        {
+            std::cout << "ERROR::TEXTURE::Failed to load " << image.path << std::endl;
+            return true;
+        }
+
+        const GLenum format = image.channels == 4 ? GL_RGBA : image.channels == 3 ? GL_RGB : image.channels == 2 ? GL_RG : GL_RED;
+        // the gray images are expanded by the swizzle, there are no one or two channel sRGB formats
+        GLenum internalFormat = image.channels == 4 ? GL_RGBA8 : image.channels == 3 ? GL_RGB8 : image.channels == 2 ? GL_RG8 : GL_R8;
+        if (image.options.srgb && image.channels >= 3)
+            internalFormat = image.channels == 4 ? GL_SRGB8_ALPHA8 : GL_SRGB8;
+        if (!image.staging)
+        {
+            image.staging = GLTexture::create();
+            glBindTexture(GL_TEXTURE_2D, image.staging);
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, NULL);
+            if (image.channels == 1)
+            {
+                const GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+                glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+            }
+        }
+        else
+            glBindTexture(GL_TEXTURE_2D, image.staging);
+
+        const uint64 rowBytes = (uint64)image.width * image.channels;
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if (image.uploadedRows < (uint32)image.height)
+        {
+            const uint32 rows = (uint32)std::min<uint64>(image.height - image.uploadedRows, std::max<uint64>(budget / rowBytes, 1));
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, image.uploadedRows, image.width, rows, format, GL_UNSIGNED_BYTE,
+                image.pixels + image.uploadedRows * rowBytes);
+            image.uploadedRows += rows;
+            budget -= std::min(budget, rows * rowBytes);
+        }
+        // then the mip levels, whole, while there is budget left
+        while (image.uploadedRows == (uint32)image.height && image.uploadedLevels < image.mips.size() && budget > 0)
+        {
+            const MipLevel& mip = image.mips[image.uploadedLevels];
+            image.uploadedLevels++;
+            glTexImage2D(GL_TEXTURE_2D, image.uploadedLevels, internalFormat, mip.width, mip.height, 0, format, GL_UNSIGNED_BYTE,
+                mip.pixels.data());
+            budget -= std::min<uint64>(budget, mip.pixels.size());
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        if (image.uploadedRows < (uint32)image.height || image.uploadedLevels < image.mips.size())
+            return false;
+
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, image.options.wrap);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, image.options.wrap);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, image.options.minFilter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, image.options.magFilter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)image.mips.size());
+
+        Texture& texture = *image.texture;
+        texture.ID = std::move(image.staging);
+        texture.width = image.width;
+        texture.height = image.height;
+        // the drivers pad RGB to four bytes
+        const uint32 texelBytes = image.channels == 3 ? 4 : image.channels;
+        texture.gpuBytes = (uint64)image.width * image.height * texelBytes;
+        for (const MipLevel& mip : image.mips)
+            texture.gpuBytes += (uint64)mip.width * mip.height * texelBytes;
+        stbi_image_free(image.pixels);
+        image.pixels = nullptr;
+        image.mips.clear();
+        return true;
+    }
+
+    static GLenum compressedFormat(const BlockFormat format, const bool srgb)
+    {
+        switch (format)
+        {
+        case BLOCK_BC1:
+            return srgb ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case BLOCK_BC3:
+            return srgb ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case BLOCK_BC4:
+            return GL_COMPRESSED_RED_RGTC1;
+        default:
+            return GL_COMPRESSED_RG_RGTC2;
+        }
+    }
+
+    // Send mip levels of a compressed texture while there is budget (at least one per call)
+    static bool uploadCompressed(DecodedTexture& image, uint64& budget)
+    {
+        if (!image.staging)
+            image.staging = GLTexture::create();
+        glBindTexture(GL_TEXTURE_2D, image.staging);
+
+        const GLenum internalFormat = compressedFormat(image.format, image.options.srgb);
+        const uint32 levelCount = (uint32)image.levels.size();
+        do
+        {
+            const CompressedLevel& level = image.levels[image.uploadedLevels];
+            glCompressedTexImage2D(GL_TEXTURE_2D, image.uploadedLevels, internalFormat, level.width, level.height, 0,
+                (GLsizei)level.size, level.data);
+            budget -= std::min(budget, level.size);
+            image.uploadedLevels++;
+        } while (image.uploadedLevels < levelCount && budget > 0);
+        if (image.uploadedLevels < levelCount)
+            return false;
+
+        if (image.format == BLOCK_BC4)
+        {
+            const GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+            glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, image.options.wrap);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, image.options.wrap);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, image.options.minFilter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, image.options.magFilter);
+
+        Texture& texture = *image.texture;
+        texture.ID = std::move(image.staging);
+        texture.width = image.width;
+        texture.height = image.height;
+        texture.gpuBytes = 0;
+        for (const CompressedLevel& level : image.levels)
+            texture.gpuBytes += level.size;
+        image.levels.clear();
+        image.compressedStorage.clear();
+        image.container.close();
+        return true;
+    }
+
+    /*
+    Send the layers of a texture array while there is budget, one mip level of one layer at a time
+    (at least one per call). The levels of all the layers are allocated first.
+    */
+    static bool uploadArray(DecodedTexture& image, uint64& budget)
+    {
+        const DecodedTexture& first = *image.layers[0];
+        const bool compressed = !first.levels.empty();
+        for (const std::unique_ptr<DecodedTexture>& layer : image.layers)
+        {
+            if (compressed ? layer->levels.empty() || layer->format != first.format : !layer->data())
+            {
+                std::cout << "ERROR::TEXTURE::Failed to load " << layer->path << std::endl;
+                return true;
+            }
+        }
+
+        const GLsizei layerCount = (GLsizei)image.layers.size();
+        const uint32 levelCount = compressed ? (uint32)first.levels.size() : (uint32)first.mips.size() + 1;
+        const GLenum internalFormat = compressed ? compressedFormat(first.format, image.options.srgb)
+            : image.options.srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+        if (!image.staging)
+        {
+            image.staging = GLTexture::create();
+            glBindTexture(GL_TEXTURE_2D_ARRAY, image.staging);
+            for (uint32 level = 0; level < levelCount; level++)
+            {
+                const GLsizei levelSize = (GLsizei)std::max(image.layerSize >> level, 1u);
+                if (compressed)
+                    glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, internalFormat, levelSize, levelSize, layerCount, 0,
+                        (GLsizei)(first.levels[level].size * layerCount), NULL);
+                else
+                    glTexImage3D(GL_TEXTURE_2D_ARRAY, level, internalFormat, levelSize, levelSize, layerCount, 0,
+                        GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            }
+        }
+        else
+            glBindTexture(GL_TEXTURE_2D_ARRAY, image.staging);
+
+        const uint32 total = levelCount * (uint32)layerCount;
+        do
+        {
+            const uint32 layer = image.uploadedLevels / levelCount;
+            const uint32 level = image.uploadedLevels % levelCount;
+            const DecodedTexture& source = *image.layers[layer];
+            if (compressed)
+            {
+                const CompressedLevel& data = source.levels[level];
+                glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, data.width, data.height, 1, internalFormat,
+                    (GLsizei)data.size, data.data);
+                budget -= std::min(budget, data.size);
+            }
+            else
+            {
+                const uint32 levelSize = level ? source.mips[level - 1].width : image.layerSize;
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, levelSize, levelSize, 1, GL_RGBA, GL_UNSIGNED_BYTE,
+                    level ? source.mips[level - 1].pixels.data() : source.data());
+                budget -= std::min<uint64>(budget, (uint64)levelSize * levelSize * 4);
+            }
+            image.uploadedLevels++;
+        } while (image.uploadedLevels < total && budget > 0);
+        if (image.uploadedLevels < total)
+            return false;
+
+        if (compressed && first.format == BLOCK_BC4)
+        {
+            const GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+            glTexParameteriv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+        }
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, image.options.wrap);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, image.options.wrap);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, image.options.minFilter);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, image.options.magFilter);
+
+        Texture& texture = *image.texture;
+        texture.ID = std::move(image.staging);
+        texture.width = (int)image.layerSize;
+        texture.height = (int)image.layerSize;
+        texture.gpuBytes = 0;
+        for (uint32 level = 0; level < levelCount; level++)
+        {
+            const uint64 levelSize = std::max(image.layerSize >> level, 1u);
+            texture.gpuBytes += (compressed ? first.levels[level].size : levelSize * levelSize * 4) * layerCount;
+        }
+        image.layers.clear();
+        return true;
+    }
+};
@@ -0,0 +1,147 @@
+#pragma once
+#include "main.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Fixed size pool of worker threads shared by the loaders.
+class ThreadPool
+{
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    bool stopping;
+public:
+    explicit ThreadPool(uint32 threadCount = 0)
+        : stopping(false)
+    {
+        if (threadCount == 0)
+        {
+            // leave one core to the GL thread
+            uint32 cores = std::thread::hardware_concurrency();
+            threadCount = cores > 1 ? cores - 1 : 1;
+        }
+
+        for (uint32 i = 0; i < threadCount; i++)
+            workers.emplace_back([this]() { workerLoop(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Pool used by default by the whole application
+    static ThreadPool& shared()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    uint32 size() const
+    {
+        return (uint32)workers.size();
+    }
+
+    template<typename Func>
+    auto submit(Func&& func) -> std::future<decltype(func())>
+    {
+        typedef decltype(func()) Result;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Func>(func));
+        std::future<Result> result = task->get_future();
+        push([task]() { (*task)(); });
+        return result;
+    }
+
+    /*
+    Call func(i) for every i in [0, count) and wait until all of them finished.
+    The calling thread takes part in the work and only waits for the helpers already running an
+    index, never for the ones still queued or for unrelated tasks, so it is safe to call it from a
+    worker and it never picks up a model import or a texture decode on the GL thread.
+    */
+    template<typename Func>
+    void parallelFor(const uint32 count, Func func)
+    {
+        if (count == 0)
+            return;
+
+        uint32 helpers = std::min(size(), count - 1);
+        if (helpers == 0)
+        {
+            for (uint32 i = 0; i < count; i++)
+                func(i);
+            return;
+        }
+
+        // a helper that starts after the loop is done finds no index left and doesn't touch func
+        struct Loop
+        {
+            std::atomic<uint32> next;
+            std::atomic<uint32> running;
+        };
+        std::shared_ptr<Loop> loop = std::make_shared<Loop>();
+        loop->next = 0;
+        loop->running = 0;
+        Func* body = &func;
+        for (uint32 i = 0; i < helpers; i++)
+        {
+            push([loop, body, count]()
+            {
+                loop->running++;
+                for (uint32 i = loop->next++; i < count; i = loop->next++)
+                    (*body)(i);
+                loop->running--;
+            });
+        }
+
+        for (uint32 i = loop->next++; i < count; i = loop->next++)
+            func(i);
+        while (loop->running.load() > 0)
+            std::this_thread::yield();
+    }
+
+private:
+    void push(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        wakeUp.notify_one();
+    }
+
+    void workerLoop()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeUp.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (stopping && tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
@@ -0,0 +1,69 @@
+#pragma once
+#include "main.h"
+#include <GLM/glm.hpp>
+#include <vector>
+
+
+struct Vertex
+{
+    glm::vec3 pos;
+    float layer = 0.0f; // MaterialArray layer, the index of the mesh in its model (w of the position attribute)
+    glm::vec3 normal;
+    glm::vec2 uvCoord;
+	glm::vec3 tangent;
+};
+
+// CPU side result of converting one submesh
+struct MeshData
+{
+    std::vector<Vertex> vertices;
+    std::vector<uint32> indices;
+};
+
+// Append the vertices of data to target, its indices rebased after the ones there and its layers moved up by firstLayer
+inline void appendMesh(MeshData& target, const MeshData& data, const float firstLayer = 0.0f)
+{
+    const uint32 base = (uint32)target.vertices.size();
+    for (const Vertex& vertex : data.vertices)
+    {
+        target.vertices.push_back(vertex);
+        target.vertices.back().layer += firstLayer;
+    }
+    for (uint32 index : data.indices)
+        target.indices.push_back(base + index);
+}
+
+// Part of an index buffer drawn with its own base vertex
+struct IndexRange
+{
+    uint32 firstIndex;
+    uint32 indexCount;
+    uint32 baseVertex;
+};
+
+// Axis aligned bounding box of the positions, zero when there are no vertices
+inline void boundingBox(const std::vector<Vertex>& vertices, glm::vec3& minPos, glm::vec3& maxPos)
+{
+    minPos = maxPos = vertices.empty() ? glm::vec3(0.0f) : vertices[0].pos;
+    for (const Vertex& vertex : vertices)
+    {
+        minPos = glm::min(minPos, vertex.pos);
+        maxPos = glm::max(maxPos, vertex.pos);
+    }
+}
+
+// Bounding sphere (center, radius) around the center of the bounding box
+inline glm::vec4 boundingSphere(const std::vector<Vertex>& vertices)
+{
+    if (vertices.empty())
+        return glm::vec4(0.0f);
+
+    glm::vec3 minPos;
+    glm::vec3 maxPos;
+    boundingBox(vertices, minPos, maxPos);
+    glm::vec3 center = (minPos + maxPos) * 0.5f;
+    float radius = 0.0f;
+    for (const Vertex& vertex : vertices)
+        radius = glm::max(radius, glm::length(vertex.pos - center));
+    return glm::vec4(center, radius);
+}
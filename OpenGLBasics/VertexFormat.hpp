@@ -0,0 +1,327 @@
+#pragma once
+#include "main.h"
+#include "Vertex.hpp"
+#define GLEW_STATIC
+#include <GL/glew.h>
+#include <GLM/glm.hpp>
+#include <GLM/gtc/packing.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+
+/*
+Compact vertex layouts.
+Positions can be stored as 16 bit integers inside the mesh bounds, the shaders rebuild them with
+the per mesh dequantization vec4 fed to POSITION_DEQUANT_LOCATION (position * w + xyz).
+The position attribute has 4 components in every layout, w is the MaterialArray layer of the vertex.
+Normals and tangents can be stored as 10_10_10_2 snorm (decoded by the GPU) or as octahedral
+16 bit snorm pairs (decoded in the shader when OCTAHEDRAL_NORMALS is defined).
+*/
+
+// generic attribute holding the position dequantization, it is free in every vertex shader
+#define POSITION_DEQUANT_LOCATION 15
+#define OCTAHEDRAL_NORMALS_DEFINE "#define OCTAHEDRAL_NORMALS\n"
+
+enum NormalEncoding
+{
+    NORMAL_FLOAT,
+    NORMAL_1010102,
+    NORMAL_OCTAHEDRAL
+};
+
+struct VertexLayout
+{
+    NormalEncoding normals = NORMAL_FLOAT;
+    bool halfUVs = false;
+    bool quantizePositions = false;
+
+    bool isFloat() const
+    {
+        return normals == NORMAL_FLOAT && !halfUVs && !quantizePositions;
+    }
+};
+
+struct VertexAttribute
+{
+    int size;
+    GLenum type;
+    GLboolean normalized;
+    uint32 offset;
+};
+
+struct VertexFormat
+{
+    VertexAttribute position;
+    VertexAttribute normal;
+    VertexAttribute uv;
+    VertexAttribute tangent;
+    uint32 stride;
+};
+
+// Worst error introduced by the packing
+struct PackingError
+{
+    float position;  // in model units
+    float normal;    // in degrees
+    float tangent;   // in degrees
+    float uv;
+};
+
+struct PackedVertices
+{
+    VertexFormat format;
+    glm::vec4 dequant;                  // position = packed * w + xyz
+    std::vector<unsigned char> data;    // empty for the float layout, the Vertex array is used as it is
+    PackingError error;
+
+    // Bytes to upload for the vertices that were packed
+    const void* bytes(const std::vector<Vertex>& vertices) const
+    {
+        return data.empty() ? (const void*)vertices.data() : (const void*)data.data();
+    }
+};
+
+inline VertexFormat makeVertexFormat(const VertexLayout& layout)
+{
+    VertexFormat format;
+    uint32 offset = 0;
+
+    auto normalAttribute = [&](VertexAttribute& attribute)
+    {
+        switch (layout.normals)
+        {
+        case NORMAL_1010102:
+            attribute = { 4, GL_INT_2_10_10_10_REV, GL_TRUE, offset };
+            offset += 4;
+            break;
+        case NORMAL_OCTAHEDRAL:
+            attribute = { 2, GL_SHORT, GL_TRUE, offset };
+            offset += 4;
+            break;
+        default:
+            attribute = { 3, GL_FLOAT, GL_FALSE, offset };
+            offset += 12;
+        }
+    };
+
+    // the 4th component is the layer, the shorts are not normalized so it stays an integer (dequant.w scales them)
+    if (layout.quantizePositions)
+    {
+        format.position = { 4, GL_SHORT, GL_FALSE, offset };
+        offset += 8;
+    }
+    else
+    {
+        format.position = { 4, GL_FLOAT, GL_FALSE, offset };
+        offset += 16;
+    }
+
+    normalAttribute(format.normal);
+
+    if (layout.halfUVs)
+    {
+        format.uv = { 2, GL_HALF_FLOAT, GL_FALSE, offset };
+        offset += 4;
+    }
+    else
+    {
+        format.uv = { 2, GL_FLOAT, GL_FALSE, offset };
+        offset += 8;
+    }
+
+    normalAttribute(format.tangent);
+
+    format.stride = offset;
+    return format;
+}
+
+// Set the vertex attributes 0 to 3 of the bound VAO for the vertex buffer bound to GL_ARRAY_BUFFER
+inline void setVertexAttributes(const VertexFormat& format)
+{
+    const VertexAttribute* attributes[] = { &format.position, &format.normal, &format.uv, &format.tangent };
+    for (uint32 i = 0; i < 4; i++)
+    {
+        glEnableVertexAttribArray(i);
+        glVertexAttribPointer(i, attributes[i]->size, attributes[i]->type, attributes[i]->normalized,
+            format.stride, (void*)(size_t)attributes[i]->offset);
+    }
+}
+
+inline glm::vec2 octahedralEncode(glm::vec3 n)
+{
+    n /= (std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z));
+    glm::vec2 result(n.x, n.y);
+    if (n.z < 0.0f)
+    {
+        result.x = (1.0f - std::fabs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+        result.y = (1.0f - std::fabs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return result;
+}
+
+inline glm::vec3 octahedralDecode(const glm::vec2& e)
+{
+    glm::vec3 n(e.x, e.y, 1.0f - std::fabs(e.x) - std::fabs(e.y));
+    float t = std::max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return glm::normalize(n);
+}
+
+inline float angleBetween(const glm::vec3& a, const glm::vec3& b)
+{
+    float la = glm::length(a);
+    float lb = glm::length(b);
+    if (la == 0.0f || lb == 0.0f)
+        return 0.0f;
+    float cosine = std::min(1.0f, std::max(-1.0f, glm::dot(a, b) / (la * lb)));
+    return glm::degrees(std::acos(cosine));
+}
+
+// Pack a unit vector with the layout encoding and return the decoded value
+inline glm::vec3 packDirection(const glm::vec3& direction, const NormalEncoding encoding, unsigned char* out)
+{
+    float length = glm::length(direction);
+    glm::vec3 n = length > 0.0f ? direction / length : glm::vec3(0.0f, 0.0f, 1.0f);
+
+    if (encoding == NORMAL_1010102)
+    {
+        glm::uint32 packed = glm::packSnorm3x10_1x2(glm::vec4(n, 0.0f));
+        memcpy(out, &packed, 4);
+        return glm::vec3(glm::unpackSnorm3x10_1x2(packed));
+    }
+
+    glm::uint32 packed = glm::packSnorm2x16(octahedralEncode(n));
+    memcpy(out, &packed, 4);
+    return octahedralDecode(glm::unpackSnorm2x16(packed));
+}
+
+inline PackedVertices packVertices(const std::vector<Vertex>& vertices, const VertexLayout& layout)
+{
+    PackedVertices packed;
+    packed.format = makeVertexFormat(layout);
+    packed.dequant = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    packed.error = { 0.0f, 0.0f, 0.0f, 0.0f };
+    if (layout.isFloat() || vertices.empty())
+        return packed;
+
+    // center and half size of the bounds used for the position quantization, w maps the shorts to it
+    if (layout.quantizePositions)
+    {
+        glm::vec3 minPos = vertices[0].pos;
+        glm::vec3 maxPos = vertices[0].pos;
+        for (const Vertex& vertex : vertices)
+        {
+            minPos = glm::min(minPos, vertex.pos);
+            maxPos = glm::max(maxPos, vertex.pos);
+        }
+        glm::vec3 half = (maxPos - minPos) * 0.5f;
+        float extent = std::max(half.x, std::max(half.y, half.z));
+        packed.dequant = glm::vec4((minPos + maxPos) * 0.5f, (extent > 0.0f ? extent : 1.0f) / 32767.0f);
+    }
+
+    const VertexFormat& format = packed.format;
+    packed.data.resize(vertices.size() * format.stride);
+    for (size_t i = 0; i < vertices.size(); i++)
+    {
+        const Vertex& vertex = vertices[i];
+        unsigned char* out = &packed.data[i * format.stride];
+
+        glm::vec3 position = vertex.pos;
+        if (layout.quantizePositions)
+        {
+            glm::vec3 local = glm::round(glm::clamp((vertex.pos - glm::vec3(packed.dequant)) / packed.dequant.w, -32767.0f, 32767.0f));
+            const glm::i16vec4 bits(local, vertex.layer);
+            memcpy(out + format.position.offset, &bits, 8);
+            position = glm::vec3(bits) * packed.dequant.w + glm::vec3(packed.dequant);
+        }
+        else
+        {
+            memcpy(out + format.position.offset, &vertex.pos, 12);
+            memcpy(out + format.position.offset + 12, &vertex.layer, 4);
+        }
+
+        glm::vec3 normal = vertex.normal;
+        glm::vec3 tangent = vertex.tangent;
+        if (layout.normals != NORMAL_FLOAT)
+        {
+            normal = packDirection(vertex.normal, layout.normals, out + format.normal.offset);
+            tangent = packDirection(vertex.tangent, layout.normals, out + format.tangent.offset);
+        }
+        else
+        {
+            memcpy(out + format.normal.offset, &vertex.normal, 12);
+            memcpy(out + format.tangent.offset, &vertex.tangent, 12);
+        }
+
+        glm::vec2 uv = vertex.uvCoord;
+        if (layout.halfUVs)
+        {
+            glm::uint32 bits = glm::packHalf2x16(vertex.uvCoord);
+            memcpy(out + format.uv.offset, &bits, 4);
+            uv = glm::unpackHalf2x16(bits);
+        }
+        else
+            memcpy(out + format.uv.offset, &vertex.uvCoord, 8);
+
+        packed.error.position = std::max(packed.error.position, glm::length(position - vertex.pos));
+        packed.error.normal = std::max(packed.error.normal, angleBetween(normal, vertex.normal));
+        packed.error.tangent = std::max(packed.error.tangent, angleBetween(tangent, vertex.tangent));
+        packed.error.uv = std::max(packed.error.uv, std::max(std::fabs(uv.x - vertex.uvCoord.x), std::fabs(uv.y - vertex.uvCoord.y)));
+    }
+
+    return packed;
+}
+
+// Read back a direction stored by packDirection (or as 3 floats)
+inline glm::vec3 unpackDirection(const unsigned char* data, const VertexAttribute& attribute)
+{
+    glm::uint32 packed;
+    memcpy(&packed, data, 4);
+    if (attribute.type == GL_INT_2_10_10_10_REV)
+        return glm::vec3(glm::unpackSnorm3x10_1x2(packed));
+    if (attribute.type == GL_SHORT)
+        return octahedralDecode(glm::unpackSnorm2x16(packed));
+
+    glm::vec3 direction;
+    memcpy(&direction, data, 12);
+    return direction;
+}
+
+// Inverse of packVertices, count vertices stored with format and dequant back to floats
+inline std::vector<Vertex> unpackVertices(const void* data, const uint32 count, const VertexFormat& format, const glm::vec4& dequant)
+{
+    std::vector<Vertex> vertices(count);
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (uint32 i = 0; i < count; i++, bytes += format.stride)
+    {
+        Vertex& vertex = vertices[i];
+        if (format.position.type == GL_SHORT)
+        {
+            glm::i16vec4 bits;
+            memcpy(&bits, bytes + format.position.offset, 8);
+            vertex.pos = glm::vec3(bits) * dequant.w + glm::vec3(dequant);
+            vertex.layer = (float)bits.w;
+        }
+        else
+        {
+            memcpy(&vertex.pos, bytes + format.position.offset, 12);
+            memcpy(&vertex.layer, bytes + format.position.offset + 12, 4);
+        }
+
+        vertex.normal = unpackDirection(bytes + format.normal.offset, format.normal);
+        vertex.tangent = unpackDirection(bytes + format.tangent.offset, format.tangent);
+
+        if (format.uv.type == GL_HALF_FLOAT)
+        {
+            glm::uint32 bits;
+            memcpy(&bits, bytes + format.uv.offset, 4);
+            vertex.uvCoord = glm::unpackHalf2x16(bits);
+        }
+        else
+            memcpy(&vertex.uvCoord, bytes + format.uv.offset, 8);
+    }
+    return vertices;
+}
@@ -1,7 +1,14 @@
 #include "main.h"
 #include "Model.hpp"
+#include "Culling.hpp"
+#include "StaticBatch.hpp"
+#include "HierarchicalLod.hpp"
+#include "Impostor.hpp"
+#include "TextureCache.hpp"
 #include <GLFW/glfw3.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "ImGui/imgui.h"
 #include "ImGui/imgui_impl_glfw.h"
@@ -20,6 +27,9 @@ float lastY = HEIGHT / 2.0f;
 float deltaTime = 0.0f;	// time between current frame and last frame
 float lastFrame = 0.0f;
 bool firstMouse = true;
+// the heavy test scenes (--field and --crowd, or the GUI checkboxes)
+bool showField = false;	// 144 wheels drawn through the HLOD
+bool showCrowd = false;	// 10000 wheels drawn as impostors past a cutoff
 
 void initLog()
 {
@@ -37,13 +47,66 @@ int main(int argc, char** argv)
 {
     initLog();
 
+    // compare the OBJ readers without opening a window
+    if (argc > 2 && strcmp(argv[1], "--bench-obj") == 0)
+    {
+        for (int i = 2; i < argc; i++)
+            benchmarkObjImport(argv[i]);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "--bench-cull") == 0)
+    {
+        benchmarkCulling((uint32)atoi(argv[2]));
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "--bench-codec") == 0)
+    {
+        benchmarkShortIndexStreams();
+        for (int i = 2; i < argc; i++)
+            benchmarkMeshCodec(argv[i]);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "--bench-mips") == 0)
+    {
+        for (int i = 2; i < argc; i++)
+            benchmarkMipGeneration(argv[i]);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "--bench-bc") == 0)
+    {
+        for (int i = 2; i < argc; i++)
+            benchmarkBlockCompression(argv[i]);
+        return 0;
+    }
+    // build the block compressed containers ahead of time: --compress-textures bc1|bc3|bc4|bc5 images...
+    if (argc > 3 && strcmp(argv[1], "--compress-textures") == 0)
+    {
+        const BlockFormat format = strcmp(argv[2], "bc3") == 0 ? BLOCK_BC3 : strcmp(argv[2], "bc4") == 0 ? BLOCK_BC4
+            : strcmp(argv[2], "bc5") == 0 ? BLOCK_BC5 : BLOCK_BC1;
+        int failed = 0;
+        for (int i = 3; i < argc; i++)
+            failed |= !compressTextureFile(argv[i], format, format == BLOCK_BC1 || format == BLOCK_BC3);
+        return failed;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--field") == 0)
+            showField = true;
+        else if (strcmp(argv[i], "--crowd") == 0)
+            showCrowd = true;
+    }
+
     GLFWwindow* window = nullptr;
     if (createWindow(&window) || configOpenGL())
     {
         return 1;
     }
 
-    if(run(window))
+    const int result = run(window);
+    // the models are gone with run, the shared GL objects go before the context
+    GeometryArena::shared().shutdown();
+    if(result)
     {
         return 1;
     }
@@ -60,18 +123,24 @@ int run(GLFWwindow* window)
 	glm::vec3 sunPos = sunDir * 1.8f;
 
     // SHADERS
-    Shader shader("res\\Shaders\\vertexInstanced.vert", "res\\Shaders\\fragment_PBR.frag");
-    shader.bind();
-    shader.setInt("material.albedo", 0);
-	shader.setInt("material.MRA", 1);
-	shader.setInt("shadowMap", 2);
-
-	shader.setVec4f("sun.direction", sunDir.x, sunDir.y, sunDir.z, 0);
-	shader.setVec4f("sun.position", sunPos.x, sunPos.y, sunPos.z, 1.0f),
-    shader.setVec4f("sun.ambient", 0.2f, 0.2f, 0.2f);
-    shader.setVec4f("sun.diffuse", 1.0f, 0.9f, 0.8f);
-    shader.setVec4f("sun.specular");
-	shader.setFloat("sun.energy", 10.5f);
+    // the lit shader, the meshes read their maps from MaterialArrays with the layer of their vertices
+    Shader shader("res\\Shaders\\vertexInstanced.vert", "res\\Shaders\\fragment_PBR.frag", MATERIAL_ARRAYS_DEFINE);
+    // the impostors are lit by the same shader from their baked atlases
+    Shader impostorShader("res\\Shaders\\impostor.vert", "res\\Shaders\\fragment_PBR.frag", IMPOSTOR_DEFINE);
+    for (Shader* lit : { &shader, &impostorShader })
+    {
+        lit->bind();
+        lit->setInt("material.albedo", 0);
+        lit->setInt("material.MRA", 1);
+        lit->setInt("shadowMap", 2);
+
+        lit->setVec4f("sun.direction", sunDir.x, sunDir.y, sunDir.z, 0);
+        lit->setVec4f("sun.position", sunPos.x, sunPos.y, sunPos.z, 1.0f);
+        lit->setVec4f("sun.ambient", 0.2f, 0.2f, 0.2f);
+        lit->setVec4f("sun.diffuse", 1.0f, 0.9f, 0.8f);
+        lit->setVec4f("sun.specular");
+        lit->setFloat("sun.energy", 10.5f);
+    }
 	
 
 	Shader r2TexShader("res\\Shaders\\renderToTexture.vert", "res\\Shaders\\renderToTexture.frag");
@@ -82,35 +151,40 @@ int run(GLFWwindow* window)
 
 	Shader unlitShader("res\\Shaders\\vertexInstanced.vert", "res\\Shaders\\fragment_unlit.frag");
 	unlitShader.setInt("diffuse", 0);
+
+	Shader impostorBake("res\\Shaders\\impostorBake.vert", "res\\Shaders\\impostorBake.frag", MATERIAL_ARRAYS_DEFINE);
     
 	
 	// MODELS
-    Texture tireTexD("res\\Textures\\Tire_df.png");
-    Texture tireTexS("res\\Textures\\Tire_sp.png");
-	Texture tireTexN("res\\Textures\\Tire_nm_inv.png");
-    Material tireMat = { &tireTexD, &tireTexS, &tireTexN, 27.0f};
-
-	Texture rimTexD("res\\Textures\\Rim_df.png");
-	Texture rimTexS("res\\Textures\\Rim_sp.png");
-	Texture rimTexN("res\\Textures\\Rim_nm.png");
-	Material rimMat = { &rimTexD, &rimTexS, &rimTexN, 256.0f};
-
-    std::vector<Material> materials = { tireMat, rimMat };
-    ModelInstanced model("res\\Models\\wheel.obj", &materials, "Wheel");
-
-	Texture floorTexD("res\\Textures\\RedBrick\\brick_df.png");
-	Texture floorTexS("res\\Textures\\blue.bmp");
-	Texture floorTexN("res\\Textures\\RedBrick\\brick_nm.png");
-	Material floorMaterial = { &floorTexD, &floorTexS, &floorTexN, 5.0f };
-	
-	std::vector<Material> floorMaterials = { floorMaterial };
-	ModelInstanced floor("res\\Models\\plane.obj", &floorMaterials);
+	// the textures are decoded in the background, they are gray until uploaded.
+	// The cache shares the ones loaded from the same file. They are block compressed, the
+	// containers are written next to the images the first time.
+	// The mip chains are made on the CPU, the color ones with the sharper Kaiser filter.
+	TextureOptions colorOptions;
+	colorOptions.compression = TEXTURE_COMPRESS_COLOR;
+	colorOptions.mipFilter = MIP_FILTER_KAISER;
+	colorOptions.minFilter = GL_LINEAR_MIPMAP_LINEAR;
+	// the lit shaders have no normal mapping, the normal maps of the materials are not loaded.
+    // Every wheel reads the tire and rim maps from texture arrays, its two meshes are merged in one draw
+    MaterialArray wheelMaterials({ { "res\\Textures\\Tire_df.png", "res\\Textures\\Tire_sp.png" },
+        { "res\\Textures\\Rim_df.png", "res\\Textures\\Rim_sp.png" } }, 1024, colorOptions, colorOptions);
+    // the models are loaded in the background and drawn once they are uploaded. The wheel comes with
+    // levels of detail stored coarsest first: its base level is drawn first and the finer ones stream in.
+    ImportOptions wheelOptions;
+    wheelOptions.lodCount = 4;
+    wheelOptions.progressive = true;
+    wheelOptions.mergeMeshes = true;
+    ModelInstanced model(ModelLoader::shared().load("res\\Models\\wheel.obj", wheelOptions, "Wheel"), &wheelMaterials, "Wheel");
+
+	// the maps of the static scene, layer 0 is the floor
+	MaterialArray staticMaterials({ { "res\\Textures\\RedBrick\\brick_df.png", "res\\Textures\\blue.bmp" } }, 1024,
+		colorOptions, colorOptions);
     
-	Texture sunD("res\\Textures\\white.bmp");
-	Material sunMaterial = { &sunD, nullptr, nullptr, 1.0f };
+	std::shared_ptr<Texture> sunD = TextureCache::shared().acquire("res\\Textures\\white.bmp");
+	Material sunMaterial = { sunD.get(), nullptr, nullptr, 1.0f };
 
 	std::vector<Material> sunMaterials = { sunMaterial };
-	ModelInstanced sunModel("res\\Models\\sphere_lp.obj", &sunMaterials);
+	ModelInstanced sunModel(ModelLoader::shared().load("res\\Models\\sphere_lp.obj"), &sunMaterials);
 
 	// when instanced is 2 drawcalls 1 per mesh (wheel)
     const uint32 wheelsCount = 1;
@@ -120,7 +194,29 @@ int run(GLFWwindow* window)
 	
 	glm::mat4 floorMat = glm::translate(glm::vec3(0, -0.8, 0))
 		* glm::scale(glm::vec3(10.0f, 10.0f, 10.0f));
-	glm::mat3 floorNMat = glm::transpose(glm::inverse(glm::mat3(floorMat)));
+
+	// the floor never moves, it is merged in world space with the other static objects in one draw
+	// its CPU copy is kept so the batch is built without reading the mesh back from the GPU
+	ImportOptions staticOptions;
+	staticOptions.cpuData = CPU_DATA_KEEP;
+	StaticBatch staticScene(staticMaterials);
+	staticScene.add(ModelLoader::shared().load("res\\Models\\plane.obj", staticOptions), 0, floorMat);
+
+	// a field of wheels behind the floor, the far groups are drawn as simplified proxies.
+	// It is placed the first time it is shown, its proxies need every level of the wheel.
+	ModelInstanced fieldWheel(model.getGeometry(), &wheelMaterials, "FieldWheel");
+	HierarchicalLod field(4.0f, 6.0f);
+	HlodStats fieldStats = { 0, 0, 0 };
+
+	// a crowd of wheels further away, drawn as impostors past the cutoff once the wheel is baked
+	ModelInstanced crowdWheel(model.getGeometry(), &wheelMaterials, "CrowdWheel");
+	Impostor wheelImpostor;
+	std::vector<glm::mat4> crowdMats;
+	for (int x = 0; x < 100; x++)
+		for (int z = 0; z < 100; z++)
+			crowdMats.push_back(glm::translate(glm::vec3(-50.0f + x, -0.3f, -35.0f - z))
+				* glm::rotate(glm::radians((float)((x * 100 + z) * 37 % 360)), glm::vec3(0, 1, 0)) * glm::scale(glm::vec3(0.4f)));
+	uint32 crowdImpostors = 0;
     
 	glm::mat4 modelMat = glm::rotate(glm::radians(0.0f), glm::vec3(0, 1, 0));
     glm::mat3 normalMat = glm::transpose(glm::inverse(glm::mat3(modelMat)));
@@ -129,6 +225,7 @@ int run(GLFWwindow* window)
 	
 	glm::mat4 transform;
 	float angle = 0.0f;
+	InstanceCuller wheelCuller;
 
 	// Screen plane
 	uint32 vao;
@@ -283,6 +380,8 @@ int run(GLFWwindow* window)
 	shadowMap.setMat4f("lightSpaceMatrix", PVmatLight);
 	shader.bind();
 	shader.setMat4f("lightSpaceMatrix", PVmatLight);
+	impostorShader.bind();
+	impostorShader.setMat4f("lightSpaceMatrix", PVmatLight);
 
 
 	
@@ -294,6 +393,27 @@ int run(GLFWwindow* window)
 		ImGui_ImplGlfw_NewFrame();
 		ImGui::NewFrame();
 
+        // Upload what the loader imported, a few milliseconds per frame
+        ModelLoader::shared().update(2.0f);
+        TextureLoader::shared().update();
+        staticScene.update();
+        // the field and the crowd are only built once they are shown
+        if (showField)
+        {
+            if (field.placementCount() == 0)
+                for (int x = -6; x < 6; x++)
+                    for (int z = 0; z < 12; z++)
+                        field.add(fieldWheel, glm::translate(glm::vec3(x * 1.5f, -0.3f, -12.0f - z * 1.5f)) * glm::scale(glm::vec3(0.5f)));
+            field.update();
+        }
+        if (showCrowd && !wheelImpostor.isBaked())
+        {
+            // the impostor is baked from the full detail wheel
+            crowdWheel.getGeometry()->requestAll();
+            if (crowdWheel.getGeometry()->isComplete() && !TextureLoader::shared().pendingCount())
+                wheelImpostor.bake(crowdWheel, impostorBake);
+        }
+
         // Logic
 		angle += .5f;
 		angle = (angle > 360.0f) ? 0.0f : angle;
@@ -314,11 +434,9 @@ int run(GLFWwindow* window)
 
 			shadowMap.bind();
 
-			shadowMap.setMat4f("model", modelMat);
-			model.draw(shader, 1);
-
-			shadowMap.setMat4f("model", floorMat);
-			floor.draw(shader, 1);
+			// the wheel casts the levels the camera sees, the shadow map reads the instance model matrices
+			model.drawLods(cam, perspective, (float)HEIGHT, 1, &modelMat);
+			staticScene.draw();
 		}
 		
 
@@ -334,7 +452,7 @@ int run(GLFWwindow* window)
 			unlitShader.bind();
 			transform = PVmat * sunMat;
 			sunModel.setTransforms(1, &transform, 0);
-			sunModel.draw(unlitShader, 1);
+			sunModel.draw(1);
 			
 
 			shader.bind();
@@ -344,17 +462,22 @@ int run(GLFWwindow* window)
 			glActiveTexture(GL_TEXTURE0 + 2);
 			glBindTexture(GL_TEXTURE_2D, depthMap);
 
-			transform = PVmat * modelMat;
-			model.setTransforms(1, &transform, 0);
-			model.setTransforms(1, &modelMat, 1);
-			model.setTransforms(1, &normalMat);
-			model.draw(shader, 1);
-
-			transform = PVmat * floorMat;
-			floor.setTransforms(1, &transform, 0);
-			floor.setTransforms(1, &floorMat, 1);
-			floor.setTransforms(1, &floorNMat);
-			floor.draw(shader, 1);
+			// only the instances inside the view are drawn, each with the level it needs.
+			// The wheel streams in its finer levels as the camera gets closer.
+			const uint32 visibleWheels = wheelCuller.cull(PVmat, model.getBounds(), wheelsCount, &modelMat, &normalMat);
+			if (visibleWheels)
+				model.drawLods(cam, perspective, (float)HEIGHT, visibleWheels, wheelCuller.models.data());
+
+			staticScene.setViewProjection(PVmat);
+			staticScene.draw();
+
+			if (showField)
+				fieldStats = field.draw(PVmat, camPos);
+
+			if (showCrowd)
+			{
+				crowdImpostors = wheelImpostor.drawInstances(crowdWheel, impostorShader, PVmat, camPos, 8.0f, (uint32)crowdMats.size(), crowdMats.data());
+			}
 		}
 		
 
@@ -380,6 +503,31 @@ int run(GLFWwindow* window)
 			static float f = 0.0f;
 			ImGui::SliderFloat("float", &f, 0.0f, 1.0f);            // Edit 1 float using a slider from 0.0f to 1.0f
 			ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+			if (ModelLoader::shared().pendingCount())
+				ImGui::Text("Loading %u models", ModelLoader::shared().pendingCount());
+			if (TextureLoader::shared().pendingCount())
+				ImGui::Text("Loading %u textures", TextureLoader::shared().pendingCount());
+			if (staticScene.isBuilt())
+				ImGui::Text("Static: %u objects in %u draws", staticScene.objectCount(), staticScene.batchCount());
+			ImGui::Checkbox("Wheel field", &showField);
+			if (showField && field.isBuilt())
+				ImGui::Text("HLOD: %u clusters, %u proxies and %u objects in %u draws", field.clusterCount(), fieldStats.proxies, fieldStats.objects, fieldStats.drawCalls);
+			ImGui::Checkbox("Wheel crowd", &showCrowd);
+			if (showCrowd)
+				ImGui::Text("Crowd: %u of %u wheels as impostors", crowdImpostors, (uint32)crowdMats.size());
+			if (ImGui::CollapsingHeader("Memory"))
+			{
+				ModelRegistry::shared().forEach([](const ModelGeometry& geometry)
+				{
+					const ModelMemory memory = geometry.memoryUsage();
+					ImGui::Text("%s: CPU %.1f KB, GPU %.1f KB", geometry.getName().c_str(), memory.cpuBytes / 1024.0, memory.gpuBytes / 1024.0);
+				});
+				const TextureCacheStats textureStats = TextureCache::shared().stats();
+				ImGui::Text("Textures: %u, %.1f KB, %.0f%% cache hits", textureStats.textures, textureStats.residentBytes / 1024.0,
+					TextureCache::shared().hitRate() * 100.0f);
+				if (ImGui::Button("Print memory report"))
+					printMemoryReport();
+			}
 		}
 
 		// GUI Rendering
@@ -394,6 +542,8 @@ int run(GLFWwindow* window)
     }
 
 	// Cleanup
+	ModelLoader::shared().shutdown();
+	TextureLoader::shared().shutdown();
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplGlfw_Shutdown();
 	ImGui::DestroyContext();
@@ -1,9 +1,12 @@
 #pragma once
 #define GLEW_STATIC
 #include <GL/glew.h>
+#include "GLHandle.hpp"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include <string>
+#include <algorithm>
+#include <filesystem>
 #include <vector>
 #include <fstream>
 #include <sstream>
@@ -13,6 +16,23 @@
 
 
 typedef unsigned int uint32;
+typedef unsigned long long uint64;
+
+// Same string for every spelling of a path (separators, "..", case on Windows), used as a cache key
+std::string canonicalPath(const std::string& path)
+{
+    std::string normalized = path;
+    std::replace(normalized.begin(), normalized.end(), '\\', '/');
+    std::error_code error;
+    std::filesystem::path canonical = std::filesystem::weakly_canonical(normalized, error);
+    if (error)
+        canonical = std::filesystem::path(normalized).lexically_normal();
+    std::string result = canonical.generic_string();
+#ifdef _WIN32
+    std::transform(result.begin(), result.end(), result.begin(), [](const char c) { return (char)tolower(c); });
+#endif
+    return result;
+}
 
 std::string getShaderSrc(const char* fileName)
 {
@@ -53,14 +73,15 @@ void shaderCompileStatus(uint32 shader)
 class Shader
 {
 public:
-    // the program ID
-    unsigned int ID;
+    // the program ID, deleted with the shader
+    GLProgram ID;
 
     // constructor reads and builds the shader
-    Shader(const char* vertexPath, const char* fragmentPath)
+    // defines are inserted after the #version line of both sources
+    Shader(const char* vertexPath, const char* fragmentPath, const std::string& defines = "")
     {
         // Get the shader sources and compile them
-        auto stringSource = getShaderSrc(vertexPath);
+        auto stringSource = insertDefines(getShaderSrc(vertexPath), defines);
         auto vertexShaderSource = stringSource.c_str();
         uint32 vertexShader;
         vertexShader = glCreateShader(GL_VERTEX_SHADER);
@@ -68,7 +89,7 @@ public:
         glCompileShader(vertexShader);
         shaderCompileStatus(vertexShader);
 
-        stringSource = getShaderSrc(fragmentPath);
+        stringSource = insertDefines(getShaderSrc(fragmentPath), defines);
         const char* fragmentShaderSource = stringSource.c_str();
         uint32 fragmentShader;
         fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
@@ -77,7 +98,7 @@ public:
         shaderCompileStatus(fragmentShader);
         
         // create the shader program
-        ID = glCreateProgram();
+        ID = GLProgram::create();
         // attach the shaders to the program
         glAttachShader(ID, vertexShader);
         glAttachShader(ID, fragmentShader);
@@ -136,17 +157,33 @@ private:
     {
         return glGetUniformLocation(ID, name);
     }
+
+    static std::string insertDefines(const std::string& source, const std::string& defines)
+    {
+        if (defines.empty())
+            return source;
+        size_t lineEnd = source.find('\n');
+        if (lineEnd == std::string::npos)
+            return source + "\n" + defines;
+        return source.substr(0, lineEnd + 1) + defines + source.substr(lineEnd + 1);
+    }
 };
 
 
 class Texture
 {
 public:
-    uint32 ID;
+    GLTexture ID; // deleted with the texture, so textures can only be moved
+    GLenum target; // GL_TEXTURE_2D, or GL_TEXTURE_2D_ARRAY for the textures of a MaterialArray
+    int width;
+    int height;
+    uint32 layers;
+    uint64 gpuBytes; // estimate of the video memory used, mip chain included
 
     Texture(const char* fileName)
+        : target(GL_TEXTURE_2D), width(0), height(0), layers(1), gpuBytes(0)
     {
-        int width, height, nrChannels;
+        int nrChannels;
         unsigned char* data = stbi_load(fileName, &width, &height, &nrChannels, 0);
         if (!data)
         {
@@ -154,7 +191,7 @@ public:
             return;
         }
 
-        glGenTextures(1, &ID);
+        ID = GLTexture::create();
         glBindTexture(GL_TEXTURE_2D, ID);
 
         // set the texture wrapping/filtering options (on the currently bound texture object)
@@ -167,15 +204,35 @@ public:
         GLenum channels = (nrChannels == 4) ? GL_SRGB_ALPHA : GL_SRGB;
 		GLenum channelsImage = (nrChannels == 4) ? GL_RGBA : GL_RGB;
         glTexImage2D(GL_TEXTURE_2D, 0, channels, width, height, 0, channelsImage, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
+        // sampled with GL_LINEAR, the mip chain would never be read (TextureLoader makes it on the CPU)
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        gpuBytes = (uint64)width * height * 4;
 
         stbi_image_free(data);
     }
 
+    // A 1x1 texture of one color (0xAABBGGRR), bound in place of an image until it is loaded.
+    // With inLayers, a texture array of inLayers layers of that color.
+    explicit Texture(const uint32 color, const uint32 inLayers = 0)
+        : target(inLayers ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D), width(1), height(1), layers(std::max(inLayers, 1u)), gpuBytes(4 * layers)
+    {
+        std::vector<unsigned char> pixels(4 * layers);
+        for (uint32 i = 0; i < pixels.size(); i++)
+            pixels[i] = (unsigned char)(color >> (i % 4 * 8));
+        ID = GLTexture::create();
+        glBindTexture(target, ID);
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        if (target == GL_TEXTURE_2D_ARRAY)
+            glTexImage3D(target, 0, GL_SRGB_ALPHA, 1, 1, layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+        else
+            glTexImage2D(target, 0, GL_SRGB_ALPHA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    }
+
     void bind(const uint32 unit = 0) const
     {
         glActiveTexture(GL_TEXTURE0 + unit);
-        glBindTexture(GL_TEXTURE_2D, ID);
+        glBindTexture(target, ID);
     }
 };
 
@@ -1,9 +1,20 @@
 #version 330
 in vec2 uvCoord;
-in vec4 vNormal;
 in vec4 vPos;
+#ifdef IMPOSTOR
+// the quad of a baked view (impostor.vert), the surface comes from the atlases
+in mat3 frameToWorld;
+in vec3 frameDir;
+in float radius;
+
+uniform mat4 PV;
+uniform mat4 lightSpaceMatrix;
+uniform sampler2D normalDepth;
+#else
+in vec4 vNormal;
 in vec4 lightSpacePos;
 in mat3 tbnMatrix;
+#endif
 
 // OUT VARIABLES
 out vec4 FragColor;
@@ -11,11 +22,24 @@ out vec4 FragColor;
 // UNIFORMS
 uniform vec4 viewPos;
 uniform sampler2D shadowMap;
+#if defined(MATERIAL_ARRAYS) && !defined(IMPOSTOR)
+// the maps of all the materials (MaterialArray), every vertex has the layer of its material
+flat in float materialLayer;
+uniform struct Material
+{
+    sampler2DArray albedo;
+    sampler2DArray MRA;
+} material;
+#define materialTexture(map) texture(map, vec3(uvCoord, materialLayer))
+#else
+// the impostors read the albedo and MRA atlases baked from the model
 uniform struct Material
 {
     sampler2D albedo;
     sampler2D MRA; //metallic Roughness AmbientOcclusion
 } material;
+#define materialTexture(map) texture(map, uvCoord)
+#endif
 
 uniform struct DirLight
 {
@@ -99,19 +123,19 @@ float GeometrySmith(vec3 N, vec3 V, vec3 L, float roughness)
     return ggx1 * ggx2;
 }
 
-vec3 CalcDirLight(DirLight light, vec3 N, vec3 V)
+vec3 CalcDirLight(DirLight light, vec3 N, vec3 V, vec4 P)
 {
     // calculate per-light radiance
-    vec3 L = normalize(light.position - vPos).xyz;
+    vec3 L = normalize(light.position - P).xyz;
     vec3 H = normalize(V + L);
-    float distance    = length(light.position - vPos);
+    float distance    = length(light.position - P);
     float attenuation = 1.0 / (distance * distance);
     vec3 radiance     = light.diffuse.rgb * attenuation * light.energy;        
     
     // cook-torrance brdf
-    vec3 albedo = texture(material.albedo, uvCoord).rgb;
-    float metallic = texture(material.MRA, uvCoord).r;
-    float roughness = texture(material.MRA, uvCoord).g;
+    vec3 albedo = materialTexture(material.albedo).rgb;
+    float metallic = materialTexture(material.MRA).r;
+    float roughness = materialTexture(material.MRA).g;
 
     vec3 F0 = vec3(0.04);
     F0 = mix(F0, albedo, metallic);
@@ -134,14 +158,29 @@ vec3 CalcDirLight(DirLight light, vec3 N, vec3 V)
 
 void main()
 {
-    vec4 V = normalize(viewPos - vPos);
+#ifdef IMPOSTOR
+    if (materialTexture(material.albedo).a < 0.5)
+        discard;
+    vec4 baked = texture(normalDepth, uvCoord);
+
+    // move the quad fragment to the baked surface so the impostors intersect and are lit like the meshes
+    vec4 P = vec4(vPos.xyz + frameDir * radius * (1.0 - 2.0 * baked.a), 1.0);
+    vec4 clip = PV * P;
+    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+    vec4 N = vec4(normalize(frameToWorld * (baked.xyz * 2.0 - 1.0)), 0.0);
+    vec4 posLightSpace = lightSpaceMatrix * P;
+#else
+    vec4 P = vPos;
     vec4 N = normalize(vNormal);
-    vec3 color = CalcDirLight(sun, N.xyz, V.xyz);
+    vec4 posLightSpace = lightSpacePos;
+#endif
+    vec4 V = normalize(viewPos - P);
+    vec3 color = CalcDirLight(sun, N.xyz, V.xyz, P);
     
-    vec3 albedo = texture(material.albedo, uvCoord).rgb;
-    float AO = texture(material.MRA, uvCoord).b;
+    vec3 albedo = materialTexture(material.albedo).rgb;
+    float AO = materialTexture(material.MRA).b;
     vec3 ambient = vec3(0.05) * albedo * AO;
-    float shadow = ShadowCalulation(lightSpacePos, sun.direction, N);
+    float shadow = ShadowCalulation(posLightSpace, sun.direction, N);
     color = ambient + color * (1 - shadow);
 	
     color = color / (color + vec3(1.0));
@@ -0,0 +1,58 @@
+#version 330
+layout(location = 0)in vec2 corner;
+layout(location = 8)in mat4 model;
+
+uniform mat4 PV;
+uniform vec4 viewPos;
+uniform vec4 bounds;    // model space bounding sphere
+uniform float frames;   // the atlas is frames x frames views
+
+out vec2 uvCoord;
+out vec4 vPos;
+out mat3 frameToWorld;  // model space normals to world space
+out vec3 frameDir;      // world space direction the frame was baked from
+out float radius;       // world space
+
+vec2 octEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 e = n.xy;
+    if (n.z < 0.0)
+        e = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return e;
+}
+
+vec3 octDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+void main()
+{
+    mat3 linear = mat3(model);
+    float scale = max(length(linear[0]), max(length(linear[1]), length(linear[2])));
+    mat3 rotation = mat3(linear[0] / length(linear[0]), linear[1] / length(linear[1]), linear[2] / length(linear[2]));
+    vec3 center = vec3(model * vec4(bounds.xyz, 1.0));
+
+    // nearest baked view of the direction to the camera, in model space
+    vec3 toCamera = transpose(rotation) * normalize(viewPos.xyz - center);
+    vec2 frame = clamp(floor((octEncode(toCamera) * 0.5 + 0.5) * frames), vec2(0.0), vec2(frames - 1.0));
+    vec3 dir = octDecode((frame + 0.5) / frames * 2.0 - 1.0);
+
+    // the quad faces the baked view with the axes of its camera (see Impostor::bake)
+    vec3 up = abs(dir.y) > 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(0.0, 1.0, 0.0);
+    vec3 right = normalize(cross(-dir, up));
+    up = cross(right, -dir);
+
+    radius = bounds.w * scale;
+    vPos = vec4(center + rotation * (right * corner.x + up * corner.y) * radius, 1.0);
+    gl_Position = PV * vPos;
+
+    uvCoord = (frame + corner * 0.5 + 0.5) / frames;
+    frameToWorld = rotation;
+    frameDir = rotation * dir;
+}
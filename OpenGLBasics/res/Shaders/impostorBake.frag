@@ -0,0 +1,35 @@
+#version 330
+in vec2 uvCoord;
+in vec3 vNormal;
+
+// OUT VARIABLES
+layout(location = 0) out vec4 albedo;
+layout(location = 1) out vec4 normalDepth;
+layout(location = 2) out vec4 MRA;
+
+// UNIFORMS
+#ifdef MATERIAL_ARRAYS
+// the maps of all the materials (MaterialArray), every vertex has the layer of its material
+flat in float materialLayer;
+uniform struct Material
+{
+    sampler2DArray albedo;
+    sampler2DArray MRA;
+} material;
+#define materialTexture(map) texture(map, vec3(uvCoord, materialLayer))
+#else
+uniform struct Material
+{
+    sampler2D albedo;
+    sampler2D MRA; //metallic Roughness AmbientOcclusion
+} material;
+#define materialTexture(map) texture(map, uvCoord)
+#endif
+
+void main()
+{
+    albedo = vec4(materialTexture(material.albedo).rgb, 1.0);
+    MRA = vec4(materialTexture(material.MRA).rgb, 1.0);
+    // model space normal and the depth inside the bounding sphere (0 in front, 1 behind)
+    normalDepth = vec4(normalize(vNormal) * 0.5 + 0.5, gl_FragCoord.z);
+}
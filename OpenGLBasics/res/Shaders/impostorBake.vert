@@ -0,0 +1,36 @@
+#version 330
+layout(location = 0)in vec4 position; // w: MaterialArray layer
+layout(location = 1)in vec3 normal;
+layout(location = 2)in vec2 texCoord;
+layout(location = 4)in mat4 transform;
+// position dequantization of packed meshes (position * w + xyz)
+layout(location = 15)in vec4 positionDequant;
+
+out vec2 uvCoord;
+out vec3 vNormal;
+flat out float materialLayer;
+
+#ifdef OCTAHEDRAL_NORMALS
+vec3 octDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+#endif
+
+void main()
+{
+    vec4 pos = vec4(position.xyz * positionDequant.w + positionDequant.xyz, 1.0);
+#ifdef OCTAHEDRAL_NORMALS
+    vNormal = octDecode(normal.xy);
+#else
+    vNormal = normal;
+#endif
+    // the transform is the view projection of the baked frame, the normals stay in model space
+    gl_Position = transform * pos;
+    uvCoord = texCoord;
+    materialLayer = position.w;
+}
@@ -1,10 +1,13 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
+// the instance model matrix, like vertexInstanced
+layout (location = 8) in mat4 model;
+// position dequantization of packed meshes (position * w + xyz)
+layout (location = 15) in vec4 positionDequant;
 
 uniform mat4 lightSpaceMatrix;
-uniform mat4 model;
 
 void main()
 {
-    gl_Position = lightSpaceMatrix * model * vec4(aPos, 1.0);
+    gl_Position = lightSpaceMatrix * model * vec4(aPos * positionDequant.w + positionDequant.xyz, 1.0);
 }
\ No newline at end of file
@@ -1,11 +1,13 @@
 #version 330
-layout(location = 0)in vec3 position;
+layout(location = 0)in vec4 position; // w: MaterialArray layer
 layout(location = 1)in vec3 normal;
 layout(location = 2)in vec2 texCoord;
 layout(location = 3)in vec3 tangent;
 layout(location = 4)in mat4 transform;
 layout(location = 8)in mat4 model;
 layout(location = 12)in mat3 normalMat;
+// position dequantization of packed meshes (position * w + xyz)
+layout(location = 15)in vec4 positionDequant;
 
 uniform mat4 lightSpaceMatrix;
 
@@ -14,20 +16,40 @@ out vec4 vPos;
 out vec2 uvCoord;
 out vec4 lightSpacePos;
 out vec4 vNormal;
+flat out float materialLayer;
+
+#ifdef OCTAHEDRAL_NORMALS
+vec3 octDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+#endif
 
 void main()
 {
-    vec4 pos = vec4(position, 1.0);
+    vec4 pos = vec4(position.xyz * positionDequant.w + positionDequant.xyz, 1.0);
+#ifdef OCTAHEDRAL_NORMALS
+    vec3 vertexNormal = octDecode(normal.xy);
+    vec3 vertexTangent = octDecode(tangent.xy);
+#else
+    vec3 vertexNormal = normal;
+    vec3 vertexTangent = tangent;
+#endif
     gl_Position = transform * pos;
     
     uvCoord = texCoord;
+    materialLayer = position.w;
     vPos = model * pos;
-    vNormal = model * vec4(normal, 0.0);
+    vNormal = model * vec4(vertexNormal, 0.0);
 
     lightSpacePos =  lightSpaceMatrix * vPos;
 
-    vec3 n = normalize(vec3(model *  vec4(normal, 0.0)));
-    vec3 t = normalize(vec3(model *  vec4(tangent, 0.0)));
+    vec3 n = normalize(vec3(model *  vec4(vertexNormal, 0.0)));
+    vec3 t = normalize(vec3(model *  vec4(vertexTangent, 0.0)));
     t = normalize(t - dot(t, n) * n);
     vec3 b = cross(t, n);
     tbnMatrix = mat3(t, b, n);
@@ -2,6 +2,8 @@
 layout(location = 0)in vec3 position;
 layout(location = 1)in vec3 normal;
 layout(location = 2)in vec2 texCoord;
+// position dequantization of packed meshes (position * w + xyz)
+layout(location = 15)in vec4 positionDequant;
 
 out vec2 uvCoord;
 out vec4 vPos;
@@ -11,11 +13,26 @@ uniform mat4 transform;
 uniform mat4 model;
 uniform mat3 normalMat;
 
+#ifdef OCTAHEDRAL_NORMALS
+vec3 octDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+#endif
+
 void main()
 {
-    vec4 pos = vec4(position, 1.0);
+    vec4 pos = vec4(position * positionDequant.w + positionDequant.xyz, 1.0);
     gl_Position = transform * pos;
     uvCoord = texCoord;
+#ifdef OCTAHEDRAL_NORMALS
+    vNormal = normalMat * octDecode(normal.xy);
+#else
     vNormal = normalMat *  normal;
+#endif
     vPos = model * pos;
 }
\ No newline at end of file